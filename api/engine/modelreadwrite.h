@@ -28,6 +28,10 @@ public:
    static tResult Write(IWriter * pWriter, const sModelVertex & modelVertex);
 };
 
+// Vertex arrays are stored exactly as they are laid out in memory
+AssertAtCompileTime(sizeof(sModelVertex) == 9 * sizeof(float));
+READWRITE_RAW_TYPE(sModelVertex);
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -0,0 +1,179 @@
+///////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#ifndef INCLUDED_COROUTINE_H
+#define INCLUDED_COROUTINE_H
+
+/// @file coroutine.h
+/// Stackful coroutines and a resumable task built on them for logic that
+/// spans several frames
+
+#include "techdll.h"
+#include "comtools.h"
+#include "schedulerapi.h"
+#include "threadcallapi.h"
+
+#ifndef _WIN32
+#include <ucontext.h>
+#endif
+
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+// winbase.h still defines an empty Yield() macro for 16-bit compatibility
+#ifdef Yield
+#undef Yield
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cCoroutine
+//
+/// @class cCoroutine
+/// @brief Runs Run() on its own stack so that it can suspend itself in the
+/// middle and be resumed later from where it left off. A coroutine may be
+/// resumed from any thread, but only from one at a time. Destroying a
+/// suspended coroutine frees its stack without unwinding it.
+
+class TECH_API cCoroutine
+{
+   cCoroutine(const cCoroutine &);
+   const cCoroutine & operator =(const cCoroutine &);
+
+public:
+   enum { kDefaultStackSize = 64 * 1024 };
+
+   cCoroutine(uint stackSize = kDefaultStackSize);
+   virtual ~cCoroutine();
+
+   /// @brief Runs the coroutine until it suspends itself or Run returns
+   /// @return S_OK if the coroutine suspended, S_FALSE if it has finished
+   /// (now or before), or an E_xxx error code
+   tResult Resume();
+
+   bool IsFinished() const { return m_bFinished; }
+
+   /// @return True if Run has started and is waiting to be resumed
+   bool IsSuspended() const { return m_bStarted && !m_bRunning && !m_bFinished; }
+
+protected:
+   virtual void Run() = 0;
+
+   /// @brief Returns control to the caller of Resume. Only call from Run or
+   /// functions it calls.
+   void Suspend();
+
+private:
+   bool CreateContext();
+
+   uint m_stackSize;
+   bool m_bStarted;
+   bool m_bRunning;
+   bool m_bFinished;
+
+#ifdef _WIN32
+   static void STDCALL FiberEntry(void * param);
+   void * m_pFiber;
+   void * m_pCallerFiber;
+#else
+   static void ContextEntry();
+   ucontext_t m_context;
+   ucontext_t m_callerContext;
+   void * m_pStack;
+#endif
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cCoroutineTask
+//
+/// @class cCoroutineTask
+/// @brief A scheduler task written as straight-line code. Derived classes
+/// implement RunTask() and call Yield(), WaitSeconds() or WaitFor()
+/// wherever the logic has to wait. Locals survive across the waits.
+///
+/// The body only ever runs while the scheduler runs frame tasks. Timed
+/// waits are registered as time tasks so that a sleeping coroutine costs
+/// nothing until it is due.
+
+class TECH_API cCoroutineTask : public cComObject<IMPLEMENTS(ITask)>, public cCoroutine
+{
+public:
+   cCoroutineTask(uint stackSize = kDefaultStackSize);
+   virtual ~cCoroutineTask();
+
+   /// @brief Registers the task to start running on the next frame
+   /// @param pScheduler is the scheduler to run on, or NULL for the global one
+   tResult Start(IScheduler * pScheduler = NULL);
+
+   /// @brief Unregisters the task. If RunTask is suspended it is resumed
+   /// once more with its pending wait returning E_ABORT so that it can clean
+   /// up; it must return without waiting again.
+   tResult Stop();
+
+   bool IsRunning() const { return m_waitMode != kNotStarted && !IsFinished(); }
+
+   /// @return The value returned by RunTask, or S_FALSE if it hasn't returned
+   tResult GetResult() const { return m_result; }
+
+   virtual tResult Execute(double time);
+
+protected:
+   /// @param time is the sim time at which the task first runs
+   virtual tResult RunTask(double time) = 0;
+
+   /// @brief Waits until the next frame
+   /// @return S_OK, or E_ABORT if the task is being stopped
+   tResult Yield();
+
+   /// @brief Waits until at least the given number of seconds of sim time
+   /// have passed
+   /// @return S_OK, or E_ABORT if the task is being stopped
+   tResult WaitSeconds(double seconds);
+
+   /// @brief Waits until the future has a result or has failed, checking
+   /// once per frame
+   /// @return S_OK if the future is ready, E_FAIL if it failed, or E_ABORT
+   /// if the task is being stopped
+   template <typename RESULT>
+   tResult WaitFor(const cFuture<RESULT> & future)
+   {
+      while (!future.IsDone())
+      {
+         tResult result = Yield();
+         if (result != S_OK)
+         {
+            return result;
+         }
+      }
+      return (future.GetStatus() == kFutureReady) ? S_OK : E_FAIL;
+   }
+
+   /// @return The sim time at which the task was last resumed
+   double GetTime() const { return m_time; }
+
+private:
+   virtual void Run();
+
+   tResult Wait();
+
+   enum eWaitMode
+   {
+      kNotStarted,
+      kWaitFrame,    ///< Registered as a frame task
+      kWaitTime,     ///< Registered as a time task due at m_wakeTime
+      kStopping,
+   };
+
+   eWaitMode m_waitMode;
+   double m_time;
+   double m_wakeTime;
+   tResult m_result;
+   cAutoIPtr<IScheduler> m_pScheduler;
+   tTaskHandle m_taskHandle;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+#endif // !INCLUDED_COROUTINE_H
@@ -7,6 +7,8 @@
 #include "techdll.h"
 #include "comtools.h"
 
+#include <cstddef>
+
 #ifdef _MSC_VER
 #pragma once
 #endif
@@ -28,11 +30,23 @@
 // CLASS: cFunctor
 //
 
+// Functors are allocated on one thread and deleted on another at a high rate
+// when posted through IThreadCaller, so they come from a per-thread block
+// pool rather than the general heap.
+
 class TECH_API cFunctor
 {
 public:
    virtual ~cFunctor() = 0;
    virtual void operator ()() = 0;
+
+   static void * operator new(size_t size);
+   static void operator delete(void * p, size_t size);
+#if defined(_MSC_VER) && defined(_DEBUG)
+   // Matches the debug operator new that dbgalloc.h substitutes for plain new
+   static void * operator new(size_t size, int, const char *, int);
+   static void operator delete(void * p, int, const char *, int);
+#endif
 };
 
 ///////////////////////////////////////////////////////////////////////////////
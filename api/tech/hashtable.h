@@ -259,6 +259,7 @@ public:
 
 private:
    std::pair<const_iterator, bool> Insert(const KEY & k, const VALUE & v, bool bOverwriteExisting);
+   void Rehash(size_type actual);
    uint Probe(const KEY & k, bool bSkipErased) const;
    bool Equal(const KEY & k1, const KEY & k2) const;
 
@@ -269,6 +270,7 @@ private:
    element_type * m_elts;
    size_type m_maxSize;
    size_type m_size;
+   size_type m_nErased;
    byte m_loadFactor;
 };
 
@@ -204,6 +204,7 @@ HASHTABLE_TEMPLATE_CLASS::cHashTable()
  : m_elts(NULL)
  , m_maxSize(0)
  , m_size(0)
+ , m_nErased(0)
  , m_loadFactor(kDefaultLoadFactor)
 {
    reserve(kInitialSizeSmall);
@@ -216,6 +217,7 @@ HASHTABLE_TEMPLATE_CLASS::cHashTable(size_type initialSize)
  : m_elts(NULL)
  , m_maxSize(0)
  , m_size(0)
+ , m_nErased(0)
  , m_loadFactor(kDefaultLoadFactor)
 {
    reserve(initialSize);
@@ -229,6 +231,7 @@ HASHTABLE_TEMPLATE_CLASS::cHashTable(size_type initialSize, const allocator_type
  , m_elts(NULL)
  , m_maxSize(0)
  , m_size(0)
+ , m_nErased(0)
  , m_loadFactor(kDefaultLoadFactor)
 {
    reserve(initialSize);
@@ -241,6 +244,7 @@ HASHTABLE_TEMPLATE_CLASS::cHashTable(const cHashTable & other)
  : m_elts(NULL)
  , m_maxSize(0)
  , m_size(0)
+ , m_nErased(0)
  , m_loadFactor(other.m_loadFactor)
 {
    reserve(other.m_maxSize);
@@ -249,6 +253,7 @@ HASHTABLE_TEMPLATE_CLASS::cHashTable(const cHashTable & other)
       m_allocator.construct(&m_elts[i], other.m_elts[i]);
    }
    m_size = other.m_size;
+   m_nErased = other.m_nErased;
 }
 
 ////////////////////////////////////////
@@ -293,6 +298,19 @@ void HASHTABLE_TEMPLATE_CLASS::reserve(size_type capacity)
       return;
    }
 
+   Rehash(actual);
+}
+
+////////////////////////////////////////
+// Moves everything into a new array of the given size, which drops any
+// erased elements
+
+HASHTABLE_TEMPLATE_DECL
+void HASHTABLE_TEMPLATE_CLASS::Rehash(size_type actual)
+{
+   Assert(IsPowerOfTwo(actual));
+   Assert(actual >= m_size);
+
    element_type * newElts = m_allocator.allocate(actual, m_elts);
 
    size_type i;
@@ -308,6 +326,7 @@ void HASHTABLE_TEMPLATE_CLASS::reserve(size_type capacity)
    element_type * oldElts = m_elts;
 
    m_size = 0;
+   m_nErased = 0;
    m_maxSize = actual;
    m_elts = newElts;
 
@@ -466,7 +485,7 @@ HASHTABLE_TEMPLATE_MEMBER_TYPE(iterator) HASHTABLE_TEMPLATE_CLASS::find(const KE
 HASHTABLE_TEMPLATE_DECL
 HASHTABLE_TEMPLATE_MEMBER_TYPE(const_iterator) HASHTABLE_TEMPLATE_CLASS::find(const KEY & k) const
 {
-   uint h = Probe(k);
+   uint h = Probe(k, true);
    if (m_elts[h].state == kHES_InUse)
    {
       return const_iterator(&m_elts[h], &m_elts[0], &m_elts[m_maxSize]);
@@ -492,6 +511,7 @@ HASHTABLE_TEMPLATE_MEMBER_TYPE(size_type) HASHTABLE_TEMPLATE_CLASS::erase(const
    m_allocator.destroy(&m_elts[h]);
    m_elts[h].state = kHES_Erased;
    m_size--;
+   m_nErased++;
 
    return 1;
 }
@@ -566,13 +586,28 @@ HASHTABLE_TEMPLATE_DECL
 std::pair<HASHTABLE_TEMPLATE_MEMBER_TYPE(const_iterator), bool>
 HASHTABLE_TEMPLATE_CLASS::Insert(const KEY & k, const VALUE & v, bool bOverwriteExisting)
 {
-   if ((m_size * 255) > (m_maxSize * m_loadFactor))
+   if (((m_size + m_nErased) * 255) > (m_maxSize * m_loadFactor))
    {
-      // grow in proportion to fullness
-      reserve(m_maxSize + (m_size * 255 / m_loadFactor));
+      if ((m_size * 255 * 2) > (m_maxSize * m_loadFactor))
+      {
+         // grow in proportion to fullness
+         reserve(m_maxSize + (m_size * 255 / m_loadFactor));
+      }
+      else
+      {
+         // Mostly erased elements, which lengthen every probe and would
+         // eventually leave no empty element to stop a failed search
+         Rehash(m_maxSize);
+      }
+   }
+
+   // The key may be further along than the first erased element
+   uint h = Probe(k, true);
+   if (m_elts[h].state != kHES_InUse)
+   {
+      h = Probe(k, false);
    }
 
-   uint h = Probe(k, false);
    if ((m_elts[h].state == kHES_InUse) && !bOverwriteExisting)
    {
       return std::make_pair(const_iterator(&m_elts[h], &m_elts[0], &m_elts[m_maxSize]), false);
@@ -582,6 +617,10 @@ HASHTABLE_TEMPLATE_CLASS::Insert(const KEY & k, const VALUE & v, bool bOverwrite
    m_elts[h].second = v;
    if (m_elts[h].state != kHES_InUse)
    {
+      if (m_elts[h].state == kHES_Erased)
+      {
+         m_nErased--;
+      }
       m_elts[h].state = kHES_InUse;
       m_size++;
    }
@@ -649,6 +688,7 @@ void HASHTABLE_TEMPLATE_CLASS::Reset(size_type newInitialSize)
    m_elts = NULL;
    m_maxSize = 0;
    m_size = 0;
+   m_nErased = 0;
 
    if (newInitialSize > 0)
    {
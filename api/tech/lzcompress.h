@@ -0,0 +1,41 @@
+///////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#ifndef INCLUDED_LZCOMPRESS_H
+#define INCLUDED_LZCOMPRESS_H
+
+/// @file lzcompress.h
+/// A fast byte-oriented LZ77 codec in the LZ4 block layout. It compresses
+/// less than deflate but decompresses several times faster, which suits data
+/// that is read far more often than it is written.
+
+#include "techdll.h"
+#include "comtools.h"
+
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+
+/// @return The largest compressed size that srcSize bytes can produce
+TECH_API size_t LZCompressBound(size_t srcSize);
+
+/// @brief Compresses a block of bytes
+/// @param pDest receives the compressed block
+/// @param destSize is the capacity of pDest; LZCompressBound bytes always fit
+/// @param pCompressedSize receives the number of bytes written
+/// @return S_OK, S_FALSE if the compressed block would not fit in destSize
+/// bytes, or an E_xxx error code
+TECH_API tResult LZCompress(const void * pSrc, size_t srcSize,
+                            void * pDest, size_t destSize, size_t * pCompressedSize);
+
+/// @brief Decompresses a block produced by LZCompress. Malformed input is
+/// detected and never reads or writes outside of the given buffers.
+/// @param destSize is the exact decompressed size
+/// @return S_OK if exactly destSize bytes were produced, otherwise E_FAIL
+TECH_API tResult LZDecompress(const void * pSrc, size_t srcSize, void * pDest, size_t destSize);
+
+///////////////////////////////////////////////////////////////////////////////
+
+#endif // !INCLUDED_LZCOMPRESS_H
@@ -15,6 +15,9 @@
 
 class cFileSpec;
 F_DECLARE_INTERFACE(IReader);
+F_DECLARE_INTERFACE(IMappedReader);
+F_DECLARE_INTERFACE(IReaderSpan);
+F_DECLARE_INTERFACE(IReaderSize);
 F_DECLARE_INTERFACE(IWriter);
 F_DECLARE_INTERFACE(IMD5Writer);
 
@@ -73,6 +76,94 @@ interface IReader : IUnknown
 };
 
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// INTERFACE: IMappedReader
+//
+/// @interface IMappedReader
+/// @brief Optional interface of readers whose whole stream is resident in
+/// memory, such as memory readers and memory-mapped files. Query for it to
+/// parse the bytes in place instead of copying them out with Read.
+
+interface IMappedReader : IUnknown
+{
+   /// @brief Gets the bytes of the entire stream, independent of the read
+   /// position. The memory stays valid and unchanged for as long as the
+   /// reader is referenced.
+   virtual tResult GetMappedData(const byte * * ppData, size_t * pDataSize) = 0;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// INTERFACE: IReaderSpan
+//
+/// @interface IReaderSpan
+/// @brief Optional interface of readers that can hand out the next bytes of
+/// the stream in place. Query for it once and fall back to IReader::Read if
+/// the reader doesn't support it.
+
+interface IReaderSpan : IUnknown
+{
+   /// @brief Gets a view of the next nBytes bytes and advances past them
+   /// @return S_OK, or E_FAIL without advancing if fewer bytes remain. The
+   /// view stays valid for as long as the reader is referenced.
+   virtual tResult ReadSpan(size_t nBytes, const void * * ppData) = 0;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// INTERFACE: IReaderSize
+//
+/// @interface IReaderSize
+/// @brief Optional interface of readers that know the length of their
+/// stream without seeking to the end, which for some (a decompressing
+/// reader, say) would mean producing the whole stream.
+
+interface IReaderSize : IUnknown
+{
+   virtual tResult GetSize(ulong * pSize) = 0;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TEMPLATE: cReadWriteRaw
+//
+/// @class cReadWriteRaw
+/// @brief Marks types that cReadWriteOps stores as their in-memory bytes so
+/// that arrays of them can be transferred as one block. Only mark structs
+/// without padding whose members are all raw themselves.
+///
+/// Byte order: like the scalar operations below, block transfers use the
+/// host byte order and never swap. Saved games and model files are
+/// therefore little-endian, the order of every supported target. A port to
+/// a big-endian host must swap in the scalar operations and clear kIsRaw
+/// for every multi-byte type, or the two paths will disagree.
+
+template <typename T>
+class cReadWriteRaw
+{
+public:
+   enum { kIsRaw = false };
+};
+
+#define READWRITE_RAW_TYPE(T) \
+   template <> class cReadWriteRaw<T> { public: enum { kIsRaw = true }; }
+
+READWRITE_RAW_TYPE(int);
+READWRITE_RAW_TYPE(uint);
+READWRITE_RAW_TYPE(long);
+READWRITE_RAW_TYPE(ulong);
+READWRITE_RAW_TYPE(short);
+READWRITE_RAW_TYPE(ushort);
+READWRITE_RAW_TYPE(byte);
+READWRITE_RAW_TYPE(char);
+READWRITE_RAW_TYPE(float);
+READWRITE_RAW_TYPE(double);
+
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // INTERFACE: IWriter
@@ -266,8 +357,15 @@ TECH_API tResult FileReaderCreate(const cFileSpec & file, eFileMode mode, IReade
 TECH_API tResult FileWriterCreate(const cFileSpec & file, eFileMode mode, IWriter * * ppWriter);
 
 TECH_API tResult MemReaderCreate(const byte * pMem, size_t memSize, bool bOwn, IReader * * ppReader);
+/// @brief Creates a reader over memory that belongs to pOwner, which the
+/// reader keeps referenced until it is released
+TECH_API tResult MemReaderCreateView(const byte * pMem, size_t memSize, IUnknown * pOwner, IReader * * ppReader);
 TECH_API tResult MemWriterCreate(byte * pMem, size_t memSize, IWriter * * ppWriter);
 
+/// @brief Maps a whole file read-only into memory and returns a reader over
+/// it that also supports IMappedReader. Fails for empty files.
+TECH_API tResult MappedFileReaderCreate(const cFileSpec & file, IReader * * ppReader);
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -9,6 +9,7 @@
 #include "readwriteapi.h"
 #include "vec3.h"
 
+#include <cstring>
 #include <string>
 #include <vector>
 
@@ -74,6 +75,9 @@ public:
    static tResult Write(IWriter * pWriter, const tVec3 & v);
 };
 
+AssertAtCompileTime(sizeof(tVec3) == 3 * sizeof(tVec3::value_type));
+READWRITE_RAW_TYPE(tVec3);
+
 ////////////////////////////////////////////////////////////////////////////////
 
 template <>
@@ -85,6 +89,101 @@ public:
 };
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Read and write arrays of raw types (see cReadWriteRaw) as a single block
+
+template <typename T>
+tResult ReadRawArray(IReader * pReader, T * pValues, size_t nValues)
+{
+   AssertAtCompileTime(cReadWriteRaw<T>::kIsRaw);
+
+   if (pReader == NULL || pValues == NULL)
+   {
+      return E_POINTER;
+   }
+
+   // Copy straight out of in-memory readers rather than through Read
+   cAutoIPtr<IReaderSpan> pReaderSpan;
+   if (pReader->QueryInterface(IID_IReaderSpan, (void**)&pReaderSpan) == S_OK)
+   {
+      const void * pSpan = NULL;
+      tResult result = pReaderSpan->ReadSpan(nValues * sizeof(T), &pSpan);
+      if (result == S_OK)
+      {
+         memcpy(pValues, pSpan, nValues * sizeof(T));
+      }
+      return result;
+   }
+
+   return pReader->Read(pValues, nValues * sizeof(T));
+}
+
+template <typename T>
+tResult WriteRawArray(IWriter * pWriter, const T * pValues, size_t nValues)
+{
+   AssertAtCompileTime(cReadWriteRaw<T>::kIsRaw);
+
+   if (pWriter == NULL || pValues == NULL)
+   {
+      return E_POINTER;
+   }
+
+   return pWriter->Write(pValues, nValues * sizeof(T));
+}
+
+// Dispatches to the block functions for raw types and to the per-element
+// loop for everything else at compile time
+template <bool IS_RAW>
+class cReadWriteArray
+{
+public:
+   template <typename T>
+   static tResult Read(IReader * pReader, T * pValues, size_t nValues)
+   {
+      for (size_t i = 0; i < nValues; ++i)
+      {
+         tResult result = pReader->Read(&pValues[i]);
+         if (result != S_OK)
+         {
+            return result;
+         }
+      }
+      return S_OK;
+   }
+
+   template <typename T>
+   static tResult Write(IWriter * pWriter, const T * pValues, size_t nValues)
+   {
+      for (size_t i = 0; i < nValues; ++i)
+      {
+         tResult result = pWriter->Write(pValues[i]);
+         if (result != S_OK)
+         {
+            return result;
+         }
+      }
+      return S_OK;
+   }
+};
+
+template <>
+class cReadWriteArray<true>
+{
+public:
+   template <typename T>
+   static tResult Read(IReader * pReader, T * pValues, size_t nValues)
+   {
+      return ReadRawArray(pReader, pValues, nValues);
+   }
+
+   template <typename T>
+   static tResult Write(IWriter * pWriter, const T * pValues, size_t nValues)
+   {
+      return WriteRawArray(pWriter, pValues, nValues);
+   }
+};
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // Read and write STL strings
 
@@ -113,16 +212,7 @@ tResult cReadWriteOps< std::basic_string<T> >::Read(IReader * pReader, std::basi
    {
       WarnMsgIf1(len > 1024 * 1024, "Huge length, %d, encountered reading string\n", len);
       pS->resize(len);
-      std::basic_string<T>::iterator iter = pS->begin(), end = pS->end();
-      for (; iter != end; ++iter)
-      {
-         T & t = *iter;
-         result = pReader->Read(&t);
-         if (result != S_OK)
-         {
-            break;
-         }
-      }
+      result = cReadWriteArray<cReadWriteRaw<T>::kIsRaw>::Read(pReader, &(*pS)[0], len);
    }
 
    return result;
@@ -136,17 +226,9 @@ tResult cReadWriteOps< std::basic_string<T> >::Write(IWriter * pWriter, const st
       return E_POINTER;
    }
    tResult result = pWriter->Write(s.length());
-   if (result == S_OK)
+   if (result == S_OK && !s.empty())
    {
-      std::basic_string<T>::const_iterator iter = s.begin(), end = s.end();
-      for (; iter != end; ++iter)
-      {
-         result = pWriter->Write(*iter);
-         if (result != S_OK)
-         {
-            break;
-         }
-      }
+      result = cReadWriteArray<cReadWriteRaw<T>::kIsRaw>::Write(pWriter, s.data(), s.length());
    }
    return result;
 }
@@ -177,16 +259,7 @@ tResult cReadWriteOps< std::vector<T> >::Read(IReader * pReader, std::vector<T>
       if (nValues > 0)
       {
          pValues->resize(nValues);
-         std::vector<T>::iterator iter = pValues->begin(), end = pValues->end();
-         for (; iter != end; ++iter)
-         {
-            T & t = *iter;
-            result = pReader->Read(&t);
-            if (result != S_OK)
-            {
-               break;
-            }
-         }
+         result = cReadWriteArray<cReadWriteRaw<T>::kIsRaw>::Read(pReader, &(*pValues)[0], nValues);
       }
    }
    return result;
@@ -200,17 +273,9 @@ tResult cReadWriteOps< std::vector<T> >::Write(IWriter * pWriter, const std::vec
       return E_POINTER;
    }
    tResult result = pWriter->Write(static_cast<uint>(values.size()));
-   if (result == S_OK)
+   if (result == S_OK && !values.empty())
    {
-      std::vector<T>::const_iterator iter = values.begin(), end = values.end();
-      for (; iter != end; ++iter)
-      {
-         result = pWriter->Write(*iter);
-         if (result != S_OK)
-         {
-            break;
-         }
-      }
+      result = cReadWriteArray<cReadWriteRaw<T>::kIsRaw>::Write(pWriter, &values[0], values.size());
    }
    return result;
 }
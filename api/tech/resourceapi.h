@@ -10,6 +10,7 @@
 #include "techdll.h"
 #include "comtools.h"
 #include "techstring.h"
+#include "threadcallapi.h"
 
 #include <vector>
 
@@ -18,8 +19,10 @@
 #endif
 
 F_DECLARE_INTERFACE(IReader);
+F_DECLARE_INTERFACE(IWriter);
 
 F_DECLARE_INTERFACE(IResourceManager);
+F_DECLARE_INTERFACE(IResourceListener);
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -40,11 +43,15 @@ TECH_API tResult TextFormatRegister(const tChar * pszExtension);
 
 typedef const tChar * tResourceType;
 
+/// Identifies a resource name interned with IResourceManager::GetResourceId
+typedef uint64 tResourceId;
+
 typedef void * (* tResourceLoadNoParam)(IReader * pReader);
 
 typedef void * (* tResourceLoad)(IReader * pReader, void * typeParam);
 typedef void * (* tResourcePostload)(void * pData, int dataLength, void * loadParam);
 typedef void   (* tResourceUnload)(void * pData);
+typedef tResult (* tResourceSave)(void * pData, IWriter * pWriter);
 
 TECH_API void * ThunkResourceLoadNoParam(IReader * pReader, void * typeParam);
 
@@ -55,9 +62,81 @@ interface IResourceManager : IUnknown
    virtual tResult AddDirectoryTreeFlattened(const tChar * pszDir) = 0;
    virtual tResult AddArchive(const tChar * pszArchive) = 0;
 
+   /// @brief Loads a resource, or finds it cached, and locks it. The data
+   /// stays valid until the caller gives the lock back with Unlock; after
+   /// that it stays cached, but may be evicted to keep the cache within a
+   /// budget.
    virtual tResult Load(const tChar * pszName, tResourceType type, void * loadParam, void * * ppData) = 0;
    virtual tResult Unload(const tChar * pszName, tResourceType type) = 0;
 
+   /// @brief Interns a resource name. Code that loads the same resource
+   /// over and over should get its id once and load by id, which looks up
+   /// the cache without touching the name.
+   /// @return S_OK, or E_FAIL if the name collides with another one
+   virtual tResult GetResourceId(const tChar * pszName, tResourceId * pId) = 0;
+
+   /// @brief Loads a resource by an id from GetResourceId
+   /// @return S_OK, E_INVALIDARG if the id was never returned by
+   /// GetResourceId, or an E_xxx error code
+   virtual tResult Load(tResourceId id, tResourceType type, void * loadParam, void * * ppData) = 0;
+
+   /// @brief Releases the lock that each successful Load or LoadAsync puts
+   /// on a cached resource. Locks nest, so code that loads a resource over
+   /// and over unlocks it as often. Once nothing has it locked the resource
+   /// stays cached, but may be evicted to keep the cache within its budgets.
+   /// @return S_OK, S_FALSE if the resource wasn't locked, or an E_xxx
+   /// error code
+   virtual tResult Unlock(const tChar * pszName, tResourceType type) = 0;
+
+   /// @brief Releases a lock on a resource by an id from GetResourceId
+   virtual tResult Unlock(tResourceId id, tResourceType type) = 0;
+
+   /// @brief Limits the memory used by cached resources, evicting the least
+   /// recently used unlocked resources beyond the limit. Locked resources
+   /// count against the budget but are never evicted.
+   /// @param type is the type to limit, or NULL to limit the whole cache
+   /// @param budget is the limit in bytes, or zero for no limit
+   virtual tResult SetMemoryBudget(tResourceType type, size_t budget) = 0;
+
+   /// @brief Loads a resource in the background. The future receives what
+   /// Load would have returned through ppData.
+   /// @remarks The resource is opened and the format's load function is
+   /// called on a loader thread, so load functions must be thread-safe to be
+   /// used this way. The postload function, and any conversion from a
+   /// dependent type, runs on the calling thread. That thread must be
+   /// registered with IThreadCaller and call ReceiveCalls regularly.
+   /// Requests for a name and type that are already loading share the load
+   /// in progress.
+   /// @return S_OK if the load was started or the resource is already
+   /// loaded, or an E_xxx error code
+   virtual tResult LoadAsync(const tChar * pszName, tResourceType type, void * loadParam, cFuture<void *> * pFuture) = 0;
+
+   /// @brief Records the resources loaded from now on as dependencies of
+   /// the given resource, until called again with a NULL name. Resources
+   /// loaded by another resource's load or postload function are always
+   /// recorded as its dependencies instead.
+   virtual tResult RecordDependencies(const tChar * pszName, tResourceType type) = 0;
+
+   /// @brief Starts loading the recorded dependencies of a resource, and
+   /// theirs, in the background so that loading the resource afterwards
+   /// finds them cached. Prefetched resources are not locked.
+   /// @remarks Prefetching calls load functions on a loader thread that the
+   /// caller never asked for, so only dependencies whose formats were passed
+   /// to RegisterThreadSafeLoad are prefetched. Of those, only the ones that
+   /// loaded nothing themselves are, since their load functions are the only
+   /// ones known not to call back into the resource manager. The calling
+   /// thread must be able to receive calls, as for LoadAsync.
+   /// @return S_OK if anything was prefetched, S_FALSE if nothing is
+   /// recorded for the resource or everything is already cached, or an
+   /// E_xxx error code
+   virtual tResult Prefetch(const tChar * pszName, tResourceType type) = 0;
+
+   /// @brief Merges dependencies saved by SaveManifest into those recorded
+   virtual tResult LoadManifest(const tChar * pszFile) = 0;
+
+   /// @brief Saves the recorded dependencies to a text file
+   virtual tResult SaveManifest(const tChar * pszFile) const = 0;
+
    virtual tResult RegisterFormat(tResourceType type,
                                   tResourceType typeDepend,
                                   const tChar * pszExtension,
@@ -84,7 +163,39 @@ interface IResourceManager : IUnknown
       return RegisterFormat(type, NULL, pszExtension, ThunkResourceLoadNoParam, pfnPostload, pfnUnload, (void*)pfnLoad);
    }
 
+   /// @brief Lets the derived data cache keep what a registered format makes
+   /// from its files. When the resource_derived_cache config key names a
+   /// directory, later runs read the saved data back instead of calling the
+   /// load and postload functions on a file whose contents haven't changed.
+   /// @remarks Saved data is keyed by the MD5 digest of the file, the type
+   /// and the version. Change the version whenever the saved form, or what
+   /// the format makes from a file, changes. Formats whose postload function
+   /// loads other resources shouldn't use this, since it is skipped too.
+   /// Loads with a load parameter always call the format's functions. The
+   /// least recently written entries are removed at startup once the
+   /// directory holds more than resource_derived_cache_limit_kb.
+   /// @param pfnSave writes the postloaded data
+   /// @param pfnLoadSaved reads it back, with the format's type parameter
+   /// @return S_OK, or E_FAIL if no format has the type and extension
+   virtual tResult RegisterDerivedData(tResourceType type, const tChar * pszExtension, uint version,
+                                       tResourceSave pfnSave, tResourceLoad pfnLoadSaved) = 0;
+
+   /// @brief Declares that a registered format's load function may be
+   /// called on a loader thread, which lets Prefetch load its files
+   /// @remarks Load functions that touch a rendering context, or anything
+   /// else tied to one thread, must not be registered this way
+   /// @return S_OK, or E_FAIL if no format has the type and extension
+   virtual tResult RegisterThreadSafeLoad(tResourceType type, const tChar * pszExtension) = 0;
+
    virtual tResult ListResources(const tChar * pszMatch, std::vector<cStr> * pNames) const = 0;
+
+   /// @brief Registers a listener to hear about resources that were reloaded
+   /// because their files changed. Files in directories are watched when the
+   /// resource_hot_reload config key is set. Changes are picked up once per
+   /// scheduler frame, so a file written several times in one frame is
+   /// reloaded only once.
+   virtual tResult AddResourceListener(IResourceListener * pListener) = 0;
+   virtual tResult RemoveResourceListener(IResourceListener * pListener) = 0;
 };
 
 ////////////////////////////////////////
@@ -93,6 +204,24 @@ interface IResourceManager : IUnknown
 TECH_API tResult ResourceManagerCreate();
 
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// INTERFACE: IResourceListener
+//
+
+interface IResourceListener : IUnknown
+{
+   /// @brief Called when a locked resource has been reloaded in place. Every
+   /// Load of it now returns the new data. The locks carry over to the new
+   /// data, and the old data is unloaded once nothing has the resource
+   /// locked, so code that keeps what it loaded may use the old data until
+   /// it unlocks, or switch over here.
+   /// @remarks Resources that nothing had locked are simply dropped from the
+   /// cache and load again from the new file when next asked for.
+   virtual void OnResourceReloaded(const tChar * pszName, tResourceType type, void * pOldData, void * pNewData) = 0;
+};
+
+
 ///////////////////////////////////////////////////////////////////////////////
 
 #endif // !INCLUDED_RESOURCEAPI_H
@@ -0,0 +1,76 @@
+///////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#ifndef INCLUDED_RESOURCEPACK_H
+#define INCLUDED_RESOURCEPACK_H
+
+/// @file resourcepack.h
+/// Layout of resource pack files and the function that builds them. A pack
+/// is meant to be memory-mapped whole and used in place: a fixed header, the
+/// entry data, a table of contents sorted by name hash, then the names.
+/// Entries larger than a page start on a page boundary and smaller ones never
+/// straddle one, so each entry touches as few pages as possible and stored
+/// entries can be handed out as views into the mapping. The header and table
+/// are written as they are laid out in memory, so fields are in the byte
+/// order of the machine that built the pack; a pack built with the other
+/// byte order fails the magic number check.
+
+#include "techdll.h"
+#include "comtools.h"
+
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+
+const uint32 kResourcePackMagic = 0x4B504753; // "SGPK" in file order
+const uint32 kResourcePackVersion = 2;
+const uint32 kResourcePackAlignment = 4096;
+
+enum eResourcePackCompression
+{
+   kRPC_None = 0,
+   kRPC_LZ = 1,      ///< One LZCompress block
+};
+
+struct sResourcePackHeader
+{
+   uint32 magic;
+   uint32 version;
+   uint32 nEntries;
+   uint32 alignment;
+   uint64 tocOffset;    ///< nEntries sResourcePackEntry records
+   uint64 namesOffset;  ///< NUL-terminated entry names
+   uint64 namesSize;
+};
+
+struct sResourcePackEntry
+{
+   uint64 nameHash;     ///< ResourceIdFromNameNoCase of the name; the sort key
+   uint64 dataOffset;
+   uint32 storedSize;
+   uint32 size;
+   uint32 nameOffset;   ///< Relative to namesOffset
+   uint16 nameLength;
+   uint16 compression;  ///< An eResourcePackCompression value
+};
+
+///////////////////////////////////////
+
+enum eResourcePackBuildFlags
+{
+   kRPBF_None        = 0,
+   kRPBF_Compress    = (1 << 0), ///< Compress entries that shrink enough
+};
+
+/// @brief Writes every file under a directory tree to a pack. Entries are
+/// named by file name alone, like a flattened directory tree in the resource
+/// manager, so only the first of several files with the same name is kept.
+/// Hidden files and directories are skipped.
+/// @return S_OK, or an E_xxx error code if the pack could not be written
+TECH_API tResult ResourcePackBuild(const tChar * pszDir, const tChar * pszPack, uint flags);
+
+///////////////////////////////////////////////////////////////////////////////
+
+#endif // !INCLUDED_RESOURCEPACK_H
@@ -15,7 +15,9 @@
 #endif
 
 F_DECLARE_INTERFACE_GUID(ITask, "A237CD9F-32CA-4229-9AB2-705776BCAD9F");
+F_DECLARE_INTERFACE_GUID(IBudgetedTask, "AC709091-E5AD-4706-8669-59E50E30D859");
 F_DECLARE_INTERFACE_GUID(IScheduler, "197D6E0A-DA84-4727-B9CB-7AECAACDC653");
+F_DECLARE_INTERFACE_GUID(IJobSystem, "E2966AAC-595A-4EA5-BC77-1590C5A5E720");
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -27,11 +29,56 @@ interface ITask : IUnknown
    virtual tResult Execute(double time) = 0;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// INTERFACE: IBudgetedTask
+//
+/// @interface IBudgetedTask
+/// @brief Task whose work may take longer than a frame. It is run every
+/// frame for at most its budget and picks up where it left off next frame.
+
+interface IBudgetedTask : IUnknown
+{
+   /// @param time is the current simulation time
+   /// @param deadline is the real time, as returned by TimeGetSecs(), by
+   /// which the task should return. Check it between units of work.
+   /// @return S_OK if all pending work is done, S_FALSE if the task yielded
+   /// with work left over, or an E_xxx error code to unregister the task.
+   /// The task runs again next frame in either successful case.
+   virtual tResult Execute(double time, double deadline) = 0;
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // INTERFACE: IScheduler
 //
 
+/// Identifies one registration of a task with the scheduler. Handles are
+/// never reused, so a handle to a task that has since expired or been removed
+/// is simply rejected.
+typedef ulong tTaskHandle;
+const tTaskHandle kNoTaskHandle = 0;
+
+enum eTaskFlags
+{
+   kTaskFlagNone        = 0,
+   /// The task may run on a job system worker thread at the same time as
+   /// other concurrent tasks that are due in the same frame. Concurrent
+   /// tasks must not call back into the scheduler.
+   kTaskFlagConcurrent  = (1 << 0),
+};
+
+/// Timing of one budgeted task, from IScheduler::GetBudgetedTaskStats
+struct sBudgetedTaskStats
+{
+   ulong budgetMicrosecs;
+   ulong nRuns;            ///< Frames in which the task has run
+   ulong nYields;          ///< Runs that ended with work left over
+   ulong nOverruns;        ///< Runs that took longer than the budget
+   ulong lastMicrosecs;    ///< Length of the most recent run
+   ulong worstMicrosecs;   ///< Length of the longest run
+};
+
 interface IScheduler : IUnknown
 {
 	virtual void Start() = 0;
@@ -42,15 +89,50 @@ interface IScheduler : IUnknown
 
    /// @brief Registers a task to run on every call to IScheduler::NextFrame
    /// @param pTask specifies the task to run every frame
+   /// @param pHandle optionally receives a handle for IScheduler::RemoveTask
    /// @return S_OK if successful, or an E_xxx error code
-	virtual tResult AddRenderTask(ITask * pTask) = 0;
+	virtual tResult AddRenderTask(ITask * pTask, tTaskHandle * pHandle = NULL) = 0;
 	virtual tResult RemoveRenderTask(ITask * pTask) = 0;
 
-	virtual tResult AddFrameTask(ITask * pTask, ulong start, ulong period, ulong duration) = 0;
+	virtual tResult AddFrameTask(ITask * pTask, ulong start, ulong period, ulong duration,
+                                uint flags = kTaskFlagNone, tTaskHandle * pHandle = NULL) = 0;
 	virtual tResult RemoveFrameTask(ITask * pTask) = 0;
 
-	virtual tResult AddTimeTask(ITask * pTask, double start, double period, double duration) = 0;
+	virtual tResult AddTimeTask(ITask * pTask, double start, double period, double duration,
+                               uint flags = kTaskFlagNone, tTaskHandle * pHandle = NULL) = 0;
 	virtual tResult RemoveTimeTask(ITask * pTask) = 0;
+
+   /// @brief Registers a task to run every frame, after the frame tasks and
+   /// before the render tasks, for up to budgetMicrosecs of real time
+   /// @remarks A run that goes over the budget is counted as an overrun in
+   /// the task's stats and logged
+   virtual tResult AddBudgetedTask(IBudgetedTask * pTask, ulong budgetMicrosecs, tTaskHandle * pHandle = NULL) = 0;
+   virtual tResult RemoveBudgetedTask(IBudgetedTask * pTask) = 0;
+
+   /// @return S_OK if successful, S_FALSE if the handle does not refer to a
+   /// live budgeted task, or an E_xxx error code
+   virtual tResult GetBudgetedTaskStats(tTaskHandle handle, sBudgetedTaskStats * pStats) const = 0;
+
+   /// @brief Removes a single task registration in O(log n) time
+   /// @return S_OK if the task was removed, S_FALSE if the handle does not
+   /// refer to a live task, or an E_xxx error code
+   virtual tResult RemoveTask(tTaskHandle handle) = 0;
+
+   /// @brief Moves the next run of a frame or time task to the given frame
+   /// number or time. The task's period and expiration are unchanged.
+   /// @return S_OK if successful, S_FALSE if the handle does not refer to a
+   /// live task, or E_INVALIDARG for a render or budgeted task
+   virtual tResult RescheduleTask(tTaskHandle handle, double next) = 0;
+
+   /// @brief Declares that pTask must not run until pPrerequisite has
+   /// finished whenever both are due at the same time. Tasks due at the
+   /// same time with no ordering between them run in the order they were
+   /// added, and concurrent ones may run in parallel.
+   /// @remarks Both tasks are AddRef'd until the dependency is removed
+   /// @return S_OK if successful, S_FALSE if the dependency already exists,
+   /// or an E_xxx error code
+   virtual tResult AddTaskDependency(ITask * pTask, ITask * pPrerequisite) = 0;
+   virtual tResult RemoveTaskDependency(ITask * pTask, ITask * pPrerequisite) = 0;
 };
 
 ///////////////////////////////////////
@@ -58,6 +140,59 @@ interface IScheduler : IUnknown
 #define kSchedulerName "Scheduler"
 TECH_API tResult SchedulerCreate();
 
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// INTERFACE: IJobSystem
+//
+/// @interface IJobSystem
+/// @brief Pool of worker threads with per-worker work-stealing queues used to
+/// spread per-frame work across every core
+
+typedef void (* tJobFn)(void * pArg);
+typedef void (* tJobRangeFn)(uint begin, uint end, void * pArg);
+
+/// Opaque handle to one or more forked jobs that are joined as a unit
+typedef struct sJobHandle * tJobHandle;
+
+interface IJobSystem : IUnknown
+{
+   /// @return The number of dedicated worker threads (threads calling Join
+   /// also run jobs while they wait)
+   virtual uint GetWorkerCount() const = 0;
+
+   /// @brief Queues a job to run on any worker thread
+   /// @param pfnJob is the function to run
+   /// @param pArg is passed through to the job function
+   /// @param pHandle receives a handle for IJobSystem::Join. If it already
+   /// holds a handle, the job is added to that handle so that a single join
+   /// waits for all of them. May be NULL for a detached job.
+   /// @return S_OK if successful, or an E_xxx error code
+   virtual tResult Fork(tJobFn pfnJob, void * pArg, tJobHandle * pHandle) = 0;
+
+   /// @brief Queues a call to ITask::Execute to run on any worker thread
+   /// @remarks The task is not AddRef'd; the caller must keep it alive until
+   /// the handle is joined. If pResult is not NULL it receives the value
+   /// returned by ITask::Execute.
+   virtual tResult ForkTask(ITask * pTask, double time, tResult * pResult, tJobHandle * pHandle) = 0;
+
+   /// @brief Blocks until every job added to the handle has finished, running
+   /// queued jobs on the calling thread in the meantime. The handle is freed.
+   virtual tResult Join(tJobHandle handle) = 0;
+
+   /// @brief Splits [begin, end) into ranges of at most grainSize elements,
+   /// runs them across all workers and the calling thread and returns when
+   /// every range has finished
+   /// @param grainSize is the maximum range size, or zero to choose one
+   /// based on the number of workers
+   virtual tResult ParallelFor(uint begin, uint end, uint grainSize, tJobRangeFn pfnRange, void * pArg) = 0;
+};
+
+///////////////////////////////////////
+
+#define kJobSystemName "JobSystem"
+TECH_API tResult JobSystemCreate();
+
 ///////////////////////////////////////////////////////////////////////////////
 
 #endif // !INCLUDED_SCHEDULERAPI_H
@@ -13,6 +13,7 @@
 
 F_DECLARE_INTERFACE_GUID(ISim, "E0E7065A-9C21-4c01-8509-8C7299BEC6EF");
 F_DECLARE_INTERFACE_GUID(ISimClient, "B3E05500-6AB3-4182-BF64-319EE6D4D5DC");
+F_DECLARE_INTERFACE_GUID(ISimRenderClient, "1299FDF4-9663-4097-A6EC-F252E8E996AF");
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -20,6 +21,16 @@ F_DECLARE_INTERFACE_GUID(ISimClient, "B3E05500-6AB3-4182-BF64-319EE6D4D5DC");
 // INTERFACE: ISim
 //
 
+enum eSimClientFlags
+{
+   kSimClientFlagNone         = 0,
+   /// The client doesn't touch state used by any other sim client, so it
+   /// may run on a job system worker thread alongside the other clients.
+   /// Clients without this flag run one after another on the sim's thread,
+   /// in the order they were added.
+   kSimClientFlagConcurrent   = (1 << 0),
+};
+
 interface ISim : IUnknown
 {
 	virtual tResult Start() = 0;
@@ -31,8 +42,24 @@ interface ISim : IUnknown
    virtual double GetTimeScale() const = 0;
    virtual void SetTimeScale(double timeScale) = 0;
 
-	virtual tResult AddSimClient(ISimClient * pSimClient) = 0;
+	virtual tResult AddSimClient(ISimClient * pSimClient, uint flags = kSimClientFlagNone) = 0;
 	virtual tResult RemoveSimClient(ISimClient * pSimClient) = 0;
+
+   /// @brief Switches the sim to fixed ticks. Each frame the sim runs as
+   /// many ticks of 1/ticksPerSecond seconds as have accumulated, but no more
+   /// than maxTicksPerFrame; any backlog beyond that is dropped so that a
+   /// stall doesn't snowball. A rate of zero restores variable-length steps.
+   virtual tResult SetFixedTickRate(double ticksPerSecond, uint maxTicksPerFrame) = 0;
+   virtual double GetFixedTickRate() const = 0;
+
+   /// @return How far the sim has got from the last tick toward the next,
+   /// from zero to one. Always one when not in fixed-tick mode.
+   virtual double GetInterpolationAlpha() const = 0;
+
+   /// @brief Registers a client that is called once per rendered frame with
+   /// the interpolation alpha, after the sim ticks for that frame
+	virtual tResult AddRenderClient(ISimRenderClient * pRenderClient) = 0;
+	virtual tResult RemoveRenderClient(ISimRenderClient * pRenderClient) = 0;
 };
 
 ///////////////////////////////////////
@@ -52,6 +79,20 @@ interface ISimClient : IUnknown
 };
 
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// INTERFACE: ISimRenderClient
+//
+
+interface ISimRenderClient : IUnknown
+{
+   /// @param time is the sim time of the last tick
+   /// @param alpha is the fraction of a tick that has elapsed since then,
+   /// for blending between the previous and current sim states
+   virtual tResult Render(double time, double alpha) = 0;
+};
+
+
 ///////////////////////////////////////////////////////////////////////////////
 
 #endif // !INCLUDED_SIMAPI_H
@@ -74,6 +74,38 @@ DEFINE_GUID(IID_ISim,
 DEFINE_GUID(IID_ISimClient, 
 0xb3e05500, 0x6ab3, 0x4182, 0xbf, 0x64, 0x31, 0x9e, 0xe6, 0xd4, 0xd5, 0xdc);
 
+// {E2966AAC-595A-4EA5-BC77-1590C5A5E720}
+DEFINE_GUID(IID_IJobSystem, 
+0xe2966aac, 0x595a, 0x4ea5, 0xbc, 0x77, 0x15, 0x90, 0xc5, 0xa5, 0xe7, 0x20);
+
+// {1299FDF4-9663-4097-A6EC-F252E8E996AF}
+DEFINE_GUID(IID_ISimRenderClient, 
+0x1299fdf4, 0x9663, 0x4097, 0xa6, 0xec, 0xf2, 0x52, 0xe8, 0xe9, 0x96, 0xaf);
+
+// {AC709091-E5AD-4706-8669-59E50E30D859}
+DEFINE_GUID(IID_IBudgetedTask, 
+0xac709091, 0xe5ad, 0x4706, 0x86, 0x69, 0x59, 0xe5, 0xe, 0x30, 0xd8, 0x59);
+
+// {844E21E6-7A55-4C2C-AD74-668F26F8BC39}
+DEFINE_GUID(IID_IMappedReader, 
+0x844e21e6, 0x7a55, 0x4c2c, 0xad, 0x74, 0x66, 0x8f, 0x26, 0xf8, 0xbc, 0x39);
+
+// {8FE29412-446E-4C7C-8753-668AEDA080D5}
+DEFINE_GUID(IID_IReaderSpan, 
+0x8fe29412, 0x446e, 0x4c7c, 0x87, 0x53, 0x66, 0x8a, 0xed, 0xa0, 0x80, 0xd5);
+
+// {A243CBDB-0E23-4D4A-8635-196992F05E49}
+DEFINE_GUID(IID_IResourceListener, 
+0xa243cbdb, 0xe23, 0x4d4a, 0x86, 0x35, 0x19, 0x69, 0x92, 0xf0, 0x5e, 0x49);
+
+// {0C177547-E5CF-48AA-9FA4-62F5282F9B85}
+DEFINE_GUID(IID_IResourceStoreMonitor, 
+0xc177547, 0xe5cf, 0x48aa, 0x9f, 0xa4, 0x62, 0xf5, 0x28, 0x2f, 0x9b, 0x85);
+
+// {705D5E62-E6ED-40C0-A97B-FB355402A0E1}
+DEFINE_GUID(IID_IReaderSize, 
+0x705d5e62, 0xe6ed, 0x40c0, 0xa9, 0x7b, 0xfb, 0x35, 0x54, 0x2, 0xa0, 0xe1);
+
 ///////////////////////////////////////////////////////////////////////////////
 
 #endif // !INCLUDED_TECHGUIDS_H
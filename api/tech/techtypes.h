@@ -116,8 +116,10 @@ typedef int             int32;
 
 #if defined(_MSC_VER)
 typedef __int64         int64;
+typedef unsigned __int64 uint64;
 #elif defined(__GNUC__)
 typedef long long       int64;
+typedef unsigned long long uint64;
 #else
 #error ("Need platform definition for 64-bit integer")
 #endif
@@ -210,6 +212,8 @@ typedef void * HANDLE;
 #define _tcsrchr     wcsrchr
 #define _tcsstr      wcsstr
 #define _tfopen      wfopen
+#define _tremove     wremove
+#define _trename     wrename
 #define _vsntprintf  vsnwprintf
 #else
 #define _fgettc      fgetc
@@ -236,6 +240,8 @@ typedef void * HANDLE;
 #define _tcsrchr     strrchr
 #define _tcsstr      strstr
 #define _tfopen      fopen
+#define _tremove     remove
+#define _trename     rename
 #define _vsntprintf  vsnprintf
 #endif
 #endif
@@ -8,6 +8,7 @@
 
 #ifndef _WIN32
 #include <pthread.h>
+#include <semaphore.h>
 #endif
 
 #ifdef _MSC_VER
@@ -24,12 +25,47 @@ typedef pthread_t tThreadId;
 
 const uint kInfiniteTimeout = ~0u;
 
+/// Storage class for variables with one instance per thread. Only usable
+/// on statics and globals of POD type.
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 TECH_API void ThreadSleep(uint milliseconds);
 
 TECH_API tThreadId ThreadGetCurrentId();
 
+/// @brief Names a thread for debuggers and profilers. On Linux the name is
+/// truncated to 15 characters.
 TECH_API void ThreadSetName(tThreadId threadId, const char * pszName);
 
+/// @brief Gives up the remainder of the calling thread's time slice
+TECH_API void ThreadYield();
+
+/// @return The number of logical processors available to the process
+TECH_API uint ThreadGetProcessorCount();
+
+///////////////////////////////////////////////////////////////////////////////
+// Atomic operations. All of these act as full memory barriers.
+
+/// @return The incremented value
+TECH_API long AtomicIncrement(volatile long * pValue);
+/// @return The decremented value
+TECH_API long AtomicDecrement(volatile long * pValue);
+/// @return The current value, read with a full barrier
+TECH_API long AtomicRead(volatile long * pValue);
+/// @return The previous value
+TECH_API long AtomicExchangeAdd(volatile long * pTarget, long value);
+/// @return The previous value
+TECH_API long AtomicExchange(volatile long * pTarget, long value);
+/// @brief Stores exchange if the target equals comparand
+/// @return The previous value
+TECH_API long AtomicCompareExchange(volatile long * pTarget, long exchange, long comparand);
+TECH_API void * AtomicExchangePointer(void * volatile * ppTarget, void * pValue);
+TECH_API void * AtomicCompareExchangePointer(void * volatile * ppTarget, void * pExchange, void * pComparand);
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // CLASS: cThread
@@ -56,6 +92,13 @@ public:
 
    tThreadId GetThreadId() const;
 
+   /// @brief Only valid after Create()
+   void SetName(const char * pszName);
+
+   /// @brief Restricts the thread to the processors whose bits are set in
+   /// the mask (bit 0 is the first processor). Only valid after Create().
+   bool SetAffinity(ulong processorMask);
+
    void Join();
 
    bool Terminate();
@@ -110,6 +153,7 @@ private:
    pthread_cond_t m_cond;
    pthread_mutex_t m_mutex;
    bool m_bInitialized;
+   bool m_bSignaled;
 #endif
 };
 
@@ -131,10 +175,13 @@ public:
    bool Release();
 
 private:
+   friend class cThreadCondition;
+
 #ifdef _WIN32
    HANDLE m_hMutex;
 #else
    pthread_mutex_t m_mutex;
+   bool m_bInitialized;
 #endif
 };
 
@@ -157,6 +204,210 @@ private:
    bool m_bLocked;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cThreadCondition
+//
+// Condition variable used together with a cThreadMutex. As with any
+// condition variable, waiters must re-check their predicate in a loop
+// because Wait() can return spuriously.
+
+class TECH_API cThreadCondition
+{
+   cThreadCondition(const cThreadCondition &);
+   const cThreadCondition & operator =(const cThreadCondition &);
+
+public:
+   cThreadCondition();
+   ~cThreadCondition();
+
+   bool Create();
+
+   /// @brief Atomically releases the mutex, which the caller must hold, and
+   /// waits to be signaled. The mutex is held again on return.
+   /// @return False on timeout or error
+   bool Wait(cThreadMutex * pMutex, uint timeout = kInfiniteTimeout);
+
+   /// @brief Wakes one waiter. Call while holding the mutex.
+   void Signal();
+   /// @brief Wakes all waiters. Call while holding the mutex.
+   void Broadcast();
+
+private:
+#ifdef _WIN32
+   HANDLE m_hSemaphore;
+   long m_nWaiters; // protected by the caller's mutex
+#else
+   pthread_cond_t m_cond;
+   bool m_bInitialized;
+#endif
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cThreadSemaphore
+//
+
+class TECH_API cThreadSemaphore
+{
+   cThreadSemaphore(const cThreadSemaphore &);
+   const cThreadSemaphore & operator =(const cThreadSemaphore &);
+
+public:
+   cThreadSemaphore();
+   ~cThreadSemaphore();
+
+   bool Create(long initialCount = 0, long maxCount = 0x7FFFFFFF);
+
+   /// @brief Decrements the count, waiting for it to become non-zero first
+   /// @return False on timeout or error
+   bool Wait(uint timeout = kInfiniteTimeout);
+
+   bool Post(long count = 1);
+
+private:
+#ifdef _WIN32
+   HANDLE m_hSemaphore;
+#else
+   sem_t m_semaphore;
+   bool m_bInitialized;
+#endif
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cThreadSpinLock
+//
+// Lock for short critical sections. Contending threads spin for a while
+// (not at all on single-processor machines) before starting to yield their
+// time slice. Not recursive.
+
+class TECH_API cThreadSpinLock
+{
+   cThreadSpinLock(const cThreadSpinLock &);
+   const cThreadSpinLock & operator =(const cThreadSpinLock &);
+
+public:
+   cThreadSpinLock();
+
+   void Acquire();
+   bool TryAcquire();
+   void Release();
+
+private:
+   volatile long m_lock;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cReadWriteLock
+//
+// Allows any number of readers or a single writer. Waiting writers block
+// new readers so that a steady stream of readers can't starve them.
+// Waiting is done the same way as cThreadSpinLock so it is best suited to
+// short critical sections. Not recursive.
+
+class TECH_API cReadWriteLock
+{
+   cReadWriteLock(const cReadWriteLock &);
+   const cReadWriteLock & operator =(const cReadWriteLock &);
+
+public:
+   cReadWriteLock();
+
+   void AcquireRead();
+   bool TryAcquireRead();
+   void ReleaseRead();
+
+   void AcquireWrite();
+   bool TryAcquireWrite();
+   void ReleaseWrite();
+
+private:
+   volatile long m_state; // reader count, or kWriter
+   volatile long m_nWritersWaiting;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TEMPLATE: cScopedLock
+//
+// Holds a cThreadSpinLock (or anything with Acquire/Release) for the
+// lifetime of the object.
+
+template <typename LOCK>
+class cScopedLock
+{
+   cScopedLock(const cScopedLock &);
+   const cScopedLock & operator =(const cScopedLock &);
+
+public:
+   cScopedLock(LOCK * pLock) : m_pLock(pLock) { m_pLock->Acquire(); }
+   ~cScopedLock() { m_pLock->Release(); }
+
+private:
+   LOCK * m_pLock;
+};
+
+class cReadLock
+{
+   cReadLock(const cReadLock &);
+   const cReadLock & operator =(const cReadLock &);
+
+public:
+   cReadLock(cReadWriteLock * pLock) : m_pLock(pLock) { m_pLock->AcquireRead(); }
+   ~cReadLock() { m_pLock->ReleaseRead(); }
+
+private:
+   cReadWriteLock * m_pLock;
+};
+
+class cWriteLock
+{
+   cWriteLock(const cWriteLock &);
+   const cWriteLock & operator =(const cWriteLock &);
+
+public:
+   cWriteLock(cReadWriteLock * pLock) : m_pLock(pLock) { m_pLock->AcquireWrite(); }
+   ~cWriteLock() { m_pLock->ReleaseWrite(); }
+
+private:
+   cReadWriteLock * m_pLock;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cAtomicCounter
+//
+// A long that is only ever modified atomically
+
+class cAtomicCounter
+{
+   cAtomicCounter(const cAtomicCounter &);
+   const cAtomicCounter & operator =(const cAtomicCounter &);
+
+public:
+   explicit cAtomicCounter(long value = 0) : m_value(value) {}
+
+   /// @return The new value
+   long operator ++() { return AtomicIncrement(&m_value); }
+   long operator --() { return AtomicDecrement(&m_value); }
+
+   /// @return The new value
+   long Add(long value) { return AtomicExchangeAdd(&m_value, value) + value; }
+
+   long Get() const { return AtomicRead(const_cast<volatile long *>(&m_value)); }
+   operator long() const { return Get(); }
+
+   /// @return The previous value
+   long Exchange(long value) { return AtomicExchange(&m_value, value); }
+   /// @return The previous value
+   long CompareExchange(long exchange, long comparand) { return AtomicCompareExchange(&m_value, exchange, comparand); }
+
+private:
+   volatile long m_value;
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 
 #endif // !INCLUDED_THREAD_H
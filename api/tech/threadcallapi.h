@@ -10,13 +10,7 @@
 #include "techdll.h"
 #include "comtools.h"
 #include "functor.h"
-
-#ifdef _WIN32
-typedef ulong tThreadId;
-#else
-#include <sys/types.h>
-typedef pthread_t tThreadId;
-#endif
+#include "thread.h"
 
 #ifdef _MSC_VER
 #pragma once
@@ -24,6 +18,355 @@ typedef pthread_t tThreadId;
 
 F_DECLARE_INTERFACE(IThreadCaller);
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cFutureStateBase
+//
+/// @class cFutureStateBase
+/// @brief Reference-counted state shared by a cFuture and the call that
+/// will produce its result. Everything here is safe to use from any thread.
+
+enum eFutureStatus
+{
+   kFuturePending,
+   kFutureReady,
+   kFutureFailed, ///< The call was cancelled or could not be posted
+};
+
+class TECH_API cFutureStateBase
+{
+   cFutureStateBase(const cFutureStateBase &);
+   const cFutureStateBase & operator =(const cFutureStateBase &);
+
+public:
+   void AddRef();
+   void Release();
+
+   eFutureStatus GetStatus() const;
+
+   /// @return S_OK when ready, S_FALSE on timeout, E_FAIL if failed
+   tResult Wait(uint timeout);
+
+   /// @brief Arranges for the functor to be posted to the given thread once
+   /// the state completes. Takes ownership of the functor; if the state has
+   /// already completed it is posted immediately. Only one continuation is
+   /// allowed per state.
+   tResult SetContinuation(IThreadCaller * pThreadCaller, tThreadId threadId, cFunctor * pFunctor);
+
+protected:
+   cFutureStateBase();
+   virtual ~cFutureStateBase();
+
+   /// @brief Publishes the result (already stored by the derived class) or
+   /// the failure, wakes any waiter and posts the continuation
+   void Complete(eFutureStatus status);
+
+private:
+   volatile long m_refCount;
+   volatile long m_status;
+   cThreadEvent m_event;
+
+   void * volatile m_pContinuation;
+   IThreadCaller * m_pContinuationCaller;
+   tThreadId m_continuationThreadId;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TEMPLATE: cFutureState
+//
+
+template <typename RESULT>
+class cFutureState : public cFutureStateBase
+{
+public:
+   void SetResult(const RESULT & result)
+   {
+      m_result = result;
+      Complete(kFutureReady);
+   }
+
+   void SetFailed()
+   {
+      Complete(kFutureFailed);
+   }
+
+   /// @remarks Only valid once the status is kFutureReady
+   const RESULT & GetResult() const
+   {
+      return m_result;
+   }
+
+private:
+   RESULT m_result;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TEMPLATE: cResultFunctor
+//
+/// @class cResultFunctor
+/// @brief Functor that stores the value returned by Compute() in a future.
+/// If the functor is deleted without being called (for example, because the
+/// receiving thread terminated first) the future fails instead.
+
+template <typename RESULT>
+class cResultFunctor : public cFunctor
+{
+public:
+   cResultFunctor(cFutureState<RESULT> * pState)
+    : m_pState(pState), m_bCalled(false)
+   {
+      m_pState->AddRef();
+   }
+
+   ~cResultFunctor()
+   {
+      if (!m_bCalled)
+      {
+         m_pState->SetFailed();
+      }
+      m_pState->Release();
+   }
+
+   void operator ()()
+   {
+      m_bCalled = true;
+      m_pState->SetResult(Compute());
+   }
+
+protected:
+   virtual RESULT Compute() = 0;
+
+   void Fail()
+   {
+      m_bCalled = true;
+      m_pState->SetFailed();
+   }
+
+   cFutureState<RESULT> * m_pState;
+   bool m_bCalled;
+};
+
+////////////////////////////////////////
+
+template <typename RESULT>
+class cResultFunctor0 : public cResultFunctor<RESULT>
+{
+   typedef RESULT (* tFn)();
+public:
+   cResultFunctor0(cFutureState<RESULT> * pState, tFn pfn)
+    : cResultFunctor<RESULT>(pState), m_pfn(pfn) {}
+protected:
+   RESULT Compute() { return (*m_pfn)(); }
+   tFn m_pfn;
+};
+
+template <typename RESULT, typename ARG1>
+class cResultFunctor1 : public cResultFunctor<RESULT>
+{
+   typedef RESULT (* tFn)(ARG1);
+public:
+   cResultFunctor1(cFutureState<RESULT> * pState, tFn pfn, ARG1 arg1)
+    : cResultFunctor<RESULT>(pState), m_pfn(pfn), m_arg1(arg1) {}
+protected:
+   RESULT Compute() { return (*m_pfn)(m_arg1); }
+   tFn m_pfn;
+   ARG1 m_arg1;
+};
+
+template <typename RESULT, typename ARG1, typename ARG2>
+class cResultFunctor2 : public cResultFunctor<RESULT>
+{
+   typedef RESULT (* tFn)(ARG1, ARG2);
+public:
+   cResultFunctor2(cFutureState<RESULT> * pState, tFn pfn, ARG1 arg1, ARG2 arg2)
+    : cResultFunctor<RESULT>(pState), m_pfn(pfn), m_arg1(arg1), m_arg2(arg2) {}
+protected:
+   RESULT Compute() { return (*m_pfn)(m_arg1, m_arg2); }
+   tFn m_pfn;
+   ARG1 m_arg1;
+   ARG2 m_arg2;
+};
+
+template <typename RESULT, typename ARG1, typename ARG2, typename ARG3>
+class cResultFunctor3 : public cResultFunctor<RESULT>
+{
+   typedef RESULT (* tFn)(ARG1, ARG2, ARG3);
+public:
+   cResultFunctor3(cFutureState<RESULT> * pState, tFn pfn, ARG1 arg1, ARG2 arg2, ARG3 arg3)
+    : cResultFunctor<RESULT>(pState), m_pfn(pfn), m_arg1(arg1), m_arg2(arg2), m_arg3(arg3) {}
+protected:
+   RESULT Compute() { return (*m_pfn)(m_arg1, m_arg2, m_arg3); }
+   tFn m_pfn;
+   ARG1 m_arg1;
+   ARG2 m_arg2;
+   ARG3 m_arg3;
+};
+
+////////////////////////////////////////
+// Runs a continuation on the result of another future
+
+template <typename RESULT, typename PREV>
+class cContinuationFunctor : public cResultFunctor<RESULT>
+{
+   typedef RESULT (* tFn)(PREV);
+public:
+   cContinuationFunctor(cFutureState<RESULT> * pState, cFutureState<PREV> * pPrevState, tFn pfn)
+    : cResultFunctor<RESULT>(pState), m_pPrevState(pPrevState), m_pfn(pfn)
+   {
+      m_pPrevState->AddRef();
+   }
+
+   ~cContinuationFunctor()
+   {
+      m_pPrevState->Release();
+   }
+
+   void operator ()()
+   {
+      if (m_pPrevState->GetStatus() == kFutureReady)
+      {
+         cResultFunctor<RESULT>::operator ()();
+      }
+      else
+      {
+         this->Fail();
+      }
+   }
+
+protected:
+   RESULT Compute() { return (*m_pfn)(m_pPrevState->GetResult()); }
+   cFutureState<PREV> * m_pPrevState;
+   tFn m_pfn;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TEMPLATE: cFuture
+//
+/// @class cFuture
+/// @brief Handle to the result of a call made with
+/// IThreadCaller::PostCallWithResult. Copies share the same result.
+/// @remarks RESULT must be default constructible and copyable.
+
+template <typename RESULT>
+class cFuture
+{
+public:
+   cFuture() : m_pState(NULL) {}
+
+   explicit cFuture(cFutureState<RESULT> * pState)
+    : m_pState(pState)
+   {
+      if (m_pState != NULL)
+      {
+         m_pState->AddRef();
+      }
+   }
+
+   cFuture(const cFuture & other)
+    : m_pState(other.m_pState)
+   {
+      if (m_pState != NULL)
+      {
+         m_pState->AddRef();
+      }
+   }
+
+   ~cFuture()
+   {
+      if (m_pState != NULL)
+      {
+         m_pState->Release();
+      }
+   }
+
+   const cFuture & operator =(const cFuture & other)
+   {
+      if (other.m_pState != NULL)
+      {
+         other.m_pState->AddRef();
+      }
+      if (m_pState != NULL)
+      {
+         m_pState->Release();
+      }
+      m_pState = other.m_pState;
+      return *this;
+   }
+
+   bool IsValid() const
+   {
+      return (m_pState != NULL);
+   }
+
+   eFutureStatus GetStatus() const
+   {
+      return (m_pState != NULL) ? m_pState->GetStatus() : kFutureFailed;
+   }
+
+   /// @return True once the call has either produced a result or failed
+   bool IsDone() const
+   {
+      return GetStatus() != kFuturePending;
+   }
+
+   /// @brief Blocks until the result is available or the timeout expires
+   /// @return S_OK when the result is ready, S_FALSE on timeout, E_FAIL if
+   /// the call failed
+   /// @remarks Never wait on a call posted to the waiting thread itself
+   tResult Wait(uint timeout = kInfiniteTimeout) const
+   {
+      return (m_pState != NULL) ? m_pState->Wait(timeout) : E_FAIL;
+   }
+
+   /// @return S_OK and the result if ready, S_FALSE if still pending,
+   /// E_FAIL if the call failed
+   tResult GetResult(RESULT * pResult) const
+   {
+      if (pResult == NULL)
+      {
+         return E_POINTER;
+      }
+      switch (GetStatus())
+      {
+         case kFutureReady:
+            *pResult = m_pState->GetResult();
+            return S_OK;
+         case kFuturePending:
+            return S_FALSE;
+         default:
+            return E_FAIL;
+      }
+   }
+
+   /// @brief Chains a function to run on the result. The function is
+   /// called on the thread calling Then(), the next time that thread calls
+   /// IThreadCaller::ReceiveCalls() after the result is ready, so the
+   /// calling thread must be registered with the thread caller.
+   /// @return A future for the continuation's own result. If this future
+   /// fails, so does the returned one.
+   template <typename NEXT>
+   cFuture<NEXT> Then(IThreadCaller * pThreadCaller, NEXT (* pfn)(RESULT)) const
+   {
+      cFuture<NEXT> next(new cFutureState<NEXT>);
+      if (m_pState == NULL)
+      {
+         next.m_pState->SetFailed();
+         return next;
+      }
+      cFunctor * pFunctor = new cContinuationFunctor<NEXT, RESULT>(next.m_pState, m_pState, pfn);
+      m_pState->SetContinuation(pThreadCaller, ThreadGetCurrentId(), pFunctor);
+      return next;
+   }
+
+private:
+   template <typename OTHER> friend class cFuture;
+
+   cFutureState<RESULT> * m_pState;
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // INTERFACE: IThreadCaller
@@ -51,6 +394,10 @@ interface IThreadCaller : IUnknown
 
    /// @brief Queues a function call from the calling thread to the thread
    /// specified by the threadId parameter
+   /// @remarks Takes ownership of the functor in all cases; it is deleted
+   /// without being called if the target thread has not called ThreadInit()
+   /// (E_FAIL) or terminates before receiving it. Safe to call from any
+   /// number of threads at once without blocking.
    virtual tResult PostCall(tThreadId threadId, cFunctor * pFunctor) = 0;
 
    template <typename RETURN>
@@ -96,6 +443,46 @@ interface IThreadCaller : IUnknown
       }
       return PostCall(threadId, pFunctor);
    }
+
+   /// @brief Queues a function call to the thread specified by threadId and
+   /// returns a future that receives the function's return value. If the
+   /// call can't be posted, or the target thread terminates before running
+   /// it, the future fails rather than staying pending forever.
+   template <typename RESULT>
+   cFuture<RESULT> PostCallWithResult(tThreadId threadId, RESULT (* pfn)())
+   {
+      cFutureState<RESULT> * pState = new cFutureState<RESULT>;
+      cFuture<RESULT> future(pState);
+      PostCall(threadId, new cResultFunctor0<RESULT>(pState, pfn));
+      return future;
+   }
+
+   template <typename RESULT, typename ARG1>
+   cFuture<RESULT> PostCallWithResult(tThreadId threadId, RESULT (* pfn)(ARG1), ARG1 arg1)
+   {
+      cFutureState<RESULT> * pState = new cFutureState<RESULT>;
+      cFuture<RESULT> future(pState);
+      PostCall(threadId, new cResultFunctor1<RESULT, ARG1>(pState, pfn, arg1));
+      return future;
+   }
+
+   template <typename RESULT, typename ARG1, typename ARG2>
+   cFuture<RESULT> PostCallWithResult(tThreadId threadId, RESULT (* pfn)(ARG1, ARG2), ARG1 arg1, ARG2 arg2)
+   {
+      cFutureState<RESULT> * pState = new cFutureState<RESULT>;
+      cFuture<RESULT> future(pState);
+      PostCall(threadId, new cResultFunctor2<RESULT, ARG1, ARG2>(pState, pfn, arg1, arg2));
+      return future;
+   }
+
+   template <typename RESULT, typename ARG1, typename ARG2, typename ARG3>
+   cFuture<RESULT> PostCallWithResult(tThreadId threadId, RESULT (* pfn)(ARG1, ARG2, ARG3), ARG1 arg1, ARG2 arg2, ARG3 arg3)
+   {
+      cFutureState<RESULT> * pState = new cFutureState<RESULT>;
+      cFuture<RESULT> future(pState);
+      PostCall(threadId, new cResultFunctor3<RESULT, ARG1, ARG2, ARG3>(pState, pfn, arg1, arg2, arg3));
+      return future;
+   }
 };
 
 ////////////////////////////////////////
@@ -197,6 +197,8 @@ static void ApplyJointMatrices(uint nVertices, const sModelVertex * pVertices,
 
 cAnimatedModelRenderer::cAnimatedModelRenderer(const tChar * pszModel)
  : m_model(pszModel ? pszModel : _T(""))
+ , m_modelId(0)
+ , m_bHaveModelId(false)
  , m_pModel(NULL)
 {
 }
@@ -228,8 +230,15 @@ tResult cAnimatedModelRenderer::GetBoundingBox(tAxisAlignedBox * pBBox) const
 void cAnimatedModelRenderer::Update(double elapsedTime)
 {
    UseGlobal(ResourceManager);
+
+   // Runs every frame, so load by id to skip hashing the name each time
+   if (!m_bHaveModelId)
+   {
+      m_bHaveModelId = (pResourceManager->GetResourceId(m_model.c_str(), &m_modelId) == S_OK);
+   }
+
    IModel * pModel = NULL;
-   if (pResourceManager->Load(m_model.c_str(), kRT_Model, NULL, (void**)&pModel) != S_OK)
+   if (!m_bHaveModelId || pResourceManager->Load(m_modelId, kRT_Model, NULL, (void**)&pModel) != S_OK)
    {
       m_pModel = static_cast<IModel*>(NULL);
       return;
@@ -275,6 +284,10 @@ void cAnimatedModelRenderer::Update(double elapsedTime)
       }
    }
 
+   // m_pModel holds a reference of its own, so give back the lock that the
+   // Load above took rather than taking another one every frame
+   pResourceManager->Unlock(m_modelId, kRT_Model);
+
    if (!!m_pAnimController)
    {
       if (m_pAnimController->Advance(elapsedTime, m_blendMatrices.size(), &m_blendMatrices[0]) == S_OK)
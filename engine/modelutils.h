@@ -8,6 +8,7 @@
 #include "engine/modeltypes.h"
 
 #include "tech/axisalignedbox.h"
+#include "tech/resourceapi.h"
 #include "tech/techstring.h"
 
 #ifdef _MSC_VER
@@ -63,6 +64,8 @@ public:
 
 private:
    cStr m_model;
+   tResourceId m_modelId;
+   bool m_bHaveModelId;
    cAutoIPtr<IModel> m_pModel;
    std::vector<tMatrix34> m_blendMatrices;
    tBlendedVertices m_blendedVerts;
@@ -700,6 +700,19 @@ tResult cSaveLoadManager::OpenSingleEntry(IReader * pReader, REFGUID id, IReader
 
       if (CTIsEqualGUID(entry.id, id))
       {
+         // If the whole file is already in memory, read the entry in place.
+         // The entry reader keeps the source reader's memory alive.
+         cAutoIPtr<IMappedReader> pMappedReader;
+         const byte * pData = NULL;
+         size_t dataSize = 0;
+         if (pReader->QueryInterface(IID_IMappedReader, (void**)&pMappedReader) == S_OK
+            && pMappedReader->GetMappedData(&pData, &dataSize) == S_OK
+            && entry.offset <= dataSize
+            && entry.length <= (dataSize - entry.offset))
+         {
+            return MemReaderCreateView(pData + entry.offset, entry.length, pMappedReader, ppEntryReader);
+         }
+
          if (pReader->Seek(entry.offset, kSO_Set) != S_OK)
          {
             ErrorMsg("Unable to seek to file entry\n");
@@ -125,8 +125,13 @@ tResult cScenario::Start(const tChar * pszMap, const tChar * pszGUI, ulong randS
 
    m_rand.Seed(randSeed);
 
-   void * pData = NULL;
    UseGlobal(ResourceManager);
+
+   // Start on what the map loaded last time while the map itself loads.
+   // Only formats registered as thread-safe, like images, are prefetched.
+   pResourceManager->Prefetch(pszMap, kRT_Map);
+
+   void * pData = NULL;
    if (pResourceManager->Load(pszMap, kRT_Map, NULL, &pData) != S_OK)
    {
       return E_FAIL;
@@ -134,6 +139,9 @@ tResult cScenario::Start(const tChar * pszMap, const tChar * pszGUI, ulong randS
 
    m_map.assign(pszMap);
 
+   // Whatever is loaded during play belongs to the map's asset set too
+   pResourceManager->RecordDependencies(pszMap, kRT_Map);
+
    if (pszGUI != NULL)
    {
       UseGlobal(GUIContext);
@@ -154,6 +162,7 @@ tResult cScenario::Stop()
    pSim->Stop();
 
    UseGlobal(ResourceManager);
+   pResourceManager->RecordDependencies(NULL, NULL);
    pResourceManager->Unload(m_map.c_str(), kRT_Map);
    m_map.clear();
 
@@ -0,0 +1,76 @@
+///////////////////////////////////////////////////////////////////////////////
+// $Id$
+//
+// Builds a resource pack from a data directory tree:
+//
+//    resourcepacker +data=<directory> +out=<pack file> [+compress]
+//
+// The pack can be used in place of the directory tree by handing it to
+// IResourceManager::AddArchive.
+
+#include "stdhdr.h"
+
+#include "tech/configapi.h"
+#include "tech/dictionaryapi.h"
+#include "tech/filespec.h"
+#include "tech/resourcepack.h"
+#include "tech/techstring.h"
+#include "tech/techtime.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "tech/dbgalloc.h" // must be last header
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+static tResult InitGlobalConfig(int argc, tChar * argv[])
+{
+   Assert(argc > 0);
+
+   cFileSpec cfgFile(argv[0]);
+   cfgFile.SetFileExt(_T("cfg"));
+
+   cAutoIPtr<IDictionaryStore> pStore = DictionaryStoreCreate(cfgFile);
+   if (!!pStore)
+   {
+      pStore->Load(g_pConfig);
+   }
+
+   return ParseCommandLine(argc, argv, g_pConfig);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char * argv[])
+{
+   if (InitGlobalConfig(argc, argv) != S_OK)
+   {
+      return EXIT_FAILURE;
+   }
+
+   cStr dataDir, packFile;
+   if (ConfigGet(_T("data"), &dataDir) != S_OK || ConfigGet(_T("out"), &packFile) != S_OK)
+   {
+      fprintf(stderr, "Usage: %s +data=<directory> +out=<pack file> [+compress]\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   uint flags = ConfigIsTrue(_T("compress")) ? kRPBF_Compress : kRPBF_None;
+
+   double start = TimeGetSecs();
+
+   if (ResourcePackBuild(dataDir.c_str(), packFile.c_str(), flags) != S_OK)
+   {
+      fprintf(stderr, "Failed to build \"%s\" from \"%s\"\n", packFile.c_str(), dataDir.c_str());
+      return EXIT_FAILURE;
+   }
+
+   printf("Built \"%s\" in %.2f seconds\n", packFile.c_str(), TimeGetSecs() - start);
+
+   return EXIT_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,4 @@
+///////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#include "stdhdr.h"
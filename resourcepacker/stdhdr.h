@@ -0,0 +1,15 @@
+///////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#ifndef INCLUDED_STDHDR_H
+#define INCLUDED_STDHDR_H
+
+#include "tech/techtypes.h"
+#include "tech/techassert.h"
+#include "tech/techlog.h"
+
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#endif // !INCLUDED_STDHDR_H
@@ -0,0 +1,300 @@
+///////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#include "stdhdr.h"
+
+#include "blockpool.h"
+
+#include "tech/thread.h"
+
+#ifdef HAVE_UNITTESTPP
+#include "UnitTest++.h"
+#endif
+
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <vector>
+
+#include "tech/dbgalloc.h" // must be last header
+
+// REFERENCES
+// "Magazines and Vmem: Extending the Slab Allocator to Many CPUs and
+// Arbitrary Resources", Jeff Bonwick & Jonathan Adams, USENIX 2001.
+
+///////////////////////////////////////////////////////////////////////////////
+
+static const size_t kBlockSizes[] = { 16, 32, 64, 128, 256 };
+static const int kNumSizeClasses = _countof(kBlockSizes);
+
+// Blocks move between a thread's cache and the shared depot this many at a time
+static const uint kMagazineSize = 32;
+
+struct sFreeBlock
+{
+   sFreeBlock * pNext;
+   sFreeBlock * pNextMagazine; // only valid in the first block of a magazine
+};
+
+struct sBlockCache
+{
+   sFreeBlock * pBlocks;
+   uint nBlocks;
+};
+
+struct sBlockDepot
+{
+   cThreadSpinLock lock; // only held long enough to push or pop one pointer
+   sFreeBlock * pMagazines;
+   // Blocks from exiting threads' partly used magazines, gathered until
+   // they make up a whole one
+   sFreeBlock * pLoose;
+   uint nLoose;
+};
+
+static THREAD_LOCAL sBlockCache g_blockCaches[kNumSizeClasses];
+static sBlockDepot g_blockDepots[kNumSizeClasses];
+
+////////////////////////////////////////
+
+static int BlockSizeClass(size_t size)
+{
+   for (int i = 0; i < kNumSizeClasses; i++)
+   {
+      if (size <= kBlockSizes[i])
+      {
+         return i;
+      }
+   }
+   return -1;
+}
+
+////////////////////////////////////////
+
+static sFreeBlock * DepotPopMagazine(int sizeClass)
+{
+   sBlockDepot * pDepot = &g_blockDepots[sizeClass];
+   pDepot->lock.Acquire();
+   sFreeBlock * pMagazine = pDepot->pMagazines;
+   if (pMagazine != NULL)
+   {
+      pDepot->pMagazines = pMagazine->pNextMagazine;
+   }
+   pDepot->lock.Release();
+
+   if (pMagazine == NULL)
+   {
+      // Carve a new magazine out of a fresh chunk
+      size_t blockSize = kBlockSizes[sizeClass];
+      byte * pChunk = static_cast<byte *>(malloc(blockSize * kMagazineSize));
+      if (pChunk == NULL)
+      {
+         return NULL;
+      }
+      for (uint i = 0; i < kMagazineSize; i++)
+      {
+         sFreeBlock * pBlock = reinterpret_cast<sFreeBlock *>(pChunk + (i * blockSize));
+         pBlock->pNext = ((i + 1) < kMagazineSize) ? reinterpret_cast<sFreeBlock *>(pChunk + ((i + 1) * blockSize)) : NULL;
+      }
+      pMagazine = reinterpret_cast<sFreeBlock *>(pChunk);
+   }
+
+   return pMagazine;
+}
+
+////////////////////////////////////////
+
+static void DepotPushMagazine(int sizeClass, sFreeBlock * pMagazine)
+{
+   sBlockDepot * pDepot = &g_blockDepots[sizeClass];
+   pDepot->lock.Acquire();
+   pMagazine->pNextMagazine = pDepot->pMagazines;
+   pDepot->pMagazines = pMagazine;
+   pDepot->lock.Release();
+}
+
+////////////////////////////////////////
+
+static void DepotPushBlocks(int sizeClass, sFreeBlock * pBlocks)
+{
+   sBlockDepot * pDepot = &g_blockDepots[sizeClass];
+   pDepot->lock.Acquire();
+   while (pBlocks != NULL)
+   {
+      sFreeBlock * pBlock = pBlocks;
+      pBlocks = pBlock->pNext;
+      pBlock->pNext = pDepot->pLoose;
+      pDepot->pLoose = pBlock;
+      if (++pDepot->nLoose == kMagazineSize)
+      {
+         pDepot->pLoose->pNextMagazine = pDepot->pMagazines;
+         pDepot->pMagazines = pDepot->pLoose;
+         pDepot->pLoose = NULL;
+         pDepot->nLoose = 0;
+      }
+   }
+   pDepot->lock.Release();
+}
+
+////////////////////////////////////////
+
+void * BlockPoolAlloc(size_t size)
+{
+   int sizeClass = BlockSizeClass(size);
+   if (sizeClass < 0)
+   {
+      return malloc(size);
+   }
+
+   sBlockCache * pCache = &g_blockCaches[sizeClass];
+   if (pCache->pBlocks == NULL)
+   {
+      pCache->pBlocks = DepotPopMagazine(sizeClass);
+      if (pCache->pBlocks == NULL)
+      {
+         return NULL;
+      }
+      pCache->nBlocks = kMagazineSize;
+   }
+
+   sFreeBlock * pBlock = pCache->pBlocks;
+   pCache->pBlocks = pBlock->pNext;
+   pCache->nBlocks--;
+   return pBlock;
+}
+
+////////////////////////////////////////
+
+void BlockPoolFree(void * pBlock, size_t size)
+{
+   if (pBlock == NULL)
+   {
+      return;
+   }
+
+   int sizeClass = BlockSizeClass(size);
+   if (sizeClass < 0)
+   {
+      free(pBlock);
+      return;
+   }
+
+   sBlockCache * pCache = &g_blockCaches[sizeClass];
+
+   sFreeBlock * pFreeBlock = static_cast<sFreeBlock *>(pBlock);
+   pFreeBlock->pNext = pCache->pBlocks;
+   pCache->pBlocks = pFreeBlock;
+   pCache->nBlocks++;
+
+   // Threads that mostly receive (and so free) blocks hand full magazines
+   // back to the depot for the threads that mostly send
+   if (pCache->nBlocks >= (2 * kMagazineSize))
+   {
+      sFreeBlock * pMagazine = pCache->pBlocks;
+      sFreeBlock * pLast = pMagazine;
+      for (uint i = 1; i < kMagazineSize; i++)
+      {
+         pLast = pLast->pNext;
+      }
+      pCache->pBlocks = pLast->pNext;
+      pCache->nBlocks -= kMagazineSize;
+      pLast->pNext = NULL;
+      DepotPushMagazine(sizeClass, pMagazine);
+   }
+}
+
+////////////////////////////////////////
+
+void BlockPoolThreadTerm()
+{
+   for (int i = 0; i < kNumSizeClasses; i++)
+   {
+      sBlockCache * pCache = &g_blockCaches[i];
+      if (pCache->pBlocks != NULL)
+      {
+         DepotPushBlocks(i, pCache->pBlocks);
+         pCache->pBlocks = NULL;
+         pCache->nBlocks = 0;
+      }
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef HAVE_UNITTESTPP
+
+TEST(BlockPoolAllocFree)
+{
+   static const int kNumBlocks = 1000;
+
+   std::vector<void *> blocks;
+   for (int i = 0; i < kNumBlocks; i++)
+   {
+      size_t size = 1 + (i % 300);
+      byte * pBlock = static_cast<byte *>(BlockPoolAlloc(size));
+      CHECK(pBlock != NULL);
+      memset(pBlock, i & 0xFF, size);
+      blocks.push_back(pBlock);
+   }
+
+   bool bIntact = true;
+   for (int i = 0; i < kNumBlocks; i++)
+   {
+      size_t size = 1 + (i % 300);
+      const byte * pBlock = static_cast<const byte *>(blocks[i]);
+      bIntact = bIntact && (pBlock[0] == (i & 0xFF)) && (pBlock[size - 1] == (i & 0xFF));
+      BlockPoolFree(blocks[i], size);
+   }
+   CHECK(bIntact);
+
+   // Freed blocks are reused
+   void * pBlock = BlockPoolAlloc(24);
+   void * pBlock2 = BlockPoolAlloc(24);
+   BlockPoolFree(pBlock2, 24);
+   BlockPoolFree(pBlock, 24);
+   CHECK(BlockPoolAlloc(24) == pBlock);
+   BlockPoolFree(pBlock, 24);
+}
+
+////////////////////////////////////////
+
+class cBlockPoolThread : public cThread
+{
+public:
+   cBlockPoolThread() : m_pBlock(NULL) {}
+
+   virtual int Run()
+   {
+      m_pBlock = BlockPoolAlloc(200);
+      BlockPoolFree(m_pBlock, 200);
+      return 0;
+   }
+
+   void * GetBlock() const { return m_pBlock; }
+
+private:
+   void * m_pBlock;
+};
+
+TEST(BlockPoolThreadExit)
+{
+   // Each thread takes a magazine and would keep it forever if exiting
+   // threads didn't give their blocks back, so every thread would get a
+   // block no other thread has had
+   static const int kNumThreads = 50;
+
+   std::set<void *> blocks;
+   for (int i = 0; i < kNumThreads; i++)
+   {
+      cBlockPoolThread thread;
+      CHECK(thread.Create());
+      thread.Join();
+      blocks.insert(thread.GetBlock());
+   }
+
+   CHECK(blocks.size() < 5);
+}
+
+#endif // HAVE_UNITTESTPP
+
+///////////////////////////////////////////////////////////////////////////////
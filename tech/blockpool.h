@@ -0,0 +1,33 @@
+///////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#ifndef INCLUDED_BLOCKPOOL_H
+#define INCLUDED_BLOCKPOOL_H
+
+#include "tech/techdll.h"
+
+#include <cstddef>
+
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Thread-safe allocator for the small, short-lived objects that are passed
+// between threads (functors, queue nodes). Each thread keeps a private cache
+// of free blocks per size class and only touches shared state to trade a
+// whole magazine of blocks at a time, so most allocations take no lock.
+// Memory is recycled but never returned to the system. Requests larger than
+// the biggest size class go straight to malloc.
+
+void * BlockPoolAlloc(size_t size);
+void BlockPoolFree(void * pBlock, size_t size);
+
+// Hands the calling thread's cached blocks back to the shared pool. cThread
+// does this when Run returns; other threads that use the pool should call it
+// before they exit.
+void BlockPoolThreadTerm();
+
+///////////////////////////////////////////////////////////////////////////////
+
+#endif // !INCLUDED_BLOCKPOOL_H
@@ -0,0 +1,576 @@
+///////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#include "stdhdr.h"
+
+#include "tech/coroutine.h"
+#include "tech/globalobj.h"
+#include "tech/thread.h"
+
+#ifdef HAVE_UNITTESTPP
+#include "UnitTest++.h"
+#include "scheduler.h"
+#include "tech/techtime.h"
+#endif
+
+#include <cstdlib>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "tech/dbgalloc.h" // must be last header
+
+// winbase.h, included again above, brings the Yield() macro back
+#ifdef Yield
+#undef Yield
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+LOG_DEFINE_CHANNEL(Coroutine);
+#define LocalMsg(msg)                  DebugMsgEx(Coroutine,(msg))
+#define LocalMsg1(msg,a1)              DebugMsgEx1(Coroutine,(msg),(a1))
+#define LocalMsg2(msg,a1,a2)           DebugMsgEx2(Coroutine,(msg),(a1),(a2))
+
+static const uint kMinStackSize = 16 * 1024;
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cCoroutine
+//
+
+#ifdef _WIN32
+// The fiber the thread was converted to, if any
+static THREAD_LOCAL void * g_pThreadFiber = NULL;
+#else
+// Lets ContextEntry, which takes no arguments, find its coroutine
+static THREAD_LOCAL cCoroutine * g_pStartingCoroutine = NULL;
+#endif
+
+////////////////////////////////////////
+
+cCoroutine::cCoroutine(uint stackSize)
+ : m_stackSize((stackSize > kMinStackSize) ? stackSize : kMinStackSize)
+ , m_bStarted(false)
+ , m_bRunning(false)
+ , m_bFinished(false)
+#ifdef _WIN32
+ , m_pFiber(NULL)
+ , m_pCallerFiber(NULL)
+#else
+ , m_pStack(NULL)
+#endif
+{
+}
+
+////////////////////////////////////////
+
+cCoroutine::~cCoroutine()
+{
+   Assert(!m_bRunning);
+#ifdef _WIN32
+   if (m_pFiber != NULL)
+   {
+      DeleteFiber(m_pFiber);
+      m_pFiber = NULL;
+   }
+#else
+   free(m_pStack);
+   m_pStack = NULL;
+#endif
+}
+
+////////////////////////////////////////
+
+tResult cCoroutine::Resume()
+{
+   if (m_bFinished)
+   {
+      return S_FALSE;
+   }
+
+   if (m_bRunning)
+   {
+      // Can't resume a coroutine from its own stack
+      return E_FAIL;
+   }
+
+   if (!m_bStarted)
+   {
+      if (!CreateContext())
+      {
+         return E_OUTOFMEMORY;
+      }
+      m_bStarted = true;
+   }
+
+   m_bRunning = true;
+
+#ifdef _WIN32
+   if (g_pThreadFiber == NULL)
+   {
+      g_pThreadFiber = ConvertThreadToFiber(NULL);
+      if (g_pThreadFiber == NULL)
+      {
+         // Someone else already made this thread a fiber
+         g_pThreadFiber = GetCurrentFiber();
+      }
+   }
+   m_pCallerFiber = GetCurrentFiber();
+   SwitchToFiber(m_pFiber);
+#else
+   g_pStartingCoroutine = this;
+   swapcontext(&m_callerContext, &m_context);
+#endif
+
+   m_bRunning = false;
+
+   return m_bFinished ? S_FALSE : S_OK;
+}
+
+////////////////////////////////////////
+
+void cCoroutine::Suspend()
+{
+   Assert(m_bRunning);
+#ifdef _WIN32
+   SwitchToFiber(m_pCallerFiber);
+#else
+   swapcontext(&m_context, &m_callerContext);
+#endif
+}
+
+////////////////////////////////////////
+
+bool cCoroutine::CreateContext()
+{
+#ifdef _WIN32
+   m_pFiber = CreateFiber(m_stackSize, FiberEntry, this);
+   if (m_pFiber == NULL)
+   {
+      ErrorMsg1("Error %d creating coroutine fiber\n", GetLastError());
+      return false;
+   }
+#else
+   m_pStack = malloc(m_stackSize);
+   if (m_pStack == NULL || getcontext(&m_context) != 0)
+   {
+      ErrorMsg("Error creating coroutine context\n");
+      return false;
+   }
+   m_context.uc_stack.ss_sp = m_pStack;
+   m_context.uc_stack.ss_size = m_stackSize;
+   m_context.uc_link = NULL;
+   makecontext(&m_context, ContextEntry, 0);
+#endif
+   return true;
+}
+
+////////////////////////////////////////
+
+#ifdef _WIN32
+void STDCALL cCoroutine::FiberEntry(void * param)
+{
+   cCoroutine * pCoroutine = reinterpret_cast<cCoroutine *>(param);
+   pCoroutine->Run();
+   pCoroutine->m_bFinished = true;
+   // A fiber function must never return
+   SwitchToFiber(pCoroutine->m_pCallerFiber);
+}
+#else
+void cCoroutine::ContextEntry()
+{
+   cCoroutine * pCoroutine = g_pStartingCoroutine;
+   pCoroutine->Run();
+   pCoroutine->m_bFinished = true;
+   setcontext(&pCoroutine->m_callerContext);
+}
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cCoroutineTask
+//
+
+////////////////////////////////////////
+
+cCoroutineTask::cCoroutineTask(uint stackSize)
+ : cCoroutine(stackSize)
+ , m_waitMode(kNotStarted)
+ , m_time(0)
+ , m_wakeTime(0)
+ , m_result(S_FALSE)
+ , m_taskHandle(kNoTaskHandle)
+{
+}
+
+////////////////////////////////////////
+
+cCoroutineTask::~cCoroutineTask()
+{
+}
+
+////////////////////////////////////////
+
+tResult cCoroutineTask::Start(IScheduler * pScheduler)
+{
+   if (m_waitMode != kNotStarted)
+   {
+      return E_FAIL;
+   }
+
+   if (pScheduler != NULL)
+   {
+      m_pScheduler = CTAddRef(pScheduler);
+   }
+   else if (g_pGlobalObjectRegistry != NULL)
+   {
+      m_pScheduler = static_cast<IScheduler*>(FindGlobalObject(IID_IScheduler));
+   }
+
+   if (!m_pScheduler)
+   {
+      return E_FAIL;
+   }
+
+   tResult result = m_pScheduler->AddFrameTask(static_cast<ITask*>(this), 0, 1, 0, kTaskFlagNone, &m_taskHandle);
+   if (result != S_OK)
+   {
+      SafeRelease(m_pScheduler);
+      return result;
+   }
+
+   m_waitMode = kWaitFrame;
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cCoroutineTask::Stop()
+{
+   if (!IsRunning() || m_waitMode == kStopping)
+   {
+      return S_FALSE;
+   }
+
+   m_waitMode = kStopping;
+
+   m_pScheduler->RemoveTask(m_taskHandle);
+   m_taskHandle = kNoTaskHandle;
+
+   // Let the body clean up. If the task is stopping itself it isn't
+   // suspended and its next wait returns E_ABORT instead.
+   if (IsSuspended() && Resume() == S_OK)
+   {
+      WarnMsg1("Coroutine task %p waited again after being stopped\n", this);
+   }
+
+   SafeRelease(m_pScheduler);
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cCoroutineTask::Execute(double time)
+{
+   if (m_waitMode == kWaitTime)
+   {
+      // Woken by the time task. Carry on when frame tasks run so that the
+      // body always runs at the same point in the frame.
+      m_waitMode = kWaitFrame;
+      if (m_pScheduler->AddFrameTask(static_cast<ITask*>(this), 0, 1, 0, kTaskFlagNone, &m_taskHandle) != S_OK)
+      {
+         ErrorMsg1("Unable to wake coroutine task %p\n", this);
+      }
+      return S_FALSE;
+   }
+
+   if (m_waitMode != kWaitFrame)
+   {
+      return S_FALSE;
+   }
+
+   m_time = time;
+
+   if (Resume() != S_OK)
+   {
+      LocalMsg2("Coroutine task %p finished with result 0x%08X\n", this, m_result);
+      m_taskHandle = kNoTaskHandle;
+      SafeRelease(m_pScheduler);
+      return S_FALSE;
+   }
+
+   if (m_waitMode == kWaitTime)
+   {
+      // Swap the frame task for a time task that is due at the wake time
+      if (m_pScheduler->AddTimeTask(static_cast<ITask*>(this), m_wakeTime, 1, 0, kTaskFlagNone, &m_taskHandle) != S_OK)
+      {
+         ErrorMsg1("Unable to put coroutine task %p to sleep\n", this);
+         m_waitMode = kWaitFrame;
+         return S_OK;
+      }
+      return S_FALSE;
+   }
+
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cCoroutineTask::Yield()
+{
+   if (m_waitMode == kStopping)
+   {
+      return E_ABORT;
+   }
+   m_waitMode = kWaitFrame;
+   return Wait();
+}
+
+////////////////////////////////////////
+
+tResult cCoroutineTask::WaitSeconds(double seconds)
+{
+   if (m_waitMode == kStopping)
+   {
+      return E_ABORT;
+   }
+   m_wakeTime = m_time + seconds;
+   m_waitMode = kWaitTime;
+   return Wait();
+}
+
+////////////////////////////////////////
+
+tResult cCoroutineTask::Wait()
+{
+   Suspend();
+   return (m_waitMode == kStopping) ? E_ABORT : S_OK;
+}
+
+////////////////////////////////////////
+
+void cCoroutineTask::Run()
+{
+   m_result = RunTask(m_time);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef HAVE_UNITTESTPP
+
+class cCoroutineTests
+{
+public:
+   cCoroutineTests();
+   ~cCoroutineTests();
+
+   IScheduler * AccessScheduler() { return static_cast<IScheduler*>(m_pScheduler); }
+
+   void RunFrames(int nFrames)
+   {
+      for (int i = 0; i < nFrames; i++)
+      {
+         m_pScheduler->NextFrame();
+      }
+   }
+
+private:
+   cAutoIPtr<cScheduler> m_pScheduler;
+};
+
+cCoroutineTests::cCoroutineTests()
+ : m_pScheduler(new cScheduler)
+{
+   m_pScheduler->Init();
+   m_pScheduler->Start();
+}
+
+cCoroutineTests::~cCoroutineTests()
+{
+   m_pScheduler->Stop();
+   m_pScheduler->Term();
+}
+
+////////////////////////////////////////
+
+class cCountingCoroutine : public cCoroutine
+{
+public:
+   cCountingCoroutine() : m_count(0) {}
+
+   int m_count;
+
+protected:
+   virtual void Run()
+   {
+      for (int i = 0; i < 3; i++)
+      {
+         m_count++;
+         Suspend();
+      }
+   }
+};
+
+TEST(CoroutineResume)
+{
+   cCountingCoroutine coroutine;
+   CHECK(!coroutine.IsFinished());
+   CHECK(coroutine.Resume() == S_OK);
+   CHECK_EQUAL(1, coroutine.m_count);
+   CHECK(coroutine.Resume() == S_OK);
+   CHECK(coroutine.Resume() == S_OK);
+   CHECK_EQUAL(3, coroutine.m_count);
+   CHECK(coroutine.Resume() == S_FALSE);
+   CHECK(coroutine.IsFinished());
+   CHECK(coroutine.Resume() == S_FALSE);
+   CHECK_EQUAL(3, coroutine.m_count);
+}
+
+////////////////////////////////////////
+
+class cYieldingTask : public cCoroutineTask
+{
+public:
+   cYieldingTask(int nFrames) : m_nFrames(nFrames), m_nRuns(0), m_bCleanedUp(false) {}
+
+   int m_nFrames, m_nRuns;
+   bool m_bCleanedUp;
+
+protected:
+   virtual tResult RunTask(double time)
+   {
+      for (int i = 0; i < m_nFrames; i++)
+      {
+         m_nRuns++;
+         if (Yield() != S_OK)
+         {
+            m_bCleanedUp = true;
+            return E_ABORT;
+         }
+      }
+      return S_OK;
+   }
+};
+
+TEST_FIXTURE(cCoroutineTests, CoroutineTaskYield)
+{
+   cAutoIPtr<cYieldingTask> pTask(new cYieldingTask(3));
+   CHECK(pTask->Start(AccessScheduler()) == S_OK);
+   CHECK(pTask->IsRunning());
+
+   // One step per frame
+   RunFrames(1);
+   CHECK_EQUAL(1, pTask->m_nRuns);
+   RunFrames(1);
+   CHECK_EQUAL(2, pTask->m_nRuns);
+   RunFrames(3);
+   CHECK_EQUAL(3, pTask->m_nRuns);
+
+   CHECK(!pTask->IsRunning());
+   CHECK(pTask->GetResult() == S_OK);
+}
+
+TEST_FIXTURE(cCoroutineTests, CoroutineTaskStop)
+{
+   cAutoIPtr<cYieldingTask> pTask(new cYieldingTask(100));
+   CHECK(pTask->Start(AccessScheduler()) == S_OK);
+
+   RunFrames(2);
+   CHECK_EQUAL(2, pTask->m_nRuns);
+
+   CHECK(pTask->Stop() == S_OK);
+   CHECK(pTask->m_bCleanedUp);
+   CHECK(pTask->GetResult() == E_ABORT);
+   CHECK(!pTask->IsRunning());
+
+   RunFrames(2);
+   CHECK_EQUAL(2, pTask->m_nRuns);
+}
+
+////////////////////////////////////////
+
+class cSleepingTask : public cCoroutineTask
+{
+public:
+   cSleepingTask(double seconds) : m_seconds(seconds), m_slept(0) {}
+
+   double m_seconds, m_slept;
+
+protected:
+   virtual tResult RunTask(double time)
+   {
+      double start = GetTime();
+      tResult result = WaitSeconds(m_seconds);
+      m_slept = GetTime() - start;
+      return result;
+   }
+};
+
+TEST_FIXTURE(cCoroutineTests, CoroutineTaskWaitSeconds)
+{
+   static const double kSleepSeconds = 0.05;
+
+   cAutoIPtr<cSleepingTask> pTask(new cSleepingTask(kSleepSeconds));
+   CHECK(pTask->Start(AccessScheduler()) == S_OK);
+
+   double timeout = TimeGetSecs() + 2;
+   while (pTask->IsRunning() && TimeGetSecs() < timeout)
+   {
+      RunFrames(1);
+      ThreadSleep(5);
+   }
+
+   CHECK(!pTask->IsRunning());
+   CHECK(pTask->GetResult() == S_OK);
+   CHECK(pTask->m_slept >= kSleepSeconds);
+}
+
+////////////////////////////////////////
+
+class cFutureWaitingTask : public cCoroutineTask
+{
+public:
+   cFutureWaitingTask(const cFuture<int> & future) : m_future(future), m_value(0) {}
+
+   cFuture<int> m_future;
+   int m_value;
+
+protected:
+   virtual tResult RunTask(double time)
+   {
+      tResult result = WaitFor(m_future);
+      if (result == S_OK)
+      {
+         m_future.GetResult(&m_value);
+      }
+      return result;
+   }
+};
+
+TEST_FIXTURE(cCoroutineTests, CoroutineTaskWaitForFuture)
+{
+   cFutureState<int> * pState = new cFutureState<int>;
+   pState->AddRef();
+
+   cAutoIPtr<cFutureWaitingTask> pTask(new cFutureWaitingTask(cFuture<int>(pState)));
+   CHECK(pTask->Start(AccessScheduler()) == S_OK);
+
+   RunFrames(3);
+   CHECK(pTask->IsRunning());
+
+   pState->SetResult(42);
+   pState->Release();
+
+   RunFrames(1);
+   CHECK(!pTask->IsRunning());
+   CHECK(pTask->GetResult() == S_OK);
+   CHECK_EQUAL(42, pTask->m_value);
+}
+
+#endif // HAVE_UNITTESTPP
@@ -0,0 +1,472 @@
+////////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#include "stdhdr.h"
+
+#include "derivedcache.h"
+
+#include "tech/fileenum.h"
+#include "tech/readwriteapi.h"
+#include "tech/techhash.h"
+
+#ifdef HAVE_UNITTESTPP
+#include "UnitTest++.h"
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "tech/dbgalloc.h" // must be last header
+
+////////////////////////////////////////////////////////////////////////////////
+
+LOG_EXTERN_CHANNEL(ResourceManager);
+
+#define LocalMsg1(msg,a)         DebugMsgEx1(ResourceManager,msg,(a))
+#define LocalMsg2(msg,a,b)       DebugMsgEx2(ResourceManager,msg,(a),(b))
+
+static const size_t kHashBufferSize = 8192;
+
+static const tChar kTempExt[] = _T(".tmp");
+
+////////////////////////////////////////
+
+struct sDerivedEntryFile
+{
+   cFileSpec file;
+   size_t size;
+   time_t writeTime;
+};
+
+static bool DerivedEntryFileOlder(const sDerivedEntryFile & e1, const sDerivedEntryFile & e2)
+{
+   return e1.writeTime < e2.writeTime;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cDerivedDataCache
+//
+
+////////////////////////////////////////
+
+cDerivedDataCache::cDerivedDataCache()
+{
+}
+
+////////////////////////////////////////
+
+cDerivedDataCache::~cDerivedDataCache()
+{
+}
+
+////////////////////////////////////////
+
+tResult cDerivedDataCache::SetDirectory(const tChar * pszDir)
+{
+   if (pszDir == NULL)
+   {
+      return E_POINTER;
+   }
+
+   cFilePath dir(pszDir);
+   dir.MakeFullPath();
+
+   if (!FilePathExists(dir))
+   {
+#ifdef _WIN32
+      int result = _tmkdir(dir.CStr());
+#else
+      int result = mkdir(dir.CStr(), 0755);
+#endif
+      if (result != 0 && errno != EEXIST)
+      {
+         ErrorMsg1("Unable to create derived data cache directory \"%s\"\n", dir.CStr());
+         return E_FAIL;
+      }
+   }
+
+   LocalMsg1("Caching derived resource data in \"%s\"\n", dir.CStr());
+   m_dir = dir;
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cDerivedDataCache::MakeKey(IReader * pReader, const cResourceFormat & format, void * loadParam, cStr * pKey)
+{
+   if (pReader == NULL || pKey == NULL)
+   {
+      return E_POINTER;
+   }
+
+   if (loadParam != NULL)
+   {
+      return S_FALSE;
+   }
+
+   cMD5 md5;
+   md5.Initialize();
+
+   const byte * pMappedData = NULL;
+   size_t mappedSize = 0;
+   cAutoIPtr<IMappedReader> pMappedReader;
+   if (pReader->QueryInterface(IID_IMappedReader, (void**)&pMappedReader) == S_OK
+      && pMappedReader->GetMappedData(&pMappedData, &mappedSize) == S_OK)
+   {
+      md5.Update(const_cast<byte *>(pMappedData), mappedSize);
+   }
+   else
+   {
+      if (pReader->Seek(0, kSO_Set) != S_OK)
+      {
+         return E_FAIL;
+      }
+
+      byte buffer[kHashBufferSize];
+      for (;;)
+      {
+         size_t nBytesRead = 0;
+         tResult result = pReader->Read(buffer, sizeof(buffer), &nBytesRead);
+         if (FAILED(result))
+         {
+            return result;
+         }
+         md5.Update(buffer, nBytesRead);
+         if (result != S_OK || nBytesRead < sizeof(buffer))
+         {
+            break;
+         }
+      }
+   }
+
+   if (pReader->Seek(0, kSO_Set) != S_OK)
+   {
+      return E_FAIL;
+   }
+
+   byte digest[16];
+   md5.Finalize(digest);
+
+   // Type names become part of a file name
+   pKey->erase();
+   for (const tChar * psz = format.type; *psz != 0; psz++)
+   {
+      bool bAlphaNum = (*psz >= _T('a') && *psz <= _T('z')) || (*psz >= _T('A') && *psz <= _T('Z'))
+         || (*psz >= _T('0') && *psz <= _T('9'));
+      *pKey += bAlphaNum ? *psz : _T('_');
+   }
+
+   static const tChar kHexDigits[] = _T("0123456789abcdef");
+
+   tChar szVersion[16];
+   uint version = format.derivedVersion;
+   int i = _countof(szVersion) - 1;
+   szVersion[i] = 0;
+   do
+   {
+      szVersion[--i] = kHexDigits[version & 15];
+      version >>= 4;
+   }
+   while (version != 0 && i > 0);
+
+   *pKey += _T('-');
+   *pKey += &szVersion[i];
+   *pKey += _T('-');
+   for (int j = 0; j < _countof(digest); j++)
+   {
+      *pKey += kHexDigits[digest[j] >> 4];
+      *pKey += kHexDigits[digest[j] & 15];
+   }
+
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+void * cDerivedDataCache::Load(const cStr & key, const cResourceFormat & format) const
+{
+   Assert(format.pfnLoadSaved != NULL);
+
+   if (!IsEnabled())
+   {
+      return NULL;
+   }
+
+   cAutoIPtr<IReader> pReader;
+   if (MappedFileReaderCreate(GetEntryFile(key.c_str()), &pReader) != S_OK)
+   {
+      return NULL;
+   }
+
+   void * pData = (*format.pfnLoadSaved)(pReader, format.typeParam);
+   if (pData == NULL)
+   {
+      WarnMsg1("Ignoring bad derived data cache entry \"%s\"\n", key.c_str());
+      return NULL;
+   }
+
+   LocalMsg1("Loaded derived data \"%s\"\n", key.c_str());
+   return pData;
+}
+
+////////////////////////////////////////
+
+tResult cDerivedDataCache::Save(const cStr & key, const cResourceFormat & format, void * pData) const
+{
+   Assert(format.pfnSave != NULL);
+
+   if (!IsEnabled())
+   {
+      return S_FALSE;
+   }
+
+   if (pData == NULL)
+   {
+      return E_POINTER;
+   }
+
+   cFileSpec entryFile(GetEntryFile(key.c_str()));
+   cFileSpec tempFile(GetEntryFile((key + kTempExt).c_str()));
+
+   tResult result = E_FAIL;
+   {
+      cAutoIPtr<IWriter> pWriter;
+      if (FileWriterCreate(tempFile, kFileModeBinary, &pWriter) == S_OK)
+      {
+         result = (*format.pfnSave)(pData, pWriter);
+      }
+      // The writer closes the file when released
+   }
+
+   if (result == S_OK)
+   {
+      // Replacing an entry doesn't matter; its contents are the same
+      _tremove(entryFile.CStr());
+      if (_trename(tempFile.CStr(), entryFile.CStr()) != 0)
+      {
+         result = E_FAIL;
+      }
+   }
+
+   if (result != S_OK)
+   {
+      WarnMsg1("Unable to save derived data cache entry \"%s\"\n", key.c_str());
+      _tremove(tempFile.CStr());
+      return E_FAIL;
+   }
+
+   LocalMsg2("Saved derived data \"%s\" for type %s\n", key.c_str(), format.type);
+   return S_OK;
+}
+
+////////////////////////////////////////
+// Stale entries are never read again but stay until removed here. Any
+// leftover temporary files are removed along with them.
+
+tResult cDerivedDataCache::Prune(size_t maxBytes) const
+{
+   if (!IsEnabled())
+   {
+      return S_FALSE;
+   }
+
+   cFileSpec wildcard(_T("*"));
+   wildcard.SetPath(m_dir);
+
+   cAutoIPtr<IEnumFiles> pEnumFiles;
+   if (EnumFiles(wildcard, &pEnumFiles) != S_OK)
+   {
+      return E_FAIL;
+   }
+
+   std::vector<sDerivedEntryFile> entries;
+   size_t totalBytes = 0;
+
+   cFileSpec files[16];
+   uint attribs[16];
+   ulong nFiles = 0;
+   while (SUCCEEDED(pEnumFiles->Next(_countof(files), files, attribs, &nFiles)) && nFiles > 0)
+   {
+      for (ulong i = 0; i < nFiles; i++)
+      {
+         if ((attribs[i] & kFA_Directory) != 0)
+         {
+            continue;
+         }
+#ifdef _WIN32
+         struct _stat info;
+         if (_tstat(files[i].CStr(), &info) != 0)
+#else
+         struct stat info;
+         if (stat(files[i].CStr(), &info) != 0)
+#endif
+         {
+            continue;
+         }
+         sDerivedEntryFile entry;
+         entry.file = files[i];
+         entry.size = static_cast<size_t>(info.st_size);
+         entry.writeTime = info.st_mtime;
+         entries.push_back(entry);
+         totalBytes += entry.size;
+      }
+   }
+
+   if (totalBytes <= maxBytes)
+   {
+      return S_FALSE;
+   }
+
+   std::sort(entries.begin(), entries.end(), DerivedEntryFileOlder);
+
+   ulong nRemoved = 0;
+   std::vector<sDerivedEntryFile>::const_iterator iter = entries.begin(), end = entries.end();
+   for (; iter != end && totalBytes > maxBytes; ++iter)
+   {
+      if (_tremove(iter->file.CStr()) == 0)
+      {
+         totalBytes -= iter->size;
+         nRemoved++;
+      }
+   }
+
+   LocalMsg2("Pruned %d derived data cache entries, leaving %d bytes\n", nRemoved, totalBytes);
+   return (nRemoved > 0) ? S_OK : S_FALSE;
+}
+
+////////////////////////////////////////
+
+cFileSpec cDerivedDataCache::GetEntryFile(const tChar * pszName) const
+{
+   cFileSpec file(pszName);
+   file.SetPath(m_dir);
+   return file;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef HAVE_UNITTESTPP
+
+TEST(DerivedDataCacheMakeKey)
+{
+   static const byte kData[] = "derived data cache key";
+
+   cResourceFormat format;
+   memset(&format, 0, sizeof(format));
+   format.type = _T("Some Type");
+   format.derivedVersion = 0x2a;
+
+   cStr key1, key2, key3;
+   {
+      cAutoIPtr<IReader> pReader;
+      CHECK(MemReaderCreate(kData, sizeof(kData), false, &pReader) == S_OK);
+      CHECK(cDerivedDataCache::MakeKey(pReader, format, NULL, &key1) == S_OK);
+      // The reader is left at the start
+      byte first = 0;
+      CHECK(pReader->Read(&first, 1) == S_OK);
+      CHECK(first == kData[0]);
+   }
+
+   // The MD5 of the data goes last
+   CHECK(key1.compare(0, 13, _T("Some_Type-2a-")) == 0);
+   CHECK_EQUAL(13u + 32u, key1.length());
+
+   format.derivedVersion = 0x2b;
+   {
+      cAutoIPtr<IReader> pReader;
+      CHECK(MemReaderCreate(kData, sizeof(kData), false, &pReader) == S_OK);
+      CHECK(cDerivedDataCache::MakeKey(pReader, format, NULL, &key2) == S_OK);
+   }
+   CHECK(key1.substr(13) == key2.substr(13));
+   CHECK(key1 != key2);
+
+   {
+      cAutoIPtr<IReader> pReader;
+      CHECK(MemReaderCreate(kData, sizeof(kData) - 1, false, &pReader) == S_OK);
+      CHECK(cDerivedDataCache::MakeKey(pReader, format, NULL, &key3) == S_OK);
+   }
+   CHECK(key2 != key3);
+
+   // A load parameter may change what is made, so such loads aren't cached
+   {
+      int param = 0;
+      cStr key4;
+      cAutoIPtr<IReader> pReader;
+      CHECK(MemReaderCreate(kData, sizeof(kData), false, &pReader) == S_OK);
+      CHECK(cDerivedDataCache::MakeKey(pReader, format, &param, &key4) == S_FALSE);
+   }
+}
+
+////////////////////////////////////////
+
+static tResult DerivedCacheTestSave(void * pData, IWriter * pWriter)
+{
+   const char * psz = static_cast<const char *>(pData);
+   return pWriter->Write(psz, strlen(psz));
+}
+
+static const char kDerivedCacheTestDir[] = "derivedcachetest.dir";
+
+TEST(DerivedDataCachePrune)
+{
+   static const char kData[] = "derived data cache entry";
+   static const tChar * const kKeys[] = { _T("a"), _T("b"), _T("c") };
+
+   cResourceFormat format;
+   memset(&format, 0, sizeof(format));
+   format.type = _T("Some Type");
+   format.pfnSave = DerivedCacheTestSave;
+
+   cDerivedDataCache cache;
+   CHECK(cache.SetDirectory(kDerivedCacheTestDir) == S_OK);
+   for (int i = 0; i < _countof(kKeys); i++)
+   {
+      CHECK(cache.Save(kKeys[i], format, const_cast<char *>(kData)) == S_OK);
+   }
+
+   const size_t entrySize = strlen(kData);
+   CHECK(cache.Prune(_countof(kKeys) * entrySize) == S_FALSE);
+   CHECK(cache.Prune(2 * entrySize) == S_OK);
+
+   int nLeft = 0;
+   for (int i = 0; i < _countof(kKeys); i++)
+   {
+      cFileSpec entryFile(kKeys[i]);
+      entryFile.SetPath(cFilePath(kDerivedCacheTestDir));
+      FILE * fp = _tfopen(entryFile.CStr(), _T("rb"));
+      if (fp != NULL)
+      {
+         fclose(fp);
+         nLeft++;
+      }
+   }
+   CHECK_EQUAL(2, nLeft);
+
+   CHECK(cache.Prune(0) == S_OK);
+   CHECK(cache.Prune(0) == S_FALSE);
+
+#ifdef _WIN32
+   _rmdir(kDerivedCacheTestDir);
+#else
+   rmdir(kDerivedCacheTestDir);
+#endif
+}
+
+#endif // HAVE_UNITTESTPP
+
+////////////////////////////////////////////////////////////////////////////////
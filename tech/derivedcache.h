@@ -0,0 +1,71 @@
+///////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#ifndef INCLUDED_DERIVEDCACHE_H
+#define INCLUDED_DERIVEDCACHE_H
+
+#include "resourceformat.h"
+
+#include "tech/filepath.h"
+#include "tech/filespec.h"
+
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cDerivedDataCache
+//
+// Keeps what formats make from their files in a directory, one file per
+// entry, so that later runs can skip the load and postload functions. An
+// entry is named by the format's type and derived data version and the MD5
+// digest of the file it was made from, so edited files and changed formats
+// simply miss and stale entries are never read. Prune removes them once the
+// directory grows past a limit.
+//
+// Once the directory is set every method is safe to call from any thread.
+// Entries are written under a temporary name and renamed into place, so a
+// reader never sees one half written.
+
+class cDerivedDataCache
+{
+   cDerivedDataCache(const cDerivedDataCache &);
+   const cDerivedDataCache & operator =(const cDerivedDataCache &);
+
+public:
+   cDerivedDataCache();
+   ~cDerivedDataCache();
+
+   /// Enables the cache, creating the directory if it doesn't exist
+   tResult SetDirectory(const tChar * pszDir);
+   bool IsEnabled() const { return !m_dir.IsEmpty(); }
+
+   /// Hashes everything the reader holds and seeks it back to the start
+   /// @return S_OK, S_FALSE if the load has a parameter, which may change
+   /// what the format makes but means nothing to a later run, or an E_xxx
+   /// error code
+   static tResult MakeKey(IReader * pReader, const cResourceFormat & format, void * loadParam, cStr * pKey);
+
+   /// @return The data, or NULL if there is no usable entry
+   void * Load(const cStr & key, const cResourceFormat & format) const;
+
+   tResult Save(const cStr & key, const cResourceFormat & format, void * pData) const;
+
+   /// Removes the least recently written entries until the directory holds
+   /// no more than maxBytes
+   /// @return S_OK if any were removed, S_FALSE if none were, or an E_xxx
+   /// error code
+   tResult Prune(size_t maxBytes) const;
+
+private:
+   cFileSpec GetEntryFile(const tChar * pszName) const;
+
+   cFilePath m_dir;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+#endif // !INCLUDED_DERIVEDCACHE_H
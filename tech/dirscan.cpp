@@ -0,0 +1,392 @@
+////////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#include "stdhdr.h"
+
+#include "dirscan.h"
+
+#include "tech/fileenum.h"
+#include "tech/filepath.h"
+#include "tech/filespec.h"
+
+#ifdef HAVE_UNITTESTPP
+#include "jobsystem.h"
+#include "UnitTest++.h"
+#endif
+
+#include <algorithm>
+#include <cstdio>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "tech/dbgalloc.h" // must be last header
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////
+
+LOG_EXTERN_CHANNEL(ResourceManager);
+
+#define LocalMsg1(msg,a)         DebugMsgEx1(ResourceManager,msg,(a))
+#define LocalMsg3(msg,a,b,c)     DebugMsgEx3(ResourceManager,msg,(a),(b),(c))
+
+#ifdef __linux__
+// Layout of the records getdents64 returns; glibc doesn't declare it
+struct sLinuxDirent64
+{
+   uint64 d_ino;
+   int64 d_off;
+   unsigned short d_reclen;
+   unsigned char d_type;
+   char d_name[1];
+};
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cDirectoryScan
+//
+
+////////////////////////////////////////
+
+cDirectoryScan::cDirectoryScan()
+ : m_pJobSystem(NULL)
+ , m_handle(NULL)
+{
+   Verify(m_mutex.Create());
+}
+
+////////////////////////////////////////
+
+cDirectoryScan::~cDirectoryScan()
+{
+}
+
+////////////////////////////////////////
+
+tResult cDirectoryScan::Scan(const tChar * pszRoot, IJobSystem * pJobSystem)
+{
+   if (pszRoot == NULL)
+   {
+      return E_POINTER;
+   }
+
+   m_order.clear();
+   m_dirs.clear();
+
+   m_pJobSystem = pJobSystem;
+   m_handle = NULL;
+
+   m_dirs.push_back(sDir());
+   m_dirs.back().path = pszRoot;
+   ScanDir(&m_dirs.back());
+
+   if (m_handle != NULL)
+   {
+      m_pJobSystem->Join(m_handle);
+      m_handle = NULL;
+   }
+   m_pJobSystem = NULL;
+
+   if (!m_dirs.front().bRead)
+   {
+      return E_FAIL;
+   }
+
+   deque<sDir>::const_iterator iter = m_dirs.begin(), end = m_dirs.end();
+   for (; iter != end; ++iter)
+   {
+      if (iter->bRead)
+      {
+         m_order.push_back(&*iter);
+      }
+   }
+   sort(m_order.begin(), m_order.end(), PathLess);
+
+   LocalMsg3("Scanned %d files in %d directories under \"%s\"\n",
+      GetFileCount(), m_order.size(), pszRoot);
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+size_t cDirectoryScan::GetFileCount() const
+{
+   size_t nFiles = 0;
+   vector<const sDir *>::const_iterator iter = m_order.begin(), end = m_order.end();
+   for (; iter != end; ++iter)
+   {
+      nFiles += (*iter)->files.size();
+   }
+   return nFiles;
+}
+
+////////////////////////////////////////
+
+void cDirectoryScan::DirJob(void * pArg)
+{
+   sDirJob * pJob = reinterpret_cast<sDirJob *>(pArg);
+   pJob->pScan->ScanDir(pJob->pDir);
+   delete pJob;
+}
+
+////////////////////////////////////////
+// Only the job reading a directory touches its sDir, so just adding the
+// sub-directories needs the lock
+
+void cDirectoryScan::ScanDir(sDir * pDir)
+{
+   vector<cStr> subDirs;
+   pDir->bRead = ListDir(pDir->path.c_str(), &pDir->files, &subDirs);
+   if (!pDir->bRead)
+   {
+      WarnMsg1("Unable to read directory \"%s\"\n", pDir->path.c_str());
+      return;
+   }
+   sort(pDir->files.begin(), pDir->files.end());
+
+   vector<cStr>::const_iterator iter = subDirs.begin(), end = subDirs.end();
+   for (; iter != end; ++iter)
+   {
+      sDir * pSubDir = NULL;
+      {
+         cMutexLock lock(&m_mutex);
+         lock.Acquire();
+         m_dirs.push_back(sDir());
+         pSubDir = &m_dirs.back();
+      }
+
+      cFileSpec subDir(iter->c_str());
+      subDir.SetPath(cFilePath(pDir->path.c_str()));
+      pSubDir->path = subDir.CStr();
+      pSubDir->bRead = false;
+
+      if (m_pJobSystem != NULL)
+      {
+         sDirJob * pJob = new sDirJob;
+         pJob->pScan = this;
+         pJob->pDir = pSubDir;
+         if (m_pJobSystem->Fork(DirJob, pJob, &m_handle) == S_OK)
+         {
+            continue;
+         }
+         delete pJob;
+      }
+
+      ScanDir(pSubDir);
+   }
+}
+
+////////////////////////////////////////
+// Reads a whole directory with as few system calls as the platform allows
+
+bool cDirectoryScan::ListDir(const tChar * pszDir, vector<cStr> * pFiles, vector<cStr> * pSubDirs)
+{
+#ifdef __linux__
+   int fd = open(pszDir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   if (fd < 0)
+   {
+      return false;
+   }
+
+   // Aligned for sLinuxDirent64
+   long buffer[4096];
+
+   bool bResult = true;
+   for (;;)
+   {
+      long nBytesRead = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+      if (nBytesRead <= 0)
+      {
+         bResult = (nBytesRead == 0);
+         break;
+      }
+
+      const char * p = reinterpret_cast<const char *>(buffer);
+      const char * pEnd = p + nBytesRead;
+      for (; p < pEnd; p += reinterpret_cast<const sLinuxDirent64 *>(p)->d_reclen)
+      {
+         const sLinuxDirent64 * pEntry = reinterpret_cast<const sLinuxDirent64 *>(p);
+
+         // Also skips "." and ".."
+         if (pEntry->d_name[0] == '.')
+         {
+            continue;
+         }
+
+         bool bDir = (pEntry->d_type == DT_DIR);
+         if (pEntry->d_type == DT_UNKNOWN || pEntry->d_type == DT_LNK)
+         {
+            struct stat entryStat;
+            if (fstatat(fd, pEntry->d_name, &entryStat, 0) != 0)
+            {
+               continue;
+            }
+            bDir = S_ISDIR(entryStat.st_mode);
+         }
+
+         (bDir ? pSubDirs : pFiles)->push_back(cStr(pEntry->d_name));
+      }
+   }
+
+   close(fd);
+   return bResult;
+#else
+   cFileSpec wildcard(_T("*"));
+   wildcard.SetPath(cFilePath(pszDir));
+
+   cAutoIPtr<IEnumFiles> pEnumFiles;
+   if (EnumFiles(wildcard, &pEnumFiles) != S_OK)
+   {
+      return false;
+   }
+
+   cFileSpec files[64];
+   uint attribs[64];
+   ulong nFiles = 0;
+   while (SUCCEEDED(pEnumFiles->Next(_countof(files), files, attribs, &nFiles)) && nFiles > 0)
+   {
+      for (ulong i = 0; i < nFiles; i++)
+      {
+         const tChar * pszName = files[i].GetFileName();
+         if ((attribs[i] & kFA_Hidden) == kFA_Hidden || pszName[0] == _T('.'))
+         {
+            continue;
+         }
+         ((attribs[i] & kFA_Directory) == kFA_Directory ? pSubDirs : pFiles)->push_back(cStr(pszName));
+      }
+   }
+   return true;
+#endif
+}
+
+////////////////////////////////////////
+// Ordering paths with the separator below every other character puts each
+// directory right before its own sub-directories and after its parent's
+// earlier-named sub-directories, just like a depth-first walk
+
+bool cDirectoryScan::PathLess(const sDir * pLhs, const sDir * pRhs)
+{
+   const tChar * pszLhs = pLhs->path.c_str();
+   const tChar * pszRhs = pRhs->path.c_str();
+   for (;; pszLhs++, pszRhs++)
+   {
+      uint l = (*pszLhs == _T('/') || *pszLhs == _T('\\')) ? 1 : static_cast<uint>(*pszLhs);
+      uint r = (*pszRhs == _T('/') || *pszRhs == _T('\\')) ? 1 : static_cast<uint>(*pszRhs);
+      if (l != r || l == 0)
+      {
+         return l < r;
+      }
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef HAVE_UNITTESTPP
+
+#ifdef __linux__
+
+static const char kTestScanDir[] = "dirscantest";
+
+static void MakeTestScanTree(const char * const * ppszPaths, size_t nPaths)
+{
+   for (size_t i = 0; i < nPaths; i++)
+   {
+      cStr path(kTestScanDir);
+      path += '/';
+      path += ppszPaths[i];
+      if (path[path.length() - 1] == '/')
+      {
+         mkdir(path.c_str(), 0755);
+      }
+      else
+      {
+         FILE * fp = fopen(path.c_str(), "w");
+         if (fp != NULL)
+         {
+            fclose(fp);
+         }
+      }
+   }
+}
+
+static void RemoveTestScanTree(const char * const * ppszPaths, size_t nPaths)
+{
+   // Children were listed after their parents
+   for (size_t i = nPaths; i > 0; i--)
+   {
+      cStr path(kTestScanDir);
+      path += '/';
+      path += ppszPaths[i - 1];
+      remove(path.c_str());
+   }
+   rmdir(kTestScanDir);
+}
+
+TEST(DirectoryScanOrder)
+{
+   static const char * const kPaths[] =
+   {
+      "b/", "b/z.txt", "b/a.txt",
+      "a/", "a/c/", "a/c/c.txt", "a/a.txt",
+      "a.b/", "a.b/ab.txt",
+      ".hidden/", ".hidden/h.txt",
+      "root.txt", ".dotfile",
+   };
+
+   mkdir(kTestScanDir, 0755);
+   MakeTestScanTree(kPaths, _countof(kPaths));
+
+   cDirectoryScan scan;
+   CHECK(scan.Scan(kTestScanDir, NULL) == S_OK);
+
+   // "a.b" sorts before "a/c" because the separator sorts first
+   static const char * const kExpectedDirs[] = { "", "/a", "/a/c", "/a.b", "/b" };
+   CHECK_EQUAL(_countof(kExpectedDirs), scan.GetDirectoryCount());
+   for (size_t i = 0; i < _countof(kExpectedDirs) && i < scan.GetDirectoryCount(); i++)
+   {
+      CHECK_EQUAL((cStr(kTestScanDir) + kExpectedDirs[i]).c_str(), scan.GetDirectory(i).c_str());
+   }
+
+   CHECK_EQUAL(6u, scan.GetFileCount());
+   if (scan.GetDirectoryCount() == _countof(kExpectedDirs))
+   {
+      CHECK_EQUAL(1u, scan.GetFileNames(0).size());
+      CHECK_EQUAL(2u, scan.GetFileNames(4).size());
+      CHECK_EQUAL("a.txt", scan.GetFileNames(4)[0].c_str());
+      CHECK_EQUAL("z.txt", scan.GetFileNames(4)[1].c_str());
+   }
+
+   // Reading directories in parallel comes out the same
+   {
+      cAutoIPtr<cJobSystem> pJobSystem(new cJobSystem(3));
+      CHECK(pJobSystem->Init() == S_OK);
+      cDirectoryScan parallelScan;
+      CHECK(parallelScan.Scan(kTestScanDir, static_cast<IJobSystem*>(pJobSystem)) == S_OK);
+      CHECK_EQUAL(scan.GetDirectoryCount(), parallelScan.GetDirectoryCount());
+      for (size_t i = 0; i < scan.GetDirectoryCount() && i < parallelScan.GetDirectoryCount(); i++)
+      {
+         CHECK(scan.GetDirectory(i) == parallelScan.GetDirectory(i));
+         CHECK(scan.GetFileNames(i) == parallelScan.GetFileNames(i));
+      }
+      pJobSystem->Term();
+   }
+
+   CHECK(scan.Scan("dirscantest-missing", NULL) == E_FAIL);
+
+   RemoveTestScanTree(kPaths, _countof(kPaths));
+}
+
+#endif // __linux__
+
+#endif // HAVE_UNITTESTPP
+
+////////////////////////////////////////////////////////////////////////////////
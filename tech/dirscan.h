@@ -0,0 +1,86 @@
+///////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#ifndef INCLUDED_DIRSCAN_H
+#define INCLUDED_DIRSCAN_H
+
+#include "tech/schedulerapi.h"
+#include "tech/techstring.h"
+#include "tech/thread.h"
+
+#include <deque>
+#include <vector>
+
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cDirectoryScan
+//
+// Lists every file in a directory tree in one go, skipping hidden files and
+// directories. Each directory is read by its own job, so with a job system
+// sibling directories are read in parallel. Once every directory is read the
+// results are sorted into the order of a depth-first walk that takes
+// sub-directories by name, which doesn't depend on the order the jobs ran or
+// the order the file system returned entries.
+
+class cDirectoryScan
+{
+   cDirectoryScan(const cDirectoryScan &);
+   const cDirectoryScan & operator =(const cDirectoryScan &);
+
+public:
+   cDirectoryScan();
+   ~cDirectoryScan();
+
+   /// @param pJobSystem reads directories in parallel; if NULL the calling
+   /// thread reads them all
+   /// @return S_OK, or E_FAIL if the root directory could not be read
+   tResult Scan(const tChar * pszRoot, IJobSystem * pJobSystem);
+
+   /// The root directory comes first
+   size_t GetDirectoryCount() const { return m_order.size(); }
+   const cStr & GetDirectory(size_t index) const { return m_order[index]->path; }
+
+   /// File names without the directory, in name order
+   const std::vector<cStr> & GetFileNames(size_t index) const { return m_order[index]->files; }
+
+   size_t GetFileCount() const;
+
+private:
+   struct sDir
+   {
+      cStr path;
+      std::vector<cStr> files;
+      bool bRead;
+   };
+
+   struct sDirJob
+   {
+      cDirectoryScan * pScan;
+      sDir * pDir;
+   };
+
+   static void DirJob(void * pArg);
+   void ScanDir(sDir * pDir);
+   static bool ListDir(const tChar * pszDir, std::vector<cStr> * pFiles, std::vector<cStr> * pSubDirs);
+   static bool PathLess(const sDir * pLhs, const sDir * pRhs);
+
+   IJobSystem * m_pJobSystem;
+   tJobHandle m_handle;
+
+   // A deque so that jobs can hold on to their own sDir while others are
+   // being added
+   cThreadMutex m_mutex;
+   std::deque<sDir> m_dirs;
+
+   std::vector<const sDir *> m_order;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+#endif // !INCLUDED_DIRSCAN_H
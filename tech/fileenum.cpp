@@ -269,7 +269,11 @@ cEnumFilesPosix::cEnumFilesPosix(const cFileSpec & spec)
 
 cEnumFilesPosix::~cEnumFilesPosix()
 {
-   Reset();
+   if (m_pDir != NULL)
+   {
+      closedir(m_pDir);
+      m_pDir = NULL;
+   }
 }
 
 ////////////////////////////////////////
@@ -334,8 +338,9 @@ tResult cEnumFilesPosix::GetNext(ulong count, cFileSpec * pFileSpecs, uint * pAt
    bool bFound = false;
    ulong nFound = 0;
 
-   struct dirent * pEnt = readdir(m_pDir);
-   while ((pEnt != NULL) && (nFound < count))
+   // Only read as many entries as fit so that none are lost between calls
+   struct dirent * pEnt = NULL;
+   while ((nFound < count) && ((pEnt = readdir(m_pDir)) != NULL))
    {
       LocalMsg1("Found entry \"%s\"\n", pEnt->d_name);
       if (strcmp(pEnt->d_name, ".") != 0 && strcmp(pEnt->d_name, "..") != 0
@@ -367,8 +372,6 @@ tResult cEnumFilesPosix::GetNext(ulong count, cFileSpec * pFileSpecs, uint * pAt
 
          nFound++;
       }
-
-      pEnt = readdir(m_pDir);
    }
 
    LocalMsg1("Found %d entries\n", nFound);
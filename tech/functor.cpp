@@ -5,10 +5,14 @@
 
 #include "tech/functor.h"
 
+#include "blockpool.h"
+
 #ifdef HAVE_UNITTESTPP
 #include "UnitTest++.h"
 #endif
 
+#include <new>
+
 #include "tech/dbgalloc.h" // must be last header
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -22,6 +26,44 @@ cFunctor::~cFunctor()
 {
 }
 
+////////////////////////////////////////
+
+void * cFunctor::operator new(size_t size)
+{
+   void * p = BlockPoolAlloc(size);
+   if (p == NULL)
+   {
+      throw std::bad_alloc();
+   }
+   return p;
+}
+
+////////////////////////////////////////
+
+void cFunctor::operator delete(void * p, size_t size)
+{
+   BlockPoolFree(p, size);
+}
+
+#if defined(_MSC_VER) && defined(_DEBUG)
+
+////////////////////////////////////////
+
+void * cFunctor::operator new(size_t size, int, const char *, int)
+{
+   return cFunctor::operator new(size);
+}
+
+////////////////////////////////////////
+// Only called if a functor constructor throws, which none of them do; the
+// size isn't known here so the block can't be returned to its pool
+
+void cFunctor::operator delete(void *, int, const char *, int)
+{
+}
+
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 
 #ifdef HAVE_UNITTESTPP
@@ -41,6 +83,22 @@ TEST(Functor1)
    CHECK_EQUAL(g_functor1Arg, 99);
 }
 
+////////////////////////////////////////
+
+TEST(FunctorPooledAlloc)
+{
+   cFunctor * pFunctor = new cFunctor1<void, int>(Functor1TestFunction, 7);
+   CHECK(pFunctor != NULL);
+   (*pFunctor)();
+   CHECK_EQUAL(g_functor1Arg, 7);
+   delete pFunctor;
+
+   // The block just freed is handed straight back out
+   cFunctor * pFunctor2 = new cFunctor1<void, int>(Functor1TestFunction, 8);
+   CHECK(pFunctor2 == pFunctor);
+   delete pFunctor2;
+}
+
 #endif // HAVE_UNITTESTPP
 
 ///////////////////////////////////////////////////////////////////////////////
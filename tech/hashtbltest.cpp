@@ -352,6 +352,28 @@ TEST_FIXTURE(cHashTableTests, TestErase)
    }
 }
 
+////////////////////////////////////////
+// Erased elements must not pile up until no empty element is left to end
+// a failed search
+
+TEST(HashTableEraseChurn)
+{
+   typedef cHashTable<int, int> tIntHashTable;
+   tIntHashTable hashTable(tIntHashTable::kInitialSizeSmall);
+
+   for (int i = 0; i < 10000; i++)
+   {
+      CHECK(hashTable.insert(i, i).second);
+      CHECK_EQUAL(1, hashTable.erase(i));
+   }
+
+   CHECK(hashTable.empty());
+   CHECK_EQUAL(static_cast<size_t>(tIntHashTable::kInitialSizeSmall), hashTable.max_size());
+
+   const tIntHashTable & constHashTable = hashTable;
+   CHECK(constHashTable.find(-1) == constHashTable.end());
+}
+
 ////////////////////////////////////////
 
 TEST_FIXTURE(cHashTableTests, TestFindSuccess)
@@ -6,9 +6,12 @@
 #include "image.h"
 
 #include "tech/globalobj.h"
+#include "tech/readwriteapi.h"
 #include "tech/resourceapi.h"
 #include "tech/techmath.h"
 
+#include <vector>
+
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -584,6 +587,96 @@ void ImageUnload(void * pData)
    reinterpret_cast<IImage*>(pData)->Release();
 }
 
+////////////////////////////////////////
+// Decoded images for the derived data cache: the size, the pixel format
+// and the pixels, which are read in place when the reader allows it
+
+static const uint kImageDerivedVersion = 1;
+static const uint kImageMaxDimension = 32768;
+static const ulong kImageMaxBytes = 512 * 1024 * 1024;
+
+tResult ImageSave(void * pData, IWriter * pWriter)
+{
+   IImage * pImage = reinterpret_cast<IImage*>(pData);
+   uint memSize = BytesPerPixel(pImage->GetPixelFormat()) * pImage->GetWidth() * pImage->GetHeight();
+   if (memSize == 0)
+   {
+      return E_FAIL;
+   }
+
+   if (pWriter->Write(pImage->GetWidth()) == S_OK
+      && pWriter->Write(pImage->GetHeight()) == S_OK
+      && pWriter->Write(static_cast<int>(pImage->GetPixelFormat())) == S_OK
+      && pWriter->Write(pImage->GetData(), memSize) == S_OK)
+   {
+      return S_OK;
+   }
+
+   return E_FAIL;
+}
+
+void * ImageLoadSaved(IReader * pReader, void * typeParam)
+{
+   uint width = 0, height = 0;
+   int pixelFormat = kPF_ERROR;
+   if (pReader->Read(&width) != S_OK
+      || pReader->Read(&height) != S_OK
+      || pReader->Read(&pixelFormat) != S_OK
+      || width > kImageMaxDimension || height > kImageMaxDimension)
+   {
+      return NULL;
+   }
+
+   // A stale or corrupt entry may claim anything, so the size is worked out
+   // without overflowing and checked against what is left to read before
+   // anything is allocated
+   uint64 memSize64 = static_cast<uint64>(BytesPerPixel(static_cast<ePixelFormat>(pixelFormat))) * width * height;
+   if (memSize64 == 0 || memSize64 > kImageMaxBytes)
+   {
+      return NULL;
+   }
+   ulong memSize = static_cast<ulong>(memSize64);
+
+   ulong pos = 0, end = 0;
+   if (pReader->Tell(&pos) != S_OK
+      || pReader->Seek(0, kSO_End) != S_OK
+      || pReader->Tell(&end) != S_OK
+      || pReader->Seek(pos, kSO_Set) != S_OK
+      || end < pos || end - pos < memSize)
+   {
+      return NULL;
+   }
+
+   const void * pPixels = NULL;
+   std::vector<byte> pixels;
+   cAutoIPtr<IReaderSpan> pReaderSpan;
+   if (pReader->QueryInterface(IID_IReaderSpan, (void**)&pReaderSpan) == S_OK)
+   {
+      if (pReaderSpan->ReadSpan(memSize, &pPixels) != S_OK)
+      {
+         return NULL;
+      }
+   }
+   else
+   {
+      pixels.resize(memSize);
+      size_t nBytesRead = 0;
+      if (FAILED(pReader->Read(&pixels[0], memSize, &nBytesRead)) || nBytesRead != memSize)
+      {
+         return NULL;
+      }
+      pPixels = &pixels[0];
+   }
+
+   IImage * pImage = NULL;
+   if (ImageCreate(width, height, static_cast<ePixelFormat>(pixelFormat), pPixels, &pImage) != S_OK)
+   {
+      return NULL;
+   }
+
+   return pImage;
+}
+
 ////////////////////////////////////////
 
 tResult ImageRegisterResourceFormats()
@@ -596,6 +689,21 @@ tResult ImageRegisterResourceFormats()
          && pResourceManager->RegisterFormat(kRT_Image, _T("jpg"), JpgLoad, NULL, ImageUnload) == S_OK
          && pResourceManager->RegisterFormat(kRT_Image, _T("tga"), TargaLoad, NULL, ImageUnload) == S_OK)
       {
+         // The decoders only touch the image they're making
+         static const tChar * const kExtensions[] = { _T("bmp"), _T("jpeg"), _T("jpg"), _T("tga") };
+         for (int i = 0; i < _countof(kExtensions); i++)
+         {
+            pResourceManager->RegisterThreadSafeLoad(kRT_Image, kExtensions[i]);
+         }
+
+         // Bitmaps are stored decoded already
+         static const tChar * const kDerivedExtensions[] = { _T("jpeg"), _T("jpg"), _T("tga") };
+         for (int i = 0; i < _countof(kDerivedExtensions); i++)
+         {
+            pResourceManager->RegisterDerivedData(kRT_Image, kDerivedExtensions[i], kImageDerivedVersion,
+                                                  ImageSave, ImageLoadSaved);
+         }
+
 #ifdef _WIN32
          if (pResourceManager->RegisterFormat(kRT_WindowsDDB, kRT_Image, NULL, NULL, WindowsDDBFromImage, WindowsDDBUnload) != S_OK)
          {
@@ -640,12 +748,18 @@ tResult ImageCreate(uint width, uint height, ePixelFormat pixelFormat, const voi
       return E_POINTER;
    }
 
-   uint memSize = BytesPerPixel(pixelFormat) * width * height;
-   if (memSize == 0)
+   uint64 memSize64 = static_cast<uint64>(BytesPerPixel(pixelFormat)) * width * height;
+   if (memSize64 == 0)
    {
       WarnMsg1("Invalid pixel format %d\n", pixelFormat);
       return E_FAIL;
    }
+   else if (memSize64 > kImageMaxBytes)
+   {
+      WarnMsg2("Image of %d x %d is too large\n", width, height);
+      return E_INVALIDARG;
+   }
+   size_t memSize = static_cast<size_t>(memSize64);
 
    byte * pImageData = new byte[memSize];
    if (pImageData == NULL)
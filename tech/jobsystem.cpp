@@ -0,0 +1,754 @@
+///////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#include "stdhdr.h"
+
+#include "jobsystem.h"
+
+#include "tech/configapi.h"
+#include "tech/techtime.h"
+
+#ifdef HAVE_UNITTESTPP
+#include "UnitTest++.h"
+#endif
+
+#include <cstdio>
+
+#include "tech/dbgalloc.h" // must be last header
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+LOG_DEFINE_CHANNEL(JobSystem);
+
+#define LocalMsg(msg)            DebugMsgEx(JobSystem,msg)
+#define LocalMsg1(msg,a)         DebugMsgEx1(JobSystem,msg,(a))
+#define LocalMsg2(msg,a,b)       DebugMsgEx2(JobSystem,msg,(a),(b))
+
+// REFERENCES
+// "Scheduling Multithreaded Computations by Work Stealing", Blumofe & Leiserson,
+// Journal of the ACM, 1999.
+
+///////////////////////////////////////////////////////////////////////////////
+
+static const uint kNoQueue = ~0u;
+
+// Number of times an idle worker yields before going to sleep on the work event
+static const int kIdleSpins = 64;
+
+// Sleeping workers wake at least this often in case a signal was missed
+static const uint kIdleWaitMillis = 2;
+
+// ParallelFor with no grain size makes this many ranges per thread so that
+// workers that finish early have something left to steal
+static const uint kRangesPerThread = 4;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Set on worker threads so that forks from inside a job go to the worker's
+// own queue instead of the shared one
+static THREAD_LOCAL cJobSystem * g_pWorkerJobSystem = NULL;
+static THREAD_LOCAL uint g_workerQueueIndex = kNoQueue;
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// STRUCT: sJobHandle
+//
+
+struct sJobHandle
+{
+   volatile long nPending;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cJobWorker
+//
+
+class cJobWorker : public cThread
+{
+public:
+   cJobWorker(cJobSystem * pJobSystem, uint index)
+    : m_pJobSystem(pJobSystem)
+    , m_index(index)
+   {
+   }
+
+protected:
+   virtual int Run()
+   {
+      return m_pJobSystem->WorkerMain(m_index);
+   }
+
+private:
+   cJobSystem * m_pJobSystem;
+   uint m_index;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cJobQueue
+//
+
+////////////////////////////////////////
+
+cJobQueue::cJobQueue()
+{
+}
+
+////////////////////////////////////////
+
+cJobQueue::~cJobQueue()
+{
+   WarnMsgIf1(!m_jobs.empty(), "Discarding %d queued jobs\n", m_jobs.size());
+}
+
+////////////////////////////////////////
+
+bool cJobQueue::Create()
+{
+   return m_mutex.Create();
+}
+
+////////////////////////////////////////
+
+void cJobQueue::Push(const sJob & job)
+{
+   cMutexLock lock(&m_mutex);
+   if (lock.Acquire())
+   {
+      m_jobs.push_back(job);
+   }
+}
+
+////////////////////////////////////////
+
+bool cJobQueue::Pop(sJob * pJob)
+{
+   Assert(pJob != NULL);
+   cMutexLock lock(&m_mutex);
+   if (lock.Acquire() && !m_jobs.empty())
+   {
+      *pJob = m_jobs.back();
+      m_jobs.pop_back();
+      return true;
+   }
+   return false;
+}
+
+////////////////////////////////////////
+
+bool cJobQueue::Steal(sJob * pJob)
+{
+   Assert(pJob != NULL);
+   cMutexLock lock(&m_mutex);
+   if (lock.Acquire() && !m_jobs.empty())
+   {
+      *pJob = m_jobs.front();
+      m_jobs.pop_front();
+      return true;
+   }
+   return false;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cJobSystem
+//
+
+////////////////////////////////////////
+
+cJobSystem::cJobSystem(uint nWorkers)
+ : m_nWorkersRequested(nWorkers)
+ , m_nIdleWorkers(0)
+ , m_bShutdown(0)
+{
+}
+
+////////////////////////////////////////
+
+cJobSystem::~cJobSystem()
+{
+   Assert(m_workers.empty());
+   Assert(m_queues.empty());
+}
+
+////////////////////////////////////////
+
+tResult cJobSystem::Init()
+{
+   uint nWorkers = m_nWorkersRequested;
+   if (nWorkers == kAutoWorkerCount)
+   {
+      // Leave a core for the main thread, which helps out whenever it joins
+      int nConfigWorkers = 0;
+      if (ConfigGet(_T("job_workers"), &nConfigWorkers) == S_OK && nConfigWorkers >= 0)
+      {
+         nWorkers = nConfigWorkers;
+      }
+      else
+      {
+         // Still one worker on a single core so that detached jobs run
+         // without anyone joining them
+         nWorkers = Max(ThreadGetProcessorCount(), 2u) - 1;
+      }
+   }
+
+   if (!m_workEvent.Create())
+   {
+      ErrorMsg("Error creating job system work event\n");
+      return E_FAIL;
+   }
+
+   // All queues must exist before any worker starts stealing from them
+   for (uint i = 0; i <= nWorkers; i++)
+   {
+      cJobQueue * pQueue = new cJobQueue;
+      if (pQueue == NULL || !pQueue->Create())
+      {
+         delete pQueue;
+         ErrorMsg("Error creating job queue\n");
+         return E_FAIL;
+      }
+      m_queues.push_back(pQueue);
+   }
+
+   m_bShutdown = 0;
+
+   for (uint i = 0; i < nWorkers; i++)
+   {
+      cJobWorker * pWorker = new cJobWorker(this, i);
+      if (pWorker == NULL || !pWorker->Create())
+      {
+         delete pWorker;
+         ErrorMsg1("Error creating job worker thread %d\n", i);
+         break;
+      }
+      char szName[32];
+      sprintf(szName, "JobWorker%d", i);
+      ThreadSetName(pWorker->GetThreadId(), szName);
+      m_workers.push_back(pWorker);
+   }
+
+   LocalMsg1("Job system started with %d worker threads\n", m_workers.size());
+
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cJobSystem::Term()
+{
+   AtomicIncrement(&m_bShutdown);
+
+   {
+      vector<cJobWorker *>::iterator iter = m_workers.begin(), end = m_workers.end();
+      for (; iter != end; ++iter)
+      {
+         m_workEvent.Signal();
+      }
+   }
+
+   {
+      vector<cJobWorker *>::iterator iter = m_workers.begin(), end = m_workers.end();
+      for (; iter != end; ++iter)
+      {
+         (*iter)->Join();
+         delete *iter;
+      }
+      m_workers.clear();
+   }
+
+   {
+      vector<cJobQueue *>::iterator iter = m_queues.begin(), end = m_queues.end();
+      for (; iter != end; ++iter)
+      {
+         delete *iter;
+      }
+      m_queues.clear();
+   }
+
+   m_workEvent.Destroy();
+
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+uint cJobSystem::GetWorkerCount() const
+{
+   return m_workers.size();
+}
+
+////////////////////////////////////////
+
+tResult cJobSystem::Fork(tJobFn pfnJob, void * pArg, tJobHandle * pHandle)
+{
+   if (pfnJob == NULL)
+   {
+      return E_POINTER;
+   }
+
+   if (m_queues.empty())
+   {
+      return E_FAIL;
+   }
+
+   // Nothing would ever pick up a detached job without workers
+   if (pHandle == NULL && m_workers.empty())
+   {
+      (*pfnJob)(pArg);
+      return S_OK;
+   }
+
+   sJobHandle * pJobHandle = NULL;
+   if (pHandle != NULL)
+   {
+      if (*pHandle == NULL)
+      {
+         *pHandle = new sJobHandle;
+         if (*pHandle == NULL)
+         {
+            return E_OUTOFMEMORY;
+         }
+         (*pHandle)->nPending = 0;
+      }
+      pJobHandle = *pHandle;
+      AtomicIncrement(&pJobHandle->nPending);
+   }
+
+   sJob job;
+   job.pfnJob = pfnJob;
+   job.pArg = pArg;
+   job.pHandle = pJobHandle;
+   m_queues[GetCurrentQueue()]->Push(job);
+
+   if (AtomicRead(&m_nIdleWorkers) > 0)
+   {
+      m_workEvent.Signal();
+   }
+
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+struct sTaskJob
+{
+   ITask * pTask;
+   double time;
+   tResult * pResult;
+};
+
+static void TaskJob(void * pArg)
+{
+   sTaskJob * pTaskJob = reinterpret_cast<sTaskJob *>(pArg);
+   tResult result = pTaskJob->pTask->Execute(pTaskJob->time);
+   if (pTaskJob->pResult != NULL)
+   {
+      *pTaskJob->pResult = result;
+   }
+   delete pTaskJob;
+}
+
+tResult cJobSystem::ForkTask(ITask * pTask, double time, tResult * pResult, tJobHandle * pHandle)
+{
+   if (pTask == NULL)
+   {
+      return E_POINTER;
+   }
+
+   sTaskJob * pTaskJob = new sTaskJob;
+   if (pTaskJob == NULL)
+   {
+      return E_OUTOFMEMORY;
+   }
+
+   pTaskJob->pTask = pTask;
+   pTaskJob->time = time;
+   pTaskJob->pResult = pResult;
+
+   tResult result = Fork(TaskJob, pTaskJob, pHandle);
+   if (result != S_OK)
+   {
+      delete pTaskJob;
+   }
+   return result;
+}
+
+////////////////////////////////////////
+
+tResult cJobSystem::Join(tJobHandle handle)
+{
+   if (handle == NULL)
+   {
+      return E_POINTER;
+   }
+
+   uint queueIndex = GetCurrentQueue();
+   while (AtomicRead(&handle->nPending) > 0)
+   {
+      if (!RunOneJob(queueIndex))
+      {
+         ThreadYield();
+      }
+   }
+
+   delete handle;
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+struct sRangeJob
+{
+   tJobRangeFn pfnRange;
+   void * pArg;
+   uint begin;
+   uint end;
+};
+
+static void RangeJob(void * pArg)
+{
+   sRangeJob * pRangeJob = reinterpret_cast<sRangeJob *>(pArg);
+   (*pRangeJob->pfnRange)(pRangeJob->begin, pRangeJob->end, pRangeJob->pArg);
+}
+
+tResult cJobSystem::ParallelFor(uint begin, uint end, uint grainSize, tJobRangeFn pfnRange, void * pArg)
+{
+   if (pfnRange == NULL)
+   {
+      return E_POINTER;
+   }
+
+   if (end <= begin)
+   {
+      return S_FALSE;
+   }
+
+   uint count = end - begin;
+
+   if (grainSize == 0)
+   {
+      uint nRanges = (m_workers.size() + 1) * kRangesPerThread;
+      grainSize = (count + nRanges - 1) / nRanges;
+   }
+
+   uint nRanges = (count + grainSize - 1) / grainSize;
+   if (nRanges <= 1 || m_workers.empty())
+   {
+      (*pfnRange)(begin, end, pArg);
+      return S_OK;
+   }
+
+   // The calling thread runs the first range itself
+   vector<sRangeJob> rangeJobs(nRanges - 1);
+   tJobHandle handle = NULL;
+   for (uint i = 1; i < nRanges; i++)
+   {
+      sRangeJob & rangeJob = rangeJobs[i - 1];
+      rangeJob.pfnRange = pfnRange;
+      rangeJob.pArg = pArg;
+      rangeJob.begin = begin + (i * grainSize);
+      rangeJob.end = ((end - rangeJob.begin) > grainSize) ? (rangeJob.begin + grainSize) : end;
+      if (Fork(RangeJob, &rangeJob, &handle) != S_OK)
+      {
+         (*pfnRange)(rangeJob.begin, rangeJob.end, pArg);
+      }
+   }
+
+   (*pfnRange)(begin, begin + grainSize, pArg);
+
+   return (handle != NULL) ? Join(handle) : S_OK;
+}
+
+////////////////////////////////////////
+
+uint cJobSystem::GetCurrentQueue() const
+{
+   Assert(!m_queues.empty());
+   if (g_pWorkerJobSystem == this)
+   {
+      return g_workerQueueIndex;
+   }
+   return m_queues.size() - 1;
+}
+
+////////////////////////////////////////
+
+bool cJobSystem::RunOneJob(uint queueIndex)
+{
+   Assert(queueIndex < m_queues.size());
+
+   sJob job;
+   if (!m_queues[queueIndex]->Pop(&job))
+   {
+      bool bStole = false;
+      uint nQueues = m_queues.size();
+      for (uint i = 1; (i < nQueues) && !bStole; i++)
+      {
+         bStole = m_queues[(queueIndex + i) % nQueues]->Steal(&job);
+      }
+      if (!bStole)
+      {
+         return false;
+      }
+   }
+
+   (*job.pfnJob)(job.pArg);
+
+   if (job.pHandle != NULL)
+   {
+      AtomicDecrement(&job.pHandle->nPending);
+   }
+
+   return true;
+}
+
+////////////////////////////////////////
+
+int cJobSystem::WorkerMain(uint workerIndex)
+{
+   g_pWorkerJobSystem = this;
+   g_workerQueueIndex = workerIndex;
+
+   int nSpins = 0;
+   while (AtomicRead(&m_bShutdown) == 0)
+   {
+      if (RunOneJob(workerIndex))
+      {
+         nSpins = 0;
+      }
+      else if (nSpins < kIdleSpins)
+      {
+         nSpins++;
+         ThreadYield();
+      }
+      else
+      {
+         AtomicIncrement(&m_nIdleWorkers);
+         m_workEvent.Wait(kIdleWaitMillis);
+         AtomicDecrement(&m_nIdleWorkers);
+      }
+   }
+
+   g_pWorkerJobSystem = NULL;
+   g_workerQueueIndex = kNoQueue;
+
+   return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+tResult JobSystemCreate()
+{
+   cAutoIPtr<IJobSystem> pJobSystem(static_cast<IJobSystem*>(new cJobSystem));
+   if (!pJobSystem)
+   {
+      return E_OUTOFMEMORY;
+   }
+   return RegisterGlobalObject(IID_IJobSystem, pJobSystem);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef HAVE_UNITTESTPP
+
+class cJobSystemTests
+{
+public:
+   cJobSystemTests();
+   ~cJobSystemTests();
+
+   IJobSystem * AccessJobSystem() { return static_cast<IJobSystem*>(m_pJobSystem); }
+
+private:
+   cAutoIPtr<cJobSystem> m_pJobSystem;
+};
+
+cJobSystemTests::cJobSystemTests()
+ : m_pJobSystem(new cJobSystem(3))
+{
+   m_pJobSystem->Init();
+}
+
+cJobSystemTests::~cJobSystemTests()
+{
+   if (!!m_pJobSystem)
+   {
+      m_pJobSystem->Term();
+      SafeRelease(m_pJobSystem);
+   }
+}
+
+////////////////////////////////////////
+
+static void IncrementJob(void * pArg)
+{
+   AtomicIncrement(reinterpret_cast<volatile long *>(pArg));
+}
+
+TEST_FIXTURE(cJobSystemTests, JobSystemForkJoin)
+{
+   static const int kNumJobs = 1000;
+
+   volatile long count = 0;
+   tJobHandle handle = NULL;
+   for (int i = 0; i < kNumJobs; i++)
+   {
+      CHECK(AccessJobSystem()->Fork(IncrementJob, (void*)&count, &handle) == S_OK);
+   }
+   CHECK(handle != NULL);
+   CHECK(AccessJobSystem()->Join(handle) == S_OK);
+
+   CHECK_EQUAL(kNumJobs, count);
+}
+
+////////////////////////////////////////
+
+struct sNestedForkArg
+{
+   IJobSystem * pJobSystem;
+   volatile long * pCount;
+};
+
+static void NestedForkJob(void * pArg)
+{
+   sNestedForkArg * pNestedArg = reinterpret_cast<sNestedForkArg *>(pArg);
+   tJobHandle handle = NULL;
+   for (int i = 0; i < 10; i++)
+   {
+      pNestedArg->pJobSystem->Fork(IncrementJob, (void*)pNestedArg->pCount, &handle);
+   }
+   pNestedArg->pJobSystem->Join(handle);
+}
+
+TEST(JobSystemNoWorkers)
+{
+   cAutoIPtr<cJobSystem> pJobSystem(new cJobSystem(0));
+   CHECK(pJobSystem->Init() == S_OK);
+   CHECK_EQUAL(0, pJobSystem->GetWorkerCount());
+
+   // Detached jobs run right away
+   volatile long count = 0;
+   CHECK(pJobSystem->Fork(IncrementJob, (void*)&count, NULL) == S_OK);
+   CHECK_EQUAL(1, count);
+
+   // Joined jobs run on the joining thread
+   tJobHandle handle = NULL;
+   CHECK(pJobSystem->Fork(IncrementJob, (void*)&count, &handle) == S_OK);
+   CHECK(pJobSystem->Join(handle) == S_OK);
+   CHECK_EQUAL(2, count);
+
+   pJobSystem->Term();
+}
+
+////////////////////////////////////////
+
+TEST_FIXTURE(cJobSystemTests, JobSystemNestedForkJoin)
+{
+   volatile long count = 0;
+   sNestedForkArg arg = { AccessJobSystem(), &count };
+   tJobHandle handle = NULL;
+   for (int i = 0; i < 50; i++)
+   {
+      CHECK(AccessJobSystem()->Fork(NestedForkJob, &arg, &handle) == S_OK);
+   }
+   CHECK(AccessJobSystem()->Join(handle) == S_OK);
+
+   CHECK_EQUAL(500, count);
+}
+
+////////////////////////////////////////
+
+static void SquareRange(uint begin, uint end, void * pArg)
+{
+   uint * pValues = reinterpret_cast<uint *>(pArg);
+   for (uint i = begin; i < end; i++)
+   {
+      pValues[i] = i * i;
+   }
+}
+
+TEST_FIXTURE(cJobSystemTests, JobSystemParallelFor)
+{
+   static const uint kNumValues = 10007;
+   vector<uint> values(kNumValues, 0);
+
+   CHECK(AccessJobSystem()->ParallelFor(0, kNumValues, 0, SquareRange, &values[0]) == S_OK);
+   CHECK(AccessJobSystem()->ParallelFor(0, 0, 0, SquareRange, &values[0]) == S_FALSE);
+
+   bool bAllCorrect = true;
+   for (uint i = 0; i < kNumValues; i++)
+   {
+      bAllCorrect = bAllCorrect && (values[i] == i * i);
+   }
+   CHECK(bAllCorrect);
+}
+
+////////////////////////////////////////
+
+class cJobCounterTask : public cComObject<IMPLEMENTS(ITask)>
+{
+public:
+   cJobCounterTask() : m_count(0) {}
+
+   virtual tResult Execute(double time)
+   {
+      AtomicIncrement(&m_count);
+      return S_FALSE;
+   }
+
+   long GetCount() const { return m_count; }
+
+private:
+   volatile long m_count;
+};
+
+TEST_FIXTURE(cJobSystemTests, JobSystemForkTask)
+{
+   cAutoIPtr<cJobCounterTask> pTask(new cJobCounterTask);
+
+   tResult results[8];
+   tJobHandle handle = NULL;
+   for (int i = 0; i < _countof(results); i++)
+   {
+      results[i] = E_FAIL;
+      CHECK(AccessJobSystem()->ForkTask(pTask, 0, &results[i], &handle) == S_OK);
+   }
+   CHECK(AccessJobSystem()->Join(handle) == S_OK);
+
+   CHECK_EQUAL(_countof(results), pTask->GetCount());
+   for (int i = 0; i < _countof(results); i++)
+   {
+      CHECK(results[i] == S_FALSE);
+   }
+}
+
+////////////////////////////////////////
+
+TEST_FIXTURE(cJobSystemTests, JobSystemParallelForTimeTrial)
+{
+   static const uint kNumValues = 1 << 20;
+   vector<uint> values(kNumValues, 0);
+
+   double serial = -TimeGetSecs();
+   SquareRange(0, kNumValues, &values[0]);
+   serial += TimeGetSecs();
+
+   double parallel = -TimeGetSecs();
+   AccessJobSystem()->ParallelFor(0, kNumValues, 0, SquareRange, &values[0]);
+   parallel += TimeGetSecs();
+
+   LocalMsg2("ParallelFor time trial: serial %f secs, parallel %f secs\n", serial, parallel);
+}
+
+#endif // HAVE_UNITTESTPP
+
+///////////////////////////////////////////////////////////////////////////////
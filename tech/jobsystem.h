@@ -0,0 +1,109 @@
+///////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#ifndef INCLUDED_JOBSYSTEM_H
+#define INCLUDED_JOBSYSTEM_H
+
+#include "tech/globalobjdef.h"
+#include "tech/schedulerapi.h"
+#include "tech/thread.h"
+
+#include <deque>
+#include <vector>
+
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+class cJobWorker;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// STRUCT: sJob
+//
+
+struct sJob
+{
+   tJobFn pfnJob;
+   void * pArg;
+   sJobHandle * pHandle;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cJobQueue
+//
+// Each worker owns one of these. The owner pushes and pops at the back so
+// that it works on the most recently forked (cache-warm) job, while idle
+// workers steal from the front where the oldest, usually largest, jobs are.
+
+class cJobQueue
+{
+   cJobQueue(const cJobQueue &);
+   const cJobQueue & operator =(const cJobQueue &);
+
+public:
+   cJobQueue();
+   ~cJobQueue();
+
+   bool Create();
+
+   void Push(const sJob & job);
+   bool Pop(sJob * pJob);
+   bool Steal(sJob * pJob);
+
+private:
+   cThreadMutex m_mutex;
+   std::deque<sJob> m_jobs;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cJobSystem
+//
+
+class cJobSystem : public cComObject2<IMPLEMENTS(IJobSystem), IMPLEMENTS(IGlobalObject)>
+{
+   friend class cJobWorker;
+
+public:
+   enum { kAutoWorkerCount = ~0u };
+
+   cJobSystem(uint nWorkers = kAutoWorkerCount);
+   ~cJobSystem();
+
+   DECLARE_NAME_STRING(kJobSystemName)
+   DECLARE_NO_CONSTRAINTS()
+
+   virtual tResult Init();
+   virtual tResult Term();
+
+   virtual uint GetWorkerCount() const;
+
+   virtual tResult Fork(tJobFn pfnJob, void * pArg, tJobHandle * pHandle);
+   virtual tResult ForkTask(ITask * pTask, double time, tResult * pResult, tJobHandle * pHandle);
+   virtual tResult Join(tJobHandle handle);
+
+   virtual tResult ParallelFor(uint begin, uint end, uint grainSize, tJobRangeFn pfnRange, void * pArg);
+
+private:
+   uint GetCurrentQueue() const;
+   bool RunOneJob(uint queueIndex);
+   int WorkerMain(uint workerIndex);
+
+   uint m_nWorkersRequested;
+
+   std::vector<cJobWorker *> m_workers;
+
+   // One queue per worker plus a shared queue at the end for jobs forked
+   // from threads outside the pool (e.g., the main thread)
+   std::vector<cJobQueue *> m_queues;
+
+   cThreadEvent m_workEvent;
+   volatile long m_nIdleWorkers;
+   volatile long m_bShutdown;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+#endif // !INCLUDED_JOBSYSTEM_H
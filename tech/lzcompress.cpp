@@ -0,0 +1,441 @@
+///////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#include "stdhdr.h"
+
+#include "tech/lzcompress.h"
+
+#ifdef HAVE_UNITTESTPP
+#include "UnitTest++.h"
+#include "tech/techtime.h"
+#include <vector>
+#endif
+
+#include <cstring>
+
+#include "tech/dbgalloc.h" // must be last header
+
+// REFERENCES
+// https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// A block is a series of sequences, each a token byte, a run of literals
+// and a back-reference. The token's high nibble is the literal count and its
+// low nibble the match length minus kMinMatch; a nibble of 15 continues in
+// bytes of 255 terminated by a smaller one. The back-reference is a 16-bit
+// little-endian offset. The last sequence is literals only.
+
+static const size_t kMinMatch = 4;
+static const size_t kMaxOffset = 0xFFFF;
+static const size_t kLastLiterals = 5;    // Block must end in this many literals
+static const size_t kMatchSearchLimit = 12; // No match may start closer to the end
+static const uint kNibbleMax = 15;
+
+static const uint kHashBits = 12;
+
+static inline uint32 LZRead32(const byte * p)
+{
+   uint32 value;
+   memcpy(&value, p, sizeof(value));
+   return value;
+}
+
+static inline uint LZHash(uint32 sequence)
+{
+   return (sequence * 2654435761U) >> (32 - kHashBits);
+}
+
+////////////////////////////////////////
+
+size_t LZCompressBound(size_t srcSize)
+{
+   return srcSize + (srcSize / 255) + 16;
+}
+
+////////////////////////////////////////
+
+static byte * LZWriteLength(byte * pOut, size_t length)
+{
+   for (; length >= 255; length -= 255)
+   {
+      *pOut++ = 255;
+   }
+   *pOut++ = static_cast<byte>(length);
+   return pOut;
+}
+
+// Writes one sequence; a match length of zero makes it the final one
+static bool LZWriteSequence(const byte * pLiterals, size_t nLiterals, size_t offset, size_t matchLength,
+                            byte * * ppOut, const byte * pOutEnd)
+{
+   size_t matchCode = (matchLength > 0) ? (matchLength - kMinMatch) : 0;
+
+   size_t worstCase = 1 + nLiterals + (nLiterals / 255) + 1;
+   if (matchLength > 0)
+   {
+      worstCase += 2 + (matchCode / 255) + 1;
+   }
+   if (worstCase > static_cast<size_t>(pOutEnd - *ppOut))
+   {
+      return false;
+   }
+
+   byte * pOut = *ppOut;
+   byte * pToken = pOut++;
+
+   if (nLiterals >= kNibbleMax)
+   {
+      *pToken = static_cast<byte>(kNibbleMax << 4);
+      pOut = LZWriteLength(pOut, nLiterals - kNibbleMax);
+   }
+   else
+   {
+      *pToken = static_cast<byte>(nLiterals << 4);
+   }
+
+   memcpy(pOut, pLiterals, nLiterals);
+   pOut += nLiterals;
+
+   if (matchLength > 0)
+   {
+      *pOut++ = static_cast<byte>(offset & 0xFF);
+      *pOut++ = static_cast<byte>(offset >> 8);
+
+      if (matchCode >= kNibbleMax)
+      {
+         *pToken |= kNibbleMax;
+         pOut = LZWriteLength(pOut, matchCode - kNibbleMax);
+      }
+      else
+      {
+         *pToken |= static_cast<byte>(matchCode);
+      }
+   }
+
+   *ppOut = pOut;
+   return true;
+}
+
+////////////////////////////////////////
+
+tResult LZCompress(const void * pSrc, size_t srcSize,
+                   void * pDest, size_t destSize, size_t * pCompressedSize)
+{
+   if ((pSrc == NULL && srcSize > 0) || pDest == NULL || pCompressedSize == NULL)
+   {
+      return E_POINTER;
+   }
+
+   const byte * const pIn = static_cast<const byte *>(pSrc);
+   const byte * const pInEnd = pIn + srcSize;
+   const byte * pAnchor = pIn;
+
+   byte * pOut = static_cast<byte *>(pDest);
+   const byte * const pOutEnd = pOut + destSize;
+
+   if (srcSize > kMatchSearchLimit)
+   {
+      const byte * const pMatchStartLimit = pInEnd - kMatchSearchLimit;
+      const byte * const pMatchEndLimit = pInEnd - kLastLiterals;
+
+      // Positions are relative to the start of the input; stale or colliding
+      // ones are weeded out by comparing the bytes
+      uint32 table[1 << kHashBits];
+      memset(table, 0, sizeof(table));
+
+      const byte * p = pIn;
+      while (p < pMatchStartLimit)
+      {
+         uint32 sequence = LZRead32(p);
+         uint hash = LZHash(sequence);
+         const byte * pCandidate = pIn + table[hash];
+         table[hash] = static_cast<uint32>(p - pIn);
+
+         if (pCandidate >= p
+            || static_cast<size_t>(p - pCandidate) > kMaxOffset
+            || LZRead32(pCandidate) != sequence)
+         {
+            p++;
+            continue;
+         }
+
+         size_t matchLength = kMinMatch;
+         while ((p + matchLength) < pMatchEndLimit && pCandidate[matchLength] == p[matchLength])
+         {
+            matchLength++;
+         }
+
+         if (!LZWriteSequence(pAnchor, p - pAnchor, p - pCandidate, matchLength, &pOut, pOutEnd))
+         {
+            return S_FALSE;
+         }
+
+         p += matchLength;
+         pAnchor = p;
+      }
+   }
+
+   if (!LZWriteSequence(pAnchor, pInEnd - pAnchor, 0, 0, &pOut, pOutEnd))
+   {
+      return S_FALSE;
+   }
+
+   *pCompressedSize = pOut - static_cast<byte *>(pDest);
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+static bool LZReadLength(const byte * * ppIn, const byte * pInEnd, size_t * pLength)
+{
+   const byte * pIn = *ppIn;
+   byte next;
+   do
+   {
+      if (pIn >= pInEnd)
+      {
+         return false;
+      }
+      next = *pIn++;
+      *pLength += next;
+   }
+   while (next == 255);
+   *ppIn = pIn;
+   return true;
+}
+
+////////////////////////////////////////
+
+tResult LZDecompress(const void * pSrc, size_t srcSize, void * pDest, size_t destSize)
+{
+   if (pSrc == NULL || (pDest == NULL && destSize > 0))
+   {
+      return E_POINTER;
+   }
+
+   const byte * pIn = static_cast<const byte *>(pSrc);
+   const byte * const pInEnd = pIn + srcSize;
+
+   byte * const pOutStart = static_cast<byte *>(pDest);
+   byte * pOut = pOutStart;
+   byte * const pOutEnd = pOut + destSize;
+
+   while (pIn < pInEnd)
+   {
+      uint token = *pIn++;
+
+      size_t nLiterals = token >> 4;
+      if (nLiterals == kNibbleMax && !LZReadLength(&pIn, pInEnd, &nLiterals))
+      {
+         return E_FAIL;
+      }
+
+      if (nLiterals > static_cast<size_t>(pInEnd - pIn) || nLiterals > static_cast<size_t>(pOutEnd - pOut))
+      {
+         return E_FAIL;
+      }
+
+      memcpy(pOut, pIn, nLiterals);
+      pIn += nLiterals;
+      pOut += nLiterals;
+
+      if (pIn == pInEnd)
+      {
+         break;
+      }
+
+      if ((pInEnd - pIn) < 2)
+      {
+         return E_FAIL;
+      }
+
+      size_t offset = pIn[0] | (pIn[1] << 8);
+      pIn += 2;
+
+      if (offset == 0 || offset > static_cast<size_t>(pOut - pOutStart))
+      {
+         return E_FAIL;
+      }
+
+      size_t matchLength = token & kNibbleMax;
+      if (matchLength == kNibbleMax && !LZReadLength(&pIn, pInEnd, &matchLength))
+      {
+         return E_FAIL;
+      }
+      matchLength += kMinMatch;
+
+      if (matchLength > static_cast<size_t>(pOutEnd - pOut))
+      {
+         return E_FAIL;
+      }
+
+      const byte * pMatch = pOut - offset;
+      if (offset >= matchLength)
+      {
+         memcpy(pOut, pMatch, matchLength);
+      }
+      else
+      {
+         // Byte by byte because the copy overlaps its own output
+         for (size_t i = 0; i < matchLength; i++)
+         {
+            pOut[i] = pMatch[i];
+         }
+      }
+      pOut += matchLength;
+   }
+
+   return (pOut == pOutEnd) ? S_OK : E_FAIL;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef HAVE_UNITTESTPP
+
+namespace
+{
+   void MakeTextLikeData(size_t size, std::vector<byte> * pData)
+   {
+      static const char szWords[] = "vertex index mesh joint texture material terrain tile ";
+      pData->resize(size);
+      for (size_t i = 0; i < size; i++)
+      {
+         (*pData)[i] = (i % 89 == 0) ? static_cast<byte>(i) : szWords[(i * 7 / 5) % (sizeof(szWords) - 1)];
+      }
+   }
+
+   bool RoundTrip(const std::vector<byte> & input, size_t * pCompressedSize)
+   {
+      std::vector<byte> compressed(LZCompressBound(input.size()));
+      size_t compressedSize = 0;
+      if (LZCompress(input.empty() ? NULL : &input[0], input.size(), &compressed[0], compressed.size(), &compressedSize) != S_OK)
+      {
+         return false;
+      }
+
+      std::vector<byte> output(input.size() + 1);
+      if (LZDecompress(&compressed[0], compressedSize, &output[0], input.size()) != S_OK)
+      {
+         return false;
+      }
+
+      output.resize(input.size());
+      if (pCompressedSize != NULL)
+      {
+         *pCompressedSize = compressedSize;
+      }
+      return output == input;
+   }
+}
+
+TEST(LZCompressRoundTrip)
+{
+   std::vector<byte> data;
+   CHECK(RoundTrip(data, NULL));
+
+   static const size_t sizes[] = { 1, 12, 13, 100, 4096, 200000 };
+   for (int i = 0; i < _countof(sizes); i++)
+   {
+      size_t compressedSize = 0;
+      MakeTextLikeData(sizes[i], &data);
+      CHECK(RoundTrip(data, &compressedSize));
+      if (sizes[i] >= 4096)
+      {
+         CHECK(compressedSize < (data.size() / 2));
+      }
+   }
+
+   // Long runs produce overlapping matches and multi-byte lengths
+   data.assign(100000, 'x');
+   size_t compressedSize = 0;
+   CHECK(RoundTrip(data, &compressedSize));
+   CHECK(compressedSize < 1000);
+
+   srand(42);
+   data.resize(65536);
+   for (size_t i = 0; i < data.size(); i++)
+   {
+      data[i] = static_cast<byte>(rand());
+   }
+   CHECK(RoundTrip(data, NULL));
+}
+
+TEST(LZCompressDoesNotFit)
+{
+   std::vector<byte> data(4096);
+   srand(7);
+   for (size_t i = 0; i < data.size(); i++)
+   {
+      data[i] = static_cast<byte>(rand());
+   }
+
+   std::vector<byte> compressed(data.size());
+   size_t compressedSize = 0;
+   CHECK_EQUAL(S_FALSE, LZCompress(&data[0], data.size(), &compressed[0], compressed.size(), &compressedSize));
+}
+
+TEST(LZDecompressRejectsBadInput)
+{
+   std::vector<byte> data;
+   MakeTextLikeData(10000, &data);
+
+   std::vector<byte> compressed(LZCompressBound(data.size()));
+   size_t compressedSize = 0;
+   CHECK_EQUAL(S_OK, LZCompress(&data[0], data.size(), &compressed[0], compressed.size(), &compressedSize));
+
+   std::vector<byte> output(data.size());
+
+   // Wrong expected size either way
+   CHECK_EQUAL(E_FAIL, LZDecompress(&compressed[0], compressedSize, &output[0], data.size() - 1));
+   output.resize(data.size() + 1);
+   CHECK_EQUAL(E_FAIL, LZDecompress(&compressed[0], compressedSize, &output[0], output.size()));
+   output.resize(data.size());
+
+   // Truncated
+   CHECK_EQUAL(E_FAIL, LZDecompress(&compressed[0], compressedSize / 2, &output[0], output.size()));
+
+   // A back-reference before the start of the output
+   static const byte badOffset[] = { 0x10, 'a', 0x05, 0x00, 0x00 };
+   CHECK_EQUAL(E_FAIL, LZDecompress(badOffset, sizeof(badOffset), &output[0], 5));
+
+   // Every corruption must fail or succeed cleanly without overrunning
+   for (size_t i = 0; i < compressedSize; i += 37)
+   {
+      std::vector<byte> corrupt(compressed.begin(), compressed.begin() + compressedSize);
+      corrupt[i] ^= 0x5A;
+      LZDecompress(&corrupt[0], corrupt.size(), &output[0], output.size());
+   }
+}
+
+TEST(LZCompressTimeTrial)
+{
+   static const size_t kDataSize = 4 * 1024 * 1024;
+
+   std::vector<byte> data;
+   MakeTextLikeData(kDataSize, &data);
+
+   std::vector<byte> compressed(LZCompressBound(data.size()));
+   size_t compressedSize = 0;
+
+   double compressTime = -TimeGetSecs();
+   CHECK_EQUAL(S_OK, LZCompress(&data[0], data.size(), &compressed[0], compressed.size(), &compressedSize));
+   compressTime += TimeGetSecs();
+
+   std::vector<byte> output(data.size());
+
+   double decompressTime = -TimeGetSecs();
+   CHECK_EQUAL(S_OK, LZDecompress(&compressed[0], compressedSize, &output[0], output.size()));
+   decompressTime += TimeGetSecs();
+
+   CHECK(output == data);
+
+   double megabytes = static_cast<double>(kDataSize) / (1024 * 1024);
+   DebugMsg3("LZ time trial: ratio %f, compress %f MB/sec, decompress %f MB/sec\n",
+      static_cast<double>(compressedSize) / kDataSize, megabytes / compressTime, megabytes / decompressTime);
+}
+
+#endif // HAVE_UNITTESTPP
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,272 @@
+///////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#include "stdhdr.h"
+
+#include "tech/readwriteapi.h"
+#include "tech/readwriteutils.h"
+#include "tech/filespec.h"
+
+#ifdef HAVE_UNITTESTPP
+#include "UnitTest++.h"
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "tech/dbgalloc.h" // must be last header
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cFileMapping
+//
+// Owns a read-only view of a whole file. Readers created over the view keep
+// the mapping referenced so that it is unmapped when the last one goes away.
+
+class cFileMapping : public cComObject<IMPLEMENTS(IUnknown)>
+{
+public:
+   cFileMapping(void * pView, size_t viewSize);
+   virtual ~cFileMapping();
+
+   static tResult Create(const cFileSpec & file, cFileMapping * * ppMapping);
+
+   const byte * GetData() const { return static_cast<const byte *>(m_pView); }
+   size_t GetSize() const { return m_viewSize; }
+
+private:
+   void * m_pView;
+   size_t m_viewSize;
+};
+
+///////////////////////////////////////
+
+cFileMapping::cFileMapping(void * pView, size_t viewSize)
+ : m_pView(pView)
+ , m_viewSize(viewSize)
+{
+}
+
+///////////////////////////////////////
+
+cFileMapping::~cFileMapping()
+{
+   if (m_pView != NULL)
+   {
+#ifdef _WIN32
+      UnmapViewOfFile(m_pView);
+#else
+      munmap(m_pView, m_viewSize);
+#endif
+      m_pView = NULL;
+      m_viewSize = 0;
+   }
+}
+
+///////////////////////////////////////
+
+#ifdef _WIN32
+
+tResult cFileMapping::Create(const cFileSpec & file, cFileMapping * * ppMapping)
+{
+   HANDLE hFile = CreateFile(file.CStr(), GENERIC_READ, FILE_SHARE_READ, NULL,
+      OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+   if (hFile == INVALID_HANDLE_VALUE)
+   {
+      return E_FAIL;
+   }
+
+   DWORD sizeHigh = 0;
+   DWORD sizeLow = GetFileSize(hFile, &sizeHigh);
+   if (sizeLow == 0 || sizeHigh != 0 || sizeLow == INVALID_FILE_SIZE)
+   {
+      CloseHandle(hFile);
+      return E_FAIL;
+   }
+
+   void * pView = NULL;
+   HANDLE hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+   if (hMapping != NULL)
+   {
+      pView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+      // The view holds its own reference to the mapping object
+      CloseHandle(hMapping);
+   }
+   CloseHandle(hFile);
+
+   if (pView == NULL)
+   {
+      return E_FAIL;
+   }
+
+   *ppMapping = new cFileMapping(pView, sizeLow);
+   if (*ppMapping == NULL)
+   {
+      UnmapViewOfFile(pView);
+      return E_OUTOFMEMORY;
+   }
+
+   return S_OK;
+}
+
+#else
+
+tResult cFileMapping::Create(const cFileSpec & file, cFileMapping * * ppMapping)
+{
+   int fd = open(file.CStr(), O_RDONLY);
+   if (fd < 0)
+   {
+      return E_FAIL;
+   }
+
+   struct stat fileStat;
+   if (fstat(fd, &fileStat) != 0 || fileStat.st_size <= 0)
+   {
+      close(fd);
+      return E_FAIL;
+   }
+
+   size_t viewSize = static_cast<size_t>(fileStat.st_size);
+   void * pView = mmap(NULL, viewSize, PROT_READ, MAP_PRIVATE, fd, 0);
+   // The mapping stays valid after the descriptor is closed
+   close(fd);
+
+   if (pView == MAP_FAILED)
+   {
+      return E_FAIL;
+   }
+
+#ifdef MADV_WILLNEED
+   // Loaders almost always consume the whole file so start the read-ahead now
+   madvise(pView, viewSize, MADV_WILLNEED);
+#endif
+
+   *ppMapping = new cFileMapping(pView, viewSize);
+   if (*ppMapping == NULL)
+   {
+      munmap(pView, viewSize);
+      return E_OUTOFMEMORY;
+   }
+
+   return S_OK;
+}
+
+#endif
+
+///////////////////////////////////////
+
+tResult MappedFileReaderCreate(const cFileSpec & file, IReader * * ppReader)
+{
+   if (ppReader == NULL)
+   {
+      return E_POINTER;
+   }
+
+   cFileMapping * pMapping = NULL;
+   tResult result = cFileMapping::Create(file, &pMapping);
+   if (result != S_OK)
+   {
+      return result;
+   }
+
+   // The reader takes its own reference on the mapping
+   cAutoIPtr<IUnknown> pOwner(static_cast<IUnknown *>(pMapping));
+   return MemReaderCreateView(pMapping->GetData(), pMapping->GetSize(), pOwner, ppReader);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef HAVE_UNITTESTPP
+
+SUITE(ReadWriteMapped)
+{
+   static const char szTestFile[] = "readwritemapped.tmp";
+
+   TEST(MappedFileReaderBasics)
+   {
+      const int writeInt = 1000;
+      const std::string writeString("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz");
+      const float writeFloat = 3.14159f;
+
+      try
+      {
+         {
+            cAutoIPtr<IWriter> pWriter;
+            CHECK_EQUAL(S_OK, FileWriterCreate(cFileSpec(szTestFile), kFileModeBinary, &pWriter));
+            CHECK_EQUAL(S_OK, pWriter->Write(writeInt));
+            CHECK_EQUAL(S_OK, pWriter->Write(writeString));
+            CHECK_EQUAL(S_OK, pWriter->Write(writeFloat));
+         }
+
+         cAutoIPtr<IReader> pReader;
+         CHECK_EQUAL(S_OK, MappedFileReaderCreate(cFileSpec(szTestFile), &pReader));
+
+         int readInt = -1;
+         CHECK_EQUAL(S_OK, pReader->Read(&readInt));
+         CHECK_EQUAL(writeInt, readInt);
+
+         std::string readString;
+         CHECK_EQUAL(S_OK, pReader->Read(&readString));
+         CHECK_EQUAL(writeString, readString);
+
+         float readFloat = 0;
+         CHECK_EQUAL(S_OK, pReader->Read(&readFloat));
+         CHECK(writeFloat == readFloat);
+
+         ulong endPos = 0;
+         CHECK_EQUAL(S_OK, pReader->Tell(&endPos));
+
+         cAutoIPtr<IMappedReader> pMappedReader;
+         CHECK_EQUAL(S_OK, pReader->QueryInterface(IID_IMappedReader, (void**)&pMappedReader));
+
+         const byte * pData = NULL;
+         size_t dataSize = 0;
+         CHECK_EQUAL(S_OK, pMappedReader->GetMappedData(&pData, &dataSize));
+         CHECK_EQUAL(endPos, dataSize);
+         CHECK(memcmp(pData, &writeInt, sizeof(writeInt)) == 0);
+
+         // The view must outlive the reader that it was obtained through
+         SafeRelease(pReader);
+         CHECK(memcmp(pData, &writeInt, sizeof(writeInt)) == 0);
+         SafeRelease(pMappedReader);
+
+         CHECK(remove(szTestFile) == 0);
+      }
+      catch (...)
+      {
+         remove(szTestFile);
+         throw;
+      }
+   }
+
+   TEST(MappedFileReaderEmptyOrMissing)
+   {
+      remove(szTestFile);
+
+      cAutoIPtr<IReader> pReader;
+      CHECK(MappedFileReaderCreate(cFileSpec(szTestFile), &pReader) != S_OK);
+
+      {
+         cAutoIPtr<IWriter> pWriter;
+         CHECK_EQUAL(S_OK, FileWriterCreate(cFileSpec(szTestFile), kFileModeBinary, &pWriter));
+      }
+
+      CHECK(MappedFileReaderCreate(cFileSpec(szTestFile), &pReader) != S_OK);
+
+      CHECK(remove(szTestFile) == 0);
+   }
+}
+
+#endif // HAVE_UNITTESTPP
+
+
+///////////////////////////////////////////////////////////////////////////////
@@ -28,10 +28,11 @@ static const wchar_t wszLineDelimiters[] = L"\r\n";
 
 ////////////////////////////////////////
 
-cMemReader::cMemReader(const byte * pMem, size_t memSize, bool bOwn)
+cMemReader::cMemReader(const byte * pMem, size_t memSize, bool bOwn, IUnknown * pOwner)
  : m_pMem(pMem)
  , m_memSize(memSize)
  , m_bOwn(bOwn)
+ , m_pOwner(CTAddRef(pOwner))
  , m_readPos(0)
 {
 }
@@ -56,6 +57,7 @@ void cMemReader::OnFinalRelease()
       m_pMem = NULL;
       m_memSize = 0;
    }
+   SafeRelease(m_pOwner);
 }
 
 ////////////////////////////////////////
@@ -211,6 +213,44 @@ tResult cMemReader::Read(void * pv, size_t nBytes, size_t * pnBytesRead)
 
 ////////////////////////////////////////
 
+tResult cMemReader::GetMappedData(const byte * * ppData, size_t * pDataSize)
+{
+   if (ppData == NULL || pDataSize == NULL)
+   {
+      return E_POINTER;
+   }
+
+   if (m_pMem == NULL)
+   {
+      return E_FAIL;
+   }
+
+   *ppData = m_pMem;
+   *pDataSize = m_memSize;
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cMemReader::ReadSpan(size_t nBytes, const void * * ppData)
+{
+   if (ppData == NULL)
+   {
+      return E_POINTER;
+   }
+
+   if (m_pMem == NULL || m_readPos > m_memSize || nBytes > (m_memSize - m_readPos))
+   {
+      return E_FAIL;
+   }
+
+   *ppData = m_pMem + m_readPos;
+   m_readPos += nBytes;
+   return S_OK;
+}
+
+////////////////////////////////////////
+
 tResult MemReaderCreate(const byte * pMem, size_t memSize, bool bOwn, IReader * * ppReader)
 {
    if (pMem == NULL || ppReader == NULL)
@@ -228,6 +268,25 @@ tResult MemReaderCreate(const byte * pMem, size_t memSize, bool bOwn, IReader *
    return S_OK;
 }
 
+////////////////////////////////////////
+
+tResult MemReaderCreateView(const byte * pMem, size_t memSize, IUnknown * pOwner, IReader * * ppReader)
+{
+   if (pMem == NULL || ppReader == NULL)
+   {
+      return E_POINTER;
+   }
+
+   *ppReader = static_cast<IReader *>(new cMemReader(pMem, memSize, false, pOwner));
+
+   if (*ppReader == NULL)
+   {
+      return E_OUTOFMEMORY;
+   }
+
+   return S_OK;
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -334,6 +393,23 @@ tResult MemWriterCreate(byte * pMem, size_t memSize, IWriter * * ppWriter)
 
 #ifdef HAVE_UNITTESTPP
 
+namespace
+{
+   // Hides the optional interfaces of a reader to exercise the plain paths
+   class cPlainReader : public cComObject<IMPLEMENTS(IReader)>
+   {
+   public:
+      cPlainReader(IReader * pReader) : m_pReader(CTAddRef(pReader)) {}
+      virtual tResult Tell(ulong * pPos) { return m_pReader->Tell(pPos); }
+      virtual tResult Seek(long pos, eSeekOrigin origin) { return m_pReader->Seek(pos, origin); }
+      virtual tResult ReadLine(std::string * pLine) { return m_pReader->ReadLine(pLine); }
+      virtual tResult ReadLine(std::wstring * pLine) { return m_pReader->ReadLine(pLine); }
+      virtual tResult Read(void * pv, size_t cb, size_t * pcbRead = NULL) { return m_pReader->Read(pv, cb, pcbRead); }
+   private:
+      cAutoIPtr<IReader> m_pReader;
+   };
+}
+
 SUITE(ReadWriteMem)
 {
    TEST(MemWriterBasics)
@@ -370,6 +446,131 @@ SUITE(ReadWriteMem)
       }
    }
 
+   TEST(MemReaderSpan)
+   {
+      byte mem[16];
+      for (int i = 0; i < _countof(mem); i++)
+      {
+         mem[i] = static_cast<byte>(i);
+      }
+
+      cAutoIPtr<IReader> pReader;
+      CHECK_EQUAL(S_OK, MemReaderCreate(&mem[0], sizeof(mem), false, &pReader));
+
+      cAutoIPtr<IReaderSpan> pReaderSpan;
+      CHECK_EQUAL(S_OK, pReader->QueryInterface(IID_IReaderSpan, (void**)&pReaderSpan));
+
+      byte first = 0;
+      CHECK_EQUAL(S_OK, pReader->Read(&first));
+
+      const void * pSpan = NULL;
+      CHECK_EQUAL(S_OK, pReaderSpan->ReadSpan(10, &pSpan));
+      CHECK(pSpan == &mem[1]);
+
+      // Asking for more than remains must fail without moving
+      CHECK(pReaderSpan->ReadSpan(6, &pSpan) != S_OK);
+
+      ulong pos = 0;
+      CHECK_EQUAL(S_OK, pReader->Tell(&pos));
+      CHECK_EQUAL(11, pos);
+
+      CHECK_EQUAL(S_OK, pReaderSpan->ReadSpan(5, &pSpan));
+      CHECK(pSpan == &mem[11]);
+   }
+
+   TEST(MemReaderVectorSpan)
+   {
+      std::vector<uint16> values;
+      for (uint16 i = 0; i < 100; i++)
+      {
+         values.push_back(i * 3);
+      }
+
+      byte mem[256];
+
+      {
+         cAutoIPtr<IWriter> pWriter;
+         CHECK_EQUAL(S_OK, MemWriterCreate(&mem[0], sizeof(mem), &pWriter));
+         CHECK_EQUAL(S_OK, pWriter->Write(values));
+      }
+
+      cAutoIPtr<IReader> pReader;
+      CHECK_EQUAL(S_OK, MemReaderCreate(&mem[0], sizeof(mem), false, &pReader));
+
+      std::vector<uint16> readValues;
+      CHECK_EQUAL(S_OK, pReader->Read(&readValues));
+      CHECK(values == readValues);
+
+      ulong pos = 0;
+      CHECK_EQUAL(S_OK, pReader->Tell(&pos));
+      CHECK_EQUAL(sizeof(uint) + values.size() * sizeof(uint16), pos);
+   }
+
+   TEST(RawVectorMatchesElementwiseFormat)
+   {
+      std::vector<tVec3> values;
+      for (int i = 0; i < 50; i++)
+      {
+         float f = static_cast<float>(i);
+         values.push_back(tVec3(f, f * 2, -f));
+      }
+
+      byte blockMem[1024], elementMem[1024];
+      memset(blockMem, 0, sizeof(blockMem));
+      memset(elementMem, 0, sizeof(elementMem));
+
+      {
+         cAutoIPtr<IWriter> pWriter;
+         CHECK_EQUAL(S_OK, MemWriterCreate(&blockMem[0], sizeof(blockMem), &pWriter));
+         CHECK_EQUAL(S_OK, pWriter->Write(values));
+      }
+
+      {
+         cAutoIPtr<IWriter> pWriter;
+         CHECK_EQUAL(S_OK, MemWriterCreate(&elementMem[0], sizeof(elementMem), &pWriter));
+         CHECK_EQUAL(S_OK, pWriter->Write(static_cast<uint>(values.size())));
+         for (uint i = 0; i < values.size(); i++)
+         {
+            CHECK_EQUAL(S_OK, pWriter->Write(values[i]));
+         }
+      }
+
+      CHECK(memcmp(blockMem, elementMem, sizeof(blockMem)) == 0);
+
+      cAutoIPtr<IReader> pMemReader;
+      CHECK_EQUAL(S_OK, MemReaderCreate(&blockMem[0], sizeof(blockMem), false, &pMemReader));
+      cAutoIPtr<IReader> pReader(static_cast<IReader *>(new cPlainReader(pMemReader)));
+
+      std::vector<tVec3> readValues;
+      CHECK_EQUAL(S_OK, pReader->Read(&readValues));
+      CHECK_EQUAL(values.size(), readValues.size());
+      CHECK(memcmp(&values[0], &readValues[0], values.size() * sizeof(tVec3)) == 0);
+   }
+
+   TEST(RawStringReadWrite)
+   {
+      const std::string writeString("The quick brown fox jumps over the lazy dog");
+
+      byte mem[128];
+
+      {
+         cAutoIPtr<IWriter> pWriter;
+         CHECK_EQUAL(S_OK, MemWriterCreate(&mem[0], sizeof(mem), &pWriter));
+         CHECK_EQUAL(S_OK, pWriter->Write(writeString));
+         CHECK_EQUAL(S_OK, pWriter->Write(std::string()));
+      }
+
+      cAutoIPtr<IReader> pMemReader;
+      CHECK_EQUAL(S_OK, MemReaderCreate(&mem[0], sizeof(mem), false, &pMemReader));
+      cAutoIPtr<IReader> pReader(static_cast<IReader *>(new cPlainReader(pMemReader)));
+
+      std::string readString, emptyString("x");
+      CHECK_EQUAL(S_OK, pReader->Read(&readString));
+      CHECK_EQUAL(writeString, readString);
+      CHECK_EQUAL(S_OK, pReader->Read(&emptyString));
+      CHECK(emptyString.empty());
+   }
+
    TEST(MemWriterExceedMemCapacity)
    {
       byte mem[10];
@@ -15,10 +15,11 @@
 // CLASS: cMemReader
 //
 
-class cMemReader : public cComObject<IMPLEMENTS(IReader)>
+class cMemReader : public cComObject3<IMPLEMENTS(IReader), IMPLEMENTS(IMappedReader),
+                                      IMPLEMENTS(IReaderSpan)>
 {
 public:
-   cMemReader(const byte * pMem, size_t memSize, bool bOwn);
+   cMemReader(const byte * pMem, size_t memSize, bool bOwn, IUnknown * pOwner = NULL);
    virtual ~cMemReader();
 
    virtual void OnFinalRelease();
@@ -31,10 +32,15 @@ public:
 
    virtual tResult Read(void * pv, size_t cb, size_t * pcbRead = NULL);
 
+   virtual tResult GetMappedData(const byte * * ppData, size_t * pDataSize);
+
+   virtual tResult ReadSpan(size_t nBytes, const void * * ppData);
+
 private:
    const byte * m_pMem;
    size_t m_memSize;
    bool m_bOwn;
+   cAutoIPtr<IUnknown> m_pOwner;
    size_t m_readPos;
 };
 
@@ -160,6 +160,10 @@ tResult cResourceFormatTable::RegisterFormat(tResourceType type,
    format.pfnPostload = pfnPostload;
    format.pfnUnload = pfnUnload;
    format.typeParam = typeParam;
+   format.derivedVersion = 0;
+   format.pfnSave = NULL;
+   format.pfnLoadSaved = NULL;
+   format.bThreadSafeLoad = false;
    m_formats.push_back(format);
 
    return S_OK;
@@ -174,6 +178,79 @@ tResult cResourceFormatTable::RevokeFormat(tResourceType type, tResourceType typ
 
 ////////////////////////////////////////
 
+tResult cResourceFormatTable::RegisterDerivedData(tResourceType type, const tChar * pszExtension, uint version,
+                                                  tResourceSave pfnSave, tResourceLoad pfnLoadSaved)
+{
+   if (!type || pszExtension == NULL)
+   {
+      return E_INVALIDARG;
+   }
+
+   if (pfnSave == NULL || pfnLoadSaved == NULL)
+   {
+      return E_POINTER;
+   }
+
+   cResourceFormat * pFormat = FindFormat(type, pszExtension);
+   if (pFormat == NULL)
+   {
+      WarnMsg2("No \"%s\" resource format for derived data with file extension \"%s\"\n",
+         ResourceTypeName(type), pszExtension);
+      return E_FAIL;
+   }
+
+   pFormat->derivedVersion = version;
+   pFormat->pfnSave = pfnSave;
+   pFormat->pfnLoadSaved = pfnLoadSaved;
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cResourceFormatTable::RegisterThreadSafeLoad(tResourceType type, const tChar * pszExtension)
+{
+   if (!type || pszExtension == NULL)
+   {
+      return E_INVALIDARG;
+   }
+
+   cResourceFormat * pFormat = FindFormat(type, pszExtension);
+   if (pFormat == NULL)
+   {
+      WarnMsg2("No \"%s\" resource format with file extension \"%s\" to load on any thread\n",
+         ResourceTypeName(type), pszExtension);
+      return E_FAIL;
+   }
+
+   pFormat->bThreadSafeLoad = true;
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+bool cResourceFormatTable::IsThreadSafeLoad(const tChar * pszName, tResourceType type)
+{
+   uint formatIds[10];
+   uint nFormats = DeduceFormats(pszName, type, formatIds, _countof(formatIds));
+   if (nFormats == 0)
+   {
+      return false;
+   }
+
+   for (uint i = 0; i < nFormats; i++)
+   {
+      const cResourceFormat & format = m_formats[formatIds[i]];
+      if (format.typeDepend ? !IsThreadSafeLoad(pszName, format.typeDepend) : !format.bThreadSafeLoad)
+      {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+////////////////////////////////////////
+
 uint cResourceFormatTable::DeduceFormats(const tChar * pszName, tResourceType type,
                                          uint * pFormatIds, uint nMaxFormats)
 {
@@ -253,6 +330,24 @@ void cResourceFormatTable::GetExtensionsForType(tResourceType type, std::set<uin
 
 ////////////////////////////////////////
 
+tResourceType cResourceFormatTable::FindType(const tChar * pszType) const
+{
+   Assert(pszType != NULL);
+
+   tResourceFormats::const_iterator iter = m_formats.begin(), end = m_formats.end();
+   for (; iter != end; ++iter)
+   {
+      if (SameType(iter->type, pszType))
+      {
+         return iter->type;
+      }
+   }
+
+   return NULL;
+}
+
+////////////////////////////////////////
+
 uint cResourceFormatTable::GetExtensionId(const tChar * pszExtension)
 {
    Assert(pszExtension != NULL);
@@ -285,6 +380,27 @@ uint cResourceFormatTable::GetExtensionIdForName(const tChar * pszName)
    return kNoIndex;
 }
 
+////////////////////////////////////////
+// The format that loads the type straight from files with the extension
+
+cResourceFormat * cResourceFormatTable::FindFormat(tResourceType type, const tChar * pszExtension)
+{
+   tExtensions::const_iterator f = std::find(m_extensions.begin(), m_extensions.end(), pszExtension);
+   if (f != m_extensions.end())
+   {
+      uint extensionId = f - m_extensions.begin();
+      tResourceFormats::iterator iter = m_formats.begin(), end = m_formats.end();
+      for (; iter != end; ++iter)
+      {
+         if (iter->extensionId == extensionId && !iter->typeDepend && SameType(iter->type, type))
+         {
+            return &(*iter);
+         }
+      }
+   }
+   return NULL;
+}
+
 ////////////////////////////////////////
 
 void cResourceFormatTable::DumpFormats() const
@@ -340,6 +456,23 @@ TEST(ResourceFormatTableRegister)
    CHECK(rft.RegisterFormat("bitmap", NULL, "bmp", NopLoad, NULL, NopUnload, NULL) == S_OK);
 }
 
+TEST(ResourceFormatTableThreadSafeLoad)
+{
+   cResourceFormatTable rft;
+   CHECK(rft.RegisterFormat("bitmap", NULL, "bmp", NopLoad, NULL, NopUnload, NULL) == S_OK);
+   CHECK(rft.RegisterFormat("bitmap", NULL, "tga", NopLoad, NULL, NopUnload, NULL) == S_OK);
+   CHECK(rft.RegisterFormat("texture", "bitmap", NULL, NULL, NopPostload, NopUnload, NULL) == S_OK);
+   CHECK(rft.RegisterThreadSafeLoad("bitmap", "jpg") == E_FAIL);
+   CHECK(rft.RegisterThreadSafeLoad("bitmap", "bmp") == S_OK);
+
+   // Converted types need the formats they're converted from to be safe
+   CHECK(rft.IsThreadSafeLoad("foo.bmp", "bitmap"));
+   CHECK(rft.IsThreadSafeLoad("foo.bmp", "texture"));
+   CHECK(!rft.IsThreadSafeLoad("foo.tga", "bitmap"));
+   CHECK(!rft.IsThreadSafeLoad("foo.tga", "texture"));
+   CHECK(!rft.IsThreadSafeLoad("foo.jpg", "bitmap"));
+}
+
 #endif // HAVE_UNITTESTPP
 
 ////////////////////////////////////////////////////////////////////////////////
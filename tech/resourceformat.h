@@ -33,6 +33,14 @@ public:
    tResourcePostload pfnPostload;
    tResourceUnload pfnUnload;
    void * typeParam;
+
+   // For the derived data cache, if pfnSave isn't NULL
+   uint derivedVersion;
+   tResourceSave pfnSave;
+   tResourceLoad pfnLoadSaved;
+
+   // Whether pfnLoad may run on a loader thread without being asked to
+   bool bThreadSafeLoad;
 };
 
 
@@ -52,13 +60,28 @@ public:
                           void * typeParam);
    tResult RevokeFormat(tResourceType type, tResourceType typeDepend, const tChar * pszExtension);
 
+   tResult RegisterDerivedData(tResourceType type, const tChar * pszExtension, uint version,
+                               tResourceSave pfnSave, tResourceLoad pfnLoadSaved);
+
+   tResult RegisterThreadSafeLoad(tResourceType type, const tChar * pszExtension);
+
+   /// @return Whether every load function that loading the resource could
+   /// call, including those of the types it may be converted from, is
+   /// registered as thread-safe
+   bool IsThreadSafeLoad(const tChar * pszName, tResourceType type);
+
    uint DeduceFormats(const tChar * pszName, tResourceType type, uint * pFormatIds, uint nMaxFormats);
 
+   uint GetFormatCount() const { return m_formats.size(); }
    cResourceFormat * GetFormat(uint formatId) { return &m_formats[formatId]; }
    const cResourceFormat * GetFormat(uint formatId) const { return &m_formats[formatId]; }
 
    void GetExtensionsForType(tResourceType type, std::set<uint> * pExtensionIds) const;
 
+   /// @return The type constant of a registered format whose type has the
+   /// given name, or NULL if there is none
+   tResourceType FindType(const tChar * pszType) const;
+
    const tChar * GetExtension(uint extensionId) const { return m_extensions[extensionId].c_str(); }
    uint GetExtensionId(const tChar * pszExtension);
    uint GetExtensionIdForName(const tChar * pszName);
@@ -66,6 +89,8 @@ public:
    void DumpFormats() const;
 
 private:
+   cResourceFormat * FindFormat(tResourceType type, const tChar * pszExtension);
+
    typedef std::vector<cResourceFormat> tResourceFormats;
    tResourceFormats m_formats;
 
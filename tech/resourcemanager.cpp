@@ -5,18 +5,26 @@
 
 #include "resourcemanager.h"
 #include "resourcestore.h"
+#include "dictionary.h"
+#include "dirscan.h"
 
+#include "tech/configapi.h"
 #include "tech/fileenum.h"
 #include "tech/filepath.h"
 #include "tech/filespec.h"
+#include "tech/globalobj.h"
+#include "tech/hashtabletem.h"
 #include "tech/readwriteapi.h"
+#include "tech/techtime.h"
 
 #define BOOST_MEM_FN_ENABLE_STDCALL
 #include <boost/mem_fn.hpp>
+#include <boost/bind.hpp>
 
 #include <cstdio>
 #include <vector>
 #include <algorithm>
+#include <functional>
 #include <set>
 
 #include "tech/dbgalloc.h" // must be last header
@@ -40,6 +48,36 @@ LOG_DEFINE_CHANNEL(ResourceManager);
 #define LocalMsgIf3(cond,msg,a,b,c)    DebugMsgIfEx3(ResourceManager,(cond),msg,(a),(b),(c))
 #define LocalMsgIf4(cond,msg,a,b,c,d)  DebugMsgIfEx4(ResourceManager,(cond),msg,(a),(b),(c),(d))
 
+static const int kDefaultLoaderThreads = 2;
+
+static const size_t kBytesPerKb = 1024;
+
+static const int kDefaultDerivedCacheLimitKb = 256 * 1024;
+
+// How many of the slowest traced loads DumpLoadStats lists
+static const size_t kSlowestLoadsDumped = 10;
+
+////////////////////////////////////////////////////////////////////////////////
+// Leaves the reader at the start. Readers that decompress know their size
+// up front, and seeking one to the end would decompress everything twice.
+
+static tResult GetReaderSize(IReader * pReader, ulong * pSize)
+{
+   cAutoIPtr<IReaderSize> pReaderSize;
+   if (pReader->QueryInterface(IID_IReaderSize, (void**)&pReaderSize) == S_OK)
+   {
+      return pReaderSize->GetSize(pSize);
+   }
+
+   if (pReader->Seek(0, kSO_End) != S_OK
+      || pReader->Tell(pSize) != S_OK
+      || pReader->Seek(0, kSO_Set) != S_OK)
+   {
+      return E_FAIL;
+   }
+   return S_OK;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 // REFERENCES
@@ -59,6 +97,103 @@ void * ThunkResourceLoadNoParam(IReader * pReader, void * typeParam)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// STRUCT: cResourceManager::sAsyncLoad
+//
+
+struct cResourceManager::sAsyncLoad
+{
+   sAsyncLoad(const tChar * pszName, tResourceType type, const cResourceCacheKey & key, void * loadParam)
+    : name(pszName)
+    , type(type)
+    , key(key)
+    , loadParam(loadParam)
+    , iFormat(0)
+    , threadId(ThreadGetCurrentId())
+    , pState(new cFutureState<void *>)
+    , nLocks(1)
+    , bOnLoader(false)
+    , bCancelled(false)
+    , pData(NULL)
+    , dataSize(0)
+    , bDerived(false)
+    , storeIndex(kNoIndex)
+   {
+      pState->AddRef();
+   }
+
+   ~sAsyncLoad()
+   {
+      pState->Release();
+   }
+
+   cStr name;
+   tResourceType type;
+   cResourceCacheKey key;
+   void * loadParam;
+   vector<uint> formatIds; // candidate formats, tried in order
+   uint iFormat;           // index of the one being tried
+   tThreadId threadId;     // the thread that finishes the load
+   cFutureState<void *> * pState;
+   ulong nLocks;           // one per request, including dependents
+   vector<sAsyncLoad *> dependents; // loads converting from this one
+   bool bOnLoader;         // queued, loading or being posted back
+   bool bCancelled;
+
+   // For the loader thread. The format is a copy because the format table
+   // may grow meanwhile.
+   cResourceFormat format;
+   vector<cStr> fileNames;
+   void * pData;
+   ulong dataSize;
+   cStr derivedKey;        // set if the format's data can be cached
+   bool bDerived;          // pData came from the cache and is postloaded
+   uint storeIndex;        // where pData was read from
+   sLoadTimes times;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// STRUCT: cResourceManager::sLoadTimes
+//
+
+cResourceManager::sLoadTimes::sLoadTimes()
+ : readThreadId(ThreadGetCurrentId())
+ , start(0)
+ , open(0)
+ , decode(0)
+ , postloadStart(0)
+ , postload(0)
+ , bytes(0)
+ , bOpened(false)
+{
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cResourceManager::cLoaderThread
+//
+
+class cResourceManager::cLoaderThread : public cThread
+{
+public:
+   cLoaderThread(cResourceManager * pResourceManager) : m_pResourceManager(pResourceManager) {}
+
+protected:
+   virtual int Run()
+   {
+      m_pResourceManager->RunLoader();
+      return 0;
+   }
+
+private:
+   cResourceManager * m_pResourceManager;
+};
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // CLASS: cResourceManager
@@ -67,7 +202,18 @@ void * ThunkResourceLoadNoParam(IReader * pReader, void * typeParam)
 ////////////////////////////////////////
 
 cResourceManager::cResourceManager()
+ : m_reloadTask(this)
+ , m_bHotReload(false)
+ , m_nIndexedStores(0)
+ , m_storeIndexVersion(0)
+ , m_lruClock(0)
+ , m_bStopLoaders(false)
+ , m_bDependenciesChanged(false)
+ , m_pRecordingKeys(NULL)
+ , m_bTraceLoads(false)
 {
+   memset(&m_totalStats, 0, sizeof(m_totalStats));
+   memset(&m_totalLoadStats, 0, sizeof(m_totalLoadStats));
 }
 
 ////////////////////////////////////////
@@ -78,8 +224,55 @@ cResourceManager::~cResourceManager()
 
 ////////////////////////////////////////
 
+BEGIN_CONSTRAINTS(cResourceManager)
+   AFTER_GUID(IID_IScheduler)
+END_CONSTRAINTS()
+
+////////////////////////////////////////
+
 tResult cResourceManager::Init()
 {
+   if (!m_storesMutex.Create() || !m_loadQueueMutex.Create() || !m_loadQueueCondition.Create())
+   {
+      return E_FAIL;
+   }
+
+   int budgetKb = 0;
+   if (ConfigGet(_T("resource_cache_budget_kb"), &budgetKb) == S_OK && budgetKb > 0)
+   {
+      m_totalStats.budget = static_cast<size_t>(budgetKb) * kBytesPerKb;
+   }
+
+   cStr derivedDir;
+   if (ConfigGet(_T("resource_derived_cache"), &derivedDir) == S_OK && !derivedDir.empty())
+   {
+      // Resources load normally without it
+      if (m_derivedCache.SetDirectory(derivedDir.c_str()) == S_OK)
+      {
+         int derivedLimitKb = kDefaultDerivedCacheLimitKb;
+         ConfigGet(_T("resource_derived_cache_limit_kb"), &derivedLimitKb);
+         if (derivedLimitKb > 0)
+         {
+            m_derivedCache.Prune(static_cast<size_t>(derivedLimitKb) * kBytesPerKb);
+         }
+      }
+   }
+
+   if (ConfigGet(_T("resource_manifest"), &m_manifestFile) == S_OK && !m_manifestFile.empty())
+   {
+      // Doesn't exist until the first run has saved it
+      LoadManifest(m_manifestFile.c_str());
+   }
+
+   m_bTraceLoads = ConfigIsTrue(_T("resource_load_trace"));
+
+   if (ConfigIsTrue(_T("resource_hot_reload")))
+   {
+      UseGlobal(Scheduler);
+      m_bHotReload = !!pScheduler && (pScheduler->AddFrameTask(&m_reloadTask, 0, 1, 0) == S_OK);
+      WarnMsgIf(!m_bHotReload, "Unable to schedule resource hot reload\n");
+   }
+
    return S_OK;
 }
 
@@ -87,10 +280,43 @@ tResult cResourceManager::Init()
 
 tResult cResourceManager::Term()
 {
+   StopLoaderThreads();
+
+   if (m_bHotReload)
+   {
+      UseGlobal(Scheduler);
+      if (!!pScheduler)
+      {
+         pScheduler->RemoveFrameTask(&m_reloadTask);
+      }
+      m_bHotReload = false;
+   }
+   DisconnectAll();
+
+   if (m_bDependenciesChanged && !m_manifestFile.empty())
+   {
+      WarnMsgIf1(SaveManifest(m_manifestFile.c_str()) != S_OK,
+         "Unable to save resource manifest \"%s\"\n", m_manifestFile.c_str());
+   }
+   m_pRecordingKeys = NULL;
+   m_dependencies.clear();
+   m_bDependenciesChanged = false;
+
    UnloadAll();
+   m_resourceNames.clear();
 
-   for_each(m_stores.begin(), m_stores.end(), mem_fn(&IResourceStore::Release));
-   m_stores.clear();
+   {
+      cMutexLock lock(&m_storesMutex);
+      lock.Acquire();
+      for_each(m_stores.begin(), m_stores.end(), mem_fn(&IResourceStore::Release));
+      m_stores.clear();
+      m_storeIndex.clear();
+      m_unindexedStores.clear();
+      m_changingStores.clear();
+      m_nIndexedStores = 0;
+      m_openMisses.clear();
+      m_storeIndexVersion++;
+   }
 
    return S_OK;
 }
@@ -103,15 +329,27 @@ tResult cResourceManager::AddDirectory(const tChar * pszDir)
    cAutoIPtr<IResourceStore> pStore;
    if ((result = ResourceStoreCreateFileSystem(pszDir, &pStore)) == S_OK)
    {
-      LocalMsg1("Adding directory store for \"%s\"\n", pszDir);
-      m_stores.push_back(CTAddRef(pStore));
-      result = S_OK;
+      AddDirectoryStore(pszDir, pStore);
    }
    return result;
 }
 
 ////////////////////////////////////////
 
+void cResourceManager::AddDirectoryStore(const tChar * pszDir, IResourceStore * pStore)
+{
+   LocalMsg1("Adding directory store for \"%s\"\n", pszDir);
+   if (m_bHotReload)
+   {
+      StartMonitoring(pStore);
+   }
+   cMutexLock lock(&m_storesMutex);
+   lock.Acquire();
+   m_stores.push_back(CTAddRef(pStore));
+}
+
+////////////////////////////////////////
+
 tResult cResourceManager::AddDirectoryTreeFlattened(const tChar * pszDir)
 {
    if (pszDir == NULL)
@@ -121,22 +359,30 @@ tResult cResourceManager::AddDirectoryTreeFlattened(const tChar * pszDir)
 
    cFilePath root(pszDir);
    root.MakeFullPath();
-   if (AddDirectory(root.CStr()) != S_OK)
+
+   // The job system reads sibling directories in parallel if it's running
+   cAutoIPtr<IJobSystem> pJobSystem;
+   if (g_pGlobalObjectRegistry != NULL)
+   {
+      pJobSystem = static_cast<IJobSystem*>(FindGlobalObject(IID_IJobSystem));
+   }
+
+   // Each directory's store is given its file names so that they are listed
+   // once, here, rather than read again when the stores are indexed
+   cDirectoryScan scan;
+   if (scan.Scan(root.CStr(), pJobSystem) != S_OK)
    {
       return E_FAIL;
    }
 
-   tStrings dirs;
-   if (ListDirs(root, true, &dirs) > 0)
+   for (size_t i = 0; i < scan.GetDirectoryCount(); i++)
    {
-      tStrings::const_iterator iter;
-      for (iter = dirs.begin(); iter != dirs.end(); iter++)
+      cAutoIPtr<IResourceStore> pStore;
+      if (ResourceStoreCreateFileSystem(scan.GetDirectory(i).c_str(), scan.GetFileNames(i), &pStore) != S_OK)
       {
-         if (AddDirectoryTreeFlattened(iter->c_str()) != S_OK)
-         {
-            return E_FAIL;
-         }
+         return E_FAIL;
       }
+      AddDirectoryStore(scan.GetDirectory(i).c_str(), pStore);
    }
 
    return S_OK;
@@ -148,9 +394,12 @@ tResult cResourceManager::AddArchive(const tChar * pszArchive)
 {
    tResult result = E_FAIL;
    cAutoIPtr<IResourceStore> pStore;
-   if ((result = ResourceStoreCreateZip(pszArchive, &pStore)) == S_OK)
+   if ((result = ResourceStoreCreatePack(pszArchive, &pStore)) == S_OK
+      || (result = ResourceStoreCreateZip(pszArchive, &pStore)) == S_OK)
    {
       LocalMsg1("Adding archive store for \"%s\"\n", pszArchive);
+      cMutexLock lock(&m_storesMutex);
+      lock.Acquire();
       m_stores.push_back(CTAddRef(pStore));
       result = S_OK;
    }
@@ -180,24 +429,149 @@ tResult cResourceManager::Load(const tChar * pszName, tResourceType type,
    }
 #endif
 
-   tResourceCache::iterator f = m_cache.find(cResourceCacheKey(pszName, type));
-   if (f != m_cache.end() && (f->second.GetData() != NULL))
+   cResourceCacheKey key = GetCacheKey(pszName, type);
+   if (LoadCached(key, ppData) == S_OK)
+   {
+      RecordDependency(key);
+      return S_OK;
+   }
+
+   tResourceId id;
+   if (GetResourceId(pszName, &id) != S_OK)
+   {
+      return E_FAIL;
+   }
+
+   tResult result = LoadUncached(pszName, type, loadParam, ppData);
+   if (result == S_OK)
+   {
+      RecordDependency(key);
+   }
+   return result;
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::Load(tResourceId id, tResourceType type, void * loadParam, void * * ppData)
+{
+   if (ppData == NULL)
+   {
+      return E_POINTER;
+   }
+
+   if (!type)
+   {
+      return E_INVALIDARG;
+   }
+
+   cResourceCacheKey key(id, GetTypeIndex(type));
+   if (LoadCached(key, ppData) == S_OK)
+   {
+      RecordDependency(key);
+      return S_OK;
+   }
+
+   tResourceNames::const_iterator f = m_resourceNames.find(id);
+   if (f == m_resourceNames.end())
    {
+      return E_INVALIDARG;
+   }
+
+   tResult result = LoadUncached(f->second.c_str(), type, loadParam, ppData);
+   if (result == S_OK)
+   {
+      RecordDependency(key);
+   }
+   return result;
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::GetResourceId(const tChar * pszName, tResourceId * pId)
+{
+   if (pszName == NULL || pId == NULL)
+   {
+      return E_POINTER;
+   }
+
+   tResourceId id = ResourceIdFromName(pszName);
+
+   tResourceNames::const_iterator f = m_resourceNames.find(id);
+   if (f == m_resourceNames.end())
+   {
+      m_resourceNames.insert(make_pair(id, cStr(pszName)));
+   }
+   else if (f->second.compare(pszName) != 0)
+   {
+      ErrorMsg2("Resource names \"%s\" and \"%s\" have the same id\n", pszName, f->second.c_str());
+      return E_FAIL;
+   }
+
+   *pId = id;
+   return S_OK;
+}
+
+////////////////////////////////////////
+// Counts the lookup and, on a hit, locks the entry
+
+tResult cResourceManager::LoadCached(const cResourceCacheKey & key, void * * ppData)
+{
+   sResourceCacheStats & typeStats = AccessTypeStats(key.GetTypeIndex());
+
+   tResourceCache::iterator f = m_cache.find(key);
+   if (f != m_cache.end())
+   {
+      typeStats.nHits++;
+      m_totalStats.nHits++;
+      LockEntry(f);
       *ppData = f->second.GetData();
       return S_OK;
    }
 
+   typeStats.nMisses++;
+   m_totalStats.nMisses++;
+   return S_FALSE;
+}
+
+////////////////////////////////////////
+// Loads a resource that isn't cached, by whichever format works first. The
+// name must have been interned.
+
+tResult cResourceManager::LoadUncached(const tChar * pszName, tResourceType type,
+                                       void * loadParam, void * * ppData)
+{
+   cResourceCacheKey key = GetCacheKey(pszName, type);
+
+   // Finish a background load of the same resource, from a prefetch say,
+   // rather than load it a second time
+   tAsyncLoads::iterator fl = m_asyncLoads.find(key);
+   if (fl != m_asyncLoads.end() && fl->second->threadId == ThreadGetCurrentId()
+      && WaitForAsyncLoad(fl->second, ppData) == S_OK)
+   {
+      return S_OK;
+   }
+
+   tResult result = E_FAIL;
+
+   m_loadContext.push_back(key);
    uint formatIds[10];
    uint nFormats = m_formats.DeduceFormats(pszName, type, formatIds, _countof(formatIds));
    for (uint i = 0; i < nFormats; i++)
    {
       if (LoadWithFormat(pszName, type, formatIds[i], loadParam, ppData) == S_OK)
       {
-         return S_OK;
+         result = S_OK;
+         break;
       }
    }
+   m_loadContext.pop_back();
 
-   return E_FAIL;
+   if (result == S_OK)
+   {
+      EnforceBudgets();
+   }
+
+   return result;
 }
 
 ////////////////////////////////////////
@@ -211,6 +585,7 @@ tResult cResourceManager::LoadWithFormat(const tChar * pszName, tResourceType ty
    Assert(ppData != NULL);
 
    cResourceFormat * pFormat = m_formats.GetFormat(formatId);
+   cResourceCacheKey key = GetCacheKey(pszName, type);
 
 #ifdef _DEBUG
    static bool bDumpCache = false;
@@ -228,61 +603,49 @@ tResult cResourceManager::LoadWithFormat(const tChar * pszName, tResourceType ty
       void * pDependData = NULL;
       if (Load(pszName, pFormat->typeDepend, loadParam, &pDependData) == S_OK)
       {
+         // Only the conversion is timed; the Load above recorded its own
+         sLoadTimes times;
+         times.start = times.postloadStart = TimeGetSecs();
          void * pData = (*pFormat->pfnPostload)(pDependData, 0, loadParam);
+         times.postload = TimeGetSecs() - times.postloadStart;
+         RecordLoad(pszName, formatId, times, pData != NULL);
          if (pData != NULL)
          {
-            // TODO: Store the actual size of the data instead of zero
-            m_cache[cResourceCacheKey(pszName, type)] = cResourceData(pData, 0, formatId);
+            // Keeps the lock on the dependency taken by the Load above
+            ulong dataSize = GetDependencySize(key.GetId(), formatId);
+            LockEntry(AddToCache(key, pData, dataSize, formatId, loadParam, kNoIndex));
             *ppData = pData;
             return S_OK;
          }
+         UnlockDependency(key.GetId(), formatId);
       }
    }
    else
    {
-      tResult openResult = E_FAIL;
-      cAutoIPtr<IReader> pReader;
-
-      cFileSpec name(pszName);
-      if (_tcslen(name.GetFileExt()) > 0)
-      {
-         openResult = Open(name.CStr(), &pReader);
-      }
-      else
-      {
-         set<uint> extsPossible;
-         uint extensionId = m_formats.GetExtensionIdForName(pszName);
-         if (extensionId == kNoIndex)
-         {
-            // Deduce possible extensions using the type
-            m_formats.GetExtensionsForType(type, &extsPossible);
-         }
+      sLoadTimes times;
+      times.start = TimeGetSecs();
 
-         set<uint>::const_iterator iter = extsPossible.begin();
-         for (; iter != extsPossible.end(); iter++)
-         {
-            name.SetFileExt(m_formats.GetExtension(*iter));
-            openResult = Open(name.CStr(), &pReader);
-            if (openResult == S_OK)
-            {
-               break;
-            }
-         }
-      }
+      cAutoIPtr<IReader> pReader;
+      uint storeIndex = kNoIndex;
+      tResult openResult = OpenWithType(pszName, type, &pReader, &storeIndex);
 
       if ((openResult == S_OK) && !!pReader)
       {
          ulong dataSize = 0;
          void * pData = NULL;
          tResult result = E_FAIL;
-         if (pReader->Seek(0, kSO_End) == S_OK
-            && pReader->Tell(&dataSize) == S_OK
-            && pReader->Seek(0, kSO_Set) == S_OK
-            && DoLoadFromReader(pReader, pFormat, dataSize, loadParam, &pData) == S_OK)
+         if (GetReaderSize(pReader, &dataSize) == S_OK)
          {
-            m_cache[cResourceCacheKey(pszName, type)] = cResourceData(pData, dataSize, formatId);
-            *ppData = pData;
-            result = S_OK;
+            times.open = TimeGetSecs() - times.start;
+            times.bytes = dataSize;
+            times.bOpened = true;
+            if (DoLoadFromReader(pReader, pFormat, dataSize, loadParam, &pData, &times) == S_OK)
+            {
+               LockEntry(AddToCache(key, pData, dataSize, formatId, loadParam, storeIndex));
+               *ppData = pData;
+               result = S_OK;
+            }
+            RecordLoad(pszName, formatId, times, result == S_OK);
          }
          return result;
       }
@@ -291,79 +654,1759 @@ tResult cResourceManager::LoadWithFormat(const tChar * pszName, tResourceType ty
    return E_FAIL;
 }
 
-tResult cResourceManager::Open(const tChar * pszName, IReader * * ppReader)
+// Probes only the stores that list the name, those that can't list their
+// entries, and those whose entries can change, in the order the stores were
+// added. A name with a path is also looked up by its bare file name, because
+// directory stores drop any path from the names they are asked to open. A
+// name that none of them opens is only looked for again in the stores whose
+// entries can change, since files are written to directories without hot
+// reload telling the index, until another store is added.
+//
+// The stores mutex only covers picking the stores. Opening an entry may
+// inflate or decompress it, which loader threads must be able to do at the
+// same time, so the stores are held by reference and probed unlocked.
+
+tResult cResourceManager::Open(const tChar * pszName, IReader * * ppReader, uint * pStoreIndex)
 {
    Assert(pszName != NULL);
    Assert(ppReader != NULL);
-   tResourceStores::iterator iter = m_stores.begin(), end = m_stores.end();
-   for (; iter != end; ++iter)
+
+   tResourceId id = ResourceIdFromNameNoCase(pszName);
+
+   vector< cAutoIPtr<IResourceStore> > stores;
+   vector<uint> storeIndices;
+   ulong indexVersion = 0;
+   bool bMissed = false;
+   {
+      cMutexLock lock(&m_storesMutex);
+      lock.Acquire();
+
+      IndexNewStores();
+
+      storeIndices = m_changingStores;
+      bMissed = (m_openMisses.find(id) != m_openMisses.end());
+      if (!bMissed)
+      {
+         cFileSpec name(pszName);
+         tResourceId ids[2] = { id, ResourceIdFromNameNoCase(name.GetFileName()) };
+         int nIds = (ids[1] != ids[0]) ? 2 : 1;
+
+         storeIndices.insert(storeIndices.end(), m_unindexedStores.begin(), m_unindexedStores.end());
+         for (int i = 0; i < nIds; i++)
+         {
+            pair<tStoreIndex::const_iterator, tStoreIndex::const_iterator> indexed = m_storeIndex.equal_range(ids[i]);
+            for (tStoreIndex::const_iterator iter = indexed.first; iter != indexed.second; ++iter)
+            {
+               storeIndices.push_back(iter->second);
+            }
+         }
+      }
+      else if (storeIndices.empty())
+      {
+         return S_FALSE;
+      }
+      sort(storeIndices.begin(), storeIndices.end());
+      storeIndices.erase(unique(storeIndices.begin(), storeIndices.end()), storeIndices.end());
+
+      stores.reserve(storeIndices.size());
+      vector<uint>::const_iterator iter = storeIndices.begin(), end = storeIndices.end();
+      for (; iter != end; ++iter)
+      {
+         stores.push_back(cAutoIPtr<IResourceStore>(CTAddRef(m_stores[*iter])));
+      }
+
+      indexVersion = m_storeIndexVersion;
+   }
+
+   for (size_t i = 0; i < stores.size(); i++)
    {
       cAutoIPtr<IReader> pReader;
-      if ((*iter)->OpenEntry(pszName, &pReader) == S_OK)
+      if (stores[i]->OpenEntry(pszName, &pReader) == S_OK)
       {
+         if (bMissed)
+         {
+            // Written since it was missed
+            cMutexLock lock(&m_storesMutex);
+            lock.Acquire();
+            if (m_openMisses.erase(id) > 0)
+            {
+               m_storeIndexVersion++;
+            }
+            IndexEntry(pszName, storeIndices[i]);
+         }
+         if (pStoreIndex != NULL)
+         {
+            *pStoreIndex = storeIndices[i];
+         }
          return pReader.GetPointer(ppReader);
       }
    }
+
+   {
+      cMutexLock lock(&m_storesMutex);
+      lock.Acquire();
+      // A store added or an entry indexed while the lock was let go may have
+      // the name, so the miss is only remembered if nothing changed
+      if (m_storeIndexVersion == indexVersion)
+      {
+         m_openMisses.insert(id);
+      }
+   }
+
    return S_FALSE;
 }
 
 ////////////////////////////////////////
+// Lists the entries of stores added since the last call. Stores are
+// usually pushed onto m_stores directly, so this is done on the next Open
+// rather than by whatever added them. Call with the stores mutex held.
 
-tResult cResourceManager::Unload(const tChar * pszName, tResourceType type)
+void cResourceManager::IndexNewStores()
 {
-   if (pszName == NULL)
-   {
-      return E_POINTER;
-   }
-
-   if (!type)
+   if (m_nIndexedStores == m_stores.size())
    {
-      return E_INVALIDARG;
+      return;
    }
 
-   tResourceCache::iterator f = m_cache.find(cResourceCacheKey(pszName, type));
+   // The new stores may have what was missing
+   m_openMisses.clear();
+   m_storeIndexVersion++;
 
-   if (f == m_cache.end())
+   vector<cStr> names;
+   for (; m_nIndexedStores < m_stores.size(); m_nIndexedStores++)
    {
-      WarnMsg2("Resource (\"%s\", %s) not found\n", pszName, ResourceTypeName(type));
-      return S_FALSE;
-   }
-
-   tResult result = Unload(f);
+      uint storeIndex = static_cast<uint>(m_nIndexedStores);
+      names.clear();
+      if (m_stores[storeIndex]->CollectResourceNames(_T("*"), &names) != S_OK)
+      {
+         m_unindexedStores.push_back(storeIndex);
+         continue;
+      }
 
-   m_cache.erase(f);
+      // Directory stores list names with the directory in front, and open
+      // them by their bare file name
+      vector<cStr>::const_iterator iter = names.begin(), end = names.end();
+      for (; iter != end; ++iter)
+      {
+         IndexEntry(iter->c_str(), storeIndex);
+         IndexEntry(cFileSpec(iter->c_str()).GetFileName(), storeIndex);
+      }
+      LocalMsg2("Indexed %d entries of store %d\n", names.size(), storeIndex);
 
-   return result;
+      cAutoIPtr<IResourceStoreMonitor> pMonitor;
+      if (m_stores[storeIndex]->QueryInterface(IID_IResourceStoreMonitor, (void**)&pMonitor) == S_OK)
+      {
+         m_changingStores.push_back(storeIndex);
+      }
+   }
 }
 
 ////////////////////////////////////////
+// Call with the stores mutex held
 
-tResult cResourceManager::Unload(tResourceCache::iterator iter)
+void cResourceManager::IndexEntry(const tChar * pszName, uint storeIndex)
 {
-   if (iter->second.GetData() != NULL)
+   tResourceId id = ResourceIdFromNameNoCase(pszName);
+
+   pair<tStoreIndex::iterator, tStoreIndex::iterator> indexed = m_storeIndex.equal_range(id);
+   for (tStoreIndex::iterator iter = indexed.first; iter != indexed.second; ++iter)
    {
-      WarnMsgIf(iter->second.GetFormatId() == kNoIndex, "No format id for loaded resource\n");
-      if (iter->second.GetFormatId() != kNoIndex)
+      if (iter->second == storeIndex)
+      {
+         return;
+      }
+   }
+
+   m_storeIndex.insert(make_pair(id, storeIndex));
+   m_storeIndexVersion++;
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::OpenWithType(const tChar * pszName, tResourceType type, IReader * * ppReader,
+                                       uint * pStoreIndex)
+{
+   vector<cStr> fileNames;
+   GetFileNames(pszName, type, &fileNames);
+
+   tResult openResult = E_FAIL;
+   vector<cStr>::const_iterator iter = fileNames.begin(), end = fileNames.end();
+   for (; iter != end; ++iter)
+   {
+      openResult = Open(iter->c_str(), ppReader, pStoreIndex);
+      if (openResult == S_OK)
+      {
+         break;
+      }
+   }
+   return openResult;
+}
+
+////////////////////////////////////////
+// Lists the file names to try, in order, for a resource name that may
+// leave off the extension
+
+void cResourceManager::GetFileNames(const tChar * pszName, tResourceType type, vector<cStr> * pFileNames)
+{
+   Assert(pFileNames != NULL);
+
+   cFileSpec name(pszName);
+   if (_tcslen(name.GetFileExt()) > 0)
+   {
+      pFileNames->push_back(name.CStr());
+   }
+   else
+   {
+      set<uint> extsPossible;
+      uint extensionId = m_formats.GetExtensionIdForName(pszName);
+      if (extensionId == kNoIndex)
+      {
+         // Deduce possible extensions using the type
+         m_formats.GetExtensionsForType(type, &extsPossible);
+      }
+
+      set<uint>::const_iterator iter = extsPossible.begin();
+      for (; iter != extsPossible.end(); iter++)
+      {
+         name.SetFileExt(m_formats.GetExtension(*iter));
+         pFileNames->push_back(name.CStr());
+      }
+   }
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::Unload(const tChar * pszName, tResourceType type)
+{
+   if (pszName == NULL)
+   {
+      return E_POINTER;
+   }
+
+   if (!type)
+   {
+      return E_INVALIDARG;
+   }
+
+   tResourceCache::iterator f = m_cache.find(GetCacheKey(pszName, type));
+
+   if (f == m_cache.end())
+   {
+      WarnMsg2("Resource (\"%s\", %s) not found\n", pszName, ResourceTypeName(type));
+      return S_FALSE;
+   }
+
+   tResult result = Unload(f);
+
+   RemoveFromCache(f);
+
+   return result;
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::Unload(tResourceCache::iterator iter)
+{
+   UnloadRetiredData(iter->first);
+
+   if (iter->second.GetData() != NULL)
+   {
+      WarnMsgIf(iter->second.GetFormatId() == kNoIndex, "No format id for loaded resource\n");
+      if (iter->second.GetFormatId() != kNoIndex)
       {
          cResourceFormat * pFormat = m_formats.GetFormat(iter->second.GetFormatId());
-         LocalMsg2("Unloading \"%s\" (%s)\n", iter->first.GetName(), ResourceTypeName(pFormat->type));
+         LocalMsg2("Unloading \"%s\" (%s)\n", GetResourceName(iter->first.GetId()), ResourceTypeName(pFormat->type));
          pFormat->Unload(iter->second.GetData());
          return S_OK;
       }
    }
-   return E_FAIL;
+   return E_FAIL;
+}
+
+////////////////////////////////////////
+
+void cResourceManager::UnloadAll()
+{
+   tResourceCache::iterator iter = m_cache.begin(), end = m_cache.end();
+   for (; iter != end; ++iter)
+   {
+      Unload(iter);
+   }
+   Assert(m_retiredData.empty());
+   m_cache.clear();
+   m_lruEntries.clear();
+
+   vector<sCacheType>::iterator typeIter = m_cacheTypes.begin(), typeEnd = m_cacheTypes.end();
+   for (; typeIter != typeEnd; ++typeIter)
+   {
+      typeIter->stats.nEntries = typeIter->stats.nLockedEntries = 0;
+      typeIter->stats.bytes = typeIter->stats.lockedBytes = 0;
+   }
+   m_totalStats.nEntries = m_totalStats.nLockedEntries = 0;
+   m_totalStats.bytes = m_totalStats.lockedBytes = 0;
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::Unlock(const tChar * pszName, tResourceType type)
+{
+   if (pszName == NULL)
+   {
+      return E_POINTER;
+   }
+
+   if (!type)
+   {
+      return E_INVALIDARG;
+   }
+
+   return UnlockCached(GetCacheKey(pszName, type));
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::Unlock(tResourceId id, tResourceType type)
+{
+   if (!type)
+   {
+      return E_INVALIDARG;
+   }
+
+   return UnlockCached(cResourceCacheKey(id, GetTypeIndex(type)));
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::UnlockCached(const cResourceCacheKey & key)
+{
+   tResourceCache::iterator f = m_cache.find(key);
+   if (f == m_cache.end() || f->second.GetLockCount() == 0)
+   {
+      return S_FALSE;
+   }
+
+   UnlockEntry(f);
+   EnforceBudgets();
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::SetMemoryBudget(tResourceType type, size_t budget)
+{
+   if (type)
+   {
+      AccessTypeStats(GetTypeIndex(type)).budget = budget;
+   }
+   else
+   {
+      m_totalStats.budget = budget;
+   }
+   EnforceBudgets();
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+cResourceManager::tResourceCache::iterator cResourceManager::AddToCache(const cResourceCacheKey & key,
+                                                                        void * pData, ulong dataSize,
+                                                                        uint formatId, void * loadParam,
+                                                                        uint storeIndex)
+{
+   Assert(pData != NULL);
+   Assert(m_resourceNames.find(key.GetId()) != m_resourceNames.end());
+
+   pair<tResourceCache::const_iterator, bool> result = m_cache.insert(key, cResourceData(pData, dataSize, formatId, loadParam, storeIndex));
+   Assert(result.second);
+   tResourceCache::iterator iter = result.first;
+
+   sResourceCacheStats & typeStats = AccessTypeStats(key.GetTypeIndex());
+   typeStats.nEntries++;
+   typeStats.bytes += dataSize;
+   m_totalStats.nEntries++;
+   m_totalStats.bytes += dataSize;
+
+   // New entries start out unlocked
+   iter->second.SetLruTick(++m_lruClock);
+   m_lruEntries[m_lruClock] = key;
+
+   return iter;
+}
+
+////////////////////////////////////////
+// Erases an entry whose data has already been unloaded
+
+void cResourceManager::RemoveFromCache(tResourceCache::iterator iter)
+{
+   cResourceCacheKey key(iter->first);
+   uint formatId = iter->second.GetFormatId();
+   ulong dataSize = iter->second.GetDataSize();
+
+   sResourceCacheStats & typeStats = AccessTypeStats(key.GetTypeIndex());
+   typeStats.nEntries--;
+   typeStats.bytes -= dataSize;
+   m_totalStats.nEntries--;
+   m_totalStats.bytes -= dataSize;
+
+   if (iter->second.GetLockCount() > 0)
+   {
+      typeStats.nLockedEntries--;
+      typeStats.lockedBytes -= dataSize;
+      m_totalStats.nLockedEntries--;
+      m_totalStats.lockedBytes -= dataSize;
+   }
+   else
+   {
+      m_lruEntries.erase(iter->second.GetLruTick());
+   }
+
+   m_cache.erase(key);
+
+   if (formatId != kNoIndex)
+   {
+      UnlockDependency(key.GetId(), formatId);
+   }
+}
+
+////////////////////////////////////////
+
+void cResourceManager::LockEntry(tResourceCache::iterator iter, ulong nLocks)
+{
+   if (nLocks == 0)
+   {
+      return;
+   }
+
+   if (iter->second.GetLockCount() == 0)
+   {
+      m_lruEntries.erase(iter->second.GetLruTick());
+
+      ulong dataSize = iter->second.GetDataSize();
+      sResourceCacheStats & typeStats = AccessTypeStats(iter->first.GetTypeIndex());
+      typeStats.nLockedEntries++;
+      typeStats.lockedBytes += dataSize;
+      m_totalStats.nLockedEntries++;
+      m_totalStats.lockedBytes += dataSize;
+   }
+
+   while (nLocks-- > 0)
+   {
+      iter->second.Lock();
+   }
+}
+
+////////////////////////////////////////
+
+void cResourceManager::UnlockEntry(tResourceCache::iterator iter)
+{
+   if (iter->second.Unlock() == 0)
+   {
+      UnloadRetiredData(iter->first);
+
+      iter->second.SetLruTick(++m_lruClock);
+      m_lruEntries[m_lruClock] = iter->first;
+
+      ulong dataSize = iter->second.GetDataSize();
+      sResourceCacheStats & typeStats = AccessTypeStats(iter->first.GetTypeIndex());
+      typeStats.nLockedEntries--;
+      typeStats.lockedBytes -= dataSize;
+      m_totalStats.nLockedEntries--;
+      m_totalStats.lockedBytes -= dataSize;
+   }
+}
+
+////////////////////////////////////////
+// Releases the lock a converted resource holds on what it was converted from
+
+void cResourceManager::UnlockDependency(tResourceId id, uint formatId)
+{
+   const cResourceFormat * pFormat = m_formats.GetFormat(formatId);
+   if (pFormat->typeDepend)
+   {
+      tResourceCache::iterator f = m_cache.find(cResourceCacheKey(id, GetTypeIndex(pFormat->typeDepend)));
+      if (f != m_cache.end() && f->second.GetLockCount() > 0)
+      {
+         UnlockEntry(f);
+      }
+   }
+}
+
+////////////////////////////////////////
+// Gives back the lock that loading takes on the resource, or that a load in
+// progress will take when it finishes, for loads that no caller holds
+
+void cResourceManager::ReleaseLoadLock(const cResourceCacheKey & key, sAsyncLoad * pPending)
+{
+   if (pPending != NULL)
+   {
+      Assert(pPending->nLocks > 0);
+      pPending->nLocks--;
+   }
+   else
+   {
+      tResourceCache::iterator f = m_cache.find(key);
+      if (f != m_cache.end() && f->second.GetLockCount() > 0)
+      {
+         UnlockEntry(f);
+      }
+   }
+}
+
+////////////////////////////////////////
+// The format can't report the size of what its postload function makes
+// from a dependency, so a converted resource is charged the dependency's size
+
+ulong cResourceManager::GetDependencySize(tResourceId id, uint formatId)
+{
+   const cResourceFormat * pFormat = m_formats.GetFormat(formatId);
+   tResourceCache::iterator f = m_cache.find(cResourceCacheKey(id, GetTypeIndex(pFormat->typeDepend)));
+   return (f != m_cache.end()) ? f->second.GetDataSize() : 0;
+}
+
+////////////////////////////////////////
+
+const tChar * cResourceManager::GetResourceName(tResourceId id) const
+{
+   tResourceNames::const_iterator f = m_resourceNames.find(id);
+   return (f != m_resourceNames.end()) ? f->second.c_str() : _T("<unknown>");
+}
+
+////////////////////////////////////////
+// Gets the index of a type in the cache keys, adding it if it's new
+
+uint cResourceManager::GetTypeIndex(tResourceType type)
+{
+   uint index = FindTypeIndex(type);
+   if (index == kNoIndex)
+   {
+      sCacheType cacheType;
+      cacheType.pType = type;
+      cacheType.name = type;
+      memset(&cacheType.stats, 0, sizeof(cacheType.stats));
+      index = m_cacheTypes.size();
+      m_cacheTypes.push_back(cacheType);
+   }
+   else if (m_cacheTypes[index].pType == NULL)
+   {
+      // Added by name from a manifest
+      m_cacheTypes[index].pType = type;
+   }
+   return index;
+}
+
+////////////////////////////////////////
+
+uint cResourceManager::FindTypeIndex(tResourceType type) const
+{
+   Assert(type != NULL);
+
+   // Nearly every caller passes one of a handful of type constants
+   uint i, nTypes = m_cacheTypes.size();
+   for (i = 0; i < nTypes; i++)
+   {
+      if (m_cacheTypes[i].pType == type)
+      {
+         return i;
+      }
+   }
+
+   for (i = 0; i < nTypes; i++)
+   {
+      if (m_cacheTypes[i].name.compare(type) == 0)
+      {
+         return i;
+      }
+   }
+
+   return kNoIndex;
+}
+
+////////////////////////////////////////
+
+cResourceCacheKey cResourceManager::GetCacheKey(const tChar * pszName, tResourceType type)
+{
+   return cResourceCacheKey(ResourceIdFromName(pszName), GetTypeIndex(type));
+}
+
+////////////////////////////////////////
+
+bool cResourceManager::IsOverBudget() const
+{
+   if (m_totalStats.budget > 0 && m_totalStats.bytes > m_totalStats.budget)
+   {
+      return true;
+   }
+
+   vector<sCacheType>::const_iterator iter = m_cacheTypes.begin(), end = m_cacheTypes.end();
+   for (; iter != end; ++iter)
+   {
+      if (iter->stats.budget > 0 && iter->stats.bytes > iter->stats.budget)
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+////////////////////////////////////////
+// Evicts unlocked entries, least recently used first, until the cache and
+// every type are within their budgets or nothing more can be evicted
+
+void cResourceManager::EnforceBudgets()
+{
+   tLruEntries::iterator iter = m_lruEntries.begin();
+   while (iter != m_lruEntries.end() && IsOverBudget())
+   {
+      ulong tick = iter->first;
+      tResourceCache::iterator entry = m_cache.find(iter->second);
+      Assert(entry != m_cache.end());
+      ++iter;
+
+      uint typeIndex = entry->first.GetTypeIndex();
+      sResourceCacheStats & typeStats = AccessTypeStats(typeIndex);
+      bool bTotalOver = (m_totalStats.budget > 0 && m_totalStats.bytes > m_totalStats.budget);
+      bool bTypeOver = (typeStats.budget > 0 && typeStats.bytes > typeStats.budget);
+      if (!bTotalOver && !bTypeOver)
+      {
+         continue;
+      }
+
+      LocalMsg3("Evicting (\"%s\", %s), %d bytes\n", GetResourceName(entry->first.GetId()),
+         m_cacheTypes[typeIndex].name.c_str(), entry->second.GetDataSize());
+
+      typeStats.nEvictions++;
+      m_totalStats.nEvictions++;
+
+      // May unlock a dependency, which is then added at the end
+      Unload(entry);
+      RemoveFromCache(entry);
+      iter = m_lruEntries.upper_bound(tick);
+   }
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::LoadAsync(const tChar * pszName, tResourceType type,
+                                    void * loadParam, cFuture<void *> * pFuture)
+{
+   if (pszName == NULL || pFuture == NULL)
+   {
+      return E_POINTER;
+   }
+
+   if (!type)
+   {
+      return E_INVALIDARG;
+   }
+
+   tResult result = BeginAsyncLoad(pszName, type, loadParam, pFuture, NULL);
+   if (result == S_OK)
+   {
+      RecordDependency(GetCacheKey(pszName, type));
+   }
+   return result;
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::BeginAsyncLoad(const tChar * pszName, tResourceType type, void * loadParam,
+                                         cFuture<void *> * pFuture, sAsyncLoad * * ppPending)
+{
+   cResourceCacheKey key = GetCacheKey(pszName, type);
+
+   void * pData = NULL;
+   if (LoadCached(key, &pData) == S_OK)
+   {
+      cFutureState<void *> * pState = new cFutureState<void *>;
+      *pFuture = cFuture<void *>(pState);
+      pState->SetResult(pData);
+      return S_OK;
+   }
+
+   tAsyncLoads::iterator fl = m_asyncLoads.find(key);
+   if (fl != m_asyncLoads.end())
+   {
+      LocalMsg2("Joining load in progress for (\"%s\", %s)\n", pszName, ResourceTypeName(type));
+      fl->second->nLocks++;
+      *pFuture = cFuture<void *>(fl->second->pState);
+      if (ppPending != NULL)
+      {
+         *ppPending = fl->second;
+      }
+      return S_OK;
+   }
+
+   if (m_loaderThreads.empty())
+   {
+      tResult result = StartLoaderThreads();
+      if (result != S_OK)
+      {
+         return result;
+      }
+   }
+
+   if (m_pThreadCaller->ThreadIsInitialized(ThreadGetCurrentId()) != S_OK)
+   {
+      ErrorMsg("LoadAsync called from a thread that can't receive calls\n");
+      return E_FAIL;
+   }
+
+   uint formatIds[10];
+   uint nFormats = m_formats.DeduceFormats(pszName, type, formatIds, _countof(formatIds));
+   if (nFormats == 0)
+   {
+      return E_FAIL;
+   }
+
+   tResourceId id;
+   if (GetResourceId(pszName, &id) != S_OK)
+   {
+      return E_FAIL;
+   }
+
+   sAsyncLoad * pLoad = new sAsyncLoad(pszName, type, key, loadParam);
+   if (pLoad == NULL)
+   {
+      return E_OUTOFMEMORY;
+   }
+
+   pLoad->formatIds.assign(formatIds, formatIds + nFormats);
+
+   m_asyncLoads[key] = pLoad;
+   *pFuture = cFuture<void *>(pLoad->pState);
+
+   // Balanced when the load is deleted so that the loader threads and
+   // pending thread calls never outlive the resource manager
+   AddRef();
+
+   ContinueAsyncLoad(pLoad);
+
+   // May have finished already, from the cache or a failed conversion
+   if (ppPending != NULL)
+   {
+      tAsyncLoads::iterator fl = m_asyncLoads.find(key);
+      *ppPending = (fl != m_asyncLoads.end()) ? fl->second : NULL;
+   }
+
+   return S_OK;
+}
+
+////////////////////////////////////////
+// Tries the load's remaining formats until one is underway on a loader
+// thread or waiting for a dependency, or completes the load as failed
+
+void cResourceManager::ContinueAsyncLoad(sAsyncLoad * pLoad)
+{
+   for (; pLoad->iFormat < pLoad->formatIds.size(); pLoad->iFormat++)
+   {
+      const cResourceFormat * pFormat = m_formats.GetFormat(pLoad->formatIds[pLoad->iFormat]);
+
+      if (pFormat->typeDepend)
+      {
+         cFuture<void *> dependFuture;
+         sAsyncLoad * pDependLoad = NULL;
+         if (BeginAsyncLoad(pLoad->name.c_str(), pFormat->typeDepend, pLoad->loadParam,
+                            &dependFuture, &pDependLoad) == S_OK)
+         {
+            if (pDependLoad != NULL)
+            {
+               pDependLoad->dependents.push_back(pLoad);
+               return;
+            }
+
+            void * pDependData = NULL;
+            if (dependFuture.GetResult(&pDependData) == S_OK)
+            {
+               // Continues with the next format if the conversion fails
+               ConvertAsyncLoad(pLoad, pDependData);
+               return;
+            }
+         }
+      }
+      else
+      {
+         pLoad->format = *pFormat;
+         pLoad->fileNames.clear();
+         GetFileNames(pLoad->name.c_str(), pLoad->type, &pLoad->fileNames);
+         if (!pLoad->fileNames.empty())
+         {
+            cMutexLock lock(&m_loadQueueMutex);
+            lock.Acquire();
+            pLoad->bOnLoader = true;
+            m_loadQueue.push_back(pLoad);
+            m_loadQueueCondition.Signal();
+            return;
+         }
+      }
+   }
+
+   CompleteAsyncLoad(pLoad, NULL, 0);
+}
+
+////////////////////////////////////////
+
+void cResourceManager::ConvertAsyncLoad(sAsyncLoad * pLoad, void * pDependData)
+{
+   const cResourceFormat * pFormat = m_formats.GetFormat(pLoad->formatIds[pLoad->iFormat]);
+   sLoadTimes times;
+   times.start = times.postloadStart = TimeGetSecs();
+   m_loadContext.push_back(pLoad->key);
+   void * pData = (*pFormat->pfnPostload)(pDependData, 0, pLoad->loadParam);
+   m_loadContext.pop_back();
+   times.postload = TimeGetSecs() - times.postloadStart;
+   RecordLoad(pLoad->name.c_str(), pLoad->formatIds[pLoad->iFormat], times, pData != NULL);
+   if (pData != NULL)
+   {
+      CompleteAsyncLoad(pLoad, pData, GetDependencySize(pLoad->key.GetId(), pLoad->formatIds[pLoad->iFormat]));
+   }
+   else
+   {
+      UnlockDependency(pLoad->key.GetId(), pLoad->formatIds[pLoad->iFormat]);
+      pLoad->iFormat++;
+      ContinueAsyncLoad(pLoad);
+   }
+}
+
+////////////////////////////////////////
+// Caches the data (if not NULL), resolves the future, moves on any loads
+// that were waiting for this one and deletes the load
+
+void cResourceManager::CompleteAsyncLoad(sAsyncLoad * pLoad, void * pData, ulong dataSize)
+{
+   m_asyncLoads.erase(pLoad->key);
+
+   if (pData != NULL)
+   {
+      uint formatId = pLoad->formatIds[pLoad->iFormat];
+
+      tResourceCache::iterator f = m_cache.find(pLoad->key);
+      if (f != m_cache.end())
+      {
+         // Loaded synchronously in the meantime; keep the first copy
+         m_formats.GetFormat(formatId)->Unload(pData);
+         UnlockDependency(pLoad->key.GetId(), formatId);
+         pData = f->second.GetData();
+      }
+      else
+      {
+         f = AddToCache(pLoad->key, pData, dataSize, formatId, pLoad->loadParam, pLoad->storeIndex);
+      }
+
+      // Dependents that fail to convert give their locks back below
+      LockEntry(f, pLoad->nLocks);
+
+      LocalMsg2("Finished loading (\"%s\", %s)\n", pLoad->name.c_str(), ResourceTypeName(pLoad->type));
+      pLoad->pState->SetResult(pData);
+   }
+   else
+   {
+      LocalMsg2("Failed to load (\"%s\", %s)\n", pLoad->name.c_str(), ResourceTypeName(pLoad->type));
+      pLoad->pState->SetFailed();
+   }
+
+   vector<sAsyncLoad *>::iterator iter = pLoad->dependents.begin(), end = pLoad->dependents.end();
+   for (; iter != end; ++iter)
+   {
+      if (pData != NULL)
+      {
+         ConvertAsyncLoad(*iter, pData);
+      }
+      else
+      {
+         (*iter)->iFormat++;
+         ContinueAsyncLoad(*iter);
+      }
+   }
+
+   delete pLoad;
+   Release();
+
+   EnforceBudgets();
+}
+
+////////////////////////////////////////
+// Posted back to the requesting thread by a loader thread
+
+void cResourceManager::FinishAsyncLoad(cResourceManager * pResourceManager, sAsyncLoad * pLoad)
+{
+   pLoad->bOnLoader = false;
+
+   if (pLoad->bCancelled)
+   {
+      if (pLoad->pData != NULL && (pLoad->bDerived || pLoad->format.pfnPostload == NULL))
+      {
+         pLoad->format.Unload(pLoad->pData);
+      }
+      delete pLoad;
+      pResourceManager->Release();
+      return;
+   }
+
+   uint formatId = pLoad->formatIds[pLoad->iFormat];
+   void * pData = pLoad->pData;
+   if (pData != NULL)
+   {
+      if (!pLoad->bDerived)
+      {
+         pLoad->times.postloadStart = TimeGetSecs();
+         pResourceManager->m_loadContext.push_back(pLoad->key);
+         pData = pLoad->format.Postload(pData, pLoad->dataSize, pLoad->loadParam);
+         pResourceManager->m_loadContext.pop_back();
+         pLoad->times.postload = TimeGetSecs() - pLoad->times.postloadStart;
+         if (pData != NULL && !pLoad->derivedKey.empty())
+         {
+            pResourceManager->m_derivedCache.Save(pLoad->derivedKey, pLoad->format, pData);
+         }
+      }
+      pLoad->pData = NULL;
+   }
+
+   if (pLoad->times.bOpened)
+   {
+      pResourceManager->RecordLoad(pLoad->name.c_str(), formatId, pLoad->times, pData != NULL);
+   }
+
+   if (pData != NULL)
+   {
+      pResourceManager->CompleteAsyncLoad(pLoad, pData, pLoad->dataSize);
+      return;
+   }
+
+   pLoad->iFormat++;
+   pResourceManager->ContinueAsyncLoad(pLoad);
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::StartLoaderThreads()
+{
+   if (g_pGlobalObjectRegistry != NULL)
+   {
+      m_pThreadCaller = static_cast<IThreadCaller*>(FindGlobalObject(IID_IThreadCaller));
+   }
+
+   if (!m_pThreadCaller)
+   {
+      ErrorMsg("Background resource loading needs the thread caller\n");
+      return E_FAIL;
+   }
+
+   int nThreads = kDefaultLoaderThreads;
+   ConfigGet(_T("resource_loader_threads"), &nThreads);
+   if (nThreads < 1)
+   {
+      nThreads = 1;
+   }
+
+   m_bStopLoaders = false;
+
+   for (int i = 0; i < nThreads; i++)
+   {
+      cLoaderThread * pThread = new cLoaderThread(this);
+      if (pThread == NULL || !pThread->Create())
+      {
+         delete pThread;
+         ErrorMsg1("Error creating resource loader thread %d\n", i);
+         break;
+      }
+      char szName[32];
+      sprintf(szName, "ResourceLoader%d", i);
+      pThread->SetName(szName);
+      m_loaderThreads.push_back(pThread);
+   }
+
+   return m_loaderThreads.empty() ? E_FAIL : S_OK;
+}
+
+////////////////////////////////////////
+
+void cResourceManager::StopLoaderThreads()
+{
+   {
+      cMutexLock lock(&m_loadQueueMutex);
+      lock.Acquire();
+      m_bStopLoaders = true;
+      m_loadQueueCondition.Broadcast();
+   }
+
+   {
+      vector<cLoaderThread *>::iterator iter = m_loaderThreads.begin(), end = m_loaderThreads.end();
+      for (; iter != end; ++iter)
+      {
+         (*iter)->Join();
+         delete *iter;
+      }
+      m_loaderThreads.clear();
+   }
+
+   // Fail every load in progress. Ones that a loader thread finished but
+   // that haven't been received yet are deleted when they are; the rest,
+   // still queued or waiting for a dependency, are deleted here.
+   tAsyncLoads::iterator iter = m_asyncLoads.begin(), end = m_asyncLoads.end();
+   for (; iter != end; ++iter)
+   {
+      sAsyncLoad * pLoad = iter->second;
+      pLoad->bCancelled = true;
+      pLoad->pState->SetFailed();
+      if (!pLoad->bOnLoader || find(m_loadQueue.begin(), m_loadQueue.end(), pLoad) != m_loadQueue.end())
+      {
+         delete pLoad;
+         Release();
+      }
+   }
+   m_asyncLoads.clear();
+   m_loadQueue.clear();
+
+   SafeRelease(m_pThreadCaller);
+}
+
+////////////////////////////////////////
+
+void cResourceManager::RunLoader()
+{
+   for (;;)
+   {
+      sAsyncLoad * pLoad = NULL;
+      {
+         cMutexLock lock(&m_loadQueueMutex);
+         lock.Acquire();
+         while (m_loadQueue.empty() && !m_bStopLoaders)
+         {
+            m_loadQueueCondition.Wait(&m_loadQueueMutex);
+         }
+         if (m_bStopLoaders)
+         {
+            break;
+         }
+         pLoad = m_loadQueue.front();
+         m_loadQueue.pop_front();
+      }
+
+      DoAsyncLoad(pLoad);
+
+      if (m_pThreadCaller->PostCall(pLoad->threadId, &FinishAsyncLoad, this, pLoad) != S_OK)
+      {
+         ErrorMsg1("Unable to finish loading \"%s\"; the requesting thread has gone\n", pLoad->name.c_str());
+      }
+   }
+}
+
+////////////////////////////////////////
+// Runs on a loader thread. Only touches the load, its copy of the format,
+// the stores and the derived data cache.
+
+void cResourceManager::DoAsyncLoad(sAsyncLoad * pLoad)
+{
+   pLoad->pData = NULL;
+   pLoad->dataSize = 0;
+   pLoad->derivedKey.erase();
+   pLoad->bDerived = false;
+   pLoad->storeIndex = kNoIndex;
+   pLoad->times = sLoadTimes();
+   pLoad->times.start = TimeGetSecs();
+
+   vector<cStr>::const_iterator iter = pLoad->fileNames.begin(), end = pLoad->fileNames.end();
+   for (; iter != end; ++iter)
+   {
+      cAutoIPtr<IReader> pReader;
+      if (Open(iter->c_str(), &pReader, &pLoad->storeIndex) == S_OK && !!pReader)
+      {
+         ulong dataSize = 0;
+         if (GetReaderSize(pReader, &dataSize) == S_OK)
+         {
+            double decodeStart = TimeGetSecs();
+            pLoad->times.open = decodeStart - pLoad->times.start;
+            pLoad->times.bytes = dataSize;
+            pLoad->times.bOpened = true;
+            if (pLoad->format.pfnSave != NULL && m_derivedCache.IsEnabled()
+               && cDerivedDataCache::MakeKey(pReader, pLoad->format, pLoad->loadParam, &pLoad->derivedKey) == S_OK)
+            {
+               pLoad->pData = m_derivedCache.Load(pLoad->derivedKey, pLoad->format);
+               pLoad->bDerived = (pLoad->pData != NULL);
+            }
+            if (pLoad->pData == NULL)
+            {
+               pLoad->pData = pLoad->format.Load(pReader);
+            }
+            pLoad->dataSize = dataSize;
+            pLoad->times.decode = TimeGetSecs() - decodeStart;
+         }
+         break;
+      }
+   }
+}
+
+////////////////////////////////////////
+// Waits on the thread that started a background load for it to finish,
+// receiving thread calls meanwhile since that is how loads finish. Moves the
+// load to the front of the queue if no loader thread has taken it yet.
+
+tResult cResourceManager::WaitForAsyncLoad(sAsyncLoad * pLoad, void * * ppData)
+{
+   LocalMsg2("Waiting for background load of (\"%s\", %s)\n", pLoad->name.c_str(), ResourceTypeName(pLoad->type));
+
+   {
+      cMutexLock lock(&m_loadQueueMutex);
+      lock.Acquire();
+      deque<sAsyncLoad *>::iterator f = find(m_loadQueue.begin(), m_loadQueue.end(), pLoad);
+      if (f != m_loadQueue.end())
+      {
+         m_loadQueue.erase(f);
+         m_loadQueue.push_front(pLoad);
+      }
+   }
+
+   // The lock that Load returns with
+   pLoad->nLocks++;
+
+   cFuture<void *> future(pLoad->pState);
+   while (!future.IsDone())
+   {
+      if (m_pThreadCaller->ReceiveCalls(NULL) != S_OK)
+      {
+         ThreadSleep(1);
+      }
+   }
+
+   return future.GetResult(ppData);
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::RecordDependencies(const tChar * pszName, tResourceType type)
+{
+   if (pszName == NULL)
+   {
+      m_pRecordingKeys = NULL;
+      return S_OK;
+   }
+
+   if (!type)
+   {
+      return E_INVALIDARG;
+   }
+
+   tResourceId id;
+   if (GetResourceId(pszName, &id) != S_OK)
+   {
+      return E_FAIL;
+   }
+
+   m_recordingKey = cResourceCacheKey(id, GetTypeIndex(type));
+   m_pRecordingKeys = &m_dependencies[m_recordingKey];
+   return S_OK;
+}
+
+////////////////////////////////////////
+// Records a successful load as a dependency of the innermost resource
+// whose functions are running, or else of the one being recorded
+
+void cResourceManager::RecordDependency(const cResourceCacheKey & key)
+{
+   const cResourceCacheKey * pParent = NULL;
+   tResourceKeys * pKeys = NULL;
+   if (!m_loadContext.empty())
+   {
+      pParent = &m_loadContext.back();
+   }
+   else if (m_pRecordingKeys != NULL)
+   {
+      pParent = &m_recordingKey;
+      pKeys = m_pRecordingKeys;
+   }
+   else
+   {
+      return;
+   }
+
+   // Loading the same name as another type is a conversion
+   if (pParent->GetId() == key.GetId())
+   {
+      return;
+   }
+
+   if (pKeys == NULL)
+   {
+      pKeys = &m_dependencies[*pParent];
+   }
+
+   if (pKeys->find(key) == pKeys->end())
+   {
+      pKeys->insert(key);
+      m_bDependenciesChanged = true;
+   }
+}
+
+////////////////////////////////////////
+// Checks every type of a name because converting one type loads another
+
+bool cResourceManager::HasDependencies(tResourceId id) const
+{
+   tDependencies::const_iterator iter = m_dependencies.lower_bound(cResourceCacheKey(id, 0));
+   for (; iter != m_dependencies.end() && iter->first.GetId() == id; ++iter)
+   {
+      if (!iter->second.empty())
+      {
+         return true;
+      }
+   }
+   return false;
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::Prefetch(const tChar * pszName, tResourceType type)
+{
+   if (pszName == NULL)
+   {
+      return E_POINTER;
+   }
+
+   if (!type)
+   {
+      return E_INVALIDARG;
+   }
+
+   uint nPrefetched = 0;
+
+   cResourceCacheKey key = GetCacheKey(pszName, type);
+   vector<cResourceCacheKey> pending(1, key);
+   tResourceKeys visited;
+   visited.insert(key);
+
+   while (!pending.empty())
+   {
+      tDependencies::const_iterator f = m_dependencies.find(pending.back());
+      pending.pop_back();
+      if (f == m_dependencies.end())
+      {
+         continue;
+      }
+
+      tResourceKeys::const_iterator iter = f->second.begin(), end = f->second.end();
+      for (; iter != end; ++iter)
+      {
+         if (!visited.insert(*iter).second)
+         {
+            continue;
+         }
+
+         if (HasDependencies(iter->GetId()))
+         {
+            pending.push_back(*iter);
+         }
+         else if (PrefetchEntry(*iter) == S_OK)
+         {
+            nPrefetched++;
+         }
+      }
+   }
+
+   LocalMsg3("Prefetching %d dependencies of (\"%s\", %s)\n", nPrefetched, pszName, ResourceTypeName(type));
+
+   return (nPrefetched > 0) ? S_OK : S_FALSE;
+}
+
+////////////////////////////////////////
+// Starts loading one resource in the background without locking it
+
+tResult cResourceManager::PrefetchEntry(const cResourceCacheKey & key)
+{
+   if (m_cache.find(key) != m_cache.end() || m_asyncLoads.find(key) != m_asyncLoads.end())
+   {
+      return S_FALSE;
+   }
+
+   // Only a registered format's type is sure to outlive the load, and
+   // types read from a manifest may have no format at all
+   tResourceType type = m_formats.FindType(m_cacheTypes[key.GetTypeIndex()].name.c_str());
+   tResourceNames::const_iterator fn = m_resourceNames.find(key.GetId());
+   if (!type || fn == m_resourceNames.end())
+   {
+      return S_FALSE;
+   }
+
+   if (!m_formats.IsThreadSafeLoad(fn->second.c_str(), type))
+   {
+      LocalMsg2("Not prefetching (\"%s\", %s) since its format isn't thread-safe\n",
+         fn->second.c_str(), ResourceTypeName(type));
+      return S_FALSE;
+   }
+
+   cFuture<void *> future;
+   sAsyncLoad * pPending = NULL;
+   tResult result = BeginAsyncLoad(fn->second.c_str(), type, NULL, &future, &pPending);
+   if (result != S_OK)
+   {
+      return result;
+   }
+
+   ReleaseLoadLock(key, pPending);
+   return S_OK;
+}
+
+////////////////////////////////////////
+// The manifest is text. Each resource that loaded anything is on a line of
+// its own, followed by what it loaded on lines indented by a tab. Names and
+// types are separated by a tab too.
+
+tResult cResourceManager::LoadManifest(const tChar * pszFile)
+{
+   if (pszFile == NULL)
+   {
+      return E_POINTER;
+   }
+
+   cAutoIPtr<IReader> pReader;
+   if (FileReaderCreate(cFileSpec(pszFile), kFileModeText, &pReader) != S_OK)
+   {
+      return E_FAIL;
+   }
+
+   uint nDependencies = 0;
+
+   cResourceCacheKey parent;
+   bool bHaveParent = false;
+
+   tResult result = S_OK;
+   while (result == S_OK)
+   {
+      cStr line;
+      result = pReader->ReadLine(&line);
+      if (FAILED(result))
+      {
+         ErrorMsg1("Error reading resource manifest \"%s\"\n", pszFile);
+         return result;
+      }
+
+      if (line.empty() || line[0] == _T('#'))
+      {
+         continue;
+      }
+
+      cResourceCacheKey key;
+      bool bDependency = (line[0] == _T('\t'));
+      if (GetManifestKey(line.c_str() + (bDependency ? 1 : 0), &key) != S_OK)
+      {
+         WarnMsg1("Bad resource manifest entry \"%s\"\n", line.c_str());
+         continue;
+      }
+
+      if (!bDependency)
+      {
+         parent = key;
+         bHaveParent = true;
+      }
+      else if (bHaveParent && parent.GetId() != key.GetId())
+      {
+         if (m_dependencies[parent].insert(key).second)
+         {
+            nDependencies++;
+         }
+      }
+   }
+
+   LocalMsg2("Read %d dependencies from resource manifest \"%s\"\n", nDependencies, pszFile);
+
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::GetManifestKey(const tChar * pszEntry, cResourceCacheKey * pKey)
+{
+   const tChar * pszTab = _tcschr(pszEntry, _T('\t'));
+   if (pszTab == NULL || pszTab == pszEntry || *(pszTab + 1) == 0)
+   {
+      return E_FAIL;
+   }
+
+   tResourceId id;
+   if (GetResourceId(cStr(pszEntry, pszTab - pszEntry).c_str(), &id) != S_OK)
+   {
+      return E_FAIL;
+   }
+
+   // The type string is only borrowed, so don't let the cache keep it
+   tResourceType type = pszTab + 1;
+   uint typeIndex = FindTypeIndex(type);
+   if (typeIndex == kNoIndex)
+   {
+      typeIndex = GetTypeIndex(type);
+      m_cacheTypes[typeIndex].pType = NULL;
+   }
+
+   *pKey = cResourceCacheKey(id, typeIndex);
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::SaveManifest(const tChar * pszFile) const
+{
+   if (pszFile == NULL)
+   {
+      return E_POINTER;
+   }
+
+   cAutoIPtr<IWriter> pWriter;
+   if (FileWriterCreate(cFileSpec(pszFile), kFileModeText, &pWriter) != S_OK)
+   {
+      return E_FAIL;
+   }
+
+   cStr text(_T("# Resource dependencies, saved by the resource manager\n"));
+
+   tDependencies::const_iterator iter = m_dependencies.begin(), end = m_dependencies.end();
+   for (; iter != end; ++iter)
+   {
+      if (iter->second.empty())
+      {
+         continue;
+      }
+
+      AppendManifestEntry(iter->first, &text);
+
+      tResourceKeys::const_iterator depIter = iter->second.begin(), depEnd = iter->second.end();
+      for (; depIter != depEnd; ++depIter)
+      {
+         text += _T('\t');
+         AppendManifestEntry(*depIter, &text);
+      }
+   }
+
+   return pWriter->Write(text.c_str(), text.length() * sizeof(cStr::value_type));
+}
+
+////////////////////////////////////////
+
+void cResourceManager::AppendManifestEntry(const cResourceCacheKey & key, cStr * pText) const
+{
+   *pText += GetResourceName(key.GetId());
+   *pText += _T('\t');
+   *pText += m_cacheTypes[key.GetTypeIndex()].name;
+   *pText += _T('\n');
+}
+
+////////////////////////////////////////
+
+void cResourceManager::StartMonitoring(IResourceStore * pStore)
+{
+   cAutoIPtr<IResourceStoreMonitor> pMonitor;
+   if (pStore->QueryInterface(IID_IResourceStoreMonitor, (void**)&pMonitor) == S_OK)
+   {
+      tResult result = pMonitor->StartMonitoring();
+      WarnMsgIf(FAILED(result) && result != E_NOTIMPL, "Changes to a resource store will not be reloaded\n");
+   }
+}
+
+////////////////////////////////////////
+// Called once a frame when hot reload is on. Collecting the changes once a
+// frame means that a file written several times over, or a batch of files
+// written together, is reloaded only once.
+
+void cResourceManager::ReloadChangedResources()
+{
+   typedef map<uint, set<cStr, cStrLessNoCase> > tChangedFiles;
+   tChangedFiles changedFiles;
+   {
+      cMutexLock lock(&m_storesMutex);
+      lock.Acquire();
+      IndexNewStores();
+      for (uint i = 0; i < m_stores.size(); i++)
+      {
+         cAutoIPtr<IResourceStoreMonitor> pMonitor;
+         if (m_stores[i]->QueryInterface(IID_IResourceStoreMonitor, (void**)&pMonitor) == S_OK)
+         {
+            vector<cStr> changedNames;
+            pMonitor->CollectChangedNames(&changedNames);
+            if (!changedNames.empty())
+            {
+               changedFiles[i].insert(changedNames.begin(), changedNames.end());
+            }
+
+            // Changes include new files, which Open must now find
+            for (size_t j = 0; j < changedNames.size(); j++)
+            {
+               IndexEntry(changedNames[j].c_str(), i);
+               if (m_openMisses.erase(ResourceIdFromNameNoCase(changedNames[j].c_str())) > 0)
+               {
+                  m_storeIndexVersion++;
+               }
+            }
+         }
+      }
+   }
+
+   if (changedFiles.empty())
+   {
+      return;
+   }
+
+   // Converted resources are reloaded along with what they were converted
+   // from, so only entries loaded straight from files are matched, and only
+   // against the changes in the store each was read from. Directory stores
+   // report bare file names, as they drop any path from the names they open.
+   vector< pair<cResourceCacheKey, cStr> > changedEntries;
+   tResourceCache::iterator iter = m_cache.begin(), end = m_cache.end();
+   for (; iter != end; ++iter)
+   {
+      const cResourceFormat * pFormat = m_formats.GetFormat(iter->second.GetFormatId());
+      if (pFormat->typeDepend)
+      {
+         continue;
+      }
+
+      tChangedFiles::const_iterator storeChanges = changedFiles.find(iter->second.GetStoreIndex());
+      if (storeChanges == changedFiles.end())
+      {
+         continue;
+      }
+
+      cFileSpec file(GetResourceName(iter->first.GetId()));
+      if (_tcslen(file.GetFileExt()) == 0 && pFormat->extensionId != kNoIndex)
+      {
+         file.SetFileExt(m_formats.GetExtension(pFormat->extensionId));
+      }
+
+      if (storeChanges->second.find(file.CStr()) != storeChanges->second.end()
+         || storeChanges->second.find(file.GetFileName()) != storeChanges->second.end())
+      {
+         changedEntries.push_back(make_pair(iter->first, cStr(file.CStr())));
+      }
+   }
+
+   vector< pair<cResourceCacheKey, cStr> >::const_iterator entryIter = changedEntries.begin();
+   for (; entryIter != changedEntries.end(); ++entryIter)
+   {
+      ReloadEntry(entryIter->first, entryIter->second.c_str());
+   }
+
+   EnforceBudgets();
+}
+
+////////////////////////////////////////
+// Loads the changed file into a locked entry, and converts it again for
+// any entries converted from it, before swapping anything in. If any step
+// fails the entries keep their data; a file caught half written will be
+// reported as changed again once finished.
+
+tResult cResourceManager::ReloadEntry(const cResourceCacheKey & key, const tChar * pszFile)
+{
+   tResourceCache::iterator f = m_cache.find(key);
+   if (f == m_cache.end())
+   {
+      return E_FAIL;
+   }
+
+   const tChar * pszName = GetResourceName(key.GetId());
+
+   if (f->second.GetLockCount() == 0)
+   {
+      LocalMsg1("Dropping changed resource \"%s\" from the cache\n", pszName);
+      Unload(f);
+      RemoveFromCache(f);
+      return S_FALSE;
+   }
+
+   uint formatId = f->second.GetFormatId();
+   void * pData = NULL;
+   ulong dataSize = 0;
+   cAutoIPtr<IResourceStore> pStore;
+   {
+      cMutexLock lock(&m_storesMutex);
+      lock.Acquire();
+      uint storeIndex = f->second.GetStoreIndex();
+      if (storeIndex < m_stores.size())
+      {
+         pStore = CTAddRef(m_stores[storeIndex]);
+      }
+   }
+
+   // Read from the store that changed, which need not be the first to have
+   // the name, and loaded the way it was the first time
+   cAutoIPtr<IReader> pReader;
+   if (!pStore
+      || pStore->OpenEntry(pszFile, &pReader) != S_OK
+      || GetReaderSize(pReader, &dataSize) != S_OK
+      || DoLoadFromReader(pReader, m_formats.GetFormat(formatId), dataSize, f->second.GetLoadParam(),
+                          &pData, NULL) != S_OK)
+   {
+      WarnMsg1("Unable to reload \"%s\"\n", pszName);
+      return E_FAIL;
+   }
+
+   // The postload function may have loaded other resources, which can
+   // rehash the cache or evict, so the entry is looked up again
+   f = m_cache.find(key);
+   if (f == m_cache.end())
+   {
+      m_formats.GetFormat(formatId)->Unload(pData);
+      return E_FAIL;
+   }
+
+   tReloads reloads;
+   sReload reload = { key, formatId, f->second.GetData(), pData, dataSize };
+   reloads.push_back(reload);
+
+   if (ReconvertDependents(key.GetId(), key.GetTypeIndex(), pData, dataSize, &reloads) != S_OK)
+   {
+      WarnMsg1("Unable to reload \"%s\" because a conversion from it failed\n", pszName);
+      tReloads::reverse_iterator riter = reloads.rbegin();
+      for (; riter != reloads.rend(); ++riter)
+      {
+         m_formats.GetFormat(riter->formatId)->Unload(riter->pNewData);
+      }
+      return E_FAIL;
+   }
+
+   tReloads::iterator iter = reloads.begin(), end = reloads.end();
+   for (; iter != end; ++iter)
+   {
+      tResourceCache::iterator fr = m_cache.find(iter->key);
+      if (fr == m_cache.end())
+      {
+         // Evicted by a load during a conversion, and its old data with it,
+         // so only the new data is left to unload
+         iter->pOldData = iter->pNewData;
+         iter->pNewData = NULL;
+         continue;
+      }
+      ReplaceData(fr, iter->pNewData, iter->dataSize);
+   }
+
+   for (iter = reloads.begin(); iter != end; ++iter)
+   {
+      if (iter->pNewData == NULL)
+      {
+         continue;
+      }
+      tResourceType type = m_cacheTypes[iter->key.GetTypeIndex()].pType;
+      LocalMsg2("Reloaded \"%s\" (%s)\n", pszName, ResourceTypeName(type));
+      ForEachConnection(bind(&IResourceListener::OnResourceReloaded, _1, pszName, type, iter->pOldData, iter->pNewData));
+   }
+
+   // Converted data may share memory with what it was converted from, so it
+   // goes first
+   tReloads::reverse_iterator riter = reloads.rbegin();
+   for (; riter != reloads.rend(); ++riter)
+   {
+      RetireData(m_cache.find(riter->key), riter->formatId, riter->pOldData);
+   }
+
+   return S_OK;
 }
 
 ////////////////////////////////////////
+// Unloads data that a reload replaced, unless the entry is locked, in which
+// case whoever holds the lock may still be using the old data
 
-void cResourceManager::UnloadAll()
+void cResourceManager::RetireData(tResourceCache::iterator iter, uint formatId, void * pOldData)
 {
-   tResourceCache::iterator iter = m_cache.begin(), end = m_cache.end();
-   for (; iter != end; ++iter)
+   if (iter == m_cache.end() || iter->second.GetLockCount() == 0)
    {
-      Unload(iter);
+      m_formats.GetFormat(formatId)->Unload(pOldData);
+      return;
    }
-   m_cache.clear();
+
+   sRetiredData retired = { iter->first, formatId, pOldData };
+   m_retiredData.push_back(retired);
+}
+
+////////////////////////////////////////
+
+void cResourceManager::UnloadRetiredData(const cResourceCacheKey & key)
+{
+   tRetiredData::iterator iter = m_retiredData.begin();
+   while (iter != m_retiredData.end())
+   {
+      if (iter->key == key)
+      {
+         LocalMsg1("Unloading data replaced by a reload of \"%s\"\n", GetResourceName(key.GetId()));
+         m_formats.GetFormat(iter->formatId)->Unload(iter->pData);
+         iter = m_retiredData.erase(iter);
+      }
+      else
+      {
+         ++iter;
+      }
+   }
+}
+
+////////////////////////////////////////
+// Converts reloaded data again for each cached type converted from its type
+
+tResult cResourceManager::ReconvertDependents(tResourceId id, uint typeIndex, void * pData, ulong dataSize,
+                                              tReloads * pReloads)
+{
+   tResourceType type = m_cacheTypes[typeIndex].pType;
+   for (uint i = 0; i < m_cacheTypes.size(); i++)
+   {
+      tResourceCache::iterator f = m_cache.find(cResourceCacheKey(id, i));
+      if (f == m_cache.end())
+      {
+         continue;
+      }
+
+      uint formatId = f->second.GetFormatId();
+      const cResourceFormat * pFormat = m_formats.GetFormat(formatId);
+      if (!pFormat->typeDepend || !SameType(pFormat->typeDepend, type))
+      {
+         continue;
+      }
+
+      // The postload function may load other resources, so nothing is read
+      // from the entry after it
+      sReload reload = { f->first, formatId, f->second.GetData(), NULL, dataSize };
+      reload.pNewData = (*pFormat->pfnPostload)(pData, 0, f->second.GetLoadParam());
+      if (reload.pNewData == NULL)
+      {
+         return E_FAIL;
+      }
+
+      pReloads->push_back(reload);
+
+      if (ReconvertDependents(id, i, reload.pNewData, dataSize, pReloads) != S_OK)
+      {
+         return E_FAIL;
+      }
+   }
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+void cResourceManager::ReplaceData(tResourceCache::iterator iter, void * pData, ulong dataSize)
+{
+   ulong oldSize = iter->second.GetDataSize();
+
+   sResourceCacheStats & typeStats = AccessTypeStats(iter->first.GetTypeIndex());
+   typeStats.bytes = typeStats.bytes - oldSize + dataSize;
+   m_totalStats.bytes = m_totalStats.bytes - oldSize + dataSize;
+
+   if (iter->second.GetLockCount() > 0)
+   {
+      typeStats.lockedBytes = typeStats.lockedBytes - oldSize + dataSize;
+      m_totalStats.lockedBytes = m_totalStats.lockedBytes - oldSize + dataSize;
+   }
+
+   iter->second.SetData(pData, dataSize);
+}
+
+////////////////////////////////////////
+
+cResourceManager::cReloadTask::cReloadTask(cResourceManager * pOuter)
+ : m_pOuter(pOuter)
+{
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::cReloadTask::Execute(double time)
+{
+   m_pOuter->ReloadChangedResources();
+   return S_OK;
 }
 
 ////////////////////////////////////////
@@ -381,6 +2424,43 @@ tResult cResourceManager::RegisterFormat(tResourceType type,
 
 ////////////////////////////////////////
 
+tResult cResourceManager::RegisterDerivedData(tResourceType type, const tChar * pszExtension, uint version,
+                                              tResourceSave pfnSave, tResourceLoad pfnLoadSaved)
+{
+   return m_formats.RegisterDerivedData(type, pszExtension, version, pfnSave, pfnLoadSaved);
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::RegisterThreadSafeLoad(tResourceType type, const tChar * pszExtension)
+{
+   return m_formats.RegisterThreadSafeLoad(type, pszExtension);
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::AddResourceListener(IResourceListener * pListener)
+{
+   if (pListener == NULL)
+   {
+      return E_POINTER;
+   }
+   return cConnectionPoint<IResourceManager, IResourceListener>::Connect(pListener);
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::RemoveResourceListener(IResourceListener * pListener)
+{
+   if (pListener == NULL)
+   {
+      return E_POINTER;
+   }
+   return cConnectionPoint<IResourceManager, IResourceListener>::Disconnect(pListener);
+}
+
+////////////////////////////////////////
+
 tResult cResourceManager::ListResources(const tChar * pszMatch, vector<cStr> * pNames) const
 {
    if (pszMatch == NULL || pNames == NULL)
@@ -412,25 +2492,33 @@ void cResourceManager::DumpFormats() const
 
 void cResourceManager::DumpCache() const
 {
-   LogMsgNoFL1(kInfo, _T("%d resource cache entries\n"), m_cache.size());
+   LogMsgNoFL3(kInfo, _T("%d resource cache entries, %d bytes (%d locked)\n"),
+      m_cache.size(), m_totalStats.bytes, m_totalStats.lockedBytes);
    static const int kNameWidth = -30;
    static const int kExtWidth = -5;
    static const int kTypeWidth = -20;
-   static const tChar kRowFormat[] = _T("%*s | %*s | %*s\n");
+   static const int kSizeWidth = 10;
+   static const int kLocksWidth = 5;
+   static const tChar kRowFormat[] = _T("%*s | %*s | %*s | %*s | %*s\n");
+   static const tChar kDataRowFormat[] = _T("%*s | %*s | %*s | %*lu | %*lu\n");
    techlog.Print(NULL, 0, kInfo, kRowFormat,
                  kNameWidth, _T("Name"),
                  kExtWidth, _T("Ext"),
-                 kTypeWidth, _T("Type"));
-   LogMsgNoFL(kInfo, _T("----------------------------------------------------------------------\n"));
+                 kTypeWidth, _T("Type"),
+                 kSizeWidth, _T("Bytes"),
+                 kLocksWidth, _T("Locks"));
+   LogMsgNoFL(kInfo, _T("------------------------------------------------------------------------------------\n"));
    tResourceCache::const_iterator iter = m_cache.begin();
    for (uint index = 0; iter != m_cache.end(); iter++, index++)
    {
       const cResourceFormat * pFormat = (iter->second.GetFormatId() != kNoIndex)
          ? m_formats.GetFormat(iter->second.GetFormatId()) : NULL;
-      techlog.Print(NULL, 0, kInfo, kRowFormat,
-         kNameWidth, iter->first.GetName(),
+      techlog.Print(NULL, 0, kInfo, kDataRowFormat,
+         kNameWidth, GetResourceName(iter->first.GetId()),
          kExtWidth, _T("None"),
-         kTypeWidth, pFormat ? ResourceTypeName(pFormat->type) : _T("Undetermined"));
+         kTypeWidth, pFormat ? ResourceTypeName(pFormat->type) : _T("Undetermined"),
+         kSizeWidth, iter->second.GetDataSize(),
+         kLocksWidth, iter->second.GetLockCount());
    }
 }
 
@@ -443,6 +2531,293 @@ size_t cResourceManager::GetCacheSize() const
 
 ////////////////////////////////////////
 
+tResult cResourceManager::GetCacheStats(tResourceType type, sResourceCacheStats * pStats) const
+{
+   if (pStats == NULL)
+   {
+      return E_POINTER;
+   }
+
+   if (!type)
+   {
+      *pStats = m_totalStats;
+      return S_OK;
+   }
+
+   uint typeIndex = FindTypeIndex(type);
+   if (typeIndex == kNoIndex)
+   {
+      memset(pStats, 0, sizeof(*pStats));
+      return S_FALSE;
+   }
+
+   *pStats = m_cacheTypes[typeIndex].stats;
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cResourceManager::GetLoadStats(tResourceType type, sResourceLoadStats * pStats) const
+{
+   if (pStats == NULL)
+   {
+      return E_POINTER;
+   }
+
+   if (!type)
+   {
+      *pStats = m_totalLoadStats;
+      return S_OK;
+   }
+
+   memset(pStats, 0, sizeof(*pStats));
+   for (uint i = 0; i < m_formatLoadStats.size(); i++)
+   {
+      if (!SameType(m_formats.GetFormat(i)->type, type))
+      {
+         continue;
+      }
+      const sResourceLoadStats & formatStats = m_formatLoadStats[i];
+      pStats->nLoads += formatStats.nLoads;
+      pStats->nFailures += formatStats.nFailures;
+      pStats->bytes += formatStats.bytes;
+      pStats->openTime += formatStats.openTime;
+      pStats->decodeTime += formatStats.decodeTime;
+      pStats->postloadTime += formatStats.postloadTime;
+      pStats->maxLoadTime = Max(pStats->maxLoadTime, formatStats.maxLoadTime);
+   }
+
+   return (pStats->nLoads > 0) ? S_OK : S_FALSE;
+}
+
+////////////////////////////////////////
+
+static double LoadTimeMillis(double seconds)
+{
+   return seconds * 1000;
+}
+
+void cResourceManager::DumpLoadStats() const
+{
+   LogMsgNoFL4(kInfo, _T("%d resource loads (%d failed), %d bytes, %f ms\n"),
+      m_totalLoadStats.nLoads, m_totalLoadStats.nFailures, m_totalLoadStats.bytes,
+      LoadTimeMillis(m_totalLoadStats.openTime + m_totalLoadStats.decodeTime + m_totalLoadStats.postloadTime));
+   static const int kTypeWidth = -20;
+   static const int kExtWidth = -5;
+   static const int kCountWidth = 6;
+   static const int kSizeWidth = 10;
+   static const int kTimeWidth = 10;
+   static const tChar kRowFormat[] = _T("%*s | %*s | %*s | %*s | %*s | %*s | %*s | %*s | %*s\n");
+   static const tChar kDataRowFormat[] = _T("%*s | %*s | %*lu | %*lu | %*lu | %*.2f | %*.2f | %*.2f | %*.2f\n");
+   techlog.Print(NULL, 0, kInfo, kRowFormat,
+                 kTypeWidth, _T("Type"),
+                 kExtWidth, _T("Ext"),
+                 kCountWidth, _T("Loads"),
+                 kCountWidth, _T("Failed"),
+                 kSizeWidth, _T("Bytes"),
+                 kTimeWidth, _T("Open ms"),
+                 kTimeWidth, _T("Decode ms"),
+                 kTimeWidth, _T("Post ms"),
+                 kTimeWidth, _T("Max ms"));
+   LogMsgNoFL(kInfo, _T("--------------------------------------------------------------------------------------------------------\n"));
+   for (uint i = 0; i < m_formatLoadStats.size(); i++)
+   {
+      const sResourceLoadStats & stats = m_formatLoadStats[i];
+      if (stats.nLoads == 0)
+      {
+         continue;
+      }
+      const cResourceFormat * pFormat = m_formats.GetFormat(i);
+      techlog.Print(NULL, 0, kInfo, kDataRowFormat,
+         kTypeWidth, ResourceTypeName(pFormat->type),
+         kExtWidth, (pFormat->extensionId != kNoIndex) ? m_formats.GetExtension(pFormat->extensionId) : _T(""),
+         kCountWidth, stats.nLoads,
+         kCountWidth, stats.nFailures,
+         kSizeWidth, static_cast<ulong>(stats.bytes),
+         kTimeWidth, LoadTimeMillis(stats.openTime),
+         kTimeWidth, LoadTimeMillis(stats.decodeTime),
+         kTimeWidth, LoadTimeMillis(stats.postloadTime),
+         kTimeWidth, LoadTimeMillis(stats.maxLoadTime));
+   }
+
+   if (m_loadTrace.empty())
+   {
+      return;
+   }
+
+   vector<pair<double, size_t> > slowest;
+   for (size_t i = 0; i < m_loadTrace.size(); i++)
+   {
+      const sLoadTimes & times = m_loadTrace[i].times;
+      slowest.push_back(make_pair(times.open + times.decode + times.postload, i));
+   }
+   size_t nDumped = Min(kSlowestLoadsDumped, slowest.size());
+   partial_sort(slowest.begin(), slowest.begin() + nDumped, slowest.end(), greater<pair<double, size_t> >());
+
+   LogMsgNoFL1(kInfo, _T("Slowest %d resource loads:\n"), nDumped);
+   for (size_t i = 0; i < nDumped; i++)
+   {
+      const sLoadTraceEntry & entry = m_loadTrace[slowest[i].second];
+      LogMsgNoFL3(kInfo, _T("   %10.2f ms  %s (%s)\n"), LoadTimeMillis(slowest[i].first),
+         entry.name.c_str(), ResourceTypeName(m_formats.GetFormat(entry.formatId)->type));
+   }
+}
+
+////////////////////////////////////////
+
+void cResourceManager::ResetLoadStats()
+{
+   m_formatLoadStats.clear();
+   memset(&m_totalLoadStats, 0, sizeof(m_totalLoadStats));
+   m_loadTrace.clear();
+}
+
+////////////////////////////////////////
+
+void cResourceManager::EnableLoadTrace(bool bEnable)
+{
+   m_bTraceLoads = bEnable;
+}
+
+////////////////////////////////////////
+
+static void AppendJsonString(const tChar * psz, cStr * pText)
+{
+   *pText += _T('"');
+   for (; *psz != 0; psz++)
+   {
+      if (*psz == _T('"') || *psz == _T('\\'))
+      {
+         *pText += _T('\\');
+      }
+      *pText += (*psz < _T(' ')) ? _T(' ') : *psz;
+   }
+   *pText += _T('"');
+}
+
+tResult cResourceManager::ExportLoadTrace(const tChar * pszFile) const
+{
+   if (pszFile == NULL)
+   {
+      return E_POINTER;
+   }
+
+   cAutoIPtr<IWriter> pWriter;
+   if (FileWriterCreate(cFileSpec(pszFile), kFileModeText, &pWriter) != S_OK)
+   {
+      return E_FAIL;
+   }
+
+   // Times are in microseconds from the first load, and threads are
+   // numbered in the order they show up
+   double base = 0;
+   for (size_t i = 0; i < m_loadTrace.size(); i++)
+   {
+      base = (i == 0) ? m_loadTrace[i].times.start : Min(base, m_loadTrace[i].times.start);
+   }
+   vector<tThreadId> threadIds;
+   bool bFirstEvent = true;
+
+   cStr text(_T("{\"traceEvents\":[\n"));
+   for (size_t i = 0; i < m_loadTrace.size(); i++)
+   {
+      const sLoadTraceEntry & entry = m_loadTrace[i];
+      const sLoadTimes & times = entry.times;
+      const cResourceFormat * pFormat = m_formats.GetFormat(entry.formatId);
+
+      for (int phase = 0; phase < 2; phase++)
+      {
+         // Conversions only have a postload
+         bool bRead = (phase == 0);
+         if (bRead ? !times.bOpened : (times.bOpened && times.postload <= 0))
+         {
+            continue;
+         }
+
+         tThreadId threadId = bRead ? times.readThreadId : entry.finishThreadId;
+         size_t tid = find(threadIds.begin(), threadIds.end(), threadId) - threadIds.begin();
+         if (tid == threadIds.size())
+         {
+            threadIds.push_back(threadId);
+         }
+
+         tChar szEvent[256];
+         if (bRead)
+         {
+            _sntprintf(szEvent, _countof(szEvent),
+               _T(",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.1f,\"dur\":%.1f,")
+               _T("\"args\":{\"bytes\":%lu,\"open_us\":%.1f,\"decode_us\":%.1f,\"succeeded\":%s}}"),
+               static_cast<int>(tid), (times.start - base) * 1e6, (times.open + times.decode) * 1e6,
+               times.bytes, times.open * 1e6, times.decode * 1e6, entry.bSucceeded ? _T("true") : _T("false"));
+         }
+         else
+         {
+            _sntprintf(szEvent, _countof(szEvent),
+               _T(",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.1f,\"dur\":%.1f,")
+               _T("\"args\":{\"postload\":true,\"succeeded\":%s}}"),
+               static_cast<int>(tid), (times.postloadStart - base) * 1e6, times.postload * 1e6,
+               entry.bSucceeded ? _T("true") : _T("false"));
+         }
+         szEvent[_countof(szEvent) - 1] = 0;
+
+         text += bFirstEvent ? _T("{\"name\":") : _T(",\n{\"name\":");
+         bFirstEvent = false;
+         AppendJsonString(entry.name.c_str(), &text);
+         text += _T(",\"cat\":");
+         AppendJsonString(ResourceTypeName(pFormat->type), &text);
+         text += szEvent;
+      }
+   }
+   text += _T("\n]}\n");
+
+   return pWriter->Write(text.c_str(), text.length() * sizeof(cStr::value_type));
+}
+
+////////////////////////////////////////
+// Called on the thread that finishes loads, as everything but reading
+// files is
+
+void cResourceManager::RecordLoad(const tChar * pszName, uint formatId, const sLoadTimes & times, bool bSucceeded)
+{
+   if (formatId >= m_formatLoadStats.size())
+   {
+      sResourceLoadStats noLoads;
+      memset(&noLoads, 0, sizeof(noLoads));
+      m_formatLoadStats.resize(formatId + 1, noLoads);
+   }
+
+   double loadTime = times.open + times.decode + times.postload;
+   LocalMsg3("Loaded \"%s\" in %f ms (%d bytes)\n", pszName, LoadTimeMillis(loadTime), times.bytes);
+
+   sResourceLoadStats * stats[] = { &m_formatLoadStats[formatId], &m_totalLoadStats };
+   for (int i = 0; i < _countof(stats); i++)
+   {
+      stats[i]->nLoads++;
+      if (!bSucceeded)
+      {
+         stats[i]->nFailures++;
+      }
+      stats[i]->bytes += times.bytes;
+      stats[i]->openTime += times.open;
+      stats[i]->decodeTime += times.decode;
+      stats[i]->postloadTime += times.postload;
+      stats[i]->maxLoadTime = Max(stats[i]->maxLoadTime, loadTime);
+   }
+
+   if (m_bTraceLoads)
+   {
+      sLoadTraceEntry entry;
+      entry.name = pszName;
+      entry.formatId = formatId;
+      entry.finishThreadId = ThreadGetCurrentId();
+      entry.times = times;
+      entry.bSucceeded = bSucceeded;
+      m_loadTrace.push_back(entry);
+   }
+}
+
+////////////////////////////////////////
+
 void DumpLoadedResources()
 {
    cAutoIPtr<IResourceManagerDiagnostics> pResMgrDiag;
@@ -468,21 +2843,49 @@ void DumpResourceFormats()
 ////////////////////////////////////////
 
 tResult cResourceManager::DoLoadFromReader(IReader * pReader, const cResourceFormat * pFormat, ulong dataSize,
-                                           void * loadParam, void * * ppData)
+                                           void * loadParam, void * * ppData, sLoadTimes * pTimes)
 {
    if (pReader == NULL || ppData == NULL)
    {
       return E_POINTER;
    }
 
+   sLoadTimes times;
+   if (pTimes == NULL)
+   {
+      pTimes = &times;
+   }
+
+   double decodeStart = TimeGetSecs();
+
+   cStr derivedKey;
+   if (pFormat->pfnSave != NULL && m_derivedCache.IsEnabled()
+      && cDerivedDataCache::MakeKey(pReader, *pFormat, loadParam, &derivedKey) == S_OK)
+   {
+      void * pData = m_derivedCache.Load(derivedKey, *pFormat);
+      if (pData != NULL)
+      {
+         pTimes->decode = TimeGetSecs() - decodeStart;
+         *ppData = pData;
+         return S_OK;
+      }
+   }
+
    void * pData = pFormat->Load(pReader);
+   pTimes->postloadStart = TimeGetSecs();
+   pTimes->decode = pTimes->postloadStart - decodeStart;
    if (pData != NULL)
    {
       // Assume the postload function cleans up pData or passes
       // it through (or returns NULL)
       pData = pFormat->Postload(pData, dataSize, loadParam);
+      pTimes->postload = TimeGetSecs() - pTimes->postloadStart;
       if (pData != NULL)
       {
+         if (!derivedKey.empty())
+         {
+            m_derivedCache.Save(derivedKey, *pFormat, pData);
+         }
          *ppData = pData;
          return S_OK;
       }
@@ -4,11 +4,20 @@
 #ifndef INCLUDED_RESOURCEMANAGER_H
 #define INCLUDED_RESOURCEMANAGER_H
 
+#include "derivedcache.h"
 #include "resourceformat.h"
 #include "resourceutils.h"
 
 #include "tech/resourceapi.h"
+#include "tech/connptimpl.h"
 #include "tech/globalobjdef.h"
+#include "tech/schedulerapi.h"
+#include "tech/hashtable.h"
+#include "tech/thread.h"
+
+#include <deque>
+#include <map>
+#include <set>
 
 #ifdef _MSC_VER
 #pragma once
@@ -22,20 +31,24 @@ F_DECLARE_INTERFACE(IResourceStore);
 // CLASS: cResourceManager
 //
 
-class cResourceManager : public cComObject3<IMPLEMENTS(IResourceManager),
+class cResourceManager : public cComObject3<IMPLEMENTSCP(IResourceManager, IResourceListener),
                                             IMPLEMENTS(IGlobalObject),
                                             IMPLEMENTS(IResourceManagerDiagnostics)>
 {
    friend class cResourceManagerTests;
 
-   typedef std::map<cResourceCacheKey, cResourceData> tResourceCache;
+   typedef cHashTable<cResourceCacheKey, cResourceData, cResourceCacheKey> tResourceCache;
+
+   struct sAsyncLoad;
+   class cLoaderThread;
+   friend class cLoaderThread;
 
 public:
    cResourceManager();
    virtual ~cResourceManager();
 
    DECLARE_NAME_STRING(kResourceManagerName)
-   DECLARE_NO_CONSTRAINTS()
+   DECLARE_CONSTRAINTS()
 
    virtual tResult Init();
    virtual tResult Term();
@@ -48,6 +61,16 @@ public:
    tResult LoadWithFormat(const tChar * pszName, tResourceType type, uint formatId, void * param, void * * ppData);
    virtual tResult Unload(const tChar * pszName, tResourceType type);
    tResult Unload(tResourceCache::iterator iter);
+   virtual tResult GetResourceId(const tChar * pszName, tResourceId * pId);
+   virtual tResult Load(tResourceId id, tResourceType type, void * loadParam, void * * ppData);
+   virtual tResult Unlock(const tChar * pszName, tResourceType type);
+   virtual tResult Unlock(tResourceId id, tResourceType type);
+   virtual tResult SetMemoryBudget(tResourceType type, size_t budget);
+   virtual tResult LoadAsync(const tChar * pszName, tResourceType type, void * loadParam, cFuture<void *> * pFuture);
+   virtual tResult RecordDependencies(const tChar * pszName, tResourceType type);
+   virtual tResult Prefetch(const tChar * pszName, tResourceType type);
+   virtual tResult LoadManifest(const tChar * pszFile);
+   virtual tResult SaveManifest(const tChar * pszFile) const;
    void UnloadAll();
    virtual tResult RegisterFormat(tResourceType type,
                                   tResourceType typeDepend,
@@ -56,23 +79,219 @@ public:
                                   tResourcePostload pfnPostload,
                                   tResourceUnload pfnUnload,
                                   void * typeParam);
+   virtual tResult RegisterDerivedData(tResourceType type, const tChar * pszExtension, uint version,
+                                       tResourceSave pfnSave, tResourceLoad pfnLoadSaved);
+   virtual tResult RegisterThreadSafeLoad(tResourceType type, const tChar * pszExtension);
    virtual tResult ListResources(const tChar * pszMatch, std::vector<cStr> * pNames) const;
+   virtual tResult AddResourceListener(IResourceListener * pListener);
+   virtual tResult RemoveResourceListener(IResourceListener * pListener);
 
    // IResourceManagerDiagnostics
    virtual void DumpFormats() const;
    virtual void DumpCache() const;
    virtual size_t GetCacheSize() const;
+   virtual tResult GetCacheStats(tResourceType type, sResourceCacheStats * pStats) const;
+   virtual tResult GetLoadStats(tResourceType type, sResourceLoadStats * pStats) const;
+   virtual void DumpLoadStats() const;
+   virtual void ResetLoadStats();
+   virtual void EnableLoadTrace(bool bEnable);
+   virtual tResult ExportLoadTrace(const tChar * pszFile) const;
 
 private:
-   tResult Open(const tChar * pszName, IReader * * ppReader);
-   tResult DoLoadFromReader(IReader * pReader, const cResourceFormat * pFormat, ulong dataSize, void * param, void * * ppData);
+   // Where the time went in one load, in seconds. The postload can run on
+   // another thread, later, so it has its own start time.
+   struct sLoadTimes
+   {
+      sLoadTimes();
+      tThreadId readThreadId;
+      double start;
+      double open;
+      double decode;
+      double postloadStart;
+      double postload;
+      ulong bytes;
+      bool bOpened;
+   };
+   void AddDirectoryStore(const tChar * pszDir, IResourceStore * pStore);
+   tResult Open(const tChar * pszName, IReader * * ppReader, uint * pStoreIndex = NULL);
+   void IndexNewStores();
+   void IndexEntry(const tChar * pszName, uint storeIndex);
+   tResult OpenWithType(const tChar * pszName, tResourceType type, IReader * * ppReader, uint * pStoreIndex = NULL);
+   void GetFileNames(const tChar * pszName, tResourceType type, std::vector<cStr> * pFileNames);
+   tResult LoadCached(const cResourceCacheKey & key, void * * ppData);
+   tResult LoadUncached(const tChar * pszName, tResourceType type, void * loadParam, void * * ppData);
+   const tChar * GetResourceName(tResourceId id) const;
+   uint GetTypeIndex(tResourceType type);
+   uint FindTypeIndex(tResourceType type) const;
+   cResourceCacheKey GetCacheKey(const tChar * pszName, tResourceType type);
+   tResult DoLoadFromReader(IReader * pReader, const cResourceFormat * pFormat, ulong dataSize, void * param,
+                            void * * ppData, sLoadTimes * pTimes);
+   void RecordLoad(const tChar * pszName, uint formatId, const sLoadTimes & times, bool bSucceeded);
+
+   // Cache bookkeeping. Converted resources keep the resource they were
+   // converted from locked, because their data may share its memory.
+   // Iterators into the cache are only good until the next AddToCache.
+   tResourceCache::iterator AddToCache(const cResourceCacheKey & key, void * pData, ulong dataSize, uint formatId,
+                                       void * loadParam, uint storeIndex);
+   void RemoveFromCache(tResourceCache::iterator iter);
+   void LockEntry(tResourceCache::iterator iter, ulong nLocks = 1);
+   void UnlockEntry(tResourceCache::iterator iter);
+   tResult UnlockCached(const cResourceCacheKey & key);
+   void UnlockDependency(tResourceId id, uint formatId);
+   void ReleaseLoadLock(const cResourceCacheKey & key, sAsyncLoad * pPending);
+   ulong GetDependencySize(tResourceId id, uint formatId);
+   sResourceCacheStats & AccessTypeStats(uint typeIndex) { return m_cacheTypes[typeIndex].stats; }
+   bool IsOverBudget() const;
+   void EnforceBudgets();
+
+   // Background loading. Everything but RunLoader and DoAsyncLoad runs on
+   // the thread that called LoadAsync.
+   tResult BeginAsyncLoad(const tChar * pszName, tResourceType type, void * loadParam,
+                          cFuture<void *> * pFuture, sAsyncLoad * * ppPending);
+   void ContinueAsyncLoad(sAsyncLoad * pLoad);
+   void ConvertAsyncLoad(sAsyncLoad * pLoad, void * pDependData);
+   void CompleteAsyncLoad(sAsyncLoad * pLoad, void * pData, ulong dataSize);
+   static void FinishAsyncLoad(cResourceManager * pResourceManager, sAsyncLoad * pLoad);
+   tResult StartLoaderThreads();
+   void StopLoaderThreads();
+   void RunLoader();
+   void DoAsyncLoad(sAsyncLoad * pLoad);
+   tResult WaitForAsyncLoad(sAsyncLoad * pLoad, void * * ppData);
+
+   // Dependency recording
+   void RecordDependency(const cResourceCacheKey & key);
+   bool HasDependencies(tResourceId id) const;
+   tResult PrefetchEntry(const cResourceCacheKey & key);
+   tResult GetManifestKey(const tChar * pszEntry, cResourceCacheKey * pKey);
+   void AppendManifestEntry(const cResourceCacheKey & key, cStr * pText) const;
+
+   // Hot reload. Reloaded data replaces the old in the same cache entry.
+   struct sReload
+   {
+      cResourceCacheKey key;
+      uint formatId;
+      void * pOldData;
+      void * pNewData;
+      ulong dataSize;
+   };
+   typedef std::vector<sReload> tReloads;
+   void RetireData(tResourceCache::iterator iter, uint formatId, void * pOldData);
+   void UnloadRetiredData(const cResourceCacheKey & key);
+   void StartMonitoring(IResourceStore * pStore);
+   void ReloadChangedResources();
+   tResult ReloadEntry(const cResourceCacheKey & key, const tChar * pszFile);
+   tResult ReconvertDependents(tResourceId id, uint typeIndex, void * pData, ulong dataSize, tReloads * pReloads);
+   void ReplaceData(tResourceCache::iterator iter, void * pData, ulong dataSize);
+
+   class cReloadTask : public cComObject<IMPLEMENTS(ITask)>
+   {
+   public:
+      cReloadTask(cResourceManager * pOuter);
+      virtual void DeleteThis() {}
+      virtual tResult Execute(double time);
+   private:
+      cResourceManager * m_pOuter;
+   };
+   friend class cReloadTask;
+   cReloadTask m_reloadTask;
+   bool m_bHotReload;
 
    typedef std::vector<IResourceStore *> tResourceStores;
    tResourceStores m_stores;
+   cThreadMutex m_storesMutex; // stores are opened from the loader threads too
+
+   // Which stores hold each entry, by the ResourceIdFromNameNoCase of its
+   // name, so that Open only probes stores that have the entry. Guarded by
+   // the stores mutex, as is everything down to m_openMisses.
+   typedef std::multimap<tResourceId, uint> tStoreIndex;
+   tStoreIndex m_storeIndex;
+   std::vector<uint> m_unindexedStores; // couldn't list their entries; always probed
+   std::vector<uint> m_changingStores; // may gain entries after listing; probed on a miss
+   size_t m_nIndexedStores;
+   std::set<tResourceId> m_openMisses; // names that no store had
+   // Changes whenever the index gains entries or misses are forgotten, so
+   // that an Open which probed the stores unlocked knows if its miss is stale
+   ulong m_storeIndexVersion;
 
    cResourceFormatTable m_formats;
 
+   cDerivedDataCache m_derivedCache;
+
    tResourceCache m_cache;
+
+   // Every name that has been loaded or asked for an id
+   typedef std::map<tResourceId, cStr> tResourceNames;
+   tResourceNames m_resourceNames;
+
+   // Unlocked entries by the order in which they were unlocked
+   typedef std::map<ulong, cResourceCacheKey> tLruEntries;
+   tLruEntries m_lruEntries;
+   ulong m_lruClock;
+
+   // Data that a hot reload replaced while the entry was locked. Whoever
+   // holds a lock may still be using it, so it is unloaded only once nothing
+   // has the entry locked, or the entry goes.
+   struct sRetiredData
+   {
+      cResourceCacheKey key;
+      uint formatId;
+      void * pData;
+   };
+   typedef std::vector<sRetiredData> tRetiredData;
+   tRetiredData m_retiredData;
+
+   // Every type that has been asked for, by cache key type index. The
+   // pointer is only compared against, to skip the string compare when the
+   // caller passes the same type constant.
+   struct sCacheType
+   {
+      tResourceType pType;
+      cStr name;
+      sResourceCacheStats stats;
+   };
+   std::vector<sCacheType> m_cacheTypes;
+   sResourceCacheStats m_totalStats;
+
+   typedef std::map<cResourceCacheKey, sAsyncLoad *> tAsyncLoads;
+   tAsyncLoads m_asyncLoads;
+
+   cAutoIPtr<IThreadCaller> m_pThreadCaller;
+   std::vector<cLoaderThread *> m_loaderThreads;
+   std::deque<sAsyncLoad *> m_loadQueue;
+   cThreadMutex m_loadQueueMutex;
+   cThreadCondition m_loadQueueCondition;
+   bool m_bStopLoaders;
+
+   // What each resource loaded, from its own functions or while recording
+   typedef std::set<cResourceCacheKey> tResourceKeys;
+   typedef std::map<cResourceCacheKey, tResourceKeys> tDependencies;
+   tDependencies m_dependencies;
+   bool m_bDependenciesChanged;
+
+   // Resources whose load or postload functions are running, innermost last
+   std::vector<cResourceCacheKey> m_loadContext;
+
+   // What the resource being recorded loaded so far, or NULL if none is.
+   // Resources cached before recording starts are loaded again and again
+   // while it goes on, so the set is looked up only once.
+   cResourceCacheKey m_recordingKey;
+   tResourceKeys * m_pRecordingKeys;
+
+   // Load timings, by format id, recorded on the thread that finishes loads
+   std::vector<sResourceLoadStats> m_formatLoadStats;
+   sResourceLoadStats m_totalLoadStats;
+   struct sLoadTraceEntry
+   {
+      cStr name;
+      uint formatId;
+      tThreadId finishThreadId;
+      sLoadTimes times;
+      bool bSucceeded;
+   };
+   std::vector<sLoadTraceEntry> m_loadTrace;
+   bool m_bTraceLoads;
+
+   cStr m_manifestFile; // loaded on Init and saved on Term if configured
 };
 
 
@@ -8,16 +8,34 @@
 #include "resourcemanager.h"
 #include "resourcestore.h"
 
+#include "tech/fileenum.h"
+#include "tech/filespec.h"
+#include "tech/globalobj.h"
 #include "tech/readwriteapi.h"
+#include "tech/techtime.h"
+#include "tech/thread.h"
 
 #include "UnitTest++.h"
 
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "tech/dbgalloc.h" // must be last header
 
 using namespace std;
 
 ///////////////////////////////////////////////////////////////////////////////
 
+LOG_EXTERN_CHANNEL(ResourceManager);
+
+#define LocalMsg3(msg,a,b,c)     DebugMsgEx3(ResourceManager,msg,(a),(b),(c))
+
+///////////////////////////////////////////////////////////////////////////////
+
 typedef pair<cStr, cStr> tStrPair;
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -34,9 +52,12 @@ public:
    virtual tResult CollectResourceNames(const tChar * pszMatch, vector<cStr> * pNames);
    virtual tResult OpenEntry(const tChar * pszName, IReader * * ppReader);
 
+   ulong GetOpenCount() const { return m_nOpens; }
+
 private:
    // Pairs of <file name, pseudo data>
    vector<tStrPair> m_testData;
+   ulong m_nOpens;
 };
 
 class cStackTestResourceStore : public cTestResourceStore
@@ -45,8 +66,22 @@ public:
    virtual void DeleteThis() {}
 };
 
+// Drops any path from the names it is asked to open, as directory stores do
+class cPathlessTestResourceStore : public cTestResourceStore
+{
+public:
+   cPathlessTestResourceStore(const tStrPair * pTestData, size_t nTestData)
+    : cTestResourceStore(pTestData, nTestData) {}
+
+   virtual tResult OpenEntry(const tChar * pszName, IReader * * ppReader)
+   {
+      return cTestResourceStore::OpenEntry(cFileSpec(pszName).GetFileName(), ppReader);
+   }
+};
+
 cTestResourceStore::cTestResourceStore(const tStrPair * pTestData, size_t nTestData)
  : m_testData(nTestData)
+ , m_nOpens(0)
 {
    for (size_t i = 0; i < nTestData; i++, pTestData++)
    {
@@ -73,6 +108,7 @@ tResult cTestResourceStore::CollectResourceNames(const tChar * pszMatch, vector<
 
 tResult cTestResourceStore::OpenEntry(const tChar * pszName, IReader * * ppReader)
 {
+   m_nOpens++;
    vector<pair<cStr, cStr> >::const_iterator iter = m_testData.begin();
    for (ulong index = 0; iter != m_testData.end(); iter++, index++)
    {
@@ -101,7 +137,13 @@ public:
    cResourceManagerTests();
    ~cResourceManagerTests();
 
-   void AddTestData(const tStrPair * pTestData, size_t nTestData);
+   cTestResourceStore * AddTestData(const tStrPair * pTestData, size_t nTestData);
+   void AddStore(IResourceStore * pStore);
+   tResult Open(const tChar * pszName, IReader * * ppReader);
+   void Recreate();
+   tResult SetDerivedDataDirectory(const tChar * pszDir);
+   void StartMonitoring();
+   void ReloadChangedResources();
 
    IResourceManager * AccessResourceManager() { return static_cast<IResourceManager *>(m_pResourceManager); }
    const IResourceManager * AccessResourceManager() const { return static_cast<const IResourceManager *>(m_pResourceManager); }
@@ -133,15 +175,70 @@ cResourceManagerTests::~cResourceManagerTests()
    }
 }
 
+////////////////////////////////////////
+// Replaces the resource manager with a new one
+
+void cResourceManagerTests::Recreate()
+{
+   SafeRelease(m_pDiagnostics);
+   m_pResourceManager->Term();
+   SafeRelease(m_pResourceManager);
+   m_pResourceManager = new cResourceManager;
+   m_pResourceManager->Init();
+   Verify(m_pResourceManager->QueryInterface(IID_IResourceManagerDiagnostics, (void**)&m_pDiagnostics) == S_OK);
+}
+
 ////////////////////////////////////////
 
-void cResourceManagerTests::AddTestData(const tStrPair * pTestData, size_t nTestData)
+tResult cResourceManagerTests::SetDerivedDataDirectory(const tChar * pszDir)
+{
+   return m_pResourceManager->m_derivedCache.SetDirectory(pszDir);
+}
+
+////////////////////////////////////////
+// Does what the resource_hot_reload config key does, minus the scheduler
+
+void cResourceManagerTests::StartMonitoring()
+{
+   for (size_t i = 0; i < m_pResourceManager->m_stores.size(); i++)
+   {
+      m_pResourceManager->StartMonitoring(m_pResourceManager->m_stores[i]);
+   }
+}
+
+////////////////////////////////////////
+
+void cResourceManagerTests::ReloadChangedResources()
+{
+   m_pResourceManager->ReloadChangedResources();
+}
+
+////////////////////////////////////////
+
+cTestResourceStore * cResourceManagerTests::AddTestData(const tStrPair * pTestData, size_t nTestData)
 {
    if ((pTestData != NULL) && (nTestData > 0))
    {
       cTestResourceStore * pStore = new cTestResourceStore(pTestData, nTestData);
-      m_pResourceManager->m_stores.push_back(static_cast<IResourceStore*>(pStore));
+      AddStore(static_cast<IResourceStore*>(pStore));
+      return pStore;
    }
+   return NULL;
+}
+
+////////////////////////////////////////
+// Takes over the caller's reference
+
+void cResourceManagerTests::AddStore(IResourceStore * pStore)
+{
+   m_pResourceManager->m_stores.push_back(pStore);
+}
+
+////////////////////////////////////////
+
+tResult cResourceManagerTests::Open(const tChar * pszName, IReader * * ppReader)
+{
+   return m_pResourceManager->Open(pszName, ppReader);
 }
 
 ////////////////////////////////////////
@@ -301,6 +398,124 @@ TEST_FIXTURE(cResourceManagerTests, ResourceManagerLoadCaseSensitivity)
 
 ////////////////////////////////////////
 
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerStoreIndex)
+{
+   cTestResourceStore * pStore1 = AddTestData(&g_basicTestResources[0], 1);
+   cTestResourceStore * pStore2 = AddTestData(&g_basicTestResources[1], _countof(g_basicTestResources) - 1);
+
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Data, NULL, "dat", RawBytesLoad, NULL, RawBytesUnload) == S_OK);
+
+   // Only the store that has the file is asked for it
+   {
+      byte * pBarDat = NULL;
+      CHECK(m_pResourceManager->Load("BAR.dat", kRT_Data, (void*)NULL, (void**)&pBarDat) == S_OK);
+      CHECK_EQUAL(0, pStore1->GetOpenCount());
+      CHECK_EQUAL(1, pStore2->GetOpenCount());
+   }
+
+   // A file no store has isn't looked for again
+   {
+      byte * pBazDat = NULL;
+      CHECK(m_pResourceManager->Load("baz.dat", kRT_Data, (void*)NULL, (void**)&pBazDat) != S_OK);
+      CHECK(m_pResourceManager->Load("baz.dat", kRT_Data, (void*)NULL, (void**)&pBazDat) != S_OK);
+      CHECK_EQUAL(0, pStore1->GetOpenCount());
+      CHECK_EQUAL(1, pStore2->GetOpenCount());
+   }
+
+   // Until another store is added
+   static const tStrPair bazDat[] = { make_pair(cStr("baz.dat"), cStr("baz_dat_baz_dat_baz_dat_baz_dat\0")) };
+   cTestResourceStore * pStore3 = AddTestData(&bazDat[0], _countof(bazDat));
+   {
+      byte * pBazDat = NULL;
+      CHECK(m_pResourceManager->Load("baz.dat", kRT_Data, (void*)NULL, (void**)&pBazDat) == S_OK);
+      CHECK_EQUAL(1, pStore3->GetOpenCount());
+      CHECK_EQUAL(0, pStore1->GetOpenCount());
+   }
+
+   // Names with a path are also looked up by their bare file name
+   static const tStrPair quxDat[] = { make_pair(cStr("qux.dat"), cStr("qux_dat_qux_dat_qux_dat_qux_dat\0")) };
+   cTestResourceStore * pStore4 = new cPathlessTestResourceStore(&quxDat[0], _countof(quxDat));
+   AddStore(static_cast<IResourceStore*>(pStore4));
+   {
+      cAutoIPtr<IReader> pReader;
+      CHECK(Open(_T("sub/qux.dat"), &pReader) == S_OK);
+      CHECK_EQUAL(1, pStore4->GetOpenCount());
+      CHECK_EQUAL(0, pStore1->GetOpenCount());
+   }
+}
+
+////////////////////////////////////////
+
+// Waits in OpenEntry for a second caller to come in. If the resource
+// manager serialized opens, the first caller would give up waiting before
+// the second one got in.
+class cRendezvousResourceStore : public cTestResourceStore
+{
+public:
+   cRendezvousResourceStore(const tStrPair * pTestData, size_t nTestData)
+    : cTestResourceStore(pTestData, nTestData), m_nArrived(0), m_nMet(0) {}
+
+   virtual tResult OpenEntry(const tChar * pszName, IReader * * ppReader)
+   {
+      AtomicIncrement(&m_nArrived);
+      double deadline = TimeGetSecs() + 2;
+      while (AtomicRead(&m_nArrived) < 2 && TimeGetSecs() < deadline)
+      {
+         ThreadYield();
+      }
+      if (AtomicRead(&m_nArrived) >= 2)
+      {
+         AtomicIncrement(&m_nMet);
+      }
+      return cTestResourceStore::OpenEntry(pszName, ppReader);
+   }
+
+   long GetMetCount() const { return m_nMet; }
+
+private:
+   volatile long m_nArrived;
+   volatile long m_nMet;
+};
+
+class cOpenResourceThread : public cThread
+{
+public:
+   cOpenResourceThread(cResourceManagerTests * pTests, const tChar * pszName)
+    : m_pTests(pTests), m_pszName(pszName), m_result(E_FAIL) {}
+
+   virtual int Run()
+   {
+      cAutoIPtr<IReader> pReader;
+      m_result = m_pTests->Open(m_pszName, &pReader);
+      return 0;
+   }
+
+   tResult GetResult() const { return m_result; }
+
+private:
+   cResourceManagerTests * m_pTests;
+   const tChar * m_pszName;
+   tResult m_result;
+};
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerOpenConcurrently)
+{
+   cRendezvousResourceStore * pStore = new cRendezvousResourceStore(&g_basicTestResources[0], _countof(g_basicTestResources));
+   AddStore(static_cast<IResourceStore*>(pStore));
+
+   cOpenResourceThread thread1(this, _T("foo.dat")), thread2(this, _T("bar.dat"));
+   CHECK(thread1.Create());
+   CHECK(thread2.Create());
+   thread1.Join();
+   thread2.Join();
+
+   CHECK(thread1.GetResult() == S_OK);
+   CHECK(thread2.GetResult() == S_OK);
+   CHECK_EQUAL(2, pStore->GetMetCount());
+}
+
+////////////////////////////////////////
+
 TEST_FIXTURE(cResourceManagerTests, ResourceManagerListResources)
 {
    AddTestData(&g_basicTestResources[0], _countof(g_basicTestResources));
@@ -330,6 +545,102 @@ TEST_FIXTURE(cResourceManagerTests, ResourceManagerListResources)
 
 ////////////////////////////////////////
 
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerLoadById)
+{
+   AddTestData(&g_basicTestResources[0], _countof(g_basicTestResources));
+
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Data, NULL, "dat", RawBytesLoad, NULL, RawBytesUnload) == S_OK);
+
+   tResourceId fooId = 0, fooId2 = 0, barId = 0;
+   CHECK(AccessResourceManager()->GetResourceId("foo", &fooId) == S_OK);
+   CHECK(AccessResourceManager()->GetResourceId("foo", &fooId2) == S_OK);
+   CHECK(AccessResourceManager()->GetResourceId("bar", &barId) == S_OK);
+   CHECK(fooId == fooId2);
+   CHECK(fooId != barId);
+
+   void * pFooById = NULL, * pFooByName = NULL;
+   CHECK(m_pResourceManager->Load(fooId, kRT_Data, (void*)NULL, &pFooById) == S_OK);
+   CHECK(m_pResourceManager->Load("foo", kRT_Data, (void*)NULL, &pFooByName) == S_OK);
+   CHECK(pFooById != NULL && pFooById == pFooByName);
+   CHECK_EQUAL(1, m_pDiagnostics->GetCacheSize());
+
+   // Names loaded without asking for an id are interned too
+   tResourceId barDatId = 0;
+   void * pBarDat = NULL, * pBarDatById = NULL;
+   CHECK(m_pResourceManager->Load("bar.dat", kRT_Data, (void*)NULL, &pBarDat) == S_OK);
+   CHECK(AccessResourceManager()->GetResourceId("bar.dat", &barDatId) == S_OK);
+   CHECK(m_pResourceManager->Load(barDatId, kRT_Data, (void*)NULL, &pBarDatById) == S_OK);
+   CHECK(pBarDatById == pBarDat);
+
+   void * pData = NULL;
+   CHECK(m_pResourceManager->Load(fooId + 1, kRT_Data, (void*)NULL, &pData) == E_INVALIDARG);
+   CHECK(m_pResourceManager->Load(fooId, kRT_Bitmap, (void*)NULL, &pData) != S_OK);
+}
+
+////////////////////////////////////////
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerLoadByIdTimeTrial)
+{
+   static const int kNumResources = 256;
+   static const int kNumFrames = 1000;
+
+   vector<tStrPair> resources(kNumResources);
+   for (int i = 0; i < kNumResources; i++)
+   {
+      tChar szName[32];
+      _sntprintf(szName, _countof(szName), _T("models/unit%03d.dat"), i);
+      resources[i] = make_pair(cStr(szName), cStr("data"));
+   }
+   AddTestData(&resources[0], resources.size());
+
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Data, NULL, "dat", RawBytesLoad, NULL, RawBytesUnload) == S_OK);
+
+   vector<tResourceId> ids(kNumResources);
+   for (int i = 0; i < kNumResources; i++)
+   {
+      void * pData = NULL;
+      CHECK(AccessResourceManager()->GetResourceId(resources[i].first.c_str(), &ids[i]) == S_OK);
+      CHECK(m_pResourceManager->Load(ids[i], kRT_Data, (void*)NULL, &pData) == S_OK);
+   }
+
+   int nFailed = 0;
+
+   double nameTime = -TimeGetSecs();
+   for (int frame = 0; frame < kNumFrames; frame++)
+   {
+      for (int i = 0; i < kNumResources; i++)
+      {
+         void * pData = NULL;
+         if (m_pResourceManager->Load(resources[i].first.c_str(), kRT_Data, (void*)NULL, &pData) != S_OK)
+         {
+            nFailed++;
+         }
+      }
+   }
+   nameTime += TimeGetSecs();
+
+   double idTime = -TimeGetSecs();
+   for (int frame = 0; frame < kNumFrames; frame++)
+   {
+      for (int i = 0; i < kNumResources; i++)
+      {
+         void * pData = NULL;
+         if (m_pResourceManager->Load(ids[i], kRT_Data, (void*)NULL, &pData) != S_OK)
+         {
+            nFailed++;
+         }
+      }
+   }
+   idTime += TimeGetSecs();
+
+   CHECK_EQUAL(0, nFailed);
+   CHECK_EQUAL(static_cast<size_t>(kNumResources), m_pDiagnostics->GetCacheSize());
+
+   LocalMsg3("%d cached loads: by name %f secs, by id %f secs\n", kNumResources * kNumFrames, nameTime, idTime);
+}
+
+////////////////////////////////////////
+
 const tStrPair g_multNameTestResources[] =
 {
    make_pair(cStr("foo.xml"), cStr("<?xml version=\"1.0\" ?>...\0")),
@@ -363,6 +674,912 @@ TEST_FIXTURE(cResourceManagerTests, ResourceManagerSameNameLoadWrongType)
    }
 }
 
+////////////////////////////////////////
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerCacheLocking)
+{
+   AddTestData(&g_basicTestResources[0], _countof(g_basicTestResources));
+
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Data, NULL, "dat", RawBytesLoad, NULL, RawBytesUnload) == S_OK);
+
+   const size_t fooSize = g_basicTestResources[0].second.length();
+
+   void * pFooDat1 = NULL, * pFooDat2 = NULL;
+   CHECK(m_pResourceManager->Load("foo", kRT_Data, (void*)NULL, &pFooDat1) == S_OK);
+   CHECK(m_pResourceManager->Load("foo", kRT_Data, (void*)NULL, &pFooDat2) == S_OK);
+
+   sResourceCacheStats stats;
+   CHECK(m_pDiagnostics->GetCacheStats(kRT_Data, &stats) == S_OK);
+   CHECK_EQUAL(1, stats.nEntries);
+   CHECK_EQUAL(1, stats.nLockedEntries);
+   CHECK_EQUAL(fooSize, stats.bytes);
+   CHECK_EQUAL(fooSize, stats.lockedBytes);
+   CHECK_EQUAL(1, stats.nHits);
+   CHECK_EQUAL(1, stats.nMisses);
+
+   CHECK(AccessResourceManager()->Unlock("foo", kRT_Data) == S_OK);
+   CHECK(m_pDiagnostics->GetCacheStats(kRT_Data, &stats) == S_OK);
+   CHECK_EQUAL(1, stats.nLockedEntries);
+
+   CHECK(AccessResourceManager()->Unlock("foo", kRT_Data) == S_OK);
+   CHECK(AccessResourceManager()->Unlock("foo", kRT_Data) == S_FALSE);
+   CHECK(m_pDiagnostics->GetCacheStats(kRT_Data, &stats) == S_OK);
+   CHECK_EQUAL(1, stats.nEntries);
+   CHECK_EQUAL(0, stats.nLockedEntries);
+   CHECK_EQUAL(0, stats.lockedBytes);
+
+   // Unlocked but still cached
+   void * pFooDat3 = NULL;
+   CHECK(m_pResourceManager->Load("foo", kRT_Data, (void*)NULL, &pFooDat3) == S_OK);
+   CHECK(pFooDat3 == pFooDat1);
+   CHECK(m_pDiagnostics->GetCacheStats(NULL, &stats) == S_OK);
+   CHECK_EQUAL(2, stats.nHits);
+   CHECK_EQUAL(1, stats.nLockedEntries);
+
+   CHECK(m_pDiagnostics->GetCacheStats(kRT_Bitmap, &stats) == S_FALSE);
+}
+
+////////////////////////////////////////
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerLoadStats)
+{
+   static const char kTestTrace[] = "resourcemanagertest-trace.json";
+
+   AddTestData(&g_basicTestResources[0], _countof(g_basicTestResources));
+
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Data, NULL, "dat", RawBytesLoad, NULL, RawBytesUnload) == S_OK);
+
+   m_pDiagnostics->EnableLoadTrace(true);
+
+   void * pData = NULL;
+   CHECK(m_pResourceManager->Load("foo", kRT_Data, (void*)NULL, &pData) == S_OK);
+   CHECK(m_pResourceManager->Load("bar", kRT_Data, (void*)NULL, &pData) == S_OK);
+   // Cache hits aren't loads
+   CHECK(m_pResourceManager->Load("foo", kRT_Data, (void*)NULL, &pData) == S_OK);
+
+   sResourceLoadStats stats;
+   CHECK(m_pDiagnostics->GetLoadStats(kRT_Data, &stats) == S_OK);
+   CHECK_EQUAL(2, stats.nLoads);
+   CHECK_EQUAL(0, stats.nFailures);
+   CHECK_EQUAL(g_basicTestResources[0].second.length() + g_basicTestResources[2].second.length(), stats.bytes);
+   CHECK(stats.maxLoadTime >= 0);
+   CHECK(stats.maxLoadTime <= stats.openTime + stats.decodeTime + stats.postloadTime);
+
+   CHECK(m_pDiagnostics->GetLoadStats(NULL, &stats) == S_OK);
+   CHECK_EQUAL(2, stats.nLoads);
+   CHECK(m_pDiagnostics->GetLoadStats(kRT_Bitmap, &stats) == S_FALSE);
+   CHECK_EQUAL(0, stats.nLoads);
+
+   CHECK(m_pDiagnostics->ExportLoadTrace(kTestTrace) == S_OK);
+   FILE * fp = fopen(kTestTrace, "r");
+   CHECK(fp != NULL);
+   if (fp != NULL)
+   {
+      char szTrace[1024] = {0};
+      fread(szTrace, 1, sizeof(szTrace) - 1, fp);
+      fclose(fp);
+      static const char kTraceStart[] = "{\"traceEvents\":[\n{\"name\":";
+      CHECK(strncmp(szTrace, kTraceStart, sizeof(kTraceStart) - 1) == 0);
+      CHECK(strstr(szTrace, "[\n,") == NULL);
+      CHECK(strstr(szTrace, ",\n]") == NULL);
+      CHECK(strstr(szTrace, "\n]}\n") != NULL);
+      CHECK(strstr(szTrace, "\"name\":\"foo\"") != NULL);
+      CHECK(strstr(szTrace, "\"name\":\"bar\"") != NULL);
+   }
+   remove(kTestTrace);
+
+   m_pDiagnostics->ResetLoadStats();
+   CHECK(m_pDiagnostics->GetLoadStats(NULL, &stats) == S_OK);
+   CHECK_EQUAL(0, stats.nLoads);
+}
+
+////////////////////////////////////////
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerCacheBudgetEviction)
+{
+   AddTestData(&g_basicTestResources[0], _countof(g_basicTestResources));
+
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Data, NULL, "dat", RawBytesLoad, NULL, RawBytesUnload) == S_OK);
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Bitmap, NULL, "bmp", RawBytesLoad, NULL, RawBytesUnload) == S_OK);
+
+   // All the test resources are the same size
+   const size_t resourceSize = g_basicTestResources[0].second.length();
+   CHECK(AccessResourceManager()->SetMemoryBudget(NULL, 2 * resourceSize) == S_OK);
+
+   void * pData = NULL;
+   CHECK(m_pResourceManager->Load("foo", kRT_Data, (void*)NULL, &pData) == S_OK);
+   CHECK(m_pResourceManager->Load("bar", kRT_Data, (void*)NULL, &pData) == S_OK);
+   CHECK(m_pResourceManager->Load("foo", kRT_Bitmap, (void*)NULL, &pData) == S_OK);
+
+   // Over budget, but nothing may be evicted while it is locked
+   CHECK_EQUAL(3, m_pDiagnostics->GetCacheSize());
+
+   CHECK(AccessResourceManager()->Unlock("foo", kRT_Data) == S_OK);
+   CHECK_EQUAL(2, m_pDiagnostics->GetCacheSize());
+
+   // Within budget now
+   CHECK(AccessResourceManager()->Unlock("bar", kRT_Data) == S_OK);
+   CHECK_EQUAL(2, m_pDiagnostics->GetCacheSize());
+
+   // Reloading goes over budget again, and the least recently used
+   // unlocked resource goes
+   CHECK(m_pResourceManager->Load("foo", kRT_Data, (void*)NULL, &pData) == S_OK);
+   CHECK_EQUAL(2, m_pDiagnostics->GetCacheSize());
+
+   sResourceCacheStats stats;
+   CHECK(m_pDiagnostics->GetCacheStats(NULL, &stats) == S_OK);
+   CHECK_EQUAL(2, stats.nEvictions);
+   CHECK_EQUAL(2 * resourceSize, stats.bytes);
+   CHECK_EQUAL(2 * resourceSize, stats.budget);
+   CHECK_EQUAL(2, stats.nLockedEntries);
+
+   CHECK(m_pDiagnostics->GetCacheStats(kRT_Data, &stats) == S_OK);
+   CHECK_EQUAL(1, stats.nEntries);
+   CHECK_EQUAL(2, stats.nEvictions);
+   CHECK_EQUAL(3, stats.nMisses);
+
+   // A per-type budget only evicts that type
+   CHECK(AccessResourceManager()->Unlock("foo", kRT_Data) == S_OK);
+   CHECK(AccessResourceManager()->Unlock("foo", kRT_Bitmap) == S_OK);
+   CHECK(AccessResourceManager()->SetMemoryBudget(kRT_Bitmap, 1) == S_OK);
+   CHECK(m_pDiagnostics->GetCacheStats(kRT_Bitmap, &stats) == S_OK);
+   CHECK_EQUAL(0, stats.nEntries);
+   CHECK_EQUAL(1, stats.nEvictions);
+   CHECK(m_pDiagnostics->GetCacheStats(kRT_Data, &stats) == S_OK);
+   CHECK_EQUAL(1, stats.nEntries);
+}
+
+////////////////////////////////////////
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerCacheBudgetRepeatedLoads)
+{
+   AddTestData(&g_basicTestResources[0], _countof(g_basicTestResources));
+
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Data, NULL, "dat", RawBytesLoad, NULL, RawBytesUnload) == S_OK);
+
+   const size_t resourceSize = g_basicTestResources[0].second.length();
+   CHECK(AccessResourceManager()->SetMemoryBudget(NULL, resourceSize) == S_OK);
+
+   // As a caller loading every frame, and done with it by the next, would
+   tResourceId fooId = 0;
+   CHECK(AccessResourceManager()->GetResourceId("foo", &fooId) == S_OK);
+   void * pData = NULL;
+   for (int i = 0; i < 100; i++)
+   {
+      CHECK(m_pResourceManager->Load(fooId, kRT_Data, (void*)NULL, &pData) == S_OK);
+      CHECK(AccessResourceManager()->Unlock(fooId, kRT_Data) == S_OK);
+   }
+
+   sResourceCacheStats stats;
+   CHECK(m_pDiagnostics->GetCacheStats(NULL, &stats) == S_OK);
+   CHECK_EQUAL(0, stats.nLockedEntries);
+
+   CHECK(m_pResourceManager->Load("bar", kRT_Data, (void*)NULL, &pData) == S_OK);
+   CHECK_EQUAL(1, m_pDiagnostics->GetCacheSize());
+   CHECK(m_pDiagnostics->GetCacheStats(NULL, &stats) == S_OK);
+   CHECK_EQUAL(1, stats.nEvictions);
+
+   // Held over many loads, it is evicted once every one is unlocked
+   for (int i = 0; i < 100; i++)
+   {
+      CHECK(m_pResourceManager->Load("bar", kRT_Data, (void*)NULL, &pData) == S_OK);
+   }
+   CHECK(m_pResourceManager->Load("foo", kRT_Data, (void*)NULL, &pData) == S_OK);
+   CHECK_EQUAL(2, m_pDiagnostics->GetCacheSize());
+   CHECK(AccessResourceManager()->Unlock("foo", kRT_Data) == S_OK);
+   for (int i = 0; i < 101; i++)
+   {
+      CHECK(AccessResourceManager()->Unlock("bar", kRT_Data) == S_OK);
+   }
+   CHECK(AccessResourceManager()->Unlock("bar", kRT_Data) == S_FALSE);
+   CHECK_EQUAL(1, m_pDiagnostics->GetCacheSize());
+}
+
+////////////////////////////////////////
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerCacheBudgetConvertedType)
+{
+   AddTestData(&g_multNameTestResources[0], _countof(g_multNameTestResources));
+
+   CHECK(AccessResourceManager()->RegisterFormat("footxt", NULL, "xml", RawBytesLoad, NULL, RawBytesUnload) == S_OK);
+   CHECK(AccessResourceManager()->RegisterFormat("fooxml", "footxt", "xml", NULL, PseudoXmlPostload, PseudoXmlUnload) == S_OK);
+
+   void * pFooXml = NULL;
+   CHECK(m_pResourceManager->Load("foo.xml", "fooxml", (void*)NULL, &pFooXml) == S_OK);
+   CHECK_EQUAL(2, m_pDiagnostics->GetCacheSize());
+
+   // The converted resource is charged the size of what it came from, and
+   // keeps that locked because it may share its memory
+   const size_t xmlSize = g_multNameTestResources[0].second.length();
+   sResourceCacheStats stats;
+   CHECK(m_pDiagnostics->GetCacheStats("fooxml", &stats) == S_OK);
+   CHECK_EQUAL(xmlSize, stats.bytes);
+   CHECK(m_pDiagnostics->GetCacheStats("footxt", &stats) == S_OK);
+   CHECK_EQUAL(1, stats.nLockedEntries);
+
+   CHECK(AccessResourceManager()->SetMemoryBudget("footxt", 1) == S_OK);
+   CHECK_EQUAL(2, m_pDiagnostics->GetCacheSize());
+
+   CHECK(AccessResourceManager()->Unlock("foo.xml", "fooxml") == S_OK);
+   CHECK(AccessResourceManager()->SetMemoryBudget(NULL, 1) == S_OK);
+   CHECK_EQUAL(0, m_pDiagnostics->GetCacheSize());
+}
+
+////////////////////////////////////////
+
+// Registers the calling thread with the thread caller for the lifetime of
+// the object so that it can receive finished background loads
+class cAsyncLoadThread
+{
+public:
+   cAsyncLoadThread() : m_bThreadInit(false)
+   {
+      UseGlobal(ThreadCaller);
+      m_bThreadInit = (pThreadCaller->ThreadInit() == S_OK);
+   }
+
+   ~cAsyncLoadThread()
+   {
+      if (m_bThreadInit)
+      {
+         UseGlobal(ThreadCaller);
+         pThreadCaller->ThreadTerm();
+      }
+   }
+
+   bool Wait(const cFuture<void *> & future)
+   {
+      UseGlobal(ThreadCaller);
+      double timeout = TimeGetSecs() + 5;
+      while (!future.IsDone() && TimeGetSecs() < timeout)
+      {
+         pThreadCaller->ReceiveCalls(NULL);
+         ThreadSleep(1);
+      }
+      return future.IsDone();
+   }
+
+private:
+   bool m_bThreadInit;
+};
+
+static tThreadId g_rawBytesLoadThread, g_postloadThread;
+
+void * ThreadRecordingLoad(IReader * pReader)
+{
+   g_rawBytesLoadThread = ThreadGetCurrentId();
+   return RawBytesLoad(pReader);
+}
+
+void * ThreadRecordingPostload(void * pData, int dataLength, void * loadParam)
+{
+   g_postloadThread = ThreadGetCurrentId();
+   return pData;
+}
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerLoadAsync)
+{
+   cAsyncLoadThread thread;
+
+   AddTestData(&g_basicTestResources[0], _countof(g_basicTestResources));
+
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Data, NULL, "dat", ThreadRecordingLoad, ThreadRecordingPostload, RawBytesUnload) == S_OK);
+
+   g_rawBytesLoadThread = g_postloadThread = ThreadGetCurrentId();
+
+   // The second request joins the first
+   cFuture<void *> future1, future2;
+   CHECK(AccessResourceManager()->LoadAsync("foo", kRT_Data, NULL, &future1) == S_OK);
+   CHECK(AccessResourceManager()->LoadAsync("foo", kRT_Data, NULL, &future2) == S_OK);
+   CHECK_EQUAL(0, m_pDiagnostics->GetCacheSize());
+
+   CHECK(thread.Wait(future1));
+   CHECK(future2.IsDone());
+
+   byte * pFooDat1 = NULL, * pFooDat2 = NULL;
+   CHECK(future1.GetResult((void**)&pFooDat1) == S_OK);
+   CHECK(future2.GetResult((void**)&pFooDat2) == S_OK);
+   CHECK(pFooDat1 != NULL && pFooDat1 == pFooDat2);
+   if (pFooDat1 != NULL)
+   {
+      CHECK(memcmp(pFooDat1, g_basicTestResources[0].second.c_str(), g_basicTestResources[0].second.length()) == 0);
+   }
+   CHECK_EQUAL(1, m_pDiagnostics->GetCacheSize());
+
+   CHECK(g_rawBytesLoadThread != ThreadGetCurrentId());
+   CHECK(g_postloadThread == ThreadGetCurrentId());
+
+   // Now it comes straight from the cache
+   cFuture<void *> future3;
+   CHECK(AccessResourceManager()->LoadAsync("foo", kRT_Data, NULL, &future3) == S_OK);
+   CHECK(future3.IsDone());
+   byte * pFooDat3 = NULL;
+   CHECK(future3.GetResult((void**)&pFooDat3) == S_OK);
+   CHECK(pFooDat3 == pFooDat1);
+
+   byte * pFooDat4 = NULL;
+   CHECK(m_pResourceManager->Load("foo", kRT_Data, (void*)NULL, (void**)&pFooDat4) == S_OK);
+   CHECK(pFooDat4 == pFooDat1);
+
+   // Every request holds a lock, including the ones that shared a load
+   for (int i = 0; i < 4; i++)
+   {
+      CHECK(AccessResourceManager()->Unlock("foo", kRT_Data) == S_OK);
+   }
+   CHECK(AccessResourceManager()->Unlock("foo", kRT_Data) == S_FALSE);
+}
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerLoadAsyncDependentType)
+{
+   cAsyncLoadThread thread;
+
+   AddTestData(&g_multNameTestResources[0], _countof(g_multNameTestResources));
+
+   CHECK(AccessResourceManager()->RegisterFormat("footxt", NULL, "xml", RawBytesLoad, NULL, RawBytesUnload) == S_OK);
+   CHECK(AccessResourceManager()->RegisterFormat("fooxml", "footxt", "xml", NULL, PseudoXmlPostload, PseudoXmlUnload) == S_OK);
+
+   cFuture<void *> future;
+   CHECK(AccessResourceManager()->LoadAsync("foo.xml", "fooxml", NULL, &future) == S_OK);
+   CHECK(thread.Wait(future));
+
+   byte * pFooXml = NULL;
+   CHECK(future.GetResult((void**)&pFooXml) == S_OK);
+   if (pFooXml != NULL)
+   {
+      const cStr & expected = g_multNameTestResources[0].second;
+      CHECK(memcmp(pFooXml, expected.c_str(), expected.length()) == 0);
+   }
+
+   // Both the converted resource and the one it came from are cached
+   CHECK_EQUAL(2, m_pDiagnostics->GetCacheSize());
+
+   // Conversion fails for this one
+   cFuture<void *> badFuture;
+   CHECK(AccessResourceManager()->LoadAsync("foo.ms3d", "fooxml", NULL, &badFuture) == S_OK);
+   CHECK(thread.Wait(badFuture));
+   CHECK(badFuture.GetStatus() == kFutureFailed);
+}
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerLoadAsyncMissing)
+{
+   cAsyncLoadThread thread;
+
+   AddTestData(&g_basicTestResources[0], _countof(g_basicTestResources));
+
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Data, NULL, "dat", RawBytesLoad, NULL, RawBytesUnload) == S_OK);
+
+   cFuture<void *> future;
+   CHECK(AccessResourceManager()->LoadAsync("nosuchfile", kRT_Data, NULL, &future) == S_OK);
+   CHECK(thread.Wait(future));
+   CHECK(future.GetStatus() == kFutureFailed);
+   CHECK_EQUAL(0, m_pDiagnostics->GetCacheSize());
+}
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerLoadAsyncTermWhileLoading)
+{
+   cAsyncLoadThread thread;
+
+   AddTestData(&g_basicTestResources[0], _countof(g_basicTestResources));
+
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Data, NULL, "dat", RawBytesLoad, NULL, RawBytesUnload) == S_OK);
+
+   cFuture<void *> futures[2];
+   CHECK(AccessResourceManager()->LoadAsync("foo", kRT_Data, NULL, &futures[0]) == S_OK);
+   CHECK(AccessResourceManager()->LoadAsync("bar", kRT_Data, NULL, &futures[1]) == S_OK);
+
+   // Nothing has been received so both are still pending
+   m_pResourceManager->Term();
+   CHECK(futures[0].GetStatus() == kFutureFailed);
+   CHECK(futures[1].GetStatus() == kFutureFailed);
+
+   // The loader threads have stopped, so any loads they finished are
+   // already waiting to be received and cleaned up
+   UseGlobal(ThreadCaller);
+   pThreadCaller->ReceiveCalls(NULL);
+
+   SafeRelease(m_pResourceManager);
+}
+
+////////////////////////////////////////
+
+#define kRT_List _T("list")
+
+// Loads each resource that the list names, like a map loading its models
+void * ListPostload(void * pData, int dataLength, void * loadParam)
+{
+   IResourceManager * pResourceManager = static_cast<IResourceManager *>(loadParam);
+   cStr names(static_cast<const char *>(pData), dataLength);
+   cStr::size_type start = 0;
+   while (start < names.length())
+   {
+      cStr::size_type end = names.find(' ', start);
+      if (end == cStr::npos)
+      {
+         end = names.length();
+      }
+      cStr name(names, start, end - start);
+      bool bList = (name.find(".lst") != cStr::npos);
+      void * pDependData = NULL;
+      if (pResourceManager->Load(name.c_str(), bList ? kRT_List : kRT_Data, loadParam, &pDependData) != S_OK)
+      {
+         RawBytesUnload(pData);
+         return NULL;
+      }
+      start = end + 1;
+   }
+   return pData;
+}
+
+const tStrPair g_dependencyTestResources[] =
+{
+   make_pair(cStr("level.lst"), cStr("a.dat b.dat sub.lst")),
+   make_pair(cStr("sub.lst"), cStr("c.dat")),
+   make_pair(cStr("a.dat"), cStr("a_dat_a_dat_a_dat")),
+   make_pair(cStr("b.dat"), cStr("b_dat_b_dat_b_dat")),
+   make_pair(cStr("c.dat"), cStr("c_dat_c_dat_c_dat")),
+   make_pair(cStr("d.dat"), cStr("d_dat_d_dat_d_dat")),
+};
+
+static const char kTestManifest[] = "resourcemanagertest.manifest";
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerPrefetchDependencies)
+{
+   cAsyncLoadThread thread;
+
+   AddTestData(&g_dependencyTestResources[0], _countof(g_dependencyTestResources));
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Data, NULL, "dat", RawBytesLoad, NULL, RawBytesUnload) == S_OK);
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_List, NULL, "lst", RawBytesLoad, ListPostload, RawBytesUnload) == S_OK);
+
+   // What the list loads is recorded, then whatever is loaded while
+   // recording it, but nothing after that
+   void * pData = NULL;
+   CHECK(AccessResourceManager()->Load("level.lst", kRT_List, AccessResourceManager(), &pData) == S_OK);
+   CHECK(AccessResourceManager()->RecordDependencies("level.lst", kRT_List) == S_OK);
+   CHECK(AccessResourceManager()->Load("d.dat", kRT_Data, NULL, &pData) == S_OK);
+   CHECK(AccessResourceManager()->RecordDependencies(NULL, NULL) == S_OK);
+   CHECK(AccessResourceManager()->Load("foo.dat", kRT_Data, NULL, &pData) != S_OK);
+   CHECK(AccessResourceManager()->SaveManifest(kTestManifest) == S_OK);
+
+   // Everything is cached already
+   CHECK(AccessResourceManager()->Prefetch("level.lst", kRT_List) == S_FALSE);
+
+   // A new resource manager reads the manifest before the formats exist
+   Recreate();
+   CHECK(AccessResourceManager()->LoadManifest(kTestManifest) == S_OK);
+   remove(kTestManifest);
+   AddTestData(&g_dependencyTestResources[0], _countof(g_dependencyTestResources));
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Data, NULL, "dat", RawBytesLoad, NULL, RawBytesUnload) == S_OK);
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_List, NULL, "lst", RawBytesLoad, ListPostload, RawBytesUnload) == S_OK);
+
+   // Nothing is loaded on a loader thread until the format says it may be
+   CHECK(AccessResourceManager()->Prefetch("level.lst", kRT_List) == S_FALSE);
+   CHECK_EQUAL(0, m_pDiagnostics->GetCacheSize());
+   CHECK(AccessResourceManager()->RegisterThreadSafeLoad(kRT_Data, "dat") == S_OK);
+
+   CHECK(AccessResourceManager()->Prefetch("sub.lst", kRT_List) == S_OK);
+   CHECK(AccessResourceManager()->Prefetch("level.lst", kRT_List) == S_OK);
+
+   // A load waits for the prefetch in progress instead of repeating it
+   byte * pA = NULL;
+   CHECK(AccessResourceManager()->Load("a.dat", kRT_Data, NULL, (void**)&pA) == S_OK);
+   if (pA != NULL)
+   {
+      CHECK(memcmp(pA, "a_dat", 5) == 0);
+   }
+   CHECK(AccessResourceManager()->Unlock("a.dat", kRT_Data) == S_OK);
+
+   // The lists load other resources, so only the rest are prefetched
+   double timeout = TimeGetSecs() + 5;
+   while (m_pDiagnostics->GetCacheSize() < 4 && TimeGetSecs() < timeout)
+   {
+      UseGlobal(ThreadCaller);
+      pThreadCaller->ReceiveCalls(NULL);
+      ThreadSleep(1);
+   }
+   CHECK_EQUAL(4, m_pDiagnostics->GetCacheSize());
+
+   // Prefetched resources aren't locked
+   static const char * const kPrefetched[] = { "a.dat", "b.dat", "c.dat", "d.dat" };
+   for (size_t i = 0; i < _countof(kPrefetched); i++)
+   {
+      CHECK(AccessResourceManager()->Unlock(kPrefetched[i], kRT_Data) == S_FALSE);
+   }
+
+   CHECK(AccessResourceManager()->Load("level.lst", kRT_List, AccessResourceManager(), &pData) == S_OK);
+   CHECK_EQUAL(6, m_pDiagnostics->GetCacheSize());
+}
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerPrefetchNothingRecorded)
+{
+   AddTestData(&g_dependencyTestResources[0], _countof(g_dependencyTestResources));
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Data, NULL, "dat", RawBytesLoad, NULL, RawBytesUnload) == S_OK);
+
+   CHECK(AccessResourceManager()->Prefetch("a.dat", kRT_Data) == S_FALSE);
+   CHECK(AccessResourceManager()->Prefetch(NULL, kRT_Data) == E_POINTER);
+   CHECK(AccessResourceManager()->LoadManifest("nosuchfile.manifest") == E_FAIL);
+   CHECK_EQUAL(0, m_pDiagnostics->GetCacheSize());
+}
+
+////////////////////////////////////////
+
+static int g_nStringLoads = 0;
+
+void * StringLoadSaved(IReader * pReader, void * typeParam)
+{
+   ulong length = 0;
+   if (pReader->Seek(0, kSO_End) == S_OK
+      && pReader->Tell(&length) == S_OK
+      && pReader->Seek(0, kSO_Set) == S_OK)
+   {
+      char * psz = new char[length + 1];
+      if (length == 0 || pReader->Read(psz, length) == S_OK)
+      {
+         psz[length] = 0;
+         return psz;
+      }
+      delete [] psz;
+   }
+   return NULL;
+}
+
+void * StringLoad(IReader * pReader)
+{
+   g_nStringLoads++;
+   return StringLoadSaved(pReader, NULL);
+}
+
+tResult StringSave(void * pData, IWriter * pWriter)
+{
+   const char * psz = static_cast<const char *>(pData);
+   return pWriter->Write(psz, strlen(psz));
+}
+
+static int g_nStringUnloads = 0;
+
+void StringUnload(void * pData)
+{
+   g_nStringUnloads++;
+   delete [] static_cast<char *>(pData);
+}
+
+static const char kTestDerivedDir[] = "resourcemanagertest.derived";
+
+static void RemoveDerivedDir()
+{
+   cFileSpec wildcard(_T("*"));
+   wildcard.SetPath(cFilePath(kTestDerivedDir));
+   {
+      cAutoIPtr<IEnumFiles> pEnumFiles;
+      if (EnumFiles(wildcard, &pEnumFiles) == S_OK)
+      {
+         cFileSpec files[10];
+         uint attribs[10];
+         ulong nFiles = 0;
+         while (SUCCEEDED(pEnumFiles->Next(_countof(files), files, attribs, &nFiles)) && nFiles > 0)
+         {
+            for (ulong i = 0; i < nFiles; i++)
+            {
+               remove(files[i].CStr());
+            }
+         }
+      }
+   }
+#ifdef _WIN32
+   _rmdir(kTestDerivedDir);
+#else
+   rmdir(kTestDerivedDir);
+#endif
+}
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerDerivedDataCache)
+{
+   static const char kReversedFoo[] = "tad_oof_tad_oof_tad_oof_tad_oof";
+
+   cAsyncLoadThread thread;
+
+   RemoveDerivedDir();
+   g_nStringLoads = 0;
+   int nExpectedLoads = 0;
+
+   for (uint version = 1; version <= 2; version++)
+   {
+      for (int run = 0; run < 2; run++)
+      {
+         // Each run starts over, like a new process would
+         Recreate();
+         CHECK(SetDerivedDataDirectory(kTestDerivedDir) == S_OK);
+         AddTestData(&g_basicTestResources[0], _countof(g_basicTestResources));
+         CHECK(AccessResourceManager()->RegisterFormat(kRT_ReverseData, "dat", StringLoad, ReversePostload, StringUnload) == S_OK);
+         CHECK(AccessResourceManager()->RegisterDerivedData(kRT_ReverseData, "bmp", version, StringSave, StringLoadSaved) == E_FAIL);
+         CHECK(AccessResourceManager()->RegisterDerivedData(kRT_ReverseData, "dat", version, StringSave, StringLoadSaved) == S_OK);
+
+         // Only the first run of each version loads and postloads the files
+         int nRunLoads = (run == 0) ? 1 : 0;
+
+         char * pszFoo = NULL;
+         CHECK(AccessResourceManager()->Load("foo.dat", kRT_ReverseData, NULL, (void**)&pszFoo) == S_OK);
+         nExpectedLoads += nRunLoads;
+         CHECK_EQUAL(nExpectedLoads, g_nStringLoads);
+         CHECK(pszFoo != NULL && strcmp(pszFoo, kReversedFoo) == 0);
+
+         cFuture<void *> future;
+         CHECK(AccessResourceManager()->LoadAsync("bar.dat", kRT_ReverseData, NULL, &future) == S_OK);
+         CHECK(thread.Wait(future));
+         char * pszBar = NULL;
+         CHECK(future.GetResult((void**)&pszBar) == S_OK);
+         nExpectedLoads += nRunLoads;
+         CHECK_EQUAL(nExpectedLoads, g_nStringLoads);
+         CHECK(pszBar != NULL && strcmp(pszBar, "tad_rab_tad_rab_tad_rab_tad_rab") == 0);
+      }
+   }
+
+   Recreate();
+   RemoveDerivedDir();
+}
+
+////////////////////////////////////////
+
+class cTestResourceListener : public cComObject<IMPLEMENTS(IResourceListener)>
+{
+public:
+   virtual void DeleteThis() {}
+
+   virtual void OnResourceReloaded(const tChar * pszName, tResourceType type, void * pOldData, void * pNewData)
+   {
+      m_names.push_back(pszName);
+      m_types.push_back(type);
+      m_oldData.push_back(pOldData);
+      m_newData.push_back(pNewData);
+   }
+
+   vector<cStr> m_names;
+   vector<tResourceType> m_types;
+   vector<void *> m_oldData, m_newData;
+};
+
+#ifdef __linux__
+
+void * StringReverseCopyPostload(void * pData, int dataLength, void * loadParam)
+{
+   const char * psz = static_cast<const char *>(pData);
+   size_t length = strlen(psz);
+   char * pszReversed = new char[length + 1];
+   for (size_t i = 0; i < length; i++)
+   {
+      pszReversed[i] = psz[length - i - 1];
+   }
+   pszReversed[length] = 0;
+   return pszReversed;
+}
+
+static const char kTestHotReloadDir[] = "resourcemanagertest.hot";
+
+static bool WriteHotReloadFile(const char * pszName, const char * pszContents)
+{
+   cStr path(kTestHotReloadDir);
+   path += "/";
+   path += pszName;
+   FILE * fp = fopen(path.c_str(), "wb");
+   if (fp == NULL)
+   {
+      return false;
+   }
+   bool bResult = (fwrite(pszContents, strlen(pszContents), 1, fp) == 1);
+   return (fclose(fp) == 0) && bResult;
+}
+
+static void RemoveHotReloadFile(const char * pszName)
+{
+   cStr path(kTestHotReloadDir);
+   path += "/";
+   path += pszName;
+   remove(path.c_str());
+}
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerHotReload)
+{
+   mkdir(kTestHotReloadDir, 0755);
+   CHECK(WriteHotReloadFile("hot.dat", "hot_dat_1"));
+   CHECK(WriteHotReloadFile("cold.dat", "cold_dat_1"));
+
+   CHECK(AccessResourceManager()->AddDirectory(kTestHotReloadDir) == S_OK);
+   StartMonitoring();
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Data, "dat", StringLoad, NULL, StringUnload) == S_OK);
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_ReverseData, kRT_Data, "dat", NULL, StringReverseCopyPostload, StringUnload) == S_OK);
+
+   cTestResourceListener listener;
+   CHECK(AccessResourceManager()->AddResourceListener(&listener) == S_OK);
+
+   g_nStringLoads = g_nStringUnloads = 0;
+
+   char * pszHot = NULL, * pszCold = NULL;
+   CHECK(AccessResourceManager()->Load("hot.dat", kRT_ReverseData, NULL, (void**)&pszHot) == S_OK);
+   CHECK(AccessResourceManager()->Load("cold.dat", kRT_Data, NULL, (void**)&pszCold) == S_OK);
+   CHECK(AccessResourceManager()->Unlock("cold.dat", kRT_Data) == S_OK);
+   CHECK_EQUAL(2, g_nStringLoads);
+   CHECK_EQUAL(3, m_pDiagnostics->GetCacheSize());
+
+   ReloadChangedResources();
+   CHECK(listener.m_names.empty());
+
+   // Written over twice in one frame
+   CHECK(WriteHotReloadFile("hot.dat", "hot_dat_2"));
+   CHECK(WriteHotReloadFile("hot.dat", "hot_dat_3"));
+   CHECK(WriteHotReloadFile("cold.dat", "cold_dat_2"));
+   ReloadChangedResources();
+
+   // The locked resource and the one converted from it are reloaded once,
+   // and the unlocked one is just dropped. The old data of the locked one
+   // is still there for whoever holds it.
+   CHECK_EQUAL(3, g_nStringLoads);
+   CHECK_EQUAL(1, g_nStringUnloads);
+   CHECK(strcmp(pszHot, "1_tad_toh") == 0);
+   CHECK_EQUAL(2, m_pDiagnostics->GetCacheSize());
+   CHECK_EQUAL(2u, listener.m_names.size());
+   if (listener.m_names.size() == 2)
+   {
+      CHECK(listener.m_names[0] == "hot.dat" && listener.m_names[1] == "hot.dat");
+      CHECK(listener.m_types[0] == kRT_Data && listener.m_types[1] == kRT_ReverseData);
+      CHECK(listener.m_oldData[1] == pszHot && listener.m_newData[1] != pszHot);
+
+      char * pszHot2 = NULL;
+      CHECK(AccessResourceManager()->Load("hot.dat", kRT_ReverseData, NULL, (void**)&pszHot2) == S_OK);
+      CHECK(pszHot2 == listener.m_newData[1]);
+      CHECK(pszHot2 != NULL && strcmp(pszHot2, "3_tad_toh") == 0);
+   }
+
+   // The locks carried over, and the old data goes with the last of them
+   CHECK(AccessResourceManager()->Unlock("hot.dat", kRT_ReverseData) == S_OK);
+   CHECK_EQUAL(1, g_nStringUnloads);
+   CHECK(AccessResourceManager()->Unlock("hot.dat", kRT_ReverseData) == S_OK);
+   CHECK(AccessResourceManager()->Unlock("hot.dat", kRT_ReverseData) == S_FALSE);
+   CHECK_EQUAL(2, g_nStringUnloads);
+
+   CHECK(AccessResourceManager()->Load("cold.dat", kRT_Data, NULL, (void**)&pszCold) == S_OK);
+   CHECK_EQUAL(4, g_nStringLoads);
+   CHECK(pszCold != NULL && strcmp(pszCold, "cold_dat_2") == 0);
+
+   CHECK(AccessResourceManager()->RemoveResourceListener(&listener) == S_OK);
+
+   Recreate();
+   RemoveHotReloadFile("hot.dat");
+   RemoveHotReloadFile("cold.dat");
+   rmdir(kTestHotReloadDir);
+}
+
+#endif // __linux__
+
+////////////////////////////////////////
+
+// Reports its entries as changed when they are written over. Its one entry
+// doesn't exist until written if it is given no data.
+class cMonitoredTestResourceStore : public cComObject2<IMPLEMENTS(IResourceStore), IMPLEMENTS(IResourceStoreMonitor)>
+{
+public:
+   cMonitoredTestResourceStore(const tChar * pszName, const char * pszData)
+    : m_name(pszName), m_data((pszData != NULL) ? pszData : ""), m_bExists(pszData != NULL) {}
+
+   virtual tResult CollectResourceNames(const tChar * pszMatch, vector<cStr> * pNames)
+   {
+      if (m_bExists)
+      {
+         pNames->push_back(m_name);
+      }
+      return S_OK;
+   }
+
+   virtual tResult OpenEntry(const tChar * pszName, IReader * * ppReader)
+   {
+      if (!m_bExists || _tcsicmp(pszName, m_name.c_str()) != 0)
+      {
+         return E_FAIL;
+      }
+      return MemReaderCreate(reinterpret_cast<const byte *>(m_data.c_str()), m_data.length(), false, ppReader);
+   }
+
+   virtual tResult StartMonitoring() { return S_OK; }
+
+   virtual tResult CollectChangedNames(vector<cStr> * pNames)
+   {
+      pNames->insert(pNames->end(), m_changed.begin(), m_changed.end());
+      tResult result = m_changed.empty() ? S_FALSE : S_OK;
+      m_changed.clear();
+      return result;
+   }
+
+   void Write(const char * pszData)
+   {
+      m_data = pszData;
+      m_bExists = true;
+      m_changed.push_back(m_name);
+   }
+
+private:
+   cStr m_name, m_data;
+   bool m_bExists;
+   vector<cStr> m_changed;
+};
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerOpenWrittenAfterMiss)
+{
+   cTestResourceStore * pPackStore = AddTestData(&g_basicTestResources[0], _countof(g_basicTestResources));
+   cMonitoredTestResourceStore * pStore = new cMonitoredTestResourceStore(_T("late.dat"), NULL);
+   AddStore(static_cast<IResourceStore *>(pStore));
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Data, "dat", StringLoad, NULL, StringUnload) == S_OK);
+
+   char * psz = NULL;
+   CHECK(AccessResourceManager()->Load("late.dat", kRT_Data, NULL, (void**)&psz) != S_OK);
+   CHECK_EQUAL(0, pPackStore->GetOpenCount());
+
+   // Found without hot reload, and without asking the store that can't change
+   pStore->Write("late_1");
+   CHECK(AccessResourceManager()->Load("late.dat", kRT_Data, NULL, (void**)&psz) == S_OK);
+   CHECK(psz != NULL && strcmp(psz, "late_1") == 0);
+   CHECK_EQUAL(0, pPackStore->GetOpenCount());
+}
+
+static void * g_lastPostloadParam = NULL;
+
+void * ParamRecordingPostload(void * pData, int dataLength, void * loadParam)
+{
+   g_lastPostloadParam = loadParam;
+   return pData;
+}
+
+void * ParamRecordingCopyPostload(void * pData, int dataLength, void * loadParam)
+{
+   g_lastPostloadParam = loadParam;
+   const char * psz = static_cast<const char *>(pData);
+   char * pszCopy = new char[strlen(psz) + 1];
+   strcpy(pszCopy, psz);
+   return pszCopy;
+}
+
+TEST_FIXTURE(cResourceManagerTests, ResourceManagerHotReloadSameFileNameTwoStores)
+{
+   cMonitoredTestResourceStore * pStoreA = new cMonitoredTestResourceStore(_T("a/same.dat"), "a_1");
+   cMonitoredTestResourceStore * pStoreB = new cMonitoredTestResourceStore(_T("b/same.dat"), "b_1");
+   AddStore(static_cast<IResourceStore *>(pStoreA));
+   AddStore(static_cast<IResourceStore *>(pStoreB));
+   StartMonitoring();
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_Data, "dat", StringLoad, ParamRecordingPostload, StringUnload) == S_OK);
+   CHECK(AccessResourceManager()->RegisterFormat(kRT_ReverseData, kRT_Data, "dat", NULL, ParamRecordingCopyPostload, StringUnload) == S_OK);
+
+   cTestResourceListener listener;
+   CHECK(AccessResourceManager()->AddResourceListener(&listener) == S_OK);
+
+   int paramA = 0, paramB = 0;
+   char * pszA = NULL, * pszB = NULL;
+   CHECK(AccessResourceManager()->Load("a/same.dat", kRT_Data, &paramA, (void**)&pszA) == S_OK);
+   CHECK(AccessResourceManager()->Load("b/same.dat", kRT_ReverseData, &paramB, (void**)&pszB) == S_OK);
+   CHECK(pszA != NULL && strcmp(pszA, "a_1") == 0);
+   CHECK(pszB != NULL && strcmp(pszB, "b_1") == 0);
+
+   // Only the entries read from the store that changed are reloaded, each
+   // converted again with what it was first loaded with
+   g_lastPostloadParam = NULL;
+   pStoreB->Write("b_2");
+   ReloadChangedResources();
+   CHECK_EQUAL(2u, listener.m_names.size());
+   if (listener.m_names.size() == 2)
+   {
+      CHECK(listener.m_names[0] == "b/same.dat" && listener.m_names[1] == "b/same.dat");
+      CHECK(strcmp(static_cast<char *>(listener.m_newData[1]), "b_2") == 0);
+   }
+   CHECK(g_lastPostloadParam == &paramB);
+
+   listener.m_names.clear();
+   pStoreA->Write("a_2");
+   ReloadChangedResources();
+   CHECK_EQUAL(1u, listener.m_names.size());
+   CHECK(g_lastPostloadParam == &paramA);
+
+   CHECK(AccessResourceManager()->Load("a/same.dat", kRT_Data, &paramA, (void**)&pszA) == S_OK);
+   CHECK(pszA != NULL && strcmp(pszA, "a_2") == 0);
+
+   CHECK(AccessResourceManager()->RemoveResourceListener(&listener) == S_OK);
+}
+
 ////////////////////////////////////////
 // Try loading the same resource as two different types. This should be allowed.
 // For example, loading a map file as terrain or as properties.
@@ -14,6 +14,7 @@
 #endif
 
 F_DECLARE_INTERFACE(IResourceStore);
+F_DECLARE_INTERFACE(IResourceStoreMonitor);
 
 F_DECLARE_INTERFACE(IReader);
 
@@ -29,10 +30,34 @@ interface IResourceStore : IUnknown
    virtual tResult OpenEntry(const tChar * pszName, IReader * * ppReader) = 0;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: IResourceStoreMonitor
+//
+// Implemented by stores whose entries can change while the game runs
+
+interface IResourceStoreMonitor : IUnknown
+{
+   /// @return S_OK, S_FALSE if already started, or E_NOTIMPL if changes
+   /// can't be watched for on this platform
+   virtual tResult StartMonitoring() = 0;
+
+   /// Appends the names of the entries written since the last call, once each
+   /// @return S_OK if any were, S_FALSE if none were, or an E_xxx error code
+   virtual tResult CollectChangedNames(std::vector<cStr> * pNames) = 0;
+};
+
 tResult ResourceStoreCreateZip(const tChar * pszArchive, IResourceStore * * ppStore);
 
+/// @return S_OK, or S_FALSE if the file is not a resource pack (see resourcepack.h)
+tResult ResourceStoreCreatePack(const tChar * pszPack, IResourceStore * * ppStore);
+
 tResult ResourceStoreCreateFileSystem(const tChar * pszDir, IResourceStore * * ppStore);
 
+/// Makes a directory store that lists the given file names instead of
+/// reading the directory whenever its names are collected
+tResult ResourceStoreCreateFileSystem(const tChar * pszDir, const std::vector<cStr> & names, IResourceStore * * ppStore);
+
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -5,12 +5,29 @@
 
 #include "resourcestore.h"
 
+#include "tech/configapi.h"
 #include "tech/fileenum.h"
 #include "tech/filepath.h"
 #include "tech/filespec.h"
 #include "tech/readwriteapi.h"
 #include "tech/techstring.h"
 
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#include <algorithm>
+#include <map>
+#include <set>
+
 #include "tech/dbgalloc.h" // must be last header
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -29,36 +46,265 @@ LOG_EXTERN_CHANNEL(ResourceStore);
 #define LocalMsgIf3(cond,msg,a,b,c)    DebugMsgIfEx3(ResourceStore,(cond),msg,(a),(b),(c))
 #define LocalMsgIf4(cond,msg,a,b,c,d)  DebugMsgIfEx4(ResourceStore,(cond),msg,(a),(b),(c),(d))
 
+// Files at least this big are memory-mapped rather than read through stdio.
+// Set resource_map_threshold_kb to a negative value to never map files.
+// Directories being watched for changes are never mapped.
+static const int kDefaultMapThresholdKb = 64;
+
+
+#ifdef __linux__
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cDirectoryWatcher
+//
+// One inotify instance shared by every monitoring directory store, because a
+// flattened directory tree adds a store per directory and the per-user limit
+// on instances is small. Whichever store is polled first reads the events
+// for all of them. Stores are created and polled on one thread, so there is
+// no locking.
+
+class cDirectoryWatcher
+{
+   cDirectoryWatcher();
+   ~cDirectoryWatcher();
+
+public:
+   static cDirectoryWatcher * Acquire();
+   void Release();
+
+   int AddWatch(const tChar * pszDir);
+   void RemoveWatch(int watch);
+
+   tResult CollectChanges(int watch, std::vector<cStr> * pNames);
+
+private:
+   void ReadEvents();
+
+   static cDirectoryWatcher * gm_pWatcher;
+
+   int m_fd;
+   ulong m_nRefs;
+
+   // Stores on the same directory share its watch descriptor and changes
+   struct sWatch
+   {
+      sWatch() : nRefs(0) {}
+      ulong nRefs;
+      std::set<cStr> changes; // names written since last collected
+   };
+   typedef std::map<int, sWatch> tWatches;
+   tWatches m_watches;
+};
+
+cDirectoryWatcher * cDirectoryWatcher::gm_pWatcher = NULL;
+
+////////////////////////////////////////
+
+cDirectoryWatcher::cDirectoryWatcher()
+ : m_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+ , m_nRefs(0)
+{
+   ErrorMsgIf(m_fd < 0, "Unable to watch resource directories for changes\n");
+}
+
+////////////////////////////////////////
+
+cDirectoryWatcher::~cDirectoryWatcher()
+{
+   if (m_fd >= 0)
+   {
+      close(m_fd);
+   }
+}
+
+////////////////////////////////////////
+
+cDirectoryWatcher * cDirectoryWatcher::Acquire()
+{
+   if (gm_pWatcher == NULL)
+   {
+      gm_pWatcher = new cDirectoryWatcher;
+   }
+   gm_pWatcher->m_nRefs++;
+   return gm_pWatcher;
+}
+
+////////////////////////////////////////
+
+void cDirectoryWatcher::Release()
+{
+   Assert(this == gm_pWatcher);
+   if (--m_nRefs == 0)
+   {
+      delete this;
+      gm_pWatcher = NULL;
+   }
+}
+
+////////////////////////////////////////
+// Editors and exporters either rewrite a file or write a new one and rename
+// it over the old, so both closing a written file and moving one in count
+
+int cDirectoryWatcher::AddWatch(const tChar * pszDir)
+{
+   if (m_fd < 0)
+   {
+      return -1;
+   }
+
+   int watch = inotify_add_watch(m_fd, pszDir, IN_CLOSE_WRITE | IN_MOVED_TO);
+   if (watch < 0)
+   {
+      WarnMsg1("Unable to watch \"%s\" for changes\n", pszDir);
+      return -1;
+   }
+
+   m_watches[watch].nRefs++;
+   return watch;
+}
+
+////////////////////////////////////////
+
+void cDirectoryWatcher::RemoveWatch(int watch)
+{
+   tWatches::iterator f = m_watches.find(watch);
+   if (f != m_watches.end() && --f->second.nRefs == 0)
+   {
+      m_watches.erase(f);
+      inotify_rm_watch(m_fd, watch);
+   }
+}
+
+////////////////////////////////////////
+
+tResult cDirectoryWatcher::CollectChanges(int watch, std::vector<cStr> * pNames)
+{
+   ReadEvents();
+
+   tWatches::iterator f = m_watches.find(watch);
+   if (f == m_watches.end())
+   {
+      return E_FAIL;
+   }
+
+   std::set<cStr> & changes = f->second.changes;
+   if (changes.empty())
+   {
+      return S_FALSE;
+   }
+
+   pNames->insert(pNames->end(), changes.begin(), changes.end());
+   changes.clear();
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+void cDirectoryWatcher::ReadEvents()
+{
+   // Aligned for struct inotify_event
+   long buffer[1024];
+
+   for (;;)
+   {
+      ssize_t nBytesRead = read(m_fd, buffer, sizeof(buffer));
+      if (nBytesRead <= 0)
+      {
+         ErrorMsgIf(nBytesRead < 0 && errno != EAGAIN && errno != EINTR,
+            "Error reading resource directory changes\n");
+         break;
+      }
+
+      const char * p = reinterpret_cast<const char *>(buffer);
+      const char * pEnd = p + nBytesRead;
+      while (p < pEnd)
+      {
+         const struct inotify_event * pEvent = reinterpret_cast<const struct inotify_event *>(p);
+         if ((pEvent->mask & IN_Q_OVERFLOW) != 0)
+         {
+            WarnMsg("Too many resource files changed at once; some will not be reloaded\n");
+         }
+         else if (pEvent->len > 0 && pEvent->name[0] != '.' && (pEvent->mask & IN_ISDIR) == 0)
+         {
+            tWatches::iterator f = m_watches.find(pEvent->wd);
+            if (f != m_watches.end())
+            {
+               f->second.changes.insert(cStr(pEvent->name));
+            }
+         }
+         p += sizeof(struct inotify_event) + pEvent->len;
+      }
+   }
+}
+#endif // __linux__
+
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //
 // CLASS: cDirectoryResourceStore
 //
 
-class cDirectoryResourceStore : public cComObject<IMPLEMENTS(IResourceStore)>
+class cDirectoryResourceStore : public cComObject2<IMPLEMENTS(IResourceStore), IMPLEMENTS(IResourceStoreMonitor)>
 {
 public:
-   cDirectoryResourceStore(const tChar * pszDir);
+   cDirectoryResourceStore(const tChar * pszDir, const std::vector<cStr> * pNames);
    virtual ~cDirectoryResourceStore();
 
    virtual tResult CollectResourceNames(const tChar * pszMatch, std::vector<cStr> * pNames);
    virtual tResult OpenEntry(const tChar * pszName, IReader * * ppReader);
 
+   virtual tResult StartMonitoring();
+   virtual tResult CollectChangedNames(std::vector<cStr> * pNames);
+
 private:
    cStr m_dir;
+   bool m_bListed;
+   std::vector<cStr> m_names; // sorted; only if the names were given up front
+   bool m_bMapFiles;
+   ulong m_mapThreshold;
+#ifdef __linux__
+   cDirectoryWatcher * m_pWatcher;
+   int m_watch;
+#endif
 };
 
 ////////////////////////////////////////
 
-cDirectoryResourceStore::cDirectoryResourceStore(const tChar * pszDir)
+cDirectoryResourceStore::cDirectoryResourceStore(const tChar * pszDir, const std::vector<cStr> * pNames)
  : m_dir((pszDir != NULL) ? pszDir : _T(""))
+ , m_bListed(pNames != NULL)
+ , m_bMapFiles(true)
+ , m_mapThreshold(0)
+#ifdef __linux__
+ , m_pWatcher(NULL)
+ , m_watch(-1)
+#endif
 {
+   int mapThresholdKb = kDefaultMapThresholdKb;
+   ConfigGet(_T("resource_map_threshold_kb"), &mapThresholdKb);
+   m_bMapFiles = (mapThresholdKb >= 0);
+   m_mapThreshold = m_bMapFiles ? static_cast<ulong>(mapThresholdKb) * 1024 : 0;
+
+   if (pNames != NULL)
+   {
+      m_names = *pNames;
+      std::sort(m_names.begin(), m_names.end());
+   }
 }
 
 ////////////////////////////////////////
 
 cDirectoryResourceStore::~cDirectoryResourceStore()
 {
+#ifdef __linux__
+   if (m_pWatcher != NULL)
+   {
+      m_pWatcher->RemoveWatch(m_watch);
+      m_pWatcher->Release();
+      m_pWatcher = NULL;
+   }
+#endif
 }
 
 ////////////////////////////////////////
@@ -75,6 +321,21 @@ tResult cDirectoryResourceStore::CollectResourceNames(const tChar * pszMatch, st
       return E_FAIL;
    }
 
+   if (m_bListed)
+   {
+      std::vector<cStr>::const_iterator iter = m_names.begin(), end = m_names.end();
+      for (; iter != end; ++iter)
+      {
+         if (WildCardMatch(pszMatch, iter->c_str()))
+         {
+            cFileSpec file(iter->c_str());
+            file.SetPath(cFilePath(m_dir.c_str()));
+            pNames->push_back(file.CStr());
+         }
+      }
+      return S_OK;
+   }
+
    cFileSpec wildcard(pszMatch);
    wildcard.SetPath(cFilePath(m_dir.c_str()));
 
@@ -121,6 +382,24 @@ tResult cDirectoryResourceStore::OpenEntry(const tChar * pszName, IReader * * pp
    cFileSpec file(pszName);
    file.SetPath(cFilePath(m_dir.c_str()));
 
+   if (m_bMapFiles)
+   {
+#ifdef _WIN32
+      struct _stat fileStat;
+      if (_tstat(file.CStr(), &fileStat) == 0
+#else
+      struct stat fileStat;
+      if (stat(file.CStr(), &fileStat) == 0
+#endif
+         && fileStat.st_size > 0
+         && static_cast<ulong>(fileStat.st_size) >= m_mapThreshold
+         && MappedFileReaderCreate(file, ppReader) == S_OK)
+      {
+         LocalMsg2("Mapped %s (%d bytes)\n", file.CStr(), static_cast<int>(fileStat.st_size));
+         return S_OK;
+      }
+   }
+
    tResult result = E_FAIL;
    cAutoIPtr<IReader> pReader;
    if ((result = FileReaderCreate(file, kFileModeBinary, &pReader)) != S_OK)
@@ -134,6 +413,69 @@ tResult cDirectoryResourceStore::OpenEntry(const tChar * pszName, IReader * * pp
 
 ////////////////////////////////////////
 
+tResult cDirectoryResourceStore::StartMonitoring()
+{
+#ifdef __linux__
+   if (m_pWatcher != NULL)
+   {
+      return S_FALSE;
+   }
+
+   cDirectoryWatcher * pWatcher = cDirectoryWatcher::Acquire();
+   int watch = pWatcher->AddWatch(m_dir.c_str());
+   if (watch < 0)
+   {
+      pWatcher->Release();
+      return E_FAIL;
+   }
+
+   LocalMsg1("Watching %s for changes\n", m_dir.c_str());
+   m_pWatcher = pWatcher;
+   m_watch = watch;
+
+   // A watched directory is one that gets written to, and a mapped file that
+   // is truncated underneath its reader faults instead of coming up short
+   m_bMapFiles = false;
+   return S_OK;
+#else
+   return E_NOTIMPL;
+#endif
+}
+
+////////////////////////////////////////
+
+tResult cDirectoryResourceStore::CollectChangedNames(std::vector<cStr> * pNames)
+{
+   if (pNames == NULL)
+   {
+      return E_POINTER;
+   }
+
+#ifdef __linux__
+   if (m_pWatcher != NULL)
+   {
+      size_t first = pNames->size();
+      tResult result = m_pWatcher->CollectChanges(m_watch, pNames);
+
+      // New files have to be listed too
+      for (size_t i = first; m_bListed && i < pNames->size(); i++)
+      {
+         std::vector<cStr>::iterator pos = std::lower_bound(m_names.begin(), m_names.end(), (*pNames)[i]);
+         if (pos == m_names.end() || *pos != (*pNames)[i])
+         {
+            m_names.insert(pos, (*pNames)[i]);
+         }
+      }
+
+      return result;
+   }
+#endif
+
+   return S_FALSE;
+}
+
+////////////////////////////////////////
+
 tResult ResourceStoreCreateFileSystem(const tChar * pszDir, IResourceStore * * ppStore)
 {
    if (pszDir == NULL || ppStore == NULL)
@@ -141,7 +483,26 @@ tResult ResourceStoreCreateFileSystem(const tChar * pszDir, IResourceStore * * p
       return E_POINTER;
    }
 
-   IResourceStore * pStore = static_cast<IResourceStore *>(new cDirectoryResourceStore(pszDir));
+   IResourceStore * pStore = static_cast<IResourceStore *>(new cDirectoryResourceStore(pszDir, NULL));
+   if (pStore == NULL)
+   {
+      return E_OUTOFMEMORY;
+   }
+
+   *ppStore = pStore;
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult ResourceStoreCreateFileSystem(const tChar * pszDir, const std::vector<cStr> & names, IResourceStore * * ppStore)
+{
+   if (pszDir == NULL || ppStore == NULL)
+   {
+      return E_POINTER;
+   }
+
+   IResourceStore * pStore = static_cast<IResourceStore *>(new cDirectoryResourceStore(pszDir, &names));
    if (pStore == NULL)
    {
       return E_OUTOFMEMORY;
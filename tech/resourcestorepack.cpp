@@ -0,0 +1,833 @@
+////////////////////////////////////////////////////////////////////////////////
+// $Id$
+
+#include "stdhdr.h"
+
+#include "dirscan.h"
+#include "resourcestore.h"
+#include "resourceutils.h"
+
+#include "tech/filepath.h"
+#include "tech/filespec.h"
+#include "tech/lzcompress.h"
+#include "tech/readwriteapi.h"
+#include "tech/resourcepack.h"
+#include "tech/techstring.h"
+
+#ifdef HAVE_UNITTESTPP
+#include "UnitTest++.h"
+#include "tech/techtime.h"
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <vector>
+
+#include "tech/dbgalloc.h" // must be last header
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////
+
+LOG_EXTERN_CHANNEL(ResourceStore);
+
+#define LocalMsg(msg)            DebugMsgEx(ResourceStore,msg)
+#define LocalMsg1(msg,a)         DebugMsgEx1(ResourceStore,msg,(a))
+#define LocalMsg2(msg,a,b)       DebugMsgEx2(ResourceStore,msg,(a),(b))
+#define LocalMsg3(msg,a,b,c)     DebugMsgEx3(ResourceStore,msg,(a),(b),(c))
+
+////////////////////////////////////////////////////////////////////////////////
+
+AssertAtCompileTime(sizeof(sResourcePackHeader) == 40);
+AssertAtCompileTime(sizeof(sResourcePackEntry) == 32);
+
+// Compressing is only worth the decode time if it saves at least this much
+static const uint kMinCompressionSavingsPercent = 12;
+static const uint kMinCompressibleSize = 256;
+
+// Entries that fit in a page are only aligned this much
+static const uint kSmallEntryAlignment = 16;
+
+static inline uint64 PackAlign(uint64 offset, uint64 alignment)
+{
+   return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+static inline tChar PackFoldCase(tChar c)
+{
+   return (c >= _T('A') && c <= _T('Z')) ? (c - _T('A') + _T('a')) : c;
+}
+
+// Pack names are stored as narrow strings, which covers the plain ASCII file
+// names used for game data in both narrow and wide builds. Like the resource
+// manager's store index, and ResourceIdFromNameNoCase which the table is
+// sorted by, names match without regard to ASCII case.
+static bool PackNameEquals(const char * pPackName, size_t length, const tChar * pszName)
+{
+   for (size_t i = 0; i < length; i++)
+   {
+      if (PackFoldCase(static_cast<tChar>(static_cast<byte>(pPackName[i]))) != PackFoldCase(pszName[i]))
+      {
+         return false;
+      }
+   }
+   return pszName[length] == 0;
+}
+
+static cStr PackNameToStr(const char * pPackName, size_t length)
+{
+   cStr name;
+   name.reserve(length);
+   for (size_t i = 0; i < length; i++)
+   {
+      name += static_cast<tChar>(static_cast<byte>(pPackName[i]));
+   }
+   return name;
+}
+
+class cPackNameLess
+{
+public:
+   bool operator()(const cStr & lhs, const cStr & rhs) const
+   {
+      return _tcsicmp(lhs.c_str(), rhs.c_str()) < 0;
+   }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cPackResourceStore
+//
+// Serves entries from a memory-mapped pack. The table of contents is used
+// in place: a lookup is one hash, a binary search and one name comparison.
+// Nothing is modified after the pack is validated, so entries can be opened
+// from any number of threads at once.
+
+class cPackResourceStore : public cComObject<IMPLEMENTS(IResourceStore)>
+{
+public:
+   cPackResourceStore(IMappedReader * pPack, const byte * pData, size_t dataSize);
+   virtual ~cPackResourceStore();
+
+   tResult ReadTableOfContents();
+
+   virtual tResult CollectResourceNames(const tChar * pszMatch, vector<cStr> * pNames);
+   virtual tResult OpenEntry(const tChar * pszName, IReader * * ppReader);
+
+private:
+   const sResourcePackEntry * FindEntry(const tChar * pszName) const;
+
+   const char * GetEntryName(const sResourcePackEntry & entry) const
+   {
+      return m_pNames + entry.nameOffset;
+   }
+
+   cAutoIPtr<IMappedReader> m_pPack;
+   const byte * m_pData;
+   size_t m_dataSize;
+
+   const sResourcePackEntry * m_pEntries;
+   uint m_nEntries;
+   const char * m_pNames;
+};
+
+////////////////////////////////////////
+
+cPackResourceStore::cPackResourceStore(IMappedReader * pPack, const byte * pData, size_t dataSize)
+ : m_pPack(CTAddRef(pPack))
+ , m_pData(pData)
+ , m_dataSize(dataSize)
+ , m_pEntries(NULL)
+ , m_nEntries(0)
+ , m_pNames(NULL)
+{
+}
+
+////////////////////////////////////////
+
+cPackResourceStore::~cPackResourceStore()
+{
+}
+
+////////////////////////////////////////
+
+tResult cPackResourceStore::ReadTableOfContents()
+{
+   if (m_dataSize < sizeof(sResourcePackHeader))
+   {
+      return E_FAIL;
+   }
+
+   const sResourcePackHeader * pHeader = reinterpret_cast<const sResourcePackHeader *>(m_pData);
+   if (pHeader->magic != kResourcePackMagic)
+   {
+      return E_FAIL;
+   }
+
+   if (pHeader->version != kResourcePackVersion)
+   {
+      ErrorMsg2("Resource pack version %d is not supported (expected %d)\n",
+         pHeader->version, kResourcePackVersion);
+      return E_FAIL;
+   }
+
+   uint64 tocSize = static_cast<uint64>(pHeader->nEntries) * sizeof(sResourcePackEntry);
+   if ((pHeader->tocOffset % sizeof(uint64)) != 0
+      || pHeader->tocOffset > m_dataSize || tocSize > (m_dataSize - pHeader->tocOffset)
+      || pHeader->namesOffset > m_dataSize || pHeader->namesSize > (m_dataSize - pHeader->namesOffset))
+   {
+      ErrorMsg("Resource pack table of contents lies outside of the pack\n");
+      return E_FAIL;
+   }
+
+   const sResourcePackEntry * pEntries = reinterpret_cast<const sResourcePackEntry *>(m_pData + pHeader->tocOffset);
+   const char * pNames = reinterpret_cast<const char *>(m_pData + pHeader->namesOffset);
+
+   // Validate everything once here so that lookups can trust the table
+   for (uint i = 0; i < pHeader->nEntries; i++)
+   {
+      const sResourcePackEntry & entry = pEntries[i];
+
+      bool bValid = (entry.nameOffset < pHeader->namesSize)
+         && (entry.nameLength < (pHeader->namesSize - entry.nameOffset))
+         && (pNames[entry.nameOffset + entry.nameLength] == 0)
+         && (entry.dataOffset <= m_dataSize)
+         && (entry.storedSize <= (m_dataSize - entry.dataOffset))
+         && (i == 0 || pEntries[i - 1].nameHash <= entry.nameHash);
+
+      if (bValid)
+      {
+         if (entry.compression == kRPC_None)
+         {
+            bValid = (entry.storedSize == entry.size);
+         }
+         else if (entry.compression != kRPC_LZ)
+         {
+            bValid = false;
+         }
+      }
+
+      if (!bValid)
+      {
+         ErrorMsg1("Bad resource pack table of contents entry %d\n", i);
+         return E_FAIL;
+      }
+   }
+
+   m_pEntries = pEntries;
+   m_nEntries = pHeader->nEntries;
+   m_pNames = pNames;
+
+   LocalMsg1("Resource pack has %d entries\n", m_nEntries);
+
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cPackResourceStore::CollectResourceNames(const tChar * pszMatch, vector<cStr> * pNames)
+{
+   if (pNames == NULL)
+   {
+      return E_POINTER;
+   }
+
+   for (uint i = 0; i < m_nEntries; i++)
+   {
+      cStr name(PackNameToStr(GetEntryName(m_pEntries[i]), m_pEntries[i].nameLength));
+      if (pszMatch == NULL || WildCardMatch(pszMatch, name.c_str()))
+      {
+         pNames->push_back(name);
+      }
+   }
+
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cPackResourceStore::OpenEntry(const tChar * pszName, IReader * * ppReader)
+{
+   if (pszName == NULL || ppReader == NULL)
+   {
+      return E_POINTER;
+   }
+
+   const sResourcePackEntry * pEntry = FindEntry(pszName);
+   if (pEntry == NULL)
+   {
+      return E_FAIL;
+   }
+
+   const byte * pStored = m_pData + pEntry->dataOffset;
+
+   if (pEntry->compression == kRPC_None)
+   {
+      // Stored entries are handed out in place, keeping the pack mapped
+      return MemReaderCreateView(pStored, pEntry->size, m_pPack, ppReader);
+   }
+
+   byte * pBuffer = new byte[pEntry->size];
+   if (pBuffer == NULL)
+   {
+      return E_OUTOFMEMORY;
+   }
+
+   if (LZDecompress(pStored, pEntry->storedSize, pBuffer, pEntry->size) != S_OK)
+   {
+      ErrorMsg1("Failed to decompress resource pack entry \"%s\"\n", pszName);
+      delete [] pBuffer;
+      return E_FAIL;
+   }
+
+   tResult result = MemReaderCreate(pBuffer, pEntry->size, true, ppReader);
+   if (result != S_OK)
+   {
+      delete [] pBuffer;
+   }
+   return result;
+}
+
+////////////////////////////////////////
+
+const sResourcePackEntry * cPackResourceStore::FindEntry(const tChar * pszName) const
+{
+   uint64 hash = ResourceIdFromNameNoCase(pszName);
+
+   uint first = 0, count = m_nEntries;
+   while (count > 0)
+   {
+      uint half = count / 2;
+      if (m_pEntries[first + half].nameHash < hash)
+      {
+         first += half + 1;
+         count -= half + 1;
+      }
+      else
+      {
+         count = half;
+      }
+   }
+
+   for (uint i = first; i < m_nEntries && m_pEntries[i].nameHash == hash; i++)
+   {
+      if (PackNameEquals(GetEntryName(m_pEntries[i]), m_pEntries[i].nameLength, pszName))
+      {
+         return &m_pEntries[i];
+      }
+   }
+
+   return NULL;
+}
+
+////////////////////////////////////////
+
+tResult ResourceStoreCreatePack(const tChar * pszPack, IResourceStore * * ppStore)
+{
+   if (pszPack == NULL || ppStore == NULL)
+   {
+      return E_POINTER;
+   }
+
+   cAutoIPtr<IReader> pReader;
+   cAutoIPtr<IMappedReader> pPack;
+   const byte * pData = NULL;
+   size_t dataSize = 0;
+   if (MappedFileReaderCreate(cFileSpec(pszPack), &pReader) != S_OK
+      || pReader->QueryInterface(IID_IMappedReader, (void**)&pPack) != S_OK
+      || pPack->GetMappedData(&pData, &dataSize) != S_OK)
+   {
+      return S_FALSE;
+   }
+
+   cAutoIPtr<cPackResourceStore> pStore(new cPackResourceStore(pPack, pData, dataSize));
+   if (!pStore)
+   {
+      return E_OUTOFMEMORY;
+   }
+
+   if (pStore->ReadTableOfContents() != S_OK)
+   {
+      return S_FALSE;
+   }
+
+   *ppStore = CTAddRef(static_cast<IResourceStore *>(pStore));
+   return S_OK;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Pack building
+//
+
+struct sPackSource
+{
+   cStr name;
+   cStr path;
+};
+
+// Scans the tree the same way cResourceManager::AddDirectoryTreeFlattened
+// does so that a pack resolves duplicate names the same way
+static tResult CollectPackSources(const cFilePath & root, vector<sPackSource> * pSources)
+{
+   cDirectoryScan scan;
+   if (scan.Scan(root.CStr(), NULL) != S_OK)
+   {
+      return E_FAIL;
+   }
+
+   // Lookups ignore case, so names that differ only in case collide
+   set<cStr, cPackNameLess> namesSeen;
+   for (size_t i = 0; i < scan.GetDirectoryCount(); i++)
+   {
+      cFilePath dir(scan.GetDirectory(i).c_str());
+      const vector<cStr> & names = scan.GetFileNames(i);
+      vector<cStr>::const_iterator iter = names.begin(), end = names.end();
+      for (; iter != end; ++iter)
+      {
+         cFileSpec file(iter->c_str());
+         file.SetPath(dir);
+
+         sPackSource source;
+         source.name = *iter;
+         source.path = file.CStr();
+
+         if (!namesSeen.insert(source.name).second)
+         {
+            WarnMsg1("Skipping \"%s\" because an earlier file has the same name\n", source.path.c_str());
+            continue;
+         }
+
+         pSources->push_back(source);
+      }
+   }
+
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+static tResult ReadWholeFile(const tChar * pszFile, vector<byte> * pContents)
+{
+   cAutoIPtr<IReader> pReader;
+   ulong length = 0;
+   if (FileReaderCreate(cFileSpec(pszFile), kFileModeBinary, &pReader) != S_OK
+      || pReader->Seek(0, kSO_End) != S_OK
+      || pReader->Tell(&length) != S_OK
+      || pReader->Seek(0, kSO_Set) != S_OK)
+   {
+      return E_FAIL;
+   }
+
+   pContents->resize(length);
+   if (length > 0 && pReader->Read(&(*pContents)[0], length) != S_OK)
+   {
+      return E_FAIL;
+   }
+
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+static tResult WritePadding(IWriter * pWriter, uint64 * pOffset, uint64 newOffset)
+{
+   static const byte zeros[kSmallEntryAlignment * 16] = { 0 };
+   while (*pOffset < newOffset)
+   {
+      size_t nBytes = static_cast<size_t>(Min(newOffset - *pOffset, static_cast<uint64>(sizeof(zeros))));
+      if (pWriter->Write(zeros, nBytes) != S_OK)
+      {
+         return E_FAIL;
+      }
+      *pOffset += nBytes;
+   }
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+class cPackEntryLess
+{
+public:
+   cPackEntryLess(const vector<char> & names) : m_names(names) {}
+
+   bool operator()(const sResourcePackEntry & a, const sResourcePackEntry & b) const
+   {
+      if (a.nameHash != b.nameHash)
+      {
+         return a.nameHash < b.nameHash;
+      }
+      return strcmp(&m_names[a.nameOffset], &m_names[b.nameOffset]) < 0;
+   }
+
+private:
+   const vector<char> & m_names;
+};
+
+////////////////////////////////////////
+
+tResult ResourcePackBuild(const tChar * pszDir, const tChar * pszPack, uint flags)
+{
+   if (pszDir == NULL || pszPack == NULL)
+   {
+      return E_POINTER;
+   }
+
+   cFilePath root(pszDir);
+   root.MakeFullPath();
+
+   vector<sPackSource> sources;
+   if (CollectPackSources(root, &sources) != S_OK)
+   {
+      ErrorMsg1("Unable to read \"%s\"\n", root.CStr());
+      return E_FAIL;
+   }
+
+   cAutoIPtr<IWriter> pWriter;
+   if (FileWriterCreate(cFileSpec(pszPack), kFileModeBinary, &pWriter) != S_OK)
+   {
+      ErrorMsg1("Unable to open \"%s\" for writing\n", pszPack);
+      return E_FAIL;
+   }
+
+   sResourcePackHeader header;
+   memset(&header, 0, sizeof(header));
+   header.magic = kResourcePackMagic;
+   header.version = kResourcePackVersion;
+   header.alignment = kResourcePackAlignment;
+
+   // The real header is written last, once the offsets are known
+   if (pWriter->Write(&header, sizeof(header)) != S_OK)
+   {
+      return E_FAIL;
+   }
+   uint64 offset = sizeof(header);
+
+   vector<sResourcePackEntry> entries;
+   vector<char> names;
+   vector<byte> contents, compressed;
+   uint64 totalSize = 0, totalStored = 0;
+
+   vector<sPackSource>::const_iterator iter = sources.begin();
+   for (; iter != sources.end(); iter++)
+   {
+      if (ReadWholeFile(iter->path.c_str(), &contents) != S_OK)
+      {
+         ErrorMsg1("Unable to read \"%s\"\n", iter->path.c_str());
+         return E_FAIL;
+      }
+
+      if (contents.size() > 0xFFFFFFFF || iter->name.length() > 0xFFFF)
+      {
+         ErrorMsg1("\"%s\" is too large for a resource pack\n", iter->path.c_str());
+         return E_FAIL;
+      }
+
+      sResourcePackEntry entry;
+      memset(&entry, 0, sizeof(entry));
+      entry.nameHash = ResourceIdFromNameNoCase(iter->name.c_str());
+      entry.size = static_cast<uint32>(contents.size());
+      entry.storedSize = entry.size;
+      entry.nameOffset = static_cast<uint32>(names.size());
+      entry.nameLength = static_cast<uint16>(iter->name.length());
+      entry.compression = kRPC_None;
+
+      for (size_t i = 0; i < iter->name.length(); i++)
+      {
+         names.push_back(static_cast<char>(iter->name[i]));
+      }
+      names.push_back(0);
+
+      const byte * pStored = contents.empty() ? NULL : &contents[0];
+
+      if ((flags & kRPBF_Compress) != 0 && contents.size() >= kMinCompressibleSize)
+      {
+         // Limiting the output size makes LZCompress give up on entries that
+         // wouldn't shrink enough
+         size_t maxCompressedSize = contents.size() - (contents.size() * kMinCompressionSavingsPercent / 100);
+         compressed.resize(maxCompressedSize);
+         size_t compressedSize = 0;
+         if (LZCompress(&contents[0], contents.size(), &compressed[0], compressed.size(), &compressedSize) == S_OK)
+         {
+            entry.storedSize = static_cast<uint32>(compressedSize);
+            entry.compression = kRPC_LZ;
+            pStored = &compressed[0];
+         }
+      }
+
+      // Large entries start on a page; small ones just stay within one
+      uint64 dataOffset = PackAlign(offset, kSmallEntryAlignment);
+      if (entry.storedSize > kResourcePackAlignment
+         || (entry.storedSize > 0 && (dataOffset / kResourcePackAlignment) != ((dataOffset + entry.storedSize - 1) / kResourcePackAlignment)))
+      {
+         dataOffset = PackAlign(offset, kResourcePackAlignment);
+      }
+
+      if (WritePadding(pWriter, &offset, dataOffset) != S_OK
+         || (entry.storedSize > 0 && pWriter->Write(pStored, entry.storedSize) != S_OK))
+      {
+         ErrorMsg1("Error writing \"%s\"\n", pszPack);
+         return E_FAIL;
+      }
+
+      entry.dataOffset = dataOffset;
+      offset += entry.storedSize;
+
+      entries.push_back(entry);
+
+      totalSize += entry.size;
+      totalStored += entry.storedSize;
+
+      LocalMsg3("Packed \"%s\" (%d -> %d bytes)\n", iter->name.c_str(), entry.size, entry.storedSize);
+   }
+
+   if (!entries.empty())
+   {
+      sort(entries.begin(), entries.end(), cPackEntryLess(names));
+   }
+
+   header.nEntries = static_cast<uint32>(entries.size());
+   header.tocOffset = PackAlign(offset, sizeof(uint64));
+   header.namesOffset = header.tocOffset + entries.size() * sizeof(sResourcePackEntry);
+   header.namesSize = names.size();
+
+   if (WritePadding(pWriter, &offset, header.tocOffset) != S_OK
+      || (!entries.empty() && pWriter->Write(&entries[0], entries.size() * sizeof(sResourcePackEntry)) != S_OK)
+      || (!names.empty() && pWriter->Write(&names[0], names.size()) != S_OK)
+      || pWriter->Seek(0, kSO_Set) != S_OK
+      || pWriter->Write(&header, sizeof(header)) != S_OK)
+   {
+      ErrorMsg1("Error writing \"%s\"\n", pszPack);
+      return E_FAIL;
+   }
+
+   InfoMsg3("Packed %d files, %d bytes stored as %d\n", static_cast<uint>(entries.size()),
+      static_cast<uint>(totalSize), static_cast<uint>(totalStored));
+
+   return S_OK;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef HAVE_UNITTESTPP
+
+namespace
+{
+   const char g_szTestDir[] = "resourcestorepack.dir";
+   const char g_szTestSubDir[] = "resourcestorepack.dir/sub";
+   const char g_szTestPack[] = "resourcestorepack.tmp";
+
+   void MakePackTestData(uint seed, size_t size, vector<byte> * pData)
+   {
+      static const char szWords[] = "vertex index mesh joint texture material terrain tile ";
+      pData->resize(size);
+      for (size_t i = 0; i < size; i++)
+      {
+         (*pData)[i] = ((i + seed) % 97 == 0) ? static_cast<byte>(i * seed) : szWords[(i + seed) % (sizeof(szWords) - 1)];
+      }
+   }
+
+   bool MakeTestDir(const char * pszDir)
+   {
+#ifdef _WIN32
+      return _mkdir(pszDir) == 0;
+#else
+      return mkdir(pszDir, 0755) == 0;
+#endif
+   }
+
+   void RemoveTestDir(const char * pszDir)
+   {
+#ifdef _WIN32
+      _rmdir(pszDir);
+#else
+      rmdir(pszDir);
+#endif
+   }
+
+   bool WriteTestFile(const char * pszDir, const char * pszName, const vector<byte> & data)
+   {
+      std::string path = std::string(pszDir) + "/" + pszName;
+      FILE * fp = fopen(path.c_str(), "wb");
+      if (fp == NULL)
+      {
+         return false;
+      }
+      bool bResult = data.empty() || (fwrite(&data[0], data.size(), 1, fp) == 1);
+      return (fclose(fp) == 0) && bResult;
+   }
+
+   void RemoveTestFile(const char * pszDir, const char * pszName)
+   {
+      std::string path = std::string(pszDir) + "/" + pszName;
+      remove(path.c_str());
+   }
+
+   bool ReadEntry(IResourceStore * pStore, const tChar * pszName, vector<byte> * pData)
+   {
+      cAutoIPtr<IReader> pReader;
+      ulong length = 0;
+      if (pStore->OpenEntry(pszName, &pReader) != S_OK
+         || pReader->Seek(0, kSO_End) != S_OK
+         || pReader->Tell(&length) != S_OK
+         || pReader->Seek(0, kSO_Set) != S_OK)
+      {
+         return false;
+      }
+      pData->resize(length);
+      return (length == 0) || (pReader->Read(&(*pData)[0], length) == S_OK);
+   }
+}
+
+TEST(PackResourceStoreBuildAndRead)
+{
+   vector<byte> big, small, dup, random(20000), empty;
+   MakePackTestData(1, 100000, &big);
+   MakePackTestData(2, 300, &small);
+   MakePackTestData(3, 500, &dup);
+   for (size_t i = 0; i < random.size(); i++)
+   {
+      random[i] = static_cast<byte>(rand());
+   }
+
+   CHECK(MakeTestDir(g_szTestDir));
+   CHECK(MakeTestDir(g_szTestSubDir));
+   CHECK(WriteTestFile(g_szTestDir, "big.dat", big));
+   CHECK(WriteTestFile(g_szTestDir, "small.txt", small));
+   CHECK(WriteTestFile(g_szTestDir, "empty.txt", empty));
+   CHECK(WriteTestFile(g_szTestSubDir, "random.dat", random));
+   CHECK(WriteTestFile(g_szTestSubDir, "small.txt", dup));
+
+   CHECK_EQUAL(S_OK, ResourcePackBuild(_T("resourcestorepack.dir"), _T("resourcestorepack.tmp"), kRPBF_Compress));
+
+   {
+      cAutoIPtr<IResourceStore> pStore;
+      CHECK_EQUAL(S_OK, ResourceStoreCreatePack(_T("resourcestorepack.tmp"), &pStore));
+
+      vector<cStr> names;
+      CHECK_EQUAL(S_OK, pStore->CollectResourceNames(_T("*"), &names));
+      CHECK_EQUAL(4, names.size());
+      names.clear();
+      CHECK_EQUAL(S_OK, pStore->CollectResourceNames(_T("*.dat"), &names));
+      CHECK_EQUAL(2, names.size());
+
+      vector<byte> data;
+      CHECK(ReadEntry(pStore, _T("big.dat"), &data) && data == big);
+      CHECK(ReadEntry(pStore, _T("random.dat"), &data) && data == random);
+      CHECK(ReadEntry(pStore, _T("empty.txt"), &data) && data.empty());
+      // The file in the top directory wins, as with a flattened tree
+      CHECK(ReadEntry(pStore, _T("small.txt"), &data) && data == small);
+      // Names match without regard to case, like the resource manager's index
+      CHECK(ReadEntry(pStore, _T("Big.DAT"), &data) && data == big);
+
+      cAutoIPtr<IReader> pReader;
+      CHECK(pStore->OpenEntry(_T("missing.dat"), &pReader) != S_OK);
+      CHECK(pStore->OpenEntry(_T("big.da"), &pReader) != S_OK);
+
+      // Incompressible entries are stored and served in place, page-aligned
+      CHECK_EQUAL(S_OK, pStore->OpenEntry(_T("random.dat"), &pReader));
+      cAutoIPtr<IMappedReader> pMappedReader;
+      CHECK_EQUAL(S_OK, pReader->QueryInterface(IID_IMappedReader, (void**)&pMappedReader));
+      const byte * pData = NULL;
+      size_t dataSize = 0;
+      CHECK_EQUAL(S_OK, pMappedReader->GetMappedData(&pData, &dataSize));
+      CHECK_EQUAL(random.size(), dataSize);
+      CHECK_EQUAL(0, reinterpret_cast<size_t>(pData) % kResourcePackAlignment);
+
+      // The view must stay valid after the store goes away
+      SafeRelease(pStore);
+      CHECK(memcmp(&random[0], pData, dataSize) == 0);
+   }
+
+   // Anything that isn't a pack is turned down quietly
+   {
+      cAutoIPtr<IResourceStore> pStore;
+      CHECK_EQUAL(S_FALSE, ResourceStoreCreatePack(_T("resourcestorepack.dir/big.dat"), &pStore));
+      CHECK_EQUAL(S_FALSE, ResourceStoreCreatePack(_T("missing.tmp"), &pStore));
+   }
+
+   RemoveTestFile(g_szTestSubDir, "random.dat");
+   RemoveTestFile(g_szTestSubDir, "small.txt");
+   RemoveTestFile(g_szTestDir, "big.dat");
+   RemoveTestFile(g_szTestDir, "small.txt");
+   RemoveTestFile(g_szTestDir, "empty.txt");
+   RemoveTestDir(g_szTestSubDir);
+   RemoveTestDir(g_szTestDir);
+   CHECK(remove(g_szTestPack) == 0);
+}
+
+TEST(PackResourceStoreTimeTrial)
+{
+   static const uint kNumEntries = 128;
+   static const size_t kEntrySize = 256 * 1024;
+
+   CHECK(MakeTestDir(g_szTestDir));
+
+   vector<byte> data;
+   for (uint i = 0; i < kNumEntries; i++)
+   {
+      char szName[32];
+      _snprintf(szName, _countof(szName), "entry%03d.dat", i);
+      MakePackTestData(i, kEntrySize, &data);
+      CHECK(WriteTestFile(g_szTestDir, szName, data));
+   }
+
+   static const uint buildFlags[] = { kRPBF_None, kRPBF_Compress };
+   for (int f = 0; f < _countof(buildFlags); f++)
+   {
+      CHECK_EQUAL(S_OK, ResourcePackBuild(_T("resourcestorepack.dir"), _T("resourcestorepack.tmp"), buildFlags[f]));
+
+      double openTime = -TimeGetSecs();
+      cAutoIPtr<IResourceStore> pStore;
+      CHECK_EQUAL(S_OK, ResourceStoreCreatePack(_T("resourcestorepack.tmp"), &pStore));
+      openTime += TimeGetSecs();
+
+      uint nFailures = 0;
+      vector<byte> actual(kEntrySize);
+
+      double readTime = -TimeGetSecs();
+      for (uint i = 0; i < kNumEntries; i++)
+      {
+         tChar szName[32];
+         _sntprintf(szName, _countof(szName), _T("entry%03d.dat"), i);
+         cAutoIPtr<IReader> pReader;
+         if (pStore->OpenEntry(szName, &pReader) != S_OK
+            || pReader->Read(&actual[0], actual.size()) != S_OK)
+         {
+            nFailures++;
+         }
+      }
+      readTime += TimeGetSecs();
+
+      CHECK_EQUAL(0, nFailures);
+
+      double megabytes = static_cast<double>(kNumEntries * kEntrySize) / (1024 * 1024);
+      LocalMsg3("Pack store time trial (%s): open %f sec, read %f MB/sec\n",
+         (buildFlags[f] & kRPBF_Compress) ? _T("compressed") : _T("stored"), openTime, megabytes / readTime);
+   }
+
+   for (uint i = 0; i < kNumEntries; i++)
+   {
+      char szName[32];
+      _snprintf(szName, _countof(szName), "entry%03d.dat", i);
+      RemoveTestFile(g_szTestDir, szName);
+   }
+   RemoveTestDir(g_szTestDir);
+   CHECK(remove(g_szTestPack) == 0);
+}
+
+#endif // HAVE_UNITTESTPP
+
+////////////////////////////////////////////////////////////////////////////////
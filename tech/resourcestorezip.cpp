@@ -5,6 +5,7 @@
 
 #include "resourcestore.h"
 
+#include "tech/configapi.h"
 #include "tech/fileenum.h"
 #include "tech/filepath.h"
 #include "tech/filespec.h"
@@ -12,9 +13,20 @@
 #include "tech/techstring.h"
 
 #define ZLIB_WINAPI
-#include <unzip.h>
+#include <zlib.h>
+
+#ifdef HAVE_UNITTESTPP
+#include "UnitTest++.h"
+#include "jobsystem.h"
+#include "tech/techtime.h"
+#include "tech/thread.h"
+#include <zip.h>
+#endif
 
+#include <cstdio>
+#include <cstring>
 #include <map>
+#include <vector>
 
 #include "tech/dbgalloc.h" // must be last header
 
@@ -40,127 +52,379 @@ LOG_EXTERN_CHANNEL(ResourceStore);
 
 static const int kUnzMaxPath = 260;
 
+// Zip record signatures and sizes (see PKWARE's APPNOTE.TXT)
+static const uint32 kZipEndOfCentralDirSig = 0x06054b50;
+static const uint32 kZipCentralDirHeaderSig = 0x02014b50;
+static const uint32 kZipLocalHeaderSig = 0x04034b50;
+static const size_t kZipEndOfCentralDirSize = 22;
+static const size_t kZipCentralDirHeaderSize = 46;
+static const size_t kZipLocalHeaderSize = 30;
+static const size_t kZipMaxCommentSize = 0xFFFF;
+
+static const uint16 kZipMethodStored = 0;
+static const uint16 kZipMethodDeflated = 8;
+static const uint16 kZipFlagEncrypted = 1;
+
+// Zip fields are little-endian regardless of the host
+static inline uint16 ZipRead16(const byte * p)
+{
+   return static_cast<uint16>(p[0] | (p[1] << 8));
+}
+
+static inline uint32 ZipRead32(const byte * p)
+{
+   return static_cast<uint32>(p[0]) | (static_cast<uint32>(p[1]) << 8)
+      | (static_cast<uint32>(p[2]) << 16) | (static_cast<uint32>(p[3]) << 24);
+}
+
+// Deflated entries at least this big are inflated as they are read instead
+// of all at once. Set resource_zip_stream_threshold_kb to a negative value to
+// always inflate them whole.
+static const int kDefaultStreamThresholdKb = 1024;
+
+// Most a streamed entry holds inflated at once
+static const size_t kInflateWindowSize = 64 * 1024;
+
+static const char szLineDelimiters[] = "\r\n";
+static const wchar_t wszLineDelimiters[] = L"\r\n";
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-// CLASS: cUnzipArchive
+// CLASS: cZipInflateReader
 //
-
-class cUnzipArchive
+// Inflates a deflated entry a window at a time as it is read, so a large
+// entry is never in memory all at once. The compressed bytes are read in
+// place from the archive mapping, which the reader keeps referenced. Reads
+// that go past the window inflate straight into the caller's buffer. Seeking
+// forward inflates and throws away everything up to the new position, and
+// seeking back before the window starts over from the start of the entry.
+// The CRC is checked once the whole entry has been inflated.
+
+class cZipInflateReader : public cComObject2<IMPLEMENTS(IReader), IMPLEMENTS(IReaderSize)>
 {
 public:
-   cUnzipArchive(unzFile unzHandle);
-   ~cUnzipArchive();
+   cZipInflateReader(IUnknown * pArchive, const byte * pCompressed, ulong compressedSize, ulong size, uint32 crc);
+   ~cZipInflateReader();
+
+   tResult Init();
+
+   virtual tResult Tell(ulong * pPos);
+   virtual tResult Seek(long pos, eSeekOrigin origin);
 
-   void IterStart();
-   bool IterNext(unz_file_pos * pFilePos, unz_file_info * pFileInfo, char * pszFile, size_t maxFile);
+   virtual tResult ReadLine(std::string * pLine);
+   virtual tResult ReadLine(std::wstring * pLine);
 
-   tResult OpenMember(const unz_file_pos & filePos, IReader * * ppReader);
+   virtual tResult Read(void * pv, size_t cb, size_t * pcbRead = NULL);
+
+   virtual tResult GetSize(ulong * pSize);
 
 private:
-   unzFile m_unzHandle;
-   bool m_bIterAtEnd;
+   void Restart();
+   tResult Inflate(byte * pDest, ulong nBytes);
+   tResult FillWindow(ulong pos);
+
+   cAutoIPtr<IUnknown> m_pArchive;
+   const byte * m_pCompressed;
+   ulong m_compressedSize;
+   ulong m_size;
+   uint32 m_crc;
+
+   z_stream m_stream;
+   bool m_bStreamInit;
+   bool m_bFailed;
+   ulong m_nInflated;
+   uLong m_inflatedCrc;
+
+   // Holds inflated bytes [m_windowStart, m_windowStart + m_windowLength),
+   // which always end at m_nInflated unless the window is empty
+   vector<byte> m_window;
+   ulong m_windowStart;
+   ulong m_windowLength;
+
+   ulong m_readPos;
 };
 
 ////////////////////////////////////////
 
-cUnzipArchive::cUnzipArchive(unzFile unzHandle)
- : m_unzHandle(unzHandle)
- , m_bIterAtEnd(false)
+cZipInflateReader::cZipInflateReader(IUnknown * pArchive, const byte * pCompressed, ulong compressedSize, ulong size, uint32 crc)
+ : m_pArchive(CTAddRef(pArchive))
+ , m_pCompressed(pCompressed)
+ , m_compressedSize(compressedSize)
+ , m_size(size)
+ , m_crc(crc)
+ , m_bStreamInit(false)
+ , m_bFailed(false)
+ , m_nInflated(0)
+ , m_inflatedCrc(0)
+ , m_windowStart(0)
+ , m_windowLength(0)
+ , m_readPos(0)
 {
+   memset(&m_stream, 0, sizeof(m_stream));
 }
 
 ////////////////////////////////////////
 
-cUnzipArchive::~cUnzipArchive()
+cZipInflateReader::~cZipInflateReader()
 {
-   if (m_unzHandle != NULL)
+   if (m_bStreamInit)
    {
-      unzClose(m_unzHandle);
-      m_unzHandle = NULL;
+      inflateEnd(&m_stream);
    }
 }
 
 ////////////////////////////////////////
 
-void cUnzipArchive::IterStart()
+tResult cZipInflateReader::Init()
 {
-   if (m_unzHandle != NULL)
+   // Negative window bits: zip members are raw deflate streams without a
+   // zlib header
+   if (inflateInit2(&m_stream, -MAX_WBITS) != Z_OK)
    {
-      unzGoToFirstFile(m_unzHandle);
+      return E_FAIL;
    }
-   m_bIterAtEnd = false;
+   m_bStreamInit = true;
+   m_window.resize(Min(kInflateWindowSize, static_cast<size_t>(m_size)));
+   Restart();
+   return S_OK;
 }
 
 ////////////////////////////////////////
 
-bool cUnzipArchive::IterNext(unz_file_pos * pFilePos, unz_file_info * pFileInfo, char * pszFile, size_t maxFile)
+tResult cZipInflateReader::Tell(ulong * pPos)
 {
-   if (!m_bIterAtEnd)
+   if (pPos == NULL)
    {
-      if (m_unzHandle != NULL)
+      return E_POINTER;
+   }
+   *pPos = m_readPos;
+   return S_OK;
+}
+
+////////////////////////////////////////
+// Only moves the read position; the inflating waits for the next read
+
+tResult cZipInflateReader::Seek(long pos, eSeekOrigin origin)
+{
+   long base = 0;
+   switch (origin)
+   {
+   case kSO_Set: base = 0; break;
+   case kSO_End: base = static_cast<long>(m_size); break;
+   case kSO_Cur: base = static_cast<long>(m_readPos); break;
+   }
+   if (base + pos < 0 || static_cast<ulong>(base + pos) > m_size)
+   {
+      return E_FAIL;
+   }
+   m_readPos = static_cast<ulong>(base + pos);
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cZipInflateReader::ReadLine(std::string * pLine)
+{
+   if (pLine == NULL)
+   {
+      return E_POINTER;
+   }
+
+   while (m_readPos < m_size)
+   {
+      if (FillWindow(m_readPos) != S_OK)
+      {
+         return E_FAIL;
+      }
+      char c = static_cast<char>(m_window[m_readPos - m_windowStart]);
+      m_readPos++;
+      if (strchr(szLineDelimiters, c) != NULL)
+      {
+         return S_OK;
+      }
+      pLine->push_back(c);
+   }
+
+   return S_FALSE;
+}
+
+////////////////////////////////////////
+
+tResult cZipInflateReader::ReadLine(std::wstring * pLine)
+{
+   if (pLine == NULL)
+   {
+      return E_POINTER;
+   }
+
+   wchar_t c = 0;
+   tResult result;
+   while ((result = Read(&c, sizeof(c))) == S_OK)
+   {
+      if (wcschr(wszLineDelimiters, c) != NULL)
+      {
+         return S_OK;
+      }
+      pLine->push_back(c);
+   }
+
+   return FAILED(result) ? result : S_FALSE;
+}
+
+////////////////////////////////////////
+
+tResult cZipInflateReader::Read(void * pv, size_t nBytes, size_t * pnBytesRead)
+{
+   if (pv == NULL)
+   {
+      return E_POINTER;
+   }
+
+   byte * pDest = reinterpret_cast<byte *>(pv);
+   size_t nBytesRead = 0;
+   tResult result = S_OK;
+   while (nBytesRead < nBytes && m_readPos < m_size)
+   {
+      size_t nWanted = Min(nBytes - nBytesRead, static_cast<size_t>(m_size - m_readPos));
+
+      // Reading on from where inflating left off, with more wanted than
+      // fits in the window, so skip the copy
+      if (m_readPos == m_nInflated && nWanted >= m_window.size())
       {
-         if (unzGetFilePos(m_unzHandle, pFilePos) == UNZ_OK &&
-            unzGetCurrentFileInfo(m_unzHandle, pFileInfo, pszFile, maxFile, NULL, 0, NULL, 0) == UNZ_OK)
+         if (Inflate(pDest + nBytesRead, static_cast<ulong>(nWanted)) != S_OK)
          {
-            m_bIterAtEnd = (unzGoToNextFile(m_unzHandle) == UNZ_END_OF_LIST_OF_FILE);
-            return true;
+            result = E_FAIL;
+            break;
          }
+         m_windowStart = m_nInflated;
+         m_windowLength = 0;
+         nBytesRead += nWanted;
+         m_readPos += static_cast<ulong>(nWanted);
+         continue;
       }
+
+      if (FillWindow(m_readPos) != S_OK)
+      {
+         result = E_FAIL;
+         break;
+      }
+
+      size_t offset = m_readPos - m_windowStart;
+      size_t nCopy = Min(nWanted, m_windowLength - offset);
+      memcpy(pDest + nBytesRead, &m_window[offset], nCopy);
+      nBytesRead += nCopy;
+      m_readPos += static_cast<ulong>(nCopy);
    }
-   return false;
+
+   if (pnBytesRead != NULL)
+   {
+      *pnBytesRead = nBytesRead;
+   }
+
+   if (FAILED(result))
+   {
+      return result;
+   }
+
+   return (nBytesRead == nBytes) ? S_OK : S_FALSE;
 }
 
 ////////////////////////////////////////
 
-tResult cUnzipArchive::OpenMember(const unz_file_pos & filePos, IReader * * ppReader)
+tResult cZipInflateReader::GetSize(ulong * pSize)
 {
-   if (ppReader == NULL)
+   if (pSize == NULL)
    {
       return E_POINTER;
    }
+   *pSize = m_size;
+   return S_OK;
+}
 
-   Assert(m_unzHandle != NULL);
+////////////////////////////////////////
 
-   if (unzGoToFilePos(m_unzHandle, const_cast<unz_file_pos*>(&filePos)) != UNZ_OK)
+void cZipInflateReader::Restart()
+{
+   inflateReset(&m_stream);
+   m_stream.next_in = const_cast<Bytef *>(m_pCompressed);
+   m_stream.avail_in = m_compressedSize;
+   m_nInflated = 0;
+   m_inflatedCrc = crc32(0, NULL, 0);
+   m_windowStart = 0;
+   m_windowLength = 0;
+}
+
+////////////////////////////////////////
+// Inflates the next nBytes of the entry
+
+tResult cZipInflateReader::Inflate(byte * pDest, ulong nBytes)
+{
+   Assert(nBytes <= (m_size - m_nInflated));
+
+   if (m_bFailed)
    {
       return E_FAIL;
    }
 
-   tResult result = E_FAIL;
-
-   unz_file_info fileInfo;
-   char szFile[kUnzMaxPath];
-   if (unzGetCurrentFileInfo(m_unzHandle, &fileInfo, szFile, _countof(szFile), NULL, 0, NULL, 0) == UNZ_OK)
+   m_stream.next_out = pDest;
+   m_stream.avail_out = nBytes;
+   while (m_stream.avail_out > 0)
    {
-      if (unzOpenCurrentFile(m_unzHandle) == UNZ_OK)
+      int zResult = inflate(&m_stream, Z_NO_FLUSH);
+      if (zResult == Z_STREAM_END)
       {
-         byte * pBuffer = new byte[fileInfo.uncompressed_size];
-         if (pBuffer == NULL)
-         {
-            result = E_OUTOFMEMORY;
-         }
-         else
-         {
-            cAutoIPtr<IReader> pReader;
-            if (unzReadCurrentFile(m_unzHandle, pBuffer, fileInfo.uncompressed_size) >= 0
-               && MemReaderCreate(pBuffer, fileInfo.uncompressed_size, true, &pReader) == S_OK)
-            {
-               *ppReader = CTAddRef(pReader);
-               result = S_OK;
-            }
-            else
-            {
-               delete [] pBuffer;
-               pBuffer = NULL;
-            }
-         }
+         break;
+      }
+      if (zResult != Z_OK)
+      {
+         m_bFailed = true;
+         break;
+      }
+   }
+
+   m_inflatedCrc = crc32(m_inflatedCrc, pDest, nBytes - m_stream.avail_out);
+   m_nInflated += nBytes - m_stream.avail_out;
+
+   if (m_stream.avail_out > 0 || (m_nInflated == m_size && m_inflatedCrc != m_crc))
+   {
+      m_bFailed = true;
+   }
+
+   if (m_bFailed)
+   {
+      ErrorMsg("Failed to inflate zip entry\n");
+      return E_FAIL;
+   }
+
+   return S_OK;
+}
+
+////////////////////////////////////////
+// Makes the window hold the byte at pos
+
+tResult cZipInflateReader::FillWindow(ulong pos)
+{
+   Assert(pos < m_size);
 
-         unzCloseCurrentFile(m_unzHandle);
+   if (pos < m_windowStart)
+   {
+      Restart();
+   }
+
+   while (pos >= (m_windowStart + m_windowLength))
+   {
+      m_windowStart = m_nInflated;
+      m_windowLength = 0;
+      ulong nBytes = Min(static_cast<ulong>(m_window.size()), m_size - m_nInflated);
+      if (Inflate(&m_window[0], nBytes) != S_OK)
+      {
+         return E_FAIL;
       }
+      m_windowLength = nBytes;
    }
 
-   return result;
+   return S_OK;
 }
 
 
@@ -168,28 +432,59 @@ tResult cUnzipArchive::OpenMember(const unz_file_pos & filePos, IReader * * ppRe
 //
 // CLASS: cZipResourceStore
 //
+// Serves entries straight out of a memory-mapped archive. The central
+// directory is parsed once into an index that is never modified afterwards,
+// and every OpenEntry call works on its own pointers into the mapping, so
+// entries can be opened and inflated from any number of threads at once.
 
 class cZipResourceStore : public cComObject<IMPLEMENTS(IResourceStore)>
 {
 public:
-   cZipResourceStore(unzFile unzHandle);
+   cZipResourceStore(IMappedReader * pArchive, const byte * pData, size_t dataSize);
    virtual ~cZipResourceStore();
 
+   tResult ReadCentralDirectory();
+
    virtual tResult CollectResourceNames(const tChar * pszMatch, vector<cStr> * pNames);
    virtual tResult OpenEntry(const tChar * pszName, IReader * * ppReader);
 
 private:
-   cUnzipArchive m_unzArchive;
+   struct sZipEntry
+   {
+      uint32 localHeaderOffset;
+      uint32 compressedSize;
+      uint32 uncompressedSize;
+      uint32 crc;
+      uint16 method;
+   };
 
-   typedef map<cStr, unz_file_pos_s> tZipDirCache;
-   tZipDirCache m_dirCache;
+   tResult GetEntryData(const sZipEntry & entry, const byte * * ppData) const;
+   tResult InflateEntry(const sZipEntry & entry, const byte * pCompressed, IReader * * ppReader) const;
+
+   cAutoIPtr<IMappedReader> m_pArchive;
+   const byte * m_pData;
+   size_t m_dataSize;
+
+   bool m_bStream;
+   ulong m_streamThreshold;
+
+   typedef map<cStr, sZipEntry> tZipIndex;
+   tZipIndex m_index;
 };
 
 ////////////////////////////////////////
 
-cZipResourceStore::cZipResourceStore(unzFile unzHandle)
- : m_unzArchive(unzHandle)
+cZipResourceStore::cZipResourceStore(IMappedReader * pArchive, const byte * pData, size_t dataSize)
+ : m_pArchive(CTAddRef(pArchive))
+ , m_pData(pData)
+ , m_dataSize(dataSize)
+ , m_bStream(true)
+ , m_streamThreshold(0)
 {
+   int streamThresholdKb = kDefaultStreamThresholdKb;
+   ConfigGet(_T("resource_zip_stream_threshold_kb"), &streamThresholdKb);
+   m_bStream = (streamThresholdKb >= 0);
+   m_streamThreshold = m_bStream ? static_cast<ulong>(streamThresholdKb) * 1024 : 0;
 }
 
 ////////////////////////////////////////
@@ -200,40 +495,123 @@ cZipResourceStore::~cZipResourceStore()
 
 ////////////////////////////////////////
 
-tResult cZipResourceStore::CollectResourceNames(const tChar * pszMatch, vector<cStr> * pNames)
+tResult cZipResourceStore::ReadCentralDirectory()
 {
-   unz_file_pos filePos;
-   unz_file_info fileInfo;
-   char szFile[kUnzMaxPath];
+   if (m_dataSize < kZipEndOfCentralDirSize)
+   {
+      return E_FAIL;
+   }
+
+   // The end record is last in the file, followed only by the archive comment
+   const byte * pEnd = NULL;
+   size_t searchStart = (m_dataSize > (kZipEndOfCentralDirSize + kZipMaxCommentSize))
+      ? (m_dataSize - kZipEndOfCentralDirSize - kZipMaxCommentSize) : 0;
+   for (size_t i = m_dataSize - kZipEndOfCentralDirSize + 1; i-- > searchStart; )
+   {
+      if (ZipRead32(m_pData + i) == kZipEndOfCentralDirSig)
+      {
+         pEnd = m_pData + i;
+         break;
+      }
+   }
+
+   if (pEnd == NULL)
+   {
+      ErrorMsg("Zip end of central directory record not found\n");
+      return E_FAIL;
+   }
 
-   m_unzArchive.IterStart();
-   while (m_unzArchive.IterNext(&filePos, &fileInfo, szFile, _countof(szFile)))
+   uint16 nEntries = ZipRead16(pEnd + 10);
+   uint32 dirSize = ZipRead32(pEnd + 12);
+   uint32 dirOffset = ZipRead32(pEnd + 16);
+   if (dirOffset > m_dataSize || dirSize > (m_dataSize - dirOffset))
    {
-      LocalMsg2("[%d] %s\n", filePos.num_of_file, szFile);
+      ErrorMsg("Zip central directory lies outside of the archive\n");
+      return E_FAIL;
+   }
+
+   const byte * pHeader = m_pData + dirOffset;
+   const byte * pDirEnd = pHeader + dirSize;
+   for (uint i = 0; i < nEntries; i++)
+   {
+      if ((pDirEnd - pHeader) < static_cast<ptrdiff_t>(kZipCentralDirHeaderSize)
+         || ZipRead32(pHeader) != kZipCentralDirHeaderSig)
+      {
+         ErrorMsg("Bad zip central directory header\n");
+         return E_FAIL;
+      }
+
+      uint16 flags = ZipRead16(pHeader + 8);
+      uint16 nameLength = ZipRead16(pHeader + 28);
+      uint16 extraLength = ZipRead16(pHeader + 30);
+      uint16 commentLength = ZipRead16(pHeader + 32);
+
+      const byte * pName = pHeader + kZipCentralDirHeaderSize;
+      const byte * pNext = pName + nameLength + extraLength + commentLength;
+      if (pNext > pDirEnd)
+      {
+         ErrorMsg("Bad zip central directory header\n");
+         return E_FAIL;
+      }
+
+      sZipEntry entry;
+      entry.method = ZipRead16(pHeader + 10);
+      entry.crc = ZipRead32(pHeader + 16);
+      entry.compressedSize = ZipRead32(pHeader + 20);
+      entry.uncompressedSize = ZipRead32(pHeader + 24);
+      entry.localHeaderOffset = ZipRead32(pHeader + 42);
+
+      char szFile[kUnzMaxPath];
+      size_t nameCopy = Min(static_cast<size_t>(nameLength), _countof(szFile) - 1);
+      memcpy(szFile, pName, nameCopy);
+      szFile[nameCopy] = 0;
+
+      pHeader = pNext;
+
+      if (nameLength == 0 || szFile[nameCopy - 1] == '/')
+      {
+         LocalMsg1("Directory: %s\n", szFile);
+         continue;
+      }
+
+      if ((flags & kZipFlagEncrypted) != 0
+         || (entry.method != kZipMethodStored && entry.method != kZipMethodDeflated))
+      {
+         WarnMsg1("Skipping zip entry \"%s\" with unsupported encryption or compression\n", szFile);
+         continue;
+      }
+
+      LocalMsg2("[%d] %s\n", i, szFile);
 
 #ifdef _UNICODE
-      size_t size = mbstowcs(NULL, szFile, 0);
-      wchar_t * pszTemp = reinterpret_cast<wchar_t*>(alloca(size));
+      size_t size = mbstowcs(NULL, szFile, 0) + 1;
+      wchar_t * pszTemp = reinterpret_cast<wchar_t*>(alloca(size * sizeof(wchar_t)));
       mbstowcs(pszTemp, szFile, size);
       cFileSpec file(pszTemp);
 #else
       cFileSpec file(szFile);
 #endif
-      m_dirCache[cStr(file.CStr())] = filePos;
+      m_index[cStr(file.CStr())] = entry;
+   }
+
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cZipResourceStore::CollectResourceNames(const tChar * pszMatch, vector<cStr> * pNames)
+{
+   if (pNames == NULL)
+   {
+      return E_POINTER;
+   }
 
-      if (pNames != NULL)
+   tZipIndex::const_iterator iter = m_index.begin(), end = m_index.end();
+   for (; iter != end; ++iter)
+   {
+      if (pszMatch == NULL || WildCardMatch(pszMatch, iter->first.c_str()))
       {
-         if (pszMatch != NULL)
-         {
-            if (WildCardMatch(pszMatch, file.CStr()))
-            {
-               pNames->push_back(file.CStr());
-            }
-         }
-         else
-         {
-            pNames->push_back(file.CStr());
-         }
+         pNames->push_back(iter->first);
       }
    }
 
@@ -249,20 +627,115 @@ tResult cZipResourceStore::OpenEntry(const tChar * pszName, IReader * * ppReader
       return E_POINTER;
    }
 
-   // HACK
-   if (m_dirCache.empty())
+   tZipIndex::const_iterator f = m_index.find(pszName);
+   if (f == m_index.end())
+   {
+      return E_FAIL;
+   }
+
+   const sZipEntry & entry = f->second;
+
+   const byte * pEntryData = NULL;
+   if (GetEntryData(entry, &pEntryData) != S_OK)
+   {
+      ErrorMsg1("Bad zip local header for \"%s\"\n", pszName);
+      return E_FAIL;
+   }
+
+   if (entry.method == kZipMethodStored)
+   {
+      // Stored entries are handed out in place, keeping the archive mapped
+      return MemReaderCreateView(pEntryData, entry.uncompressedSize, m_pArchive, ppReader);
+   }
+
+   if (m_bStream && entry.uncompressedSize >= m_streamThreshold)
+   {
+      cAutoIPtr<cZipInflateReader> pReader(new cZipInflateReader(m_pArchive, pEntryData,
+         entry.compressedSize, entry.uncompressedSize, entry.crc));
+      if (!pReader)
+      {
+         return E_OUTOFMEMORY;
+      }
+      if (pReader->Init() != S_OK)
+      {
+         return E_FAIL;
+      }
+      LocalMsg2("Streaming %s (%d bytes)\n", pszName, entry.uncompressedSize);
+      *ppReader = CTAddRef(static_cast<IReader *>(pReader));
+      return S_OK;
+   }
+
+   return InflateEntry(entry, pEntryData, ppReader);
+}
+
+////////////////////////////////////////
+
+tResult cZipResourceStore::GetEntryData(const sZipEntry & entry, const byte * * ppData) const
+{
+   if (entry.localHeaderOffset > m_dataSize
+      || kZipLocalHeaderSize > (m_dataSize - entry.localHeaderOffset))
+   {
+      return E_FAIL;
+   }
+
+   const byte * pLocalHeader = m_pData + entry.localHeaderOffset;
+   if (ZipRead32(pLocalHeader) != kZipLocalHeaderSig)
+   {
+      return E_FAIL;
+   }
+
+   // The local name and extra field lengths may differ from the central ones
+   size_t dataOffset = entry.localHeaderOffset + kZipLocalHeaderSize
+      + ZipRead16(pLocalHeader + 26) + ZipRead16(pLocalHeader + 28);
+   if (dataOffset > m_dataSize || entry.compressedSize > (m_dataSize - dataOffset))
    {
-      CollectResourceNames(NULL, NULL);
+      return E_FAIL;
    }
 
-   tZipDirCache::iterator f = m_dirCache.find(pszName);
-   if (f == m_dirCache.end())
+   *ppData = m_pData + dataOffset;
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cZipResourceStore::InflateEntry(const sZipEntry & entry, const byte * pCompressed, IReader * * ppReader) const
+{
+   byte * pBuffer = new byte[entry.uncompressedSize];
+   if (pBuffer == NULL)
    {
-      // TODO: do a slow look-up
-      return E_NOTIMPL;
+      return E_OUTOFMEMORY;
    }
 
-   return m_unzArchive.OpenMember(f->second, ppReader);
+   z_stream stream;
+   memset(&stream, 0, sizeof(stream));
+   stream.next_in = const_cast<Bytef *>(pCompressed);
+   stream.avail_in = entry.compressedSize;
+   stream.next_out = pBuffer;
+   stream.avail_out = entry.uncompressedSize;
+
+   // Negative window bits: zip members are raw deflate streams without a
+   // zlib header
+   bool bInflated = false;
+   if (inflateInit2(&stream, -MAX_WBITS) == Z_OK)
+   {
+      bInflated = (inflate(&stream, Z_FINISH) == Z_STREAM_END)
+         && (stream.total_out == entry.uncompressedSize);
+      inflateEnd(&stream);
+   }
+
+   if (!bInflated || crc32(0, pBuffer, entry.uncompressedSize) != entry.crc)
+   {
+      ErrorMsg("Failed to inflate zip entry\n");
+      delete [] pBuffer;
+      return E_FAIL;
+   }
+
+   tResult result = MemReaderCreate(pBuffer, entry.uncompressedSize, true, ppReader);
+   if (result != S_OK)
+   {
+      delete [] pBuffer;
+   }
+   return result;
 }
 
 ////////////////////////////////////////
@@ -274,29 +747,248 @@ tResult ResourceStoreCreateZip(const tChar * pszArchive, IResourceStore * * ppSt
       return E_POINTER;
    }
 
-#ifdef _UNICODE
-   size_t size = wcstombs(NULL, pszArchive, 0);
-   char * pszTemp = reinterpret_cast<char*>(alloca(size));
-   wcstombs(pszTemp, pszArchive, size);
-   unzFile unzHandle = unzOpen(pszTemp);
-#else
-   unzFile unzHandle = unzOpen(pszArchive);
-#endif
-
-   if (unzHandle == NULL)
+   cAutoIPtr<IReader> pReader;
+   cAutoIPtr<IMappedReader> pArchive;
+   const byte * pData = NULL;
+   size_t dataSize = 0;
+   if (MappedFileReaderCreate(cFileSpec(pszArchive), &pReader) != S_OK
+      || pReader->QueryInterface(IID_IMappedReader, (void**)&pArchive) != S_OK
+      || pArchive->GetMappedData(&pData, &dataSize) != S_OK)
    {
       return S_FALSE;
    }
 
-   IResourceStore * pStore = static_cast<IResourceStore *>(new cZipResourceStore(unzHandle));
-   if (pStore == NULL)
+   cAutoIPtr<cZipResourceStore> pStore(new cZipResourceStore(pArchive, pData, dataSize));
+   if (!pStore)
    {
-      unzClose(unzHandle);
       return E_OUTOFMEMORY;
    }
 
-   *ppStore = pStore;
+   if (pStore->ReadCentralDirectory() != S_OK)
+   {
+      return S_FALSE;
+   }
+
+   *ppStore = CTAddRef(static_cast<IResourceStore *>(pStore));
    return S_OK;
 }
 
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef HAVE_UNITTESTPP
+
+namespace
+{
+   const char g_szTestArchive[] = "resourcestorezip.tmp";
+
+   // Fills each entry with text-like data that deflates about as well as
+   // typical game data does
+   void MakeEntryData(uint seed, size_t size, vector<byte> * pData)
+   {
+      static const char szWords[] = "vertex index mesh joint texture material terrain tile ";
+      pData->resize(size);
+      for (size_t i = 0; i < size; i++)
+      {
+         (*pData)[i] = ((i + seed) % 97 == 0) ? static_cast<byte>(i * seed) : szWords[(i + seed) % (sizeof(szWords) - 1)];
+      }
+   }
+
+   bool WriteTestArchive(uint nEntries, size_t entrySize)
+   {
+      zipFile zf = zipOpen(g_szTestArchive, APPEND_STATUS_CREATE);
+      if (zf == NULL)
+      {
+         return false;
+      }
+
+      bool bResult = true;
+      vector<byte> data;
+      for (uint i = 0; i < nEntries && bResult; i++)
+      {
+         char szName[32];
+         _snprintf(szName, _countof(szName), "entry%03d.dat", i);
+         MakeEntryData(i, entrySize, &data);
+
+         // Alternate between stored and deflated entries
+         int method = ((i % 2) == 0) ? Z_DEFLATED : 0;
+         bResult = zipOpenNewFileInZip(zf, szName, NULL, NULL, 0, NULL, 0, NULL, method, Z_DEFAULT_COMPRESSION) == ZIP_OK
+            && zipWriteInFileInZip(zf, &data[0], static_cast<uint>(data.size())) == ZIP_OK
+            && zipCloseFileInZip(zf) == ZIP_OK;
+      }
+
+      bResult = (zipClose(zf, NULL) == ZIP_OK) && bResult;
+      return bResult;
+   }
+
+   struct sZipReadArgs
+   {
+      IResourceStore * pStore;
+      size_t entrySize;
+      volatile long nFailures;
+   };
+
+   void ReadZipEntries(uint begin, uint end, void * pArg)
+   {
+      sZipReadArgs * pArgs = reinterpret_cast<sZipReadArgs *>(pArg);
+      vector<byte> expected, actual(pArgs->entrySize);
+      for (uint i = begin; i < end; i++)
+      {
+         tChar szName[32];
+         _sntprintf(szName, _countof(szName), _T("entry%03d.dat"), i);
+         MakeEntryData(i, pArgs->entrySize, &expected);
+
+         cAutoIPtr<IReader> pReader;
+         if (pArgs->pStore->OpenEntry(szName, &pReader) != S_OK
+            || pReader->Read(&actual[0], actual.size()) != S_OK
+            || expected != actual)
+         {
+            AtomicIncrement(&pArgs->nFailures);
+         }
+      }
+   }
+}
+
+TEST(ZipResourceStoreReadEntries)
+{
+   static const uint kNumEntries = 16;
+   static const size_t kEntrySize = 10000;
+
+   CHECK(WriteTestArchive(kNumEntries, kEntrySize));
+
+   {
+      cAutoIPtr<IResourceStore> pStore;
+      CHECK_EQUAL(S_OK, ResourceStoreCreateZip(_T("resourcestorezip.tmp"), &pStore));
+
+      vector<cStr> names;
+      CHECK_EQUAL(S_OK, pStore->CollectResourceNames(_T("*.dat"), &names));
+      CHECK_EQUAL(kNumEntries, names.size());
+
+      sZipReadArgs args = { pStore, kEntrySize, 0 };
+      ReadZipEntries(0, kNumEntries, &args);
+      CHECK_EQUAL(0, args.nFailures);
+
+      cAutoIPtr<IReader> pReader;
+      CHECK(pStore->OpenEntry(_T("missing.dat"), &pReader) != S_OK);
+
+      // Stored entries must be views into the archive mapping
+      CHECK_EQUAL(S_OK, pStore->OpenEntry(_T("entry001.dat"), &pReader));
+      cAutoIPtr<IMappedReader> pMappedReader;
+      CHECK_EQUAL(S_OK, pReader->QueryInterface(IID_IMappedReader, (void**)&pMappedReader));
+      const byte * pData = NULL;
+      size_t dataSize = 0;
+      CHECK_EQUAL(S_OK, pMappedReader->GetMappedData(&pData, &dataSize));
+      CHECK_EQUAL(kEntrySize, dataSize);
+
+      // The view must stay valid after the store goes away
+      SafeRelease(pStore);
+      vector<byte> expected;
+      MakeEntryData(1, kEntrySize, &expected);
+      CHECK(memcmp(&expected[0], pData, dataSize) == 0);
+   }
+
+   CHECK(remove(g_szTestArchive) == 0);
+}
+
+TEST(ZipResourceStoreStreamLargeEntry)
+{
+   // Over the default streaming threshold, and not a multiple of the window
+   static const size_t kEntrySize = 1536 * 1024 + 17;
+
+   CHECK(WriteTestArchive(1, kEntrySize));
+
+   {
+      cAutoIPtr<IResourceStore> pStore;
+      CHECK_EQUAL(S_OK, ResourceStoreCreateZip(_T("resourcestorezip.tmp"), &pStore));
+
+      vector<byte> expected, actual(kEntrySize);
+      MakeEntryData(0, kEntrySize, &expected);
+
+      cAutoIPtr<IReader> pReader;
+      CHECK_EQUAL(S_OK, pStore->OpenEntry(_T("entry000.dat"), &pReader));
+
+      // Streamed, so not all in memory, but the size is known
+      cAutoIPtr<IMappedReader> pMappedReader;
+      CHECK(pReader->QueryInterface(IID_IMappedReader, (void**)&pMappedReader) != S_OK);
+      cAutoIPtr<IReaderSize> pReaderSize;
+      CHECK_EQUAL(S_OK, pReader->QueryInterface(IID_IReaderSize, (void**)&pReaderSize));
+      ulong size = 0;
+      CHECK_EQUAL(S_OK, pReaderSize->GetSize(&size));
+      CHECK_EQUAL(kEntrySize, size);
+
+      // Small reads come out of the window and big ones bypass it
+      static const size_t kReadSizes[] = { 1, 1000, 300000, 70000, 5 };
+      size_t pos = 0;
+      for (int i = 0; pos < kEntrySize; i = (i + 1) % _countof(kReadSizes))
+      {
+         size_t nBytes = Min(kReadSizes[i], kEntrySize - pos), nBytesRead = 0;
+         CHECK_EQUAL(S_OK, pReader->Read(&actual[pos], nBytes, &nBytesRead));
+         CHECK_EQUAL(nBytes, nBytesRead);
+         pos += nBytes;
+      }
+      CHECK(expected == actual);
+
+      byte extra = 0;
+      CHECK_EQUAL(S_FALSE, pReader->Read(&extra, 1));
+
+      // Back to the start, into the middle, and past the end
+      byte buffer[100];
+      CHECK_EQUAL(S_OK, pReader->Seek(5, kSO_Set));
+      CHECK_EQUAL(S_OK, pReader->Read(buffer, sizeof(buffer)));
+      CHECK(memcmp(buffer, &expected[5], sizeof(buffer)) == 0);
+
+      CHECK_EQUAL(S_OK, pReader->Seek(kEntrySize / 2, kSO_Cur));
+      CHECK_EQUAL(S_OK, pReader->Read(buffer, sizeof(buffer)));
+      CHECK(memcmp(buffer, &expected[105 + kEntrySize / 2], sizeof(buffer)) == 0);
+
+      size_t nBytesRead = 0;
+      CHECK_EQUAL(S_OK, pReader->Seek(-10, kSO_End));
+      CHECK_EQUAL(S_FALSE, pReader->Read(buffer, sizeof(buffer), &nBytesRead));
+      CHECK_EQUAL(10u, nBytesRead);
+      CHECK(memcmp(buffer, &expected[kEntrySize - 10], 10) == 0);
+
+      CHECK(pReader->Seek(1, kSO_End) != S_OK);
+   }
+
+   CHECK(remove(g_szTestArchive) == 0);
+}
+
+TEST(ZipResourceStoreTimeTrial)
+{
+   static const uint kNumEntries = 128;
+   static const size_t kEntrySize = 256 * 1024;
+
+   CHECK(WriteTestArchive(kNumEntries, kEntrySize));
+
+   {
+      cAutoIPtr<IResourceStore> pStore;
+      CHECK_EQUAL(S_OK, ResourceStoreCreateZip(_T("resourcestorezip.tmp"), &pStore));
+
+      sZipReadArgs args = { pStore, kEntrySize, 0 };
+
+      double serial = -TimeGetSecs();
+      ReadZipEntries(0, kNumEntries, &args);
+      serial += TimeGetSecs();
+
+      cAutoIPtr<cJobSystem> pJobSystem(new cJobSystem);
+      CHECK_EQUAL(S_OK, pJobSystem->Init());
+
+      double parallel = -TimeGetSecs();
+      pJobSystem->ParallelFor(0, kNumEntries, 1, ReadZipEntries, &args);
+      parallel += TimeGetSecs();
+
+      pJobSystem->Term();
+
+      CHECK_EQUAL(0, args.nFailures);
+
+      double megabytes = static_cast<double>(kNumEntries * kEntrySize) / (1024 * 1024);
+      LocalMsg2("Zip store time trial: serial %f MB/sec, parallel %f MB/sec\n",
+         megabytes / serial, megabytes / parallel);
+   }
+
+   CHECK(remove(g_szTestArchive) == 0);
+}
+
+#endif // HAVE_UNITTESTPP
+
 ////////////////////////////////////////////////////////////////////////////////
@@ -79,55 +79,40 @@ tStrings::size_type ListDirs(const cFilePath & path, bool bSkipHidden, tStrings
 }
 
 
-///////////////////////////////////////////////////////////////////////////////
-//
-// CLASS: cResourceCacheKey
-//
-
-////////////////////////////////////////
-
-cResourceCacheKey::cResourceCacheKey(const tChar * pszName, tResourceType type)
- : m_name(pszName)
- , m_type(type)
-{
-}
-
-////////////////////////////////////////
-
-cResourceCacheKey::cResourceCacheKey(const cResourceCacheKey & other)
- : m_name(other.m_name)
- , m_type(other.m_type)
-{
-}
+////////////////////////////////////////////////////////////////////////////////
+// 64-bit FNV-1a
 
-////////////////////////////////////////
+// Built from halves because older compilers lack 64-bit literals
+static const tResourceId kFnvOffsetBasis = (static_cast<tResourceId>(0xCBF29CE4) << 32) | 0x84222325;
+static const tResourceId kFnvPrime = (static_cast<tResourceId>(0x00000100) << 32) | 0x000001B3;
 
-cResourceCacheKey::~cResourceCacheKey()
+tResourceId ResourceIdFromName(const tChar * pszName)
 {
-}
-
-////////////////////////////////////////
+   Assert(pszName != NULL);
 
-const cResourceCacheKey & cResourceCacheKey::operator =(const cResourceCacheKey & other)
-{
-   m_name = other.m_name;
-   m_type = other.m_type;
-   return *this;
+   tResourceId id = kFnvOffsetBasis;
+   for (const tChar * p = pszName; *p != 0; p++)
+   {
+      id ^= static_cast<tResourceId>(*p);
+      id *= kFnvPrime;
+   }
+   return id;
 }
 
 ////////////////////////////////////////
 
-bool cResourceCacheKey::operator ==(const cResourceCacheKey & other) const
+tResourceId ResourceIdFromNameNoCase(const tChar * pszName)
 {
-   return (m_name.compare(other.m_name) == 0) && SameType(m_type, other.m_type);
-}
-
-////////////////////////////////////////
+   Assert(pszName != NULL);
 
-bool cResourceCacheKey::operator <(const cResourceCacheKey & other) const
-{
-   int c = m_name.compare(other.m_name);
-   return (c < 0) || ((c == 0) && (strcmp(m_type, other.m_type) < 0));
+   tResourceId id = kFnvOffsetBasis;
+   for (const tChar * p = pszName; *p != 0; p++)
+   {
+      tChar c = (*p >= _T('A') && *p <= _T('Z')) ? (*p - _T('A') + _T('a')) : *p;
+      id ^= static_cast<tResourceId>(c);
+      id *= kFnvPrime;
+   }
+   return id;
 }
 
 
@@ -142,15 +127,23 @@ cResourceData::cResourceData()
  : m_pData(NULL)
  , m_dataSize(0)
  , m_formatId(kNoIndex)
+ , m_loadParam(NULL)
+ , m_storeIndex(kNoIndex)
+ , m_lockCount(0)
+ , m_lruTick(0)
 {
 }
 
 ////////////////////////////////////////
 
-cResourceData::cResourceData(void * pData, ulong dataSize, uint formatId)
+cResourceData::cResourceData(void * pData, ulong dataSize, uint formatId, void * loadParam, uint storeIndex)
  : m_pData(pData)
  , m_dataSize(dataSize)
  , m_formatId(formatId)
+ , m_loadParam(loadParam)
+ , m_storeIndex(storeIndex)
+ , m_lockCount(0)
+ , m_lruTick(0)
 {
 }
 
@@ -160,6 +153,10 @@ cResourceData::cResourceData(const cResourceData & other)
  : m_pData(other.m_pData)
  , m_dataSize(other.m_dataSize)
  , m_formatId(other.m_formatId)
+ , m_loadParam(other.m_loadParam)
+ , m_storeIndex(other.m_storeIndex)
+ , m_lockCount(other.m_lockCount)
+ , m_lruTick(other.m_lruTick)
 {
 }
 
@@ -176,6 +173,10 @@ const cResourceData & cResourceData::operator =(const cResourceData & other)
    m_pData = other.m_pData;
    m_dataSize = other.m_dataSize;
    m_formatId = other.m_formatId;
+   m_loadParam = other.m_loadParam;
+   m_storeIndex = other.m_storeIndex;
+   m_lockCount = other.m_lockCount;
+   m_lruTick = other.m_lruTick;
    return *this;
 }
 
@@ -45,30 +45,56 @@ inline bool SameType(tResourceType lhs, tResourceType rhs)
 typedef std::vector<cStr> tStrings;
 tStrings::size_type ListDirs(const cFilePath & path, bool bSkipHidden, tStrings * pDirs);
 
+///////////////////////////////////////////////////////////////////////////////
+
+tResourceId ResourceIdFromName(const tChar * pszName);
+
+/// Folds ASCII letters to lower case first, for names that stores match
+/// without regard to case
+tResourceId ResourceIdFromNameNoCase(const tChar * pszName);
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //
 // CLASS: cResourceCacheKey
 //
 
+/// Identifies a cache entry by the resource id and the index the resource
+/// manager gave its type. Also serves as its own cHashTable hash function.
+
 class cResourceCacheKey
 {
 public:
-   cResourceCacheKey(const tChar * pszName, tResourceType type);
-   cResourceCacheKey(const cResourceCacheKey &);
-   virtual ~cResourceCacheKey();
+   cResourceCacheKey() : m_id(0), m_typeIndex(kNoIndex) {}
+   cResourceCacheKey(tResourceId id, uint typeIndex) : m_id(id), m_typeIndex(typeIndex) {}
 
-   const cResourceCacheKey & operator =(const cResourceCacheKey & other);
+   bool operator ==(const cResourceCacheKey & other) const
+   {
+      return (m_id == other.m_id) && (m_typeIndex == other.m_typeIndex);
+   }
 
-   bool operator ==(const cResourceCacheKey & other) const;
-   bool operator <(const cResourceCacheKey & other) const;
+   bool operator <(const cResourceCacheKey & other) const
+   {
+      return (m_id < other.m_id) || ((m_id == other.m_id) && (m_typeIndex < other.m_typeIndex));
+   }
 
-   inline const tChar * GetName() const { return m_name.c_str(); }
-   inline tResourceType GetType() const { return m_type; }
+   inline tResourceId GetId() const { return m_id; }
+   inline uint GetTypeIndex() const { return m_typeIndex; }
+
+   // The id is already a hash, so folding it is enough
+   static uint Hash(const cResourceCacheKey & key, uint initHash = 0)
+   {
+      return static_cast<uint>(key.m_id ^ (key.m_id >> 32)) ^ (key.m_typeIndex * 0x9E3779B9u) ^ initHash;
+   }
+
+   static bool Equal(const cResourceCacheKey & lhs, const cResourceCacheKey & rhs)
+   {
+      return lhs == rhs;
+   }
 
 private:
-   cStr m_name;
-   tResourceType m_type;
+   tResourceId m_id;
+   uint m_typeIndex;
 };
 
 
@@ -81,7 +107,7 @@ class cResourceData
 {
 public:
    cResourceData();
-   cResourceData(void * pData, ulong dataSize, uint formatId);
+   cResourceData(void * pData, ulong dataSize, uint formatId, void * loadParam, uint storeIndex);
    cResourceData(const cResourceData &);
    ~cResourceData();
 
@@ -91,10 +117,33 @@ public:
    ulong GetDataSize() const;
    uint GetFormatId() const;
 
+   /// What the entry was loaded with, so that a reload can pass it again
+   void * GetLoadParam() const;
+
+   /// The store the entry's file came from, or kNoIndex if the entry was
+   /// converted from another type
+   uint GetStoreIndex() const;
+
+   /// Swaps in reloaded data; the old data is the caller's to unload
+   void SetData(void * pData, ulong dataSize);
+
+   /// Each Load holds a lock; unlocked entries may be evicted
+   ulong GetLockCount() const;
+   ulong Lock();
+   ulong Unlock();
+
+   /// Position in the eviction order, meaningful while unlocked
+   ulong GetLruTick() const;
+   void SetLruTick(ulong tick);
+
 private:
    void * m_pData;
    ulong m_dataSize;
    uint m_formatId;
+   void * m_loadParam;
+   uint m_storeIndex;
+   ulong m_lockCount;
+   ulong m_lruTick;
 };
 
 ////////////////////////////////////////
@@ -118,17 +167,121 @@ inline uint cResourceData::GetFormatId() const
    return m_formatId;
 }
 
+////////////////////////////////////////
+
+inline void * cResourceData::GetLoadParam() const
+{
+   return m_loadParam;
+}
+
+////////////////////////////////////////
+
+inline uint cResourceData::GetStoreIndex() const
+{
+   return m_storeIndex;
+}
+
+////////////////////////////////////////
+
+inline void cResourceData::SetData(void * pData, ulong dataSize)
+{
+   m_pData = pData;
+   m_dataSize = dataSize;
+}
+
+////////////////////////////////////////
+
+inline ulong cResourceData::GetLockCount() const
+{
+   return m_lockCount;
+}
+
+////////////////////////////////////////
+
+inline ulong cResourceData::Lock()
+{
+   return ++m_lockCount;
+}
+
+////////////////////////////////////////
+
+inline ulong cResourceData::Unlock()
+{
+   Assert(m_lockCount > 0);
+   return --m_lockCount;
+}
+
+////////////////////////////////////////
+
+inline ulong cResourceData::GetLruTick() const
+{
+   return m_lruTick;
+}
+
+////////////////////////////////////////
+
+inline void cResourceData::SetLruTick(ulong tick)
+{
+   m_lruTick = tick;
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //
 // INTERFACE: IResourceManagerDiagnostics
 //
 
+struct sResourceCacheStats
+{
+   size_t nEntries;
+   size_t nLockedEntries;
+   size_t bytes;
+   size_t lockedBytes;
+   size_t budget;          ///< Zero if there is none
+   ulong nHits;
+   ulong nMisses;
+   ulong nEvictions;
+};
+
+struct sResourceLoadStats
+{
+   ulong nLoads;           ///< Loads that read a file or converted from another type
+   ulong nFailures;        ///< Loads that opened a file but got no data from it
+   size_t bytes;           ///< Size of the files read
+   double openTime;        ///< Seconds finding and opening files
+   double decodeTime;      ///< Seconds in load functions or loading derived data
+   double postloadTime;    ///< Seconds in postload and conversion functions
+   double maxLoadTime;     ///< Seconds taken by the slowest single load
+};
+
 interface IResourceManagerDiagnostics : IUnknown
 {
    virtual void DumpFormats() const = 0;
    virtual void DumpCache() const = 0;
    virtual size_t GetCacheSize() const = 0;
+
+   /// @brief Gets the cache statistics for one type, or for the whole cache
+   /// if the type is NULL
+   /// @return S_OK, or S_FALSE if nothing of the type has been requested
+   virtual tResult GetCacheStats(tResourceType type, sResourceCacheStats * pStats) const = 0;
+
+   /// @brief Gets the load timings for one type, summed over its formats, or
+   /// for every load if the type is NULL. Cache hits aren't counted.
+   /// @return S_OK, or S_FALSE if nothing of the type has been loaded
+   virtual tResult GetLoadStats(tResourceType type, sResourceLoadStats * pStats) const = 0;
+   /// @brief Logs the load timings of each format and, while loads are
+   /// traced, the slowest loads
+   virtual void DumpLoadStats() const = 0;
+   virtual void ResetLoadStats() = 0;
+
+   /// @brief Starts or stops keeping a record of every load, which the
+   /// resource_load_trace config setting also turns on
+   virtual void EnableLoadTrace(bool bEnable) = 0;
+   /// @brief Writes the recorded loads in the Trace Event Format that
+   /// chrome://tracing and similar viewers read. Each load shows up as its
+   /// read (open and load function) on the thread that read it and its
+   /// postload on the thread that finished it.
+   virtual tResult ExportLoadTrace(const tChar * pszFile) const = 0;
 };
 
 
@@ -5,18 +5,20 @@
 
 #include "scheduler.h"
 
+#include "tech/globalobj.h"
 #include "tech/techtime.h"
-
-#define BOOST_MEM_FN_ENABLE_STDCALL
-#include <boost/mem_fn.hpp>
+#include "tech/digraph.h"
+#include "tech/toposort.h"
 
 #ifdef HAVE_UNITTESTPP
 #include "UnitTest++.h"
+#include "jobsystem.h"
 #endif
 
+#include <cstring>
+
 #include "tech/dbgalloc.h" // must be last header
 
-using namespace boost;
 using namespace std;
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -50,21 +52,38 @@ static const double kNoExpiration = 0;
 
 sTaskInfo::sTaskInfo()
  : pTask(NULL)
+ , pIdentity(NULL)
+ , type(kFrameTaskType)
  , start(0)
  , period(0)
  , expiration(0)
  , next(0)
+ , sequence(0)
+ , flags(kTaskFlagNone)
+ , queueIndex(kNotInQueue)
+ , bRemoved(false)
+ , bRescheduled(false)
 {
+   memset(&budgetStats, 0, sizeof(budgetStats));
 }
 
 ////////////////////////////////////////
 
 sTaskInfo::sTaskInfo(const sTaskInfo & other)
  : pTask(other.pTask)
+ , pBudgetedTask(other.pBudgetedTask)
+ , pIdentity(other.pIdentity)
+ , type(other.type)
  , start(other.start)
  , period(other.period)
  , expiration(other.expiration)
  , next(other.next)
+ , sequence(other.sequence)
+ , flags(other.flags)
+ , queueIndex(kNotInQueue)
+ , bRemoved(other.bRemoved)
+ , bRescheduled(other.bRescheduled)
+ , budgetStats(other.budgetStats)
 {
 }
 
@@ -79,14 +98,166 @@ sTaskInfo::~sTaskInfo()
 const sTaskInfo & sTaskInfo::operator =(const sTaskInfo & other)
 {
    pTask = other.pTask;
+   pBudgetedTask = other.pBudgetedTask;
+   pIdentity = other.pIdentity;
+   type = other.type;
    start = other.start;
    period = other.period;
    expiration = other.expiration;
    next = other.next;
+   sequence = other.sequence;
+   flags = other.flags;
+   queueIndex = kNotInQueue;
+   bRemoved = other.bRemoved;
+   bRescheduled = other.bRescheduled;
+   budgetStats = other.budgetStats;
    return *this;
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cTaskQueue
+//
+
+////////////////////////////////////////
+
+cTaskQueue::cTaskQueue()
+{
+}
+
+////////////////////////////////////////
+
+cTaskQueue::~cTaskQueue()
+{
+}
+
+////////////////////////////////////////
+
+sTaskInfo * cTaskQueue::top() const
+{
+   Assert(!m_heap.empty());
+   return m_heap.front();
+}
+
+////////////////////////////////////////
+
+void cTaskQueue::push(sTaskInfo * pTaskInfo)
+{
+   Assert(pTaskInfo != NULL);
+   Assert(pTaskInfo->queueIndex == sTaskInfo::kNotInQueue);
+   m_heap.push_back(pTaskInfo);
+   pTaskInfo->queueIndex = m_heap.size() - 1;
+   SiftUp(pTaskInfo->queueIndex);
+}
+
+////////////////////////////////////////
+
+void cTaskQueue::pop()
+{
+   erase(top());
+}
+
+////////////////////////////////////////
+
+void cTaskQueue::erase(sTaskInfo * pTaskInfo)
+{
+   Assert(pTaskInfo != NULL);
+   Assert(pTaskInfo->queueIndex < m_heap.size());
+   Assert(m_heap[pTaskInfo->queueIndex] == pTaskInfo);
+
+   uint index = pTaskInfo->queueIndex;
+   pTaskInfo->queueIndex = sTaskInfo::kNotInQueue;
+
+   sTaskInfo * pLast = m_heap.back();
+   m_heap.pop_back();
+
+   if (pLast != pTaskInfo)
+   {
+      // Move the last element into the hole and let it find its place
+      Place(pLast, index);
+      update(pLast);
+   }
+}
+
+////////////////////////////////////////
+
+void cTaskQueue::update(sTaskInfo * pTaskInfo)
+{
+   Assert(pTaskInfo != NULL);
+   Assert(pTaskInfo->queueIndex < m_heap.size());
+   SiftUp(pTaskInfo->queueIndex);
+   SiftDown(pTaskInfo->queueIndex);
+}
+
+////////////////////////////////////////
+
+void cTaskQueue::clear()
+{
+   std::vector<sTaskInfo *>::iterator iter = m_heap.begin(), end = m_heap.end();
+   for (; iter != end; ++iter)
+   {
+      (*iter)->queueIndex = sTaskInfo::kNotInQueue;
+   }
+   m_heap.clear();
+}
+
+////////////////////////////////////////
+
+void cTaskQueue::SiftUp(uint index)
+{
+   sTaskInfoCompare compare;
+   sTaskInfo * pTaskInfo = m_heap[index];
+   while (index > 0)
+   {
+      uint parent = (index - 1) / 2;
+      if (!compare(m_heap[parent], pTaskInfo))
+      {
+         break;
+      }
+      Place(m_heap[parent], index);
+      index = parent;
+   }
+   Place(pTaskInfo, index);
+}
+
+////////////////////////////////////////
+
+void cTaskQueue::SiftDown(uint index)
+{
+   sTaskInfoCompare compare;
+   sTaskInfo * pTaskInfo = m_heap[index];
+   uint size = m_heap.size();
+   for (;;)
+   {
+      uint child = (2 * index) + 1;
+      if (child >= size)
+      {
+         break;
+      }
+      if ((child + 1) < size && compare(m_heap[child], m_heap[child + 1]))
+      {
+         child++;
+      }
+      if (!compare(pTaskInfo, m_heap[child]))
+      {
+         break;
+      }
+      Place(m_heap[child], index);
+      index = child;
+   }
+   Place(pTaskInfo, index);
+}
+
+////////////////////////////////////////
+
+void cTaskQueue::Place(sTaskInfo * pTaskInfo, uint index)
+{
+   m_heap[index] = pTaskInfo;
+   pTaskInfo->queueIndex = index;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // CLASS: cScheduler
@@ -94,8 +265,11 @@ const sTaskInfo & sTaskInfo::operator =(const sTaskInfo & other)
 
 ////////////////////////////////////////
 
-cScheduler::cScheduler()
- : m_lockRenderTaskQueue(0)
+cScheduler::cScheduler(IJobSystem * pJobSystem)
+ : m_nextTaskSequence(kNoTaskHandle + 1)
+ , m_pJobSystem(CTAddRef(pJobSystem))
+ , m_nRemovedRenderTasks(0)
+ , m_nRemovedBudgetedTasks(0)
 {
 }
 
@@ -116,25 +290,37 @@ tResult cScheduler::Init()
 
 tResult cScheduler::Term()
 {
-   {
-      for_each(m_renderTaskQueue.begin(), m_renderTaskQueue.end(), mem_fn(&ITask::Release));
-      m_renderTaskQueue.clear();
-   }
+   Assert(m_taskBatch.empty());
+
+   m_frameTaskQueue.clear();
+   m_timeTaskQueue.clear();
+   m_renderTasks.clear();
+   m_nRemovedRenderTasks = 0;
+   m_budgetedTasks.clear();
+   m_nRemovedBudgetedTasks = 0;
 
-   while (!m_frameTaskQueue.empty())
    {
-      sTaskInfo * pTaskInfo = m_frameTaskQueue.top();
-      m_frameTaskQueue.pop();
-      delete pTaskInfo;
+      tTaskHandleMap::iterator iter = m_taskHandles.begin(), end = m_taskHandles.end();
+      for (; iter != end; ++iter)
+      {
+         delete iter->second;
+      }
+      m_taskHandles.clear();
+      m_taskIdentities.clear();
    }
 
-   while (!m_timeTaskQueue.empty())
    {
-      sTaskInfo * pTaskInfo = m_timeTaskQueue.top();
-      m_timeTaskQueue.pop();
-      delete pTaskInfo;
+      tTaskDependencies::iterator iter = m_taskDependencies.begin(), end = m_taskDependencies.end();
+      for (; iter != end; ++iter)
+      {
+         iter->first->Release();
+         iter->second->Release();
+      }
+      m_taskDependencies.clear();
    }
 
+   SafeRelease(m_pJobSystem);
+
    return S_OK;
 }
 
@@ -161,59 +347,171 @@ bool cScheduler::IsRunning() const
 
 ////////////////////////////////////////
 
-tResult cScheduler::AddRenderTask(ITask * pTask)
+tResult cScheduler::AddRenderTask(ITask * pTask, tTaskHandle * pHandle)
+{
+   LocalMsg1("Adding render task %p\n", pTask);
+   return AddTask(kRenderTaskType, pTask, 0, 0, 0, kTaskFlagNone, pHandle);
+}
+
+////////////////////////////////////////
+
+tResult cScheduler::RemoveRenderTask(ITask * pTask)
+{
+   LocalMsg1("Removing render task %p\n", pTask);
+   return RemoveTasks(kRenderTaskType, pTask);
+}
+
+////////////////////////////////////////
+
+tResult cScheduler::AddFrameTask(ITask * pTask, ulong start, ulong period, ulong duration, uint flags, tTaskHandle * pHandle)
+{
+   LocalMsg1("Adding frame-based task %p\n", pTask);
+   return AddTask(kFrameTaskType, pTask, static_cast<double>(start), static_cast<double>(period),
+      static_cast<double>(duration), flags, pHandle);
+}
+
+////////////////////////////////////////
+
+tResult cScheduler::RemoveFrameTask(ITask * pTask)
+{
+   LocalMsg1("Removing frame-based task %p\n", pTask);
+   return RemoveTasks(kFrameTaskType, pTask);
+}
+
+////////////////////////////////////////
+
+tResult cScheduler::AddTimeTask(ITask * pTask, double start, double period, double duration, uint flags, tTaskHandle * pHandle)
+{
+   LocalMsg1("Adding time-based task %p\n", pTask);
+   return AddTask(kTimeTaskType, pTask, start, period, duration, flags, pHandle);
+}
+
+////////////////////////////////////////
+
+tResult cScheduler::RemoveTimeTask(ITask * pTask)
+{
+   LocalMsg1("Removing time-based task %p\n", pTask);
+   return RemoveTasks(kTimeTaskType, pTask);
+}
+
+////////////////////////////////////////
+
+tResult cScheduler::AddBudgetedTask(IBudgetedTask * pTask, ulong budgetMicrosecs, tTaskHandle * pHandle)
 {
    if (pTask == NULL)
    {
       return E_POINTER;
    }
 
-   if (m_lockRenderTaskQueue != 0)
+   if (budgetMicrosecs == 0)
+   {
+      return E_INVALIDARG;
+   }
+
+   cAutoIPtr<IUnknown> pIdentity;
+   if (pTask->QueryInterface(IID_IUnknown, (void**)&pIdentity) != S_OK)
    {
       return E_FAIL;
    }
 
-   LocalMsg1("Adding render task %p\n", pTask);
+   sTaskInfo * pTaskInfo = new sTaskInfo;
+   if (pTaskInfo == NULL)
+   {
+      return E_OUTOFMEMORY;
+   }
+
+   LocalMsg2("Adding budgeted task %p (%d microseconds per frame)\n", pTask, budgetMicrosecs);
+
+   pTaskInfo->pBudgetedTask = CTAddRef(pTask);
+   pTaskInfo->pIdentity = pIdentity;
+   pTaskInfo->type = kBudgetedTaskType;
+   pTaskInfo->budgetStats.budgetMicrosecs = budgetMicrosecs;
+
+   RegisterTask(pTaskInfo, pHandle);
+
+   m_budgetedTasks.push_back(pTaskInfo);
 
-   m_renderTaskQueue.push_back(CTAddRef(pTask));
    return S_OK;
 }
 
 ////////////////////////////////////////
 
-tResult cScheduler::RemoveRenderTask(ITask * pTask)
+tResult cScheduler::RemoveBudgetedTask(IBudgetedTask * pTask)
 {
-   if (pTask == NULL)
+   LocalMsg1("Removing budgeted task %p\n", pTask);
+   return RemoveTasks(kBudgetedTaskType, pTask);
+}
+
+////////////////////////////////////////
+
+tResult cScheduler::GetBudgetedTaskStats(tTaskHandle handle, sBudgetedTaskStats * pStats) const
+{
+   if (pStats == NULL)
    {
       return E_POINTER;
    }
 
-   if (m_lockRenderTaskQueue != 0)
+   tTaskHandleMap::const_iterator f = m_taskHandles.find(handle);
+   if (f == m_taskHandles.end() || f->second->bRemoved || f->second->type != kBudgetedTaskType)
    {
-      return E_FAIL;
+      return S_FALSE;
    }
 
-   deque<ITask *>::iterator iter = m_renderTaskQueue.begin(), end = m_renderTaskQueue.end();
-   for (; iter != end; ++iter)
+   *pStats = f->second->budgetStats;
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cScheduler::RemoveTask(tTaskHandle handle)
+{
+   tTaskHandleMap::iterator f = m_taskHandles.find(handle);
+   if (f == m_taskHandles.end() || f->second->bRemoved)
    {
-      if (CTIsSameObject(pTask, *iter))
-      {
-         (*iter)->Release();
-         m_renderTaskQueue.erase(iter);
-         return S_OK;
-      }
+      return S_FALSE;
    }
 
-   return S_FALSE;
+   RemoveTask(f->second);
+   return S_OK;
 }
 
 ////////////////////////////////////////
 
-static tResult AddTask(tTaskQueue * pQueue, ITask * pTask, double start, double period, double duration)
+tResult cScheduler::RescheduleTask(tTaskHandle handle, double next)
 {
-   Assert(pQueue != NULL);
+   tTaskHandleMap::iterator f = m_taskHandles.find(handle);
+   if (f == m_taskHandles.end() || f->second->bRemoved)
+   {
+      return S_FALSE;
+   }
+
+   sTaskInfo * pTaskInfo = f->second;
+   if (pTaskInfo->type == kRenderTaskType || pTaskInfo->type == kBudgetedTaskType)
+   {
+      return E_INVALIDARG;
+   }
+
+   pTaskInfo->next = next;
+
+   if (pTaskInfo->queueIndex != sTaskInfo::kNotInQueue)
+   {
+      AccessQueue(pTaskInfo->type)->update(pTaskInfo);
+   }
+   else
+   {
+      // Running right now; keep the new time when it is re-queued
+      pTaskInfo->bRescheduled = true;
+   }
+
+   return S_OK;
+}
 
-   if (period == 0)
+////////////////////////////////////////
+
+tResult cScheduler::AddTask(eTaskType type, ITask * pTask, double start, double period, double duration,
+                            uint flags, tTaskHandle * pHandle)
+{
+   if (type != kRenderTaskType && period == 0)
    {
       return E_INVALIDARG;
    }
@@ -223,6 +521,12 @@ static tResult AddTask(tTaskQueue * pQueue, ITask * pTask, double start, double
       return E_POINTER;
    }
 
+   cAutoIPtr<IUnknown> pIdentity;
+   if (pTask->QueryInterface(IID_IUnknown, (void**)&pIdentity) != S_OK)
+   {
+      return E_FAIL;
+   }
+
    sTaskInfo * pTaskInfo = new sTaskInfo;
    if (pTaskInfo == NULL)
    {
@@ -230,6 +534,8 @@ static tResult AddTask(tTaskQueue * pQueue, ITask * pTask, double start, double
    }
 
    pTaskInfo->pTask = CTAddRef(pTask);
+   pTaskInfo->pIdentity = pIdentity;
+   pTaskInfo->type = type;
    pTaskInfo->start = start;
    pTaskInfo->period = period;
    if (duration == 0)
@@ -241,179 +547,536 @@ static tResult AddTask(tTaskQueue * pQueue, ITask * pTask, double start, double
       pTaskInfo->expiration = start + duration - 1;
    }
    pTaskInfo->next = start;
+   pTaskInfo->flags = flags;
+
+   RegisterTask(pTaskInfo, pHandle);
+
+   if (type == kRenderTaskType)
+   {
+      m_renderTasks.push_back(pTaskInfo);
+   }
+   else
+   {
+      AccessQueue(type)->push(pTaskInfo);
+   }
 
-   pQueue->push(pTaskInfo);
    return S_OK;
 }
 
-static tResult RemoveTask(tTaskQueue * pQueue, ITask * pTask)
+////////////////////////////////////////
+
+void cScheduler::RegisterTask(sTaskInfo * pTaskInfo, tTaskHandle * pHandle)
 {
-   if (pTask == NULL || pQueue == NULL)
+   pTaskInfo->sequence = m_nextTaskSequence++;
+
+   m_taskHandles.insert(std::make_pair(pTaskInfo->sequence, pTaskInfo));
+   m_taskIdentities.insert(std::make_pair(std::make_pair(pTaskInfo->pIdentity, pTaskInfo->sequence), pTaskInfo));
+
+   if (pHandle != NULL)
    {
-      return E_POINTER;
+      *pHandle = pTaskInfo->sequence;
    }
+}
 
-   bool bFound = false;
-   tTaskQueue newQueue;
+////////////////////////////////////////
+
+tResult cScheduler::RemoveTasks(eTaskType type, IUnknown * pTask)
+{
+   if (pTask == NULL)
+   {
+      return E_POINTER;
+   }
 
-   while (!pQueue->empty())
+   cAutoIPtr<IUnknown> pIdentity;
+   if (pTask->QueryInterface(IID_IUnknown, (void**)&pIdentity) != S_OK)
    {
-      sTaskInfo * pTaskInfo = pQueue->top();
-      pQueue->pop();
+      return E_FAIL;
+   }
 
-      if (CTIsSameObject(pTask, pTaskInfo->pTask))
-      {
-         delete pTaskInfo;
-         bFound = true;
-      }
-      else
+   // Collect first because removing may erase from the identity map
+   std::vector<sTaskInfo *> tasks;
+   {
+      tTaskIdentityMap::iterator iter = m_taskIdentities.lower_bound(std::make_pair(pIdentity, kNoTaskHandle));
+      for (; iter != m_taskIdentities.end() && iter->first.first == pIdentity; ++iter)
       {
-         newQueue.push(pTaskInfo);
+         sTaskInfo * pTaskInfo = iter->second;
+         if (pTaskInfo->type == type && !pTaskInfo->bRemoved)
+         {
+            tasks.push_back(pTaskInfo);
+         }
       }
    }
 
-   while (!newQueue.empty())
+   std::vector<sTaskInfo *>::iterator iter = tasks.begin(), end = tasks.end();
+   for (; iter != end; ++iter)
    {
-      sTaskInfo * pTaskInfo = newQueue.top();
-      newQueue.pop();
-
-      pQueue->push(pTaskInfo);
+      RemoveTask(*iter);
    }
 
-   return bFound ? S_OK : S_FALSE;
+   return tasks.empty() ? S_FALSE : S_OK;
 }
 
 ////////////////////////////////////////
 
-tResult cScheduler::AddFrameTask(ITask * pTask, ulong start, ulong period, ulong duration)
+void cScheduler::RemoveTask(sTaskInfo * pTaskInfo)
 {
-   LocalMsg1("Adding frame-based task %p\n", pTask);
-   return AddTask(&m_frameTaskQueue, pTask, static_cast<double>(start), static_cast<double>(period), static_cast<double>(duration));
+   Assert(pTaskInfo != NULL);
+   Assert(!pTaskInfo->bRemoved);
+
+   if (pTaskInfo->type == kRenderTaskType)
+   {
+      pTaskInfo->bRemoved = true;
+      m_nRemovedRenderTasks++;
+   }
+   else if (pTaskInfo->type == kBudgetedTaskType)
+   {
+      pTaskInfo->bRemoved = true;
+      m_nRemovedBudgetedTasks++;
+   }
+   else if (pTaskInfo->queueIndex != sTaskInfo::kNotInQueue)
+   {
+      AccessQueue(pTaskInfo->type)->erase(pTaskInfo);
+      DeleteTask(pTaskInfo);
+   }
+   else
+   {
+      // Part of the batch that is running right now. Flag it so that it is
+      // deleted instead of re-queued.
+      pTaskInfo->bRemoved = true;
+   }
 }
 
 ////////////////////////////////////////
 
-tResult cScheduler::RemoveFrameTask(ITask * pTask)
+void cScheduler::DeleteTask(sTaskInfo * pTaskInfo)
 {
-   LocalMsg1("Removing frame-based task %p\n", pTask);
-   return RemoveTask(&m_frameTaskQueue, pTask);
-}
+   Assert(pTaskInfo != NULL);
+   Assert(pTaskInfo->queueIndex == sTaskInfo::kNotInQueue);
 
-////////////////////////////////////////
+   m_taskHandles.erase(pTaskInfo->sequence);
 
-tResult cScheduler::AddTimeTask(ITask * pTask, double start, double period, double duration)
-{
-   LocalMsg1("Adding time-based task %p\n", pTask);
-   return AddTask(&m_timeTaskQueue, pTask, start, period, duration);
+   m_taskIdentities.erase(std::make_pair(pTaskInfo->pIdentity, pTaskInfo->sequence));
+
+   delete pTaskInfo;
 }
 
 ////////////////////////////////////////
 
-tResult cScheduler::RemoveTimeTask(ITask * pTask)
+cTaskQueue * cScheduler::AccessQueue(eTaskType type)
 {
-   LocalMsg1("Removing time-based task %p\n", pTask);
-   return RemoveTask(&m_timeTaskQueue, pTask);
+   Assert(type == kFrameTaskType || type == kTimeTaskType);
+   return (type == kFrameTaskType) ? &m_frameTaskQueue : &m_timeTaskQueue;
 }
 
 ////////////////////////////////////////
 
-void cScheduler::NextFrame()
+tResult cScheduler::AddTaskDependency(ITask * pTask, ITask * pPrerequisite)
 {
-   m_clock.BeginFrame();
+   if (pTask == NULL || pPrerequisite == NULL)
+   {
+      return E_POINTER;
+   }
 
-   LocalMsg5("Frame %d, Time %f: %d time tasks, %d frame tasks, %d render tasks\n",
-      m_clock.GetFrameCount(), m_clock.GetFrameStart(),
-      m_timeTaskQueue.size(), m_frameTaskQueue.size(), m_renderTaskQueue.size());
+   if (CTIsSameObject(pTask, pPrerequisite))
+   {
+      return E_INVALIDARG;
+   }
 
-   // Run time-based tasks
-   while (!m_timeTaskQueue.empty())
+   tTaskDependencies::iterator iter = m_taskDependencies.begin(), end = m_taskDependencies.end();
+   for (; iter != end; ++iter)
    {
-      sTaskInfo * pTaskInfo = m_timeTaskQueue.top();
-      if (pTaskInfo->next <= m_clock.GetFrameEnd())
+      if (CTIsSameObject(pTask, iter->first) && CTIsSameObject(pPrerequisite, iter->second))
       {
-         m_timeTaskQueue.pop();
+         return S_FALSE;
+      }
+   }
 
-         m_clock.AdvanceTo(pTaskInfo->next);
+   LocalMsg2("Task %p depends on task %p\n", pTask, pPrerequisite);
 
-         if (pTaskInfo->pTask->Execute(m_clock.GetSimTime()) != S_OK)
-         {
-            delete pTaskInfo;
-            continue;
-         }
+   m_taskDependencies.push_back(std::make_pair(CTAddRef(pTask), CTAddRef(pPrerequisite)));
+   return S_OK;
+}
 
-         pTaskInfo->next += pTaskInfo->period;
+////////////////////////////////////////
+
+tResult cScheduler::RemoveTaskDependency(ITask * pTask, ITask * pPrerequisite)
+{
+   if (pTask == NULL || pPrerequisite == NULL)
+   {
+      return E_POINTER;
+   }
+
+   tTaskDependencies::iterator iter = m_taskDependencies.begin(), end = m_taskDependencies.end();
+   for (; iter != end; ++iter)
+   {
+      if (CTIsSameObject(pTask, iter->first) && CTIsSameObject(pPrerequisite, iter->second))
+      {
+         iter->first->Release();
+         iter->second->Release();
+         m_taskDependencies.erase(iter);
+         return S_OK;
+      }
+   }
+
+   return S_FALSE;
+}
 
-         if (pTaskInfo->expiration == kNoExpiration ||
-            pTaskInfo->expiration >= pTaskInfo->next)
+////////////////////////////////////////
+// Orders the batch so that every task comes after its prerequisites and
+// assigns each task a level one greater than its deepest prerequisite.
+// Tasks on the same level are independent of each other.
+
+void cScheduler::SortTaskBatch(tTaskBatch * pBatch, std::vector<uint> * pLevels) const
+{
+   Assert(pBatch != NULL);
+   Assert(pLevels != NULL);
+
+   pLevels->assign(pBatch->size(), 0);
+
+   if (m_taskDependencies.empty() || pBatch->size() < 2)
+   {
+      return;
+   }
+
+   typedef cDigraph<sTaskInfo *, int, sTaskInfoSequenceLess> tTaskGraph;
+   tTaskGraph taskGraph;
+
+   {
+      tTaskBatch::iterator iter = pBatch->begin(), end = pBatch->end();
+      for (; iter != end; ++iter)
+      {
+         taskGraph.insert(*iter);
+      }
+   }
+
+   // Only dependencies where both tasks are due in this batch matter
+   typedef std::multimap<sTaskInfo *, sTaskInfo *, sTaskInfoSequenceLess> tPrerequisiteMap;
+   tPrerequisiteMap prerequisites;
+
+   {
+      tTaskDependencies::const_iterator iter = m_taskDependencies.begin(), end = m_taskDependencies.end();
+      for (; iter != end; ++iter)
+      {
+         tTaskBatch::iterator taskIter = pBatch->begin(), prereqIter = pBatch->begin();
+         for (; taskIter != pBatch->end(); ++taskIter)
          {
-            // Re-insert with updated time
-            m_timeTaskQueue.push(pTaskInfo);
+            if (CTIsSameObject(iter->first, (*taskIter)->pTask))
+            {
+               break;
+            }
          }
-         else
+         if (taskIter == pBatch->end())
          {
-            LocalMsg2("Time task %p expiring at %f\n", pTaskInfo->pTask, pTaskInfo->expiration);
-            delete pTaskInfo;
+            continue;
+         }
+         for (; prereqIter != pBatch->end(); ++prereqIter)
+         {
+            if (CTIsSameObject(iter->second, (*prereqIter)->pTask))
+            {
+               break;
+            }
+         }
+         if (prereqIter != pBatch->end())
+         {
+            taskGraph.insert_edge(*prereqIter, *taskIter, 0);
+            prerequisites.insert(std::make_pair(*taskIter, *prereqIter));
          }
-      }
-      else
-      {
-         break;
       }
    }
 
-   m_clock.EndFrame();
+   if (prerequisites.empty())
+   {
+      return;
+   }
+
+   if (!taskGraph.acyclic())
+   {
+      WarnMsg("Scheduler task dependencies contain a cycle; running tasks in the order added\n");
+      return;
+   }
+
+   tTaskBatch sorted;
+   sorted.reserve(pBatch->size());
+   cTopoSorter<tTaskGraph::node_type> sorter(&sorted);
+   taskGraph.topological_sort(sorter);
+   Assert(sorted.size() == pBatch->size());
 
-   // Run frame tasks
-   while (!m_frameTaskQueue.empty())
+   std::map<sTaskInfo *, uint, sTaskInfoSequenceLess> levels;
+   for (uint i = 0; i < sorted.size(); i++)
    {
-      sTaskInfo * pTaskInfo = m_frameTaskQueue.top();
-      if (pTaskInfo->next <= m_clock.GetFrameCount())
+      uint level = 0;
+      tPrerequisiteMap::iterator iter = prerequisites.lower_bound(sorted[i]);
+      tPrerequisiteMap::iterator end = prerequisites.upper_bound(sorted[i]);
+      for (; iter != end; ++iter)
       {
-         LocalMsg2("Running frame task %p: time = %f\n", pTaskInfo->pTask, pTaskInfo->next);
+         uint prereqLevel = levels[iter->second] + 1;
+         if (prereqLevel > level)
+         {
+            level = prereqLevel;
+         }
+      }
+      levels[sorted[i]] = level;
+      (*pLevels)[i] = level;
+   }
 
-         m_frameTaskQueue.pop();
+   pBatch->swap(sorted);
+}
+
+////////////////////////////////////////
+// Runs the tasks in m_taskBatch, one dependency level at a time, and puts
+// them back in the given queue or deletes them if they are finished
+
+void cScheduler::RunTaskBatch(cTaskQueue * pQueue, double time)
+{
+   Assert(pQueue != NULL);
+
+   std::vector<uint> levels;
+   SortTaskBatch(&m_taskBatch, &levels);
 
-         if (pTaskInfo->pTask->Execute(m_clock.GetSimTime()) != S_OK)
+   cAutoIPtr<IJobSystem> pJobSystem;
+   {
+      tTaskBatch::iterator iter = m_taskBatch.begin(), end = m_taskBatch.end();
+      for (; iter != end; ++iter)
+      {
+         if (((*iter)->flags & kTaskFlagConcurrent) == kTaskFlagConcurrent)
          {
-            delete pTaskInfo;
-            continue;
+            if (!!m_pJobSystem)
+            {
+               pJobSystem = CTAddRef(m_pJobSystem);
+            }
+            else if (g_pGlobalObjectRegistry != NULL)
+            {
+               pJobSystem = static_cast<IJobSystem*>(FindGlobalObject(IID_IJobSystem));
+            }
+            break;
          }
+      }
+   }
 
-         pTaskInfo->next += pTaskInfo->period;
+   std::vector<tResult> results(m_taskBatch.size(), S_FALSE);
+
+   for (uint first = 0; first < m_taskBatch.size(); )
+   {
+      uint last = first + 1;
+      while (last < m_taskBatch.size() && levels[last] == levels[first])
+      {
+         last++;
+      }
+
+      tJobHandle handle = NULL;
 
-         if (pTaskInfo->expiration == kNoExpiration ||
-            pTaskInfo->expiration >= pTaskInfo->next)
+      if (!!pJobSystem)
+      {
+         for (uint i = first; i < last; i++)
          {
-            // Re-insert with updated time
-            m_frameTaskQueue.push(pTaskInfo);
+            sTaskInfo * pTaskInfo = m_taskBatch[i];
+            if (((pTaskInfo->flags & kTaskFlagConcurrent) == kTaskFlagConcurrent) && !pTaskInfo->bRemoved)
+            {
+               if (pJobSystem->ForkTask(pTaskInfo->pTask, time, &results[i], &handle) != S_OK)
+               {
+                  results[i] = pTaskInfo->pTask->Execute(time);
+               }
+            }
          }
-         else
+      }
+
+      for (uint i = first; i < last; i++)
+      {
+         sTaskInfo * pTaskInfo = m_taskBatch[i];
+         if ((!pJobSystem || ((pTaskInfo->flags & kTaskFlagConcurrent) != kTaskFlagConcurrent))
+            && !pTaskInfo->bRemoved)
          {
-            LocalMsg2("Frame task %p expiring at %f\n", pTaskInfo->pTask, pTaskInfo->expiration);
-            delete pTaskInfo;
+            LocalMsg2("Running task %p: time = %f\n", pTaskInfo->pTask, pTaskInfo->next);
+            results[i] = pTaskInfo->pTask->Execute(time);
          }
       }
+
+      if (handle != NULL)
+      {
+         pJobSystem->Join(handle);
+      }
+
+      first = last;
+   }
+
+   for (uint i = 0; i < m_taskBatch.size(); i++)
+   {
+      sTaskInfo * pTaskInfo = m_taskBatch[i];
+
+      if (pTaskInfo->bRemoved || results[i] != S_OK)
+      {
+         DeleteTask(pTaskInfo);
+         continue;
+      }
+
+      if (pTaskInfo->bRescheduled)
+      {
+         pTaskInfo->bRescheduled = false;
+      }
       else
       {
-         break;
+         pTaskInfo->next += pTaskInfo->period;
+      }
+
+      if (pTaskInfo->expiration == kNoExpiration ||
+         pTaskInfo->expiration >= pTaskInfo->next)
+      {
+         // Re-insert with updated time
+         pQueue->push(pTaskInfo);
+      }
+      else
+      {
+         LocalMsg2("Task %p expiring at %f\n", pTaskInfo->pTask, pTaskInfo->expiration);
+         DeleteTask(pTaskInfo);
+      }
+   }
+
+   m_taskBatch.clear();
+}
+
+////////////////////////////////////////
+
+void cScheduler::RunRenderTasks()
+{
+   // Render tasks added by other render tasks wait until the next frame
+   uint nRenderTasks = m_renderTasks.size();
+   for (uint i = 0; i < nRenderTasks; i++)
+   {
+      sTaskInfo * pTaskInfo = m_renderTasks[i];
+      if (!pTaskInfo->bRemoved && pTaskInfo->pTask->Execute(m_clock.GetFrameCount()) != S_OK)
+      {
+         pTaskInfo->bRemoved = true;
+         m_nRemovedRenderTasks++;
+      }
+   }
+
+   CompactTaskList(&m_renderTasks, &m_nRemovedRenderTasks);
+}
+
+////////////////////////////////////////
+
+void cScheduler::RunBudgetedTasks()
+{
+   // Tasks added by other budgeted tasks wait until the next frame
+   uint nBudgetedTasks = m_budgetedTasks.size();
+   for (uint i = 0; i < nBudgetedTasks; i++)
+   {
+      sTaskInfo * pTaskInfo = m_budgetedTasks[i];
+      if (pTaskInfo->bRemoved)
+      {
+         continue;
+      }
+
+      sBudgetedTaskStats & stats = pTaskInfo->budgetStats;
+
+      double start = TimeGetSecs();
+      double deadline = start + (stats.budgetMicrosecs / 1000000.0);
+
+      tResult result = pTaskInfo->pBudgetedTask->Execute(m_clock.GetSimTime(), deadline);
+
+      ulong elapsed = static_cast<ulong>((TimeGetSecs() - start) * 1000000.0);
+
+      stats.nRuns++;
+      stats.lastMicrosecs = elapsed;
+      if (result == S_FALSE)
+      {
+         stats.nYields++;
+      }
+      if (elapsed > stats.budgetMicrosecs)
+      {
+         stats.nOverruns++;
+         // Warn only when a task sets a new worst so as not to flood the log
+         // under sustained load
+         WarnMsgIf3(elapsed > stats.worstMicrosecs,
+            "Budgeted task %p took %d microseconds (budget %d)\n",
+            static_cast<IBudgetedTask *>(pTaskInfo->pBudgetedTask), elapsed, stats.budgetMicrosecs);
+      }
+      if (elapsed > stats.worstMicrosecs)
+      {
+         stats.worstMicrosecs = elapsed;
+      }
+
+      if (FAILED(result) && !pTaskInfo->bRemoved)
+      {
+         pTaskInfo->bRemoved = true;
+         m_nRemovedBudgetedTasks++;
       }
    }
 
-   // Run render tasks
+   CompactTaskList(&m_budgetedTasks, &m_nRemovedBudgetedTasks);
+}
+
+////////////////////////////////////////
+// Deletes the tasks flagged as removed from a render or budgeted task list
+
+void cScheduler::CompactTaskList(std::vector<sTaskInfo *> * pTasks, uint * pnRemoved)
+{
+   if (*pnRemoved > 0)
    {
-      ++m_lockRenderTaskQueue;
-      deque<ITask *>::iterator iter = m_renderTaskQueue.begin(), end = m_renderTaskQueue.end();
+      uint nKept = 0;
+      std::vector<sTaskInfo *>::iterator iter = pTasks->begin(), end = pTasks->end();
       for (; iter != end; ++iter)
       {
-         if ((*iter)->Execute(m_clock.GetFrameCount()) != S_OK)
+         if ((*iter)->bRemoved)
+         {
+            DeleteTask(*iter);
+         }
+         else
          {
-            iter = m_renderTaskQueue.erase(iter);
+            (*pTasks)[nKept++] = *iter;
          }
       }
-      --m_lockRenderTaskQueue;
+      pTasks->resize(nKept);
+      *pnRemoved = 0;
    }
 }
 
+////////////////////////////////////////
+
+void cScheduler::NextFrame()
+{
+   m_clock.BeginFrame();
+
+   LocalMsg5("Frame %d, Time %f: %d time tasks, %d frame tasks, %d render tasks\n",
+      m_clock.GetFrameCount(), m_clock.GetFrameStart(),
+      m_timeTaskQueue.size(), m_frameTaskQueue.size(), m_renderTasks.size());
+
+   // Run time-based tasks, all of those due at the same instant as one batch
+   while (!m_timeTaskQueue.empty() && m_timeTaskQueue.top()->next <= m_clock.GetFrameEnd())
+   {
+      double next = m_timeTaskQueue.top()->next;
+      while (!m_timeTaskQueue.empty() && m_timeTaskQueue.top()->next == next)
+      {
+         m_taskBatch.push_back(m_timeTaskQueue.top());
+         m_timeTaskQueue.pop();
+      }
+
+      m_clock.AdvanceTo(next);
+
+      RunTaskBatch(&m_timeTaskQueue, m_clock.GetSimTime());
+   }
+
+   m_clock.EndFrame();
+
+   // Run frame tasks, all of those due on the same frame as one batch. A
+   // task that fell behind runs again until it has caught up.
+   while (!m_frameTaskQueue.empty() && m_frameTaskQueue.top()->next <= m_clock.GetFrameCount())
+   {
+      double next = m_frameTaskQueue.top()->next;
+      while (!m_frameTaskQueue.empty() && m_frameTaskQueue.top()->next == next)
+      {
+         m_taskBatch.push_back(m_frameTaskQueue.top());
+         m_frameTaskQueue.pop();
+      }
+
+      RunTaskBatch(&m_frameTaskQueue, m_clock.GetSimTime());
+   }
+
+   RunBudgetedTasks();
+
+   RunRenderTasks();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
 tResult SchedulerCreate()
@@ -531,6 +1194,25 @@ TEST_FIXTURE(cSchedulerTests, SchedulerFrameTaskExpiration)
    CHECK_EQUAL(static_cast<int>(kFrameTaskDuration / kFrameTaskPeriod), pFrameTask->GetCount());
 }
 
+// A frame task that starts behind runs once for every frame it missed
+TEST_FIXTURE(cSchedulerTests, SchedulerFrameTaskCatchUp)
+{
+   cAutoIPtr<cCounterTask> pFrameTask(new cCounterTask);
+
+   AccessScheduler()->Start();
+   for (int i = 0; i < 3; i++)
+   {
+      AccessScheduler()->NextFrame();
+   }
+
+   CHECK(AccessScheduler()->AddFrameTask(pFrameTask, 1, 1, 0) == S_OK);
+   AccessScheduler()->NextFrame();
+   CHECK_EQUAL(4, pFrameTask->GetCount());
+   AccessScheduler()->NextFrame();
+   CHECK_EQUAL(5, pFrameTask->GetCount());
+   AccessScheduler()->Stop();
+}
+
 // Ensure nothing bad happens when tasks attempt to remove themselves during an update
 TEST_FIXTURE(cSchedulerTests, SchedulerRemoveTaskDuringFrame)
 {
@@ -545,6 +1227,306 @@ TEST_FIXTURE(cSchedulerTests, SchedulerRemoveTaskDuringFrame)
    AccessScheduler()->Stop();
 }
 
+class cOrderRecorderTask : public cComObject<IMPLEMENTS(ITask)>
+{
+public:
+   cOrderRecorderTask(char id, std::string * pOrder) : m_id(id), m_pOrder(pOrder) {}
+
+   virtual tResult Execute(double time)
+   {
+      m_pOrder->push_back(m_id);
+      return S_OK;
+   }
+
+private:
+   char m_id;
+   std::string * m_pOrder;
+};
+
+TEST_FIXTURE(cSchedulerTests, SchedulerFrameTaskDependencies)
+{
+   std::string order;
+   cAutoIPtr<ITask> pTaskA(new cOrderRecorderTask('A', &order));
+   cAutoIPtr<ITask> pTaskB(new cOrderRecorderTask('B', &order));
+   cAutoIPtr<ITask> pTaskC(new cOrderRecorderTask('C', &order));
+   cAutoIPtr<ITask> pTaskD(new cOrderRecorderTask('D', &order));
+
+   CHECK(AccessScheduler()->AddFrameTask(pTaskA, 1, 1, 0) == S_OK);
+   CHECK(AccessScheduler()->AddFrameTask(pTaskB, 1, 1, 0) == S_OK);
+   CHECK(AccessScheduler()->AddFrameTask(pTaskC, 1, 1, 0) == S_OK);
+   CHECK(AccessScheduler()->AddFrameTask(pTaskD, 1, 1, 0) == S_OK);
+
+   // A after C, C after D; B is independent
+   CHECK(AccessScheduler()->AddTaskDependency(pTaskA, pTaskC) == S_OK);
+   CHECK(AccessScheduler()->AddTaskDependency(pTaskC, pTaskD) == S_OK);
+   CHECK(AccessScheduler()->AddTaskDependency(pTaskC, pTaskD) == S_FALSE);
+   CHECK(AccessScheduler()->AddTaskDependency(pTaskA, pTaskA) == E_INVALIDARG);
+
+   AccessScheduler()->Start();
+   AccessScheduler()->NextFrame();
+   AccessScheduler()->NextFrame();
+   AccessScheduler()->Stop();
+
+   CHECK_EQUAL("BDCABDCA", order);
+
+   // A cycle falls back to the order the tasks were added in
+   CHECK(AccessScheduler()->AddTaskDependency(pTaskD, pTaskA) == S_OK);
+   order.clear();
+   AccessScheduler()->Start();
+   AccessScheduler()->NextFrame();
+   AccessScheduler()->Stop();
+   CHECK_EQUAL("ABCD", order);
+
+   CHECK(AccessScheduler()->RemoveTaskDependency(pTaskD, pTaskA) == S_OK);
+   CHECK(AccessScheduler()->RemoveTaskDependency(pTaskD, pTaskA) == S_FALSE);
+}
+
+////////////////////////////////////////
+
+class cConcurrentCounterTask : public cComObject<IMPLEMENTS(ITask)>
+{
+public:
+   cConcurrentCounterTask(volatile long * pCounter, volatile long * pSnapshot)
+    : m_pCounter(pCounter), m_pSnapshot(pSnapshot) {}
+
+   virtual tResult Execute(double time)
+   {
+      AtomicIncrement(m_pCounter);
+      if (m_pSnapshot != NULL)
+      {
+         *m_pSnapshot = *m_pCounter;
+      }
+      return S_OK;
+   }
+
+private:
+   volatile long * m_pCounter;
+   volatile long * m_pSnapshot;
+};
+
+TEST(SchedulerConcurrentFrameTasks)
+{
+   static const int kNumConcurrentTasks = 32;
+
+   cAutoIPtr<cJobSystem> pJobSystem(new cJobSystem(2));
+   CHECK(pJobSystem->Init() == S_OK);
+
+   cAutoIPtr<cScheduler> pScheduler(new cScheduler(static_cast<IJobSystem*>(pJobSystem)));
+   CHECK(pScheduler->Init() == S_OK);
+   IScheduler * pIScheduler = static_cast<IScheduler*>(pScheduler);
+
+   volatile long counter = 0, snapshot = 0;
+
+   std::vector< cAutoIPtr<ITask> > tasks;
+   for (int i = 0; i < kNumConcurrentTasks; i++)
+   {
+      tasks.push_back(cAutoIPtr<ITask>(new cConcurrentCounterTask(&counter, NULL)));
+      CHECK(pIScheduler->AddFrameTask(tasks.back(), 1, 1, 0, kTaskFlagConcurrent) == S_OK);
+   }
+
+   // Runs on the scheduler thread after every concurrent task has finished
+   cAutoIPtr<ITask> pLastTask(new cConcurrentCounterTask(&counter, &snapshot));
+   CHECK(pIScheduler->AddFrameTask(pLastTask, 1, 1, 0) == S_OK);
+   for (int i = 0; i < kNumConcurrentTasks; i++)
+   {
+      CHECK(pIScheduler->AddTaskDependency(pLastTask, tasks[i]) == S_OK);
+   }
+
+   pIScheduler->Start();
+   pIScheduler->NextFrame();
+   pIScheduler->Stop();
+
+   CHECK_EQUAL(kNumConcurrentTasks + 1, counter);
+   CHECK_EQUAL(kNumConcurrentTasks + 1, snapshot);
+
+   pScheduler->Term();
+   pJobSystem->Term();
+}
+
+////////////////////////////////////////
+
+TEST_FIXTURE(cSchedulerTests, SchedulerTaskHandles)
+{
+   cAutoIPtr<cCounterTask> pTask(new cCounterTask);
+
+   tTaskHandle frameHandle = kNoTaskHandle, timeHandle = kNoTaskHandle, renderHandle = kNoTaskHandle;
+   CHECK(AccessScheduler()->AddFrameTask(pTask, 1, 1, 0, kTaskFlagNone, &frameHandle) == S_OK);
+   CHECK(AccessScheduler()->AddTimeTask(pTask, 1000, 1, 0, kTaskFlagNone, &timeHandle) == S_OK);
+   CHECK(AccessScheduler()->AddRenderTask(pTask, &renderHandle) == S_OK);
+   CHECK(frameHandle != kNoTaskHandle);
+   CHECK(frameHandle != timeHandle);
+   CHECK(timeHandle != renderHandle);
+
+   // The time task is nowhere near due
+   CHECK(AccessScheduler()->RescheduleTask(renderHandle, 0) == E_INVALIDARG);
+   AccessScheduler()->Start();
+   AccessScheduler()->NextFrame();
+   CHECK_EQUAL(2, pTask->GetCount());
+
+   // Pulling the time task in makes it run next frame
+   CHECK(AccessScheduler()->RescheduleTask(timeHandle, 0) == S_OK);
+   AccessScheduler()->NextFrame();
+   CHECK_EQUAL(5, pTask->GetCount());
+
+   CHECK(AccessScheduler()->RemoveTask(frameHandle) == S_OK);
+   CHECK(AccessScheduler()->RemoveTask(frameHandle) == S_FALSE);
+   CHECK(AccessScheduler()->RemoveTask(renderHandle) == S_OK);
+   CHECK(AccessScheduler()->RescheduleTask(frameHandle, 0) == S_FALSE);
+   CHECK(AccessScheduler()->RemoveTimeTask(pTask) == S_OK);
+   CHECK(AccessScheduler()->RemoveTimeTask(pTask) == S_FALSE);
+
+   AccessScheduler()->NextFrame();
+   AccessScheduler()->Stop();
+   CHECK_EQUAL(5, pTask->GetCount());
+}
+
+////////////////////////////////////////
+
+TEST_FIXTURE(cSchedulerTests, SchedulerTaskHandleTimeTrial)
+{
+   static const int kNumTasks = 100000;
+
+   cAutoIPtr<cCounterTask> pTask(new cCounterTask);
+   std::vector<tTaskHandle> handles(kNumTasks, kNoTaskHandle);
+
+   double addTime = -TimeGetSecs();
+   for (int i = 0; i < kNumTasks; i++)
+   {
+      AccessScheduler()->AddTimeTask(pTask, 1000 + (i % 997), 1, 0, kTaskFlagNone, &handles[i]);
+   }
+   addTime += TimeGetSecs();
+
+   double rescheduleTime = -TimeGetSecs();
+   for (int i = 0; i < kNumTasks; i += 2)
+   {
+      CHECK(AccessScheduler()->RescheduleTask(handles[i], 2000 + (i % 991)) == S_OK);
+   }
+   rescheduleTime += TimeGetSecs();
+
+   double removeTime = -TimeGetSecs();
+   for (int i = 0; i < kNumTasks; i++)
+   {
+      CHECK(AccessScheduler()->RemoveTask(handles[(i * 7919) % kNumTasks]) == S_OK);
+   }
+   removeTime += TimeGetSecs();
+
+   CHECK_EQUAL(0, pTask->GetCount());
+
+   LocalMsg4("%d tasks: add %f secs, reschedule half %f secs, remove %f secs\n",
+      kNumTasks, addTime, rescheduleTime, removeTime);
+}
+
+////////////////////////////////////////
+
+static void BusyWaitMicrosecs(ulong microsecs)
+{
+   double end = TimeGetSecs() + (microsecs / 1000000.0);
+   while (TimeGetSecs() < end)
+   {
+   }
+}
+
+class cWorkQueueTask : public cComObject<IMPLEMENTS(IBudgetedTask)>
+{
+public:
+   cWorkQueueTask(int nItems, ulong itemMicrosecs, bool bIgnoreDeadline = false)
+    : m_nItemsLeft(nItems), m_itemMicrosecs(itemMicrosecs), m_bIgnoreDeadline(bIgnoreDeadline), m_maxItemsPerRun(0)
+   {
+   }
+
+   virtual tResult Execute(double time, double deadline)
+   {
+      double itemSecs = m_itemMicrosecs / 1000000.0;
+      int nItems = 0;
+      while (m_nItemsLeft > 0)
+      {
+         if (!m_bIgnoreDeadline && (TimeGetSecs() + itemSecs) > deadline)
+         {
+            break;
+         }
+         BusyWaitMicrosecs(m_itemMicrosecs);
+         m_nItemsLeft--;
+         nItems++;
+      }
+      if (nItems > m_maxItemsPerRun)
+      {
+         m_maxItemsPerRun = nItems;
+      }
+      return (m_nItemsLeft > 0) ? S_FALSE : S_OK;
+   }
+
+   int m_nItemsLeft;
+   ulong m_itemMicrosecs;
+   bool m_bIgnoreDeadline;
+   int m_maxItemsPerRun;
+};
+
+TEST_FIXTURE(cSchedulerTests, SchedulerBudgetedTasks)
+{
+   static const ulong kBudget = 2000;
+   static const ulong kItemCost = 200;
+   static const int kItems = 100;
+
+   cAutoIPtr<cWorkQueueTask> pTask(new cWorkQueueTask(kItems, kItemCost));
+   tTaskHandle handle = kNoTaskHandle;
+   CHECK(AccessScheduler()->AddBudgetedTask(pTask, kBudget, &handle) == S_OK);
+   CHECK(AccessScheduler()->AddBudgetedTask(pTask, 0) == E_INVALIDARG);
+
+   int nFrames = 0;
+   AccessScheduler()->Start();
+   while (pTask->m_nItemsLeft > 0 && nFrames < 1000)
+   {
+      AccessScheduler()->NextFrame();
+      nFrames++;
+   }
+   // Keeps being called once the work runs out
+   AccessScheduler()->NextFrame();
+   AccessScheduler()->Stop();
+
+   CHECK_EQUAL(0, pTask->m_nItemsLeft);
+   // The work is spread over several frames, each within the budget
+   CHECK(nFrames >= (kItems * kItemCost) / kBudget);
+   CHECK(pTask->m_maxItemsPerRun <= static_cast<int>(kBudget / kItemCost));
+
+   sBudgetedTaskStats stats;
+   CHECK(AccessScheduler()->GetBudgetedTaskStats(handle, &stats) == S_OK);
+   CHECK_EQUAL(kBudget, stats.budgetMicrosecs);
+   CHECK_EQUAL(static_cast<ulong>(nFrames + 1), stats.nRuns);
+   CHECK_EQUAL(static_cast<ulong>(nFrames - 1), stats.nYields);
+
+   CHECK(AccessScheduler()->RescheduleTask(handle, 10) == E_INVALIDARG);
+   CHECK(AccessScheduler()->RemoveBudgetedTask(pTask) == S_OK);
+   CHECK(AccessScheduler()->GetBudgetedTaskStats(handle, &stats) == S_FALSE);
+}
+
+TEST_FIXTURE(cSchedulerTests, SchedulerBudgetOverruns)
+{
+   static const ulong kBudget = 1000;
+   static const int kItems = 5;
+
+   // Ignores the deadline and does five times its budget's worth of work
+   cAutoIPtr<cWorkQueueTask> pTask(new cWorkQueueTask(kItems, kBudget, true));
+   tTaskHandle handle = kNoTaskHandle;
+   CHECK(AccessScheduler()->AddBudgetedTask(pTask, kBudget, &handle) == S_OK);
+
+   AccessScheduler()->Start();
+   AccessScheduler()->NextFrame();
+   AccessScheduler()->Stop();
+
+   sBudgetedTaskStats stats;
+   CHECK(AccessScheduler()->GetBudgetedTaskStats(handle, &stats) == S_OK);
+   CHECK_EQUAL(1u, stats.nRuns);
+   CHECK_EQUAL(1u, stats.nOverruns);
+   CHECK(stats.worstMicrosecs >= (kItems * kBudget));
+   CHECK_EQUAL(stats.worstMicrosecs, stats.lastMicrosecs);
+
+   CHECK(AccessScheduler()->RemoveTask(handle) == S_OK);
+   AccessScheduler()->Start();
+   AccessScheduler()->NextFrame();
+   AccessScheduler()->Stop();
+   CHECK(AccessScheduler()->GetBudgetedTaskStats(handle, &stats) == S_FALSE);
+}
+
 #endif // HAVE_UNITTESTPP
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -9,8 +9,9 @@
 #include "tech/globalobjdef.h"
 #include "tech/schedulerapi.h"
 
-#include <queue>
-#include <deque>
+#include <map>
+#include <utility>
+#include <vector>
 
 #ifdef _MSC_VER
 #pragma once
@@ -21,8 +22,18 @@
 // STRUCT: sTaskInfo
 //
 
+enum eTaskType
+{
+   kRenderTaskType,
+   kFrameTaskType,
+   kTimeTaskType,
+   kBudgetedTaskType,
+};
+
 struct sTaskInfo
 {
+   enum { kNotInQueue = ~0u };
+
    sTaskInfo();
    sTaskInfo(const sTaskInfo & other);
    ~sTaskInfo();
@@ -30,10 +41,19 @@ struct sTaskInfo
    const sTaskInfo & operator =(const sTaskInfo & other);
 
    cAutoIPtr<ITask> pTask;
+   cAutoIPtr<IBudgetedTask> pBudgetedTask; // instead of pTask for kBudgetedTaskType
+   IUnknown * pIdentity; // identity IUnknown of the task (not AddRef'd)
+   eTaskType type;
 	double start;
 	double period;
 	double expiration;
 	double next;
+   ulong sequence; // doubles as the task handle
+   uint flags;
+   uint queueIndex;
+   bool bRemoved;
+   bool bRescheduled;
+   sBudgetedTaskStats budgetStats;
 };
 
 struct sTaskInfoCompare
@@ -41,13 +61,59 @@ struct sTaskInfoCompare
    bool operator()(const sTaskInfo * pTask1, const sTaskInfo * pTask2) const
    {
       // Returning true puts the first argument toward the back of the
-      // priority queue. Use a greater than test so that tasks with sooner
-      // next run times are sorted toward the front of the priority queue.
-      return pTask1->next > pTask2->next;
+      // queue. Use a greater than test so that tasks with sooner next run
+      // times are sorted toward the front of the queue. Ties go to the
+      // task added first so that the order is deterministic.
+      if (pTask1->next != pTask2->next)
+      {
+         return pTask1->next > pTask2->next;
+      }
+      return pTask1->sequence > pTask2->sequence;
+   }
+};
+
+struct sTaskInfoSequenceLess
+{
+   bool operator()(const sTaskInfo * pTask1, const sTaskInfo * pTask2) const
+   {
+      return pTask1->sequence < pTask2->sequence;
    }
 };
 
-typedef std::priority_queue<sTaskInfo *, std::deque<sTaskInfo *>, sTaskInfoCompare> tTaskQueue;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cTaskQueue
+//
+// Binary heap that records each task's position in sTaskInfo::queueIndex so
+// that any task, not just the top one, can be removed or re-sorted in
+// O(log n) time. The interface follows std::priority_queue.
+
+class cTaskQueue
+{
+public:
+   cTaskQueue();
+   ~cTaskQueue();
+
+   bool empty() const { return m_heap.empty(); }
+   size_t size() const { return m_heap.size(); }
+
+   sTaskInfo * top() const;
+   void push(sTaskInfo * pTaskInfo);
+   void pop();
+
+   void erase(sTaskInfo * pTaskInfo);
+   void update(sTaskInfo * pTaskInfo);
+   void clear();
+
+private:
+   void SiftUp(uint index);
+   void SiftDown(uint index);
+   void Place(sTaskInfo * pTaskInfo, uint index);
+
+   std::vector<sTaskInfo *> m_heap;
+};
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -57,7 +123,7 @@ typedef std::priority_queue<sTaskInfo *, std::deque<sTaskInfo *>, sTaskInfoCompa
 class cScheduler : public cComObject2<IMPLEMENTS(IScheduler), IMPLEMENTS(IGlobalObject)>
 {
 public:
-	cScheduler();
+	cScheduler(IJobSystem * pJobSystem = NULL);
 	~cScheduler();
 
    DECLARE_NAME_STRING(kSchedulerName)
@@ -72,21 +138,71 @@ public:
 
 	virtual void NextFrame();
 
-   virtual tResult AddRenderTask(ITask * pTask);
+   virtual tResult AddRenderTask(ITask * pTask, tTaskHandle * pHandle);
 	virtual tResult RemoveRenderTask(ITask * pTask);
 
-	virtual tResult AddFrameTask(ITask * pTask, ulong start, ulong period, ulong duration);
+	virtual tResult AddFrameTask(ITask * pTask, ulong start, ulong period, ulong duration, uint flags, tTaskHandle * pHandle);
 	virtual tResult RemoveFrameTask(ITask * pTask);
 
-	virtual tResult AddTimeTask(ITask * pTask, double start, double period, double duration);
+	virtual tResult AddTimeTask(ITask * pTask, double start, double period, double duration, uint flags, tTaskHandle * pHandle);
 	virtual tResult RemoveTimeTask(ITask * pTask);
 
+   virtual tResult AddBudgetedTask(IBudgetedTask * pTask, ulong budgetMicrosecs, tTaskHandle * pHandle);
+   virtual tResult RemoveBudgetedTask(IBudgetedTask * pTask);
+   virtual tResult GetBudgetedTaskStats(tTaskHandle handle, sBudgetedTaskStats * pStats) const;
+
+   virtual tResult RemoveTask(tTaskHandle handle);
+   virtual tResult RescheduleTask(tTaskHandle handle, double next);
+
+   virtual tResult AddTaskDependency(ITask * pTask, ITask * pPrerequisite);
+   virtual tResult RemoveTaskDependency(ITask * pTask, ITask * pPrerequisite);
+
 private:
+   typedef std::vector<sTaskInfo *> tTaskBatch;
+
+   tResult AddTask(eTaskType type, ITask * pTask, double start, double period, double duration, uint flags, tTaskHandle * pHandle);
+   void RegisterTask(sTaskInfo * pTaskInfo, tTaskHandle * pHandle);
+   tResult RemoveTasks(eTaskType type, IUnknown * pTask);
+   void RemoveTask(sTaskInfo * pTaskInfo);
+   void DeleteTask(sTaskInfo * pTaskInfo);
+
+   cTaskQueue * AccessQueue(eTaskType type);
+
+   void RunTaskBatch(cTaskQueue * pQueue, double time);
+   void SortTaskBatch(tTaskBatch * pBatch, std::vector<uint> * pLevels) const;
+
+   void RunBudgetedTasks();
+   void RunRenderTasks();
+   void CompactTaskList(std::vector<sTaskInfo *> * pTasks, uint * pnRemoved);
+
 	cSchedulerClock m_clock;
-   tTaskQueue m_frameTaskQueue;
-   tTaskQueue m_timeTaskQueue;
-   std::deque<ITask *> m_renderTaskQueue;
-   uint m_lockRenderTaskQueue;
+   cTaskQueue m_frameTaskQueue;
+   cTaskQueue m_timeTaskQueue;
+   ulong m_nextTaskSequence;
+
+   // Every live task, by handle and by identity for the remove-by-pointer
+   // methods
+   typedef std::map<tTaskHandle, sTaskInfo *> tTaskHandleMap;
+   tTaskHandleMap m_taskHandles;
+   typedef std::map<std::pair<IUnknown *, tTaskHandle>, sTaskInfo *> tTaskIdentityMap;
+   tTaskIdentityMap m_taskIdentities;
+
+   // Tasks popped from one of the queues that are due to run right now
+   tTaskBatch m_taskBatch;
+
+   typedef std::vector< std::pair<ITask *, ITask *> > tTaskDependencies;
+   tTaskDependencies m_taskDependencies;
+
+   cAutoIPtr<IJobSystem> m_pJobSystem;
+
+   // Render tasks run in the order added. Removed ones are only flagged
+   // and are compacted out the next time the render tasks run.
+   std::vector<sTaskInfo *> m_renderTasks;
+   uint m_nRemovedRenderTasks;
+
+   // Budgeted tasks are kept the same way as render tasks
+   std::vector<sTaskInfo *> m_budgetedTasks;
+   uint m_nRemovedBudgetedTasks;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -5,9 +5,21 @@
 
 #include "sim.h"
 
+#include "tech/configapi.h"
+#include "tech/globalobj.h"
+
 #define BOOST_MEM_FN_ENABLE_STDCALL
 #include <boost/mem_fn.hpp>
 
+#ifdef HAVE_UNITTESTPP
+#include "UnitTest++.h"
+#include "jobsystem.h"
+#include "tech/techtime.h"
+#include "tech/thread.h"
+#endif
+
+#include <cmath>
+
 #include "tech/dbgalloc.h" // must be last header
 
 using namespace boost;
@@ -29,6 +41,10 @@ LOG_DEFINE_CHANNEL(Sim);
 #define LocalMsgIf3(cond,msg,a,b,c)    DebugMsgIfEx3(Sim,(cond),msg,(a),(b),(c))
 #define LocalMsgIf4(cond,msg,a,b,c,d)  DebugMsgIfEx4(Sim,(cond),msg,(a),(b),(c),(d))
 
+///////////////////////////////////////////////////////////////////////////////
+
+static const uint kDefaultMaxTicksPerFrame = 5;
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -37,12 +53,18 @@ LOG_DEFINE_CHANNEL(Sim);
 
 ////////////////////////////////////////
 
-cSim::cSim()
- : m_bIsRunning(false)
+cSim::cSim(IJobSystem * pJobSystem)
+ : m_renderTask(this)
+ , m_bIsRunning(false)
  , m_lastSchedTime(0)
  , m_simTime(0)
  , m_timeScale(1)
+ , m_tickInterval(0)
+ , m_maxTicksPerFrame(kDefaultMaxTicksPerFrame)
+ , m_tickAccumulator(0)
  , m_lockSimClients(0)
+ , m_pJobSystem(CTAddRef(pJobSystem))
+ , m_lockRenderClients(0)
 {
 }
 
@@ -62,8 +84,17 @@ END_CONSTRAINTS()
 
 tResult cSim::Init()
 {
+   double tickRate = 0;
+   if (ConfigGet(_T("sim_tick_rate"), &tickRate) == S_OK && tickRate > 0)
+   {
+      int maxTicksPerFrame = kDefaultMaxTicksPerFrame;
+      ConfigGet(_T("sim_max_ticks_per_frame"), &maxTicksPerFrame);
+      SetFixedTickRate(tickRate, maxTicksPerFrame);
+   }
+
    UseGlobal(Scheduler);
    pScheduler->AddFrameTask(static_cast<ITask*>(this), 0, 1, 0);
+   pScheduler->AddRenderTask(&m_renderTask);
 
    return S_OK;
 }
@@ -73,9 +104,16 @@ tResult cSim::Init()
 tResult cSim::Term()
 {
    DisconnectAll();
+   m_concurrentClients.clear();
+
+   SafeRelease(m_pJobSystem);
+
+   for_each(m_renderClients.begin(), m_renderClients.end(), mem_fn(&ISimRenderClient::Release));
+   m_renderClients.clear();
 
    UseGlobal(Scheduler);
    pScheduler->RemoveFrameTask(static_cast<ITask*>(this));
+   pScheduler->RemoveRenderTask(&m_renderTask);
 
    return S_OK;
 }
@@ -91,6 +129,7 @@ tResult cSim::Start()
 
    m_bIsRunning = true;
    m_lastSchedTime = 0;
+   m_tickAccumulator = 0;
    return S_OK;
 }
 
@@ -142,7 +181,7 @@ void cSim::SetTimeScale(double scale)
 
 ////////////////////////////////////////
 
-tResult cSim::AddSimClient(ISimClient * pSimClient)
+tResult cSim::AddSimClient(ISimClient * pSimClient, uint flags)
 {
    if (pSimClient == NULL)
    {
@@ -152,7 +191,12 @@ tResult cSim::AddSimClient(ISimClient * pSimClient)
    {
       return E_FAIL;
    }
-   return Connect(pSimClient);
+   tResult result = Connect(pSimClient);
+   if (result == S_OK && (flags & kSimClientFlagConcurrent) == kSimClientFlagConcurrent)
+   {
+      m_concurrentClients.insert(pSimClient);
+   }
+   return result;
 }
 
 ////////////////////////////////////////
@@ -167,11 +211,113 @@ tResult cSim::RemoveSimClient(ISimClient * pSimClient)
    {
       return E_FAIL;
    }
+   // The set holds the pointer the client was added with, as the sink list
+   // does, which may be another interface on the same object
+   std::set<ISimClient *>::iterator iter = m_concurrentClients.begin(), end = m_concurrentClients.end();
+   for (; iter != end; ++iter)
+   {
+      if (CTIsSameObject(*iter, pSimClient))
+      {
+         m_concurrentClients.erase(iter);
+         break;
+      }
+   }
    return Disconnect(pSimClient);
 }
 
 ////////////////////////////////////////
 
+tResult cSim::SetFixedTickRate(double ticksPerSecond, uint maxTicksPerFrame)
+{
+   if (ticksPerSecond < 0)
+   {
+      return E_INVALIDARG;
+   }
+
+   if (ticksPerSecond == 0)
+   {
+      m_tickInterval = 0;
+   }
+   else
+   {
+      if (maxTicksPerFrame == 0)
+      {
+         return E_INVALIDARG;
+      }
+      m_tickInterval = 1.0 / ticksPerSecond;
+      m_maxTicksPerFrame = maxTicksPerFrame;
+      LocalMsg2("Sim running at %f ticks per second, at most %d per frame\n", ticksPerSecond, maxTicksPerFrame);
+   }
+
+   m_tickAccumulator = 0;
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+double cSim::GetFixedTickRate() const
+{
+   return (m_tickInterval > 0) ? (1.0 / m_tickInterval) : 0;
+}
+
+////////////////////////////////////////
+
+double cSim::GetInterpolationAlpha() const
+{
+   return (m_tickInterval > 0) ? (m_tickAccumulator / m_tickInterval) : 1;
+}
+
+////////////////////////////////////////
+
+tResult cSim::AddRenderClient(ISimRenderClient * pRenderClient)
+{
+   if (pRenderClient == NULL)
+   {
+      return E_POINTER;
+   }
+   if (m_lockRenderClients != 0)
+   {
+      return E_FAIL;
+   }
+   std::vector<ISimRenderClient *>::iterator iter = m_renderClients.begin(), end = m_renderClients.end();
+   for (; iter != end; ++iter)
+   {
+      if (CTIsSameObject(pRenderClient, *iter))
+      {
+         return S_FALSE;
+      }
+   }
+   m_renderClients.push_back(CTAddRef(pRenderClient));
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+tResult cSim::RemoveRenderClient(ISimRenderClient * pRenderClient)
+{
+   if (pRenderClient == NULL)
+   {
+      return E_POINTER;
+   }
+   if (m_lockRenderClients != 0)
+   {
+      return E_FAIL;
+   }
+   std::vector<ISimRenderClient *>::iterator iter = m_renderClients.begin(), end = m_renderClients.end();
+   for (; iter != end; ++iter)
+   {
+      if (CTIsSameObject(pRenderClient, *iter))
+      {
+         (*iter)->Release();
+         m_renderClients.erase(iter);
+         return S_OK;
+      }
+   }
+   return S_FALSE;
+}
+
+////////////////////////////////////////
+
 tResult cSim::Execute(double time)
 {
    if (m_bIsRunning)
@@ -186,23 +332,169 @@ tResult cSim::Execute(double time)
 
       double frameTime = elapsed * m_timeScale;
 
-      m_simTime += frameTime;
+      if (m_tickInterval == 0)
+      {
+         m_simTime += frameTime;
+         RunSimClients();
+      }
+      else
+      {
+         m_tickAccumulator += frameTime;
+
+         uint nTicks = 0;
+         while (m_tickAccumulator >= m_tickInterval && nTicks < m_maxTicksPerFrame)
+         {
+            m_tickAccumulator -= m_tickInterval;
+            m_simTime += m_tickInterval;
+            RunSimClients();
+            ++nTicks;
+         }
+
+         if (m_tickAccumulator >= m_tickInterval)
+         {
+            // Too far behind to catch up; let the sim run slow instead
+            LocalMsg1("Sim dropping %f seconds of ticks\n", m_tickAccumulator - fmod(m_tickAccumulator, m_tickInterval));
+            m_tickAccumulator = fmod(m_tickAccumulator, m_tickInterval);
+         }
+      }
 
-      ++m_lockSimClients;
+      m_lastSchedTime = time;
+   }
+
+   return S_OK;
+}
+
+////////////////////////////////////////
+
+void cSim::RunSimClients()
+{
+   ++m_lockSimClients;
+
+   IJobSystem * pJobSystem = !m_concurrentClients.empty() ? AccessJobSystem() : NULL;
+
+   // Hand the concurrent clients to the job system first so that they run
+   // alongside the serial ones. The calls are set up before any are forked
+   // because the jobs point into the vector.
+   tJobHandle handle = NULL;
+   m_concurrentCalls.clear();
+   if (pJobSystem != NULL)
+   {
       tSinksIterator iter = BeginSinks(), end = EndSinks();
       for (; iter != end; ++iter)
       {
-         cAutoIPtr<ISimClient> pSimClient(CTAddRef(*iter));
-         if (pSimClient->Execute(m_simTime) != S_OK)
+         if (m_concurrentClients.find(*iter) != m_concurrentClients.end())
+         {
+            sConcurrentCall call = { *iter, m_simTime, S_OK };
+            m_concurrentCalls.push_back(call);
+         }
+      }
+      for (uint i = 0; i < m_concurrentCalls.size(); i++)
+      {
+         sConcurrentCall * pCall = &m_concurrentCalls[i];
+         if (pJobSystem->Fork(ExecuteConcurrentCall, pCall, &handle) != S_OK)
          {
-            iter = Disconnect(iter);
+            ExecuteConcurrentCall(pCall);
          }
       }
-      --m_lockSimClients;
+   }
 
-      m_lastSchedTime = time;
+   std::vector<ISimClient *> finishedClients;
+
+   {
+      tSinksIterator iter = BeginSinks(), end = EndSinks();
+      for (; iter != end; ++iter)
+      {
+         if (pJobSystem != NULL && m_concurrentClients.find(*iter) != m_concurrentClients.end())
+         {
+            continue;
+         }
+         if ((*iter)->Execute(m_simTime) != S_OK)
+         {
+            finishedClients.push_back(*iter);
+         }
+      }
    }
 
+   if (handle != NULL)
+   {
+      pJobSystem->Join(handle);
+   }
+
+   {
+      std::vector<sConcurrentCall>::iterator iter = m_concurrentCalls.begin(), end = m_concurrentCalls.end();
+      for (; iter != end; ++iter)
+      {
+         if (iter->result != S_OK)
+         {
+            finishedClients.push_back(iter->pSimClient);
+         }
+      }
+   }
+
+   --m_lockSimClients;
+
+   // Clients that return anything but S_OK are removed
+   std::vector<ISimClient *>::iterator iter = finishedClients.begin(), end = finishedClients.end();
+   for (; iter != end; ++iter)
+   {
+      RemoveSimClient(*iter);
+   }
+}
+
+////////////////////////////////////////
+
+void cSim::ExecuteConcurrentCall(void * pArg)
+{
+   sConcurrentCall * pCall = static_cast<sConcurrentCall *>(pArg);
+   pCall->result = pCall->pSimClient->Execute(pCall->time);
+}
+
+////////////////////////////////////////
+
+IJobSystem * cSim::AccessJobSystem()
+{
+   if (!m_pJobSystem && g_pGlobalObjectRegistry != NULL)
+   {
+      m_pJobSystem = static_cast<IJobSystem*>(FindGlobalObject(IID_IJobSystem));
+   }
+   return m_pJobSystem;
+}
+
+////////////////////////////////////////
+
+void cSim::RunRenderClients()
+{
+   double alpha = GetInterpolationAlpha();
+
+   ++m_lockRenderClients;
+   std::vector<ISimRenderClient *>::iterator iter = m_renderClients.begin();
+   while (iter != m_renderClients.end())
+   {
+      if ((*iter)->Render(m_simTime, alpha) != S_OK)
+      {
+         (*iter)->Release();
+         iter = m_renderClients.erase(iter);
+      }
+      else
+      {
+         ++iter;
+      }
+   }
+   --m_lockRenderClients;
+}
+
+////////////////////////////////////////
+
+cSim::cRenderTask::cRenderTask(cSim * pOuter)
+ : m_pOuter(pOuter)
+{
+}
+
+////////////////////////////////////////
+
+tResult cSim::cRenderTask::Execute(double time)
+{
+   m_pOuter->RunRenderClients();
    return S_OK;
 }
 
@@ -218,4 +510,212 @@ tResult SimCreate()
    return RegisterGlobalObject(IID_ISim, pSim);
 }
 
+
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef HAVE_UNITTESTPP
+
+class cTickCounterSimClient : public cComObject<IMPLEMENTS(ISimClient)>
+{
+public:
+   cTickCounterSimClient() : m_nTicks(0), m_lastTime(0) {}
+
+   virtual tResult Execute(double time)
+   {
+      ++m_nTicks;
+      m_lastTime = time;
+      return S_OK;
+   }
+
+   int m_nTicks;
+   double m_lastTime;
+};
+
+TEST(SimFixedTicks)
+{
+   cAutoIPtr<cSim> pSim(new cSim);
+   cAutoIPtr<cTickCounterSimClient> pClient(new cTickCounterSimClient);
+
+   CHECK(static_cast<ISim*>(pSim)->AddSimClient(pClient) == S_OK);
+   CHECK(pSim->SetFixedTickRate(10, 3) == S_OK);
+   CHECK_CLOSE(10, pSim->GetFixedTickRate(), 1e-9);
+   CHECK(pSim->Start() == S_OK);
+
+   // The first frame only establishes the starting time
+   pSim->Execute(1);
+   CHECK_EQUAL(0, pClient->m_nTicks);
+
+   pSim->Execute(1.25);
+   CHECK_EQUAL(2, pClient->m_nTicks);
+   CHECK_CLOSE(0.2, pClient->m_lastTime, 1e-9);
+   CHECK_CLOSE(0.5, pSim->GetInterpolationAlpha(), 1e-9);
+
+   // A long stall runs at most three ticks and drops the rest
+   pSim->Execute(3.25);
+   CHECK_EQUAL(5, pClient->m_nTicks);
+   CHECK_CLOSE(0.5, pClient->m_lastTime, 1e-9);
+   CHECK_CLOSE(0.5, pSim->GetInterpolationAlpha(), 1e-9);
+
+   // Back to variable steps
+   CHECK(pSim->SetFixedTickRate(0, 0) == S_OK);
+   pSim->Execute(3.5);
+   CHECK_EQUAL(6, pClient->m_nTicks);
+   CHECK_CLOSE(0.75, pSim->GetTime(), 1e-9);
+   CHECK_CLOSE(1, pSim->GetInterpolationAlpha(), 1e-9);
+
+   CHECK(pSim->RemoveSimClient(pClient) == S_OK);
+   pSim->Stop();
+}
+
+////////////////////////////////////////
+
+class cOrderRecorderSimClient : public cComObject<IMPLEMENTS(ISimClient)>
+{
+public:
+   cOrderRecorderSimClient(std::vector<int> * pOrder, int id, int nTicksToRun = -1)
+    : m_pOrder(pOrder), m_id(id), m_nTicksToRun(nTicksToRun)
+   {
+   }
+
+   virtual tResult Execute(double time)
+   {
+      m_pOrder->push_back(m_id);
+      return (m_nTicksToRun < 0 || --m_nTicksToRun > 0) ? S_OK : S_FALSE;
+   }
+
+   std::vector<int> * m_pOrder;
+   int m_id;
+   int m_nTicksToRun;
+};
+
+// Spins for a while so that clients take long enough to overlap
+class cBusySimClient : public cComObject<IMPLEMENTS(ISimClient)>
+{
+public:
+   cBusySimClient(uint nIterations) : m_nIterations(nIterations), m_nTicks(0), m_result(0) {}
+
+   virtual tResult Execute(double time)
+   {
+      double x = time;
+      for (uint i = 0; i < m_nIterations; i++)
+      {
+         x = sin(x) + 1.0;
+      }
+      m_result += x;
+      AtomicIncrement(&m_nTicks);
+      return S_OK;
+   }
+
+   uint m_nIterations;
+   volatile long m_nTicks;
+   double m_result;
+};
+
+TEST(SimConcurrentClients)
+{
+   cAutoIPtr<cJobSystem> pJobSystem(new cJobSystem(2));
+   CHECK(pJobSystem->Init() == S_OK);
+
+   cAutoIPtr<cSim> pSim(new cSim(static_cast<IJobSystem*>(pJobSystem)));
+
+   std::vector<int> order;
+   cAutoIPtr<ISimClient> pSerial1(new cOrderRecorderSimClient(&order, 1));
+   cAutoIPtr<cBusySimClient> pConcurrent1(new cBusySimClient(1000));
+   cAutoIPtr<ISimClient> pSerial2(new cOrderRecorderSimClient(&order, 2, 2));
+   cAutoIPtr<cBusySimClient> pConcurrent2(new cBusySimClient(1000));
+   cAutoIPtr<ISimClient> pSerial3(new cOrderRecorderSimClient(&order, 3));
+
+   ISim * pISim = static_cast<ISim*>(pSim);
+   CHECK(pISim->AddSimClient(pSerial1) == S_OK);
+   CHECK(pISim->AddSimClient(pConcurrent1, kSimClientFlagConcurrent) == S_OK);
+   CHECK(pISim->AddSimClient(pSerial2) == S_OK);
+   CHECK(pISim->AddSimClient(pConcurrent2, kSimClientFlagConcurrent) == S_OK);
+   CHECK(pISim->AddSimClient(pSerial3) == S_OK);
+
+   CHECK(pSim->Start() == S_OK);
+   for (int i = 1; i <= 3; i++)
+   {
+      pSim->Execute(i);
+   }
+   pSim->Stop();
+
+   // Serial clients keep their order; the second removes itself after two
+   // ticks by returning S_FALSE
+   static const int kExpectedOrder[] = { 1, 2, 3, 1, 2, 3, 1, 3 };
+   CHECK_EQUAL(_countof(kExpectedOrder), order.size());
+   CHECK(order.size() == _countof(kExpectedOrder)
+      && std::equal(order.begin(), order.end(), kExpectedOrder));
+
+   CHECK_EQUAL(3, pConcurrent1->m_nTicks);
+   CHECK_EQUAL(3, pConcurrent2->m_nTicks);
+
+   CHECK(pSim->RemoveSimClient(pSerial2) != S_OK);
+   CHECK(pSim->RemoveSimClient(pSerial1) == S_OK);
+   CHECK(pSim->RemoveSimClient(pConcurrent1) == S_OK);
+   CHECK(pSim->RemoveSimClient(pConcurrent2) == S_OK);
+   CHECK(pSim->RemoveSimClient(pSerial3) == S_OK);
+
+   pJobSystem->Term();
+}
+
+////////////////////////////////////////
+// Headless benchmark: the same sim load with the job system limited to more
+// and more worker threads
+
+TEST(SimConcurrentClientsTimeTrial)
+{
+   static const int kNumClients = 64;
+   static const uint kClientIterations = 20000;
+   static const int kNumTicks = 20;
+
+   uint nProcessors = ThreadGetProcessorCount();
+
+   double serialTime = 0;
+
+   for (uint nThreads = 1; nThreads <= nProcessors; nThreads *= 2)
+   {
+      // The thread calling Join works too, so one thread means no workers
+      cAutoIPtr<cJobSystem> pJobSystem(new cJobSystem(nThreads - 1));
+      CHECK(pJobSystem->Init() == S_OK);
+
+      cAutoIPtr<cSim> pSim(new cSim(static_cast<IJobSystem*>(pJobSystem)));
+
+      std::vector< cAutoIPtr<cBusySimClient> > clients;
+      for (int i = 0; i < kNumClients; i++)
+      {
+         clients.push_back(cAutoIPtr<cBusySimClient>(new cBusySimClient(kClientIterations)));
+         static_cast<ISim*>(pSim)->AddSimClient(clients.back(), kSimClientFlagConcurrent);
+      }
+
+      CHECK(pSim->Start() == S_OK);
+      pSim->Execute(1);
+
+      double time = -TimeGetSecs();
+      for (int i = 0; i < kNumTicks; i++)
+      {
+         pSim->Execute(2 + i);
+      }
+      time += TimeGetSecs();
+
+      pSim->Stop();
+      pJobSystem->Term();
+
+      for (int i = 0; i < kNumClients; i++)
+      {
+         CHECK_EQUAL(kNumTicks + 1, clients[i]->m_nTicks); // plus the warm-up tick
+         pSim->RemoveSimClient(clients[i]);
+      }
+
+      if (nThreads == 1)
+      {
+         serialTime = time;
+      }
+
+      LocalMsg3("%d threads: %f secs for %d sim ticks\n", nThreads, time, kNumTicks);
+      LocalMsg1("   speedup %f\n", serialTime / time);
+   }
+}
+
+#endif // HAVE_UNITTESTPP
+
 ///////////////////////////////////////////////////////////////////////////////
@@ -10,6 +10,9 @@
 #include "tech/globalobjdef.h"
 #include "tech/schedulerapi.h"
 
+#include <set>
+#include <vector>
+
 #ifdef _MSC_VER
 #pragma once
 #endif
@@ -22,7 +25,7 @@
 class cSim : public cComObject3<IMPLEMENTSCP(ISim, ISimClient), IMPLEMENTS(ITask), IMPLEMENTS(IGlobalObject)>
 {
 public:
-	cSim();
+	cSim(IJobSystem * pJobSystem = NULL);
 	~cSim();
 
    DECLARE_NAME_STRING(kSimName)
@@ -41,19 +44,64 @@ public:
    virtual double GetTimeScale() const;
    virtual void SetTimeScale(double timeScale);
 
-	virtual tResult AddSimClient(ISimClient * pSimClient);
+	virtual tResult AddSimClient(ISimClient * pSimClient, uint flags);
 	virtual tResult RemoveSimClient(ISimClient * pSimClient);
 
+   virtual tResult SetFixedTickRate(double ticksPerSecond, uint maxTicksPerFrame);
+   virtual double GetFixedTickRate() const;
+
+   virtual double GetInterpolationAlpha() const;
+
+	virtual tResult AddRenderClient(ISimRenderClient * pRenderClient);
+	virtual tResult RemoveRenderClient(ISimRenderClient * pRenderClient);
+
    // ITask
    virtual tResult Execute(double time);
 
 private:
+   void RunSimClients();
+   IJobSystem * AccessJobSystem();
+
+   struct sConcurrentCall
+   {
+      ISimClient * pSimClient;
+      double time;
+      tResult result;
+   };
+   static void ExecuteConcurrentCall(void * pArg);
+   void RunRenderClients();
+
+   class cRenderTask : public cComObject<IMPLEMENTS(ITask)>
+   {
+   public:
+      cRenderTask(cSim * pOuter);
+      virtual void DeleteThis() {}
+      virtual tResult Execute(double time);
+   private:
+      cSim * m_pOuter;
+   };
+   friend class cRenderTask;
+   cRenderTask m_renderTask;
+
    bool m_bIsRunning;
    double m_lastSchedTime; // the time argument from the last ITask::Execute
    double m_simTime;
    double m_timeScale;
 
+   double m_tickInterval; // zero when not in fixed-tick mode
+   uint m_maxTicksPerFrame;
+   double m_tickAccumulator; // scaled time not yet consumed by a tick
+
    uint m_lockSimClients;
+
+   // Sinks added with kSimClientFlagConcurrent (not AddRef'd; the sink list
+   // holds the reference)
+   std::set<ISimClient *> m_concurrentClients;
+   std::vector<sConcurrentCall> m_concurrentCalls;
+   cAutoIPtr<IJobSystem> m_pJobSystem;
+
+   std::vector<ISimRenderClient *> m_renderClients;
+   uint m_lockRenderClients;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
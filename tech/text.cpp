@@ -153,6 +153,8 @@ TECH_API tResult TextFormatRegister(const tChar * pszExtensions)
          && pResourceManager->RegisterFormat(kRT_UnicodeText, pszExtension, UnicodeTextLoad, NULL, UnicodeTextUnload) == S_OK)
 #endif
       {
+         pResourceManager->RegisterThreadSafeLoad(kRT_AsciiText, pszExtension);
+         pResourceManager->RegisterThreadSafeLoad(kRT_UnicodeText, pszExtension);
          nRegistered++;
       }
    }
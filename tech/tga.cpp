@@ -109,7 +109,7 @@ public:
    ~cTargaReader();
 
    const sTargaHeader & GetHeader() const;
-   byte * GetImageData();
+   const byte * GetImageData() const;
 
    bool ReadHeader();
    bool ReadFooter();
@@ -121,19 +121,25 @@ public:
 private:
    inline IReader * AccessReader() { return m_pReader; }
 
+   bool ReadUncompressedImageData(uint imageDataSize);
+   byte * AccessImageData();
+
    sTargaHeader m_header;
    sNewTargaFooter m_footer;
    char m_szId[256];
    byte * m_pColorMap;
    cAutoIPtr<IReader> m_pReader;
+   cAutoIPtr<IReaderSpan> m_pReaderSpan;
    byte * m_pImageData;
+   const byte * m_pImageSpan; // Image data viewed in place in the reader
 };
 
 ///////////////////////////////////////
 
 cTargaReader::cTargaReader(IReader * pReader)
  : m_pColorMap(NULL),
-   m_pImageData(NULL)
+   m_pImageData(NULL),
+   m_pImageSpan(NULL)
 {
    memset(&m_header, 0, sizeof(m_header));
    memset(&m_footer, 0, sizeof(m_footer));
@@ -141,7 +147,10 @@ cTargaReader::cTargaReader(IReader * pReader)
    m_pReader = pReader;
    Assert(pReader != NULL);
    if (pReader != NULL)
+   {
       pReader->AddRef();
+      pReader->QueryInterface(IID_IReaderSpan, (void**)&m_pReaderSpan);
+   }
 }
 
 ///////////////////////////////////////
@@ -170,8 +179,26 @@ inline const sTargaHeader & cTargaReader::GetHeader() const
 
 ///////////////////////////////////////
 
-inline byte * cTargaReader::GetImageData()
+inline const byte * cTargaReader::GetImageData() const
+{
+   return (m_pImageSpan != NULL) ? m_pImageSpan : m_pImageData;
+}
+
+///////////////////////////////////////
+// Copies image data that is only viewed in place so that it can be modified
+
+byte * cTargaReader::AccessImageData()
 {
+   if (m_pImageSpan != NULL)
+   {
+      uint imageDataSize = (GetHeader().PixelDepth / 8) * GetHeader().Width * GetHeader().Height;
+      Assert(m_pImageData == NULL);
+      m_pImageData = (byte *)malloc(imageDataSize);
+      if (m_pImageData == NULL)
+         return NULL;
+      memcpy(m_pImageData, m_pImageSpan, imageDataSize);
+      m_pImageSpan = NULL;
+   }
    return m_pImageData;
 }
 
@@ -233,24 +260,44 @@ bool cTargaReader::ReadColorMap()
 
 ///////////////////////////////////////
 
-bool cTargaReader::ReadImageData()
+bool cTargaReader::ReadUncompressedImageData(uint imageDataSize)
 {
-   Assert(m_pImageData == NULL);
-
-   uint bytesPerPixel = GetHeader().PixelDepth / 8;
-   uint imageDataSize = bytesPerPixel * GetHeader().Width * GetHeader().Height;
+   // Pixels are handed to ImageCreate as-is, so there's no need to copy them
+   // out of readers that hold the whole file in memory
+   if (!!m_pReaderSpan)
+   {
+      const void * pSpan = NULL;
+      if (m_pReaderSpan->ReadSpan(imageDataSize, &pSpan) != S_OK)
+      {
+         return false;
+      }
+      m_pImageSpan = static_cast<const byte *>(pSpan);
+      return true;
+   }
 
    m_pImageData = (byte *)malloc(imageDataSize);
    if (m_pImageData == NULL)
       return false;
 
+   return (AccessReader()->Read(m_pImageData, imageDataSize) == S_OK);
+}
+
+///////////////////////////////////////
+
+bool cTargaReader::ReadImageData()
+{
+   Assert(m_pImageData == NULL && m_pImageSpan == NULL);
+
+   uint bytesPerPixel = GetHeader().PixelDepth / 8;
+   uint imageDataSize = bytesPerPixel * GetHeader().Width * GetHeader().Height;
+
    bool bResult = false; // assume failure
 
    if (GetHeader().ImageType == kTGA_UncomprRGB ||
        GetHeader().ImageType == kTGA_UncomprBW)
    {
       if (GetHeader().ColorMapType == 0 &&
-          AccessReader()->Read(m_pImageData, imageDataSize) == S_OK)
+          ReadUncompressedImageData(imageDataSize))
       {
          bResult = true;
       }
@@ -258,7 +305,7 @@ bool cTargaReader::ReadImageData()
    else if (GetHeader().ImageType == kTGA_UncomprColorMap)
    {
       if (GetHeader().ColorMapType == 1 &&
-          AccessReader()->Read(m_pImageData, imageDataSize) == S_OK)
+          ReadUncompressedImageData(imageDataSize))
       {
          bResult = true;
       }
@@ -266,14 +313,18 @@ bool cTargaReader::ReadImageData()
    else if (GetHeader().ImageType == kTGA_RLEColorMap ||
             GetHeader().ImageType == kTGA_RLERGB)
    {
+      m_pImageData = (byte *)malloc(imageDataSize);
+      if (m_pImageData == NULL)
+         return false;
+
       uint8 bytesPerPixel = GetHeader().PixelDepth / 8;
 
       bool bReadError = false;
 
       byte * pPixelValue = (byte *)alloca(bytesPerPixel);
 
-      byte * pDecoded = GetImageData();
-      byte * pEnd = GetImageData() + imageDataSize;
+      byte * pDecoded = m_pImageData;
+      byte * pEnd = m_pImageData + imageDataSize;
       while (pDecoded < pEnd)
       {
          uint8 repCount;
@@ -335,9 +386,10 @@ IImage * cTargaReader::CreateImage()
       {
 #if NO_BGR_FORMATS
          uint8 bytesPerPixel = GetHeader().PixelDepth / 8;
-         for (int i = 0; i < (GetHeader().Width * GetHeader().Height); i++)
+         byte * pImageData = AccessImageData();
+         for (int i = 0; pImageData != NULL && i < (GetHeader().Width * GetHeader().Height); i++)
          {
-            byte * pRed = GetImageData() + (i * bytesPerPixel);
+            byte * pRed = pImageData + (i * bytesPerPixel);
             byte * pBlue = pRed + 2;
             byte temp = *pRed;
             *pRed = *pBlue;
@@ -371,7 +423,7 @@ IImage * cTargaReader::CreateImage()
 
                for (int i = 0; i < (GetHeader().Width * GetHeader().Height); i++)
                {
-                  byte * pS = m_pColorMap + (GetImageData()[i] * GetHeader().ColorMapEntrySize / 8);
+                  const byte * pS = m_pColorMap + (GetImageData()[i] * GetHeader().ColorMapEntrySize / 8);
                   byte * pD = pData + (i * 3);
                   // the color map is stored as BGR so swap red and blue while we're at it
                   pD[0] = pS[2];
@@ -381,6 +433,7 @@ IImage * cTargaReader::CreateImage()
 
                free(m_pImageData);
                m_pImageData = pData;
+               m_pImageSpan = NULL;
             }
          }
       }
@@ -6,12 +6,16 @@
 #include "tech/thread.h"
 #include "tech/techtime.h"
 
+#include "blockpool.h"
+
 #ifdef HAVE_UNITTESTPP
 #include "UnitTest++.h"
 #endif
 
 #include <cmath>
 #include <cfloat>
+#include <cstring>
+#include <vector>
 
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
@@ -24,6 +28,8 @@
 #include <sched.h>
 #include <signal.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #endif
 
 #include "tech/dbgalloc.h" // must be last header
@@ -48,12 +54,12 @@ void ThreadSleep(uint milliseconds)
 #ifdef _WIN32
    Sleep(milliseconds);
 #else
-   uint secs = milliseconds / 1000;
-   if (milliseconds > 0 && secs == 0)
+   struct timespec ts;
+   ts.tv_sec = milliseconds / 1000;
+   ts.tv_nsec = (milliseconds % 1000) * 1000000;
+   while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
    {
-      secs = 1;
    }
-   sleep(secs);
 #endif
 }
 
@@ -96,6 +102,117 @@ void ThreadSetName(tThreadId threadId, const char * pszName)
    __except (EXCEPTION_CONTINUE_EXECUTION)
    {
    }
+#elif defined(__linux__)
+   if (pszName != NULL)
+   {
+      // Linux limits names to 16 bytes including the terminator
+      char szName[16];
+      strncpy(szName, pszName, sizeof(szName) - 1);
+      szName[sizeof(szName) - 1] = 0;
+      pthread_setname_np(threadId, szName);
+   }
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void ThreadYield()
+{
+#ifdef _WIN32
+   Sleep(0);
+#else
+   sched_yield();
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+uint ThreadGetProcessorCount()
+{
+#ifdef _WIN32
+   SYSTEM_INFO sysInfo;
+   GetSystemInfo(&sysInfo);
+   return (sysInfo.dwNumberOfProcessors > 0) ? sysInfo.dwNumberOfProcessors : 1;
+#else
+   long nProcessors = sysconf(_SC_NPROCESSORS_ONLN);
+   return (nProcessors > 0) ? static_cast<uint>(nProcessors) : 1;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+long AtomicIncrement(volatile long * pValue)
+{
+#ifdef _WIN32
+   return InterlockedIncrement(pValue);
+#else
+   return __sync_add_and_fetch(pValue, 1);
+#endif
+}
+
+long AtomicDecrement(volatile long * pValue)
+{
+#ifdef _WIN32
+   return InterlockedDecrement(pValue);
+#else
+   return __sync_sub_and_fetch(pValue, 1);
+#endif
+}
+
+long AtomicRead(volatile long * pValue)
+{
+#ifdef _WIN32
+   return InterlockedCompareExchange(pValue, 0, 0);
+#else
+   return __sync_add_and_fetch(pValue, 0);
+#endif
+}
+
+long AtomicExchangeAdd(volatile long * pTarget, long value)
+{
+#ifdef _WIN32
+   return InterlockedExchangeAdd(pTarget, value);
+#else
+   return __sync_fetch_and_add(pTarget, value);
+#endif
+}
+
+long AtomicExchange(volatile long * pTarget, long value)
+{
+#ifdef _WIN32
+   return InterlockedExchange(pTarget, value);
+#else
+   // __sync_lock_test_and_set is only an acquire barrier
+   __sync_synchronize();
+   return __sync_lock_test_and_set(pTarget, value);
+#endif
+}
+
+long AtomicCompareExchange(volatile long * pTarget, long exchange, long comparand)
+{
+#ifdef _WIN32
+   return InterlockedCompareExchange(pTarget, exchange, comparand);
+#else
+   return __sync_val_compare_and_swap(pTarget, comparand, exchange);
+#endif
+}
+
+void * AtomicExchangePointer(void * volatile * ppTarget, void * pValue)
+{
+#ifdef _WIN32
+   return InterlockedExchangePointer(ppTarget, pValue);
+#else
+   __sync_synchronize();
+   return __sync_lock_test_and_set(ppTarget, pValue);
+#endif
+}
+
+void * AtomicCompareExchangePointer(void * volatile * ppTarget, void * pExchange, void * pComparand)
+{
+#ifdef _WIN32
+   return InterlockedCompareExchangePointer(ppTarget, pExchange, pComparand);
+#else
+   return __sync_val_compare_and_swap(ppTarget, pComparand, pExchange);
 #endif
 }
 
@@ -162,6 +279,14 @@ cThread::cThread()
 
 cThread::~cThread()
 {
+#ifndef _WIN32
+   // A joinable thread that is never joined must be detached so that its
+   // resources are released when it exits
+   if (m_threadId != 0 && !m_bJoined)
+   {
+      pthread_detach(m_thread);
+   }
+#endif
 }
 
 ////////////////////////////////////////
@@ -197,7 +322,12 @@ bool cThread::Create(int priority, uint stackSize)
    pthread_attr_setschedparam(&attr, &schedParam);
    int result = pthread_create(&m_thread, &attr, ThreadEntry, this); 
    pthread_attr_destroy(&attr);
-   return (result == 0);
+   if (result == 0)
+   {
+      m_threadId = m_thread;
+      return true;
+   }
+   return false;
 #endif
 }
 
@@ -233,6 +363,44 @@ bool cThread::Terminate()
 
 ////////////////////////////////////////
 
+void cThread::SetName(const char * pszName)
+{
+   Assert(m_threadId != 0);
+   ThreadSetName(m_threadId, pszName);
+}
+
+////////////////////////////////////////
+
+bool cThread::SetAffinity(ulong processorMask)
+{
+   if (processorMask == 0)
+   {
+      return false;
+   }
+#ifdef _WIN32
+   if (m_hThread != NULL)
+   {
+      return SetThreadAffinityMask(m_hThread, processorMask) != 0;
+   }
+   return false;
+#elif defined(__linux__)
+   cpu_set_t cpuSet;
+   CPU_ZERO(&cpuSet);
+   for (uint i = 0; i < (sizeof(processorMask) * 8) && i < CPU_SETSIZE; i++)
+   {
+      if (processorMask & (1ul << i))
+      {
+         CPU_SET(i, &cpuSet);
+      }
+   }
+   return pthread_setaffinity_np(m_thread, sizeof(cpuSet), &cpuSet) == 0;
+#else
+   return false;
+#endif
+}
+
+////////////////////////////////////////
+
 #ifdef _WIN32
 uint STDCALL cThread::ThreadEntry(void * param)
 {
@@ -241,6 +409,8 @@ uint STDCALL cThread::ThreadEntry(void * param)
 
    int result = pThread->Run();
 
+   BlockPoolThreadTerm();
+
    return result;
 }
 #else
@@ -251,12 +421,9 @@ void * cThread::ThreadEntry(void * param)
 
    int result = pThread->Run();
 
-   // If pthread_join is never called for a joinable thread,
-   // pthread_detach should be called
-   if (!pThread->m_bJoined)
-   {
-      pthread_detach(pThread->m_thread);
-   }
+   BlockPoolThreadTerm();
+
+   return reinterpret_cast<void *>(result);
 }
 #endif
 
@@ -273,6 +440,7 @@ cThreadEvent::cThreadEvent()
  : m_hEvent(NULL)
 #else
  : m_bInitialized(false)
+ , m_bSignaled(false)
 #endif
 {
 }
@@ -307,6 +475,7 @@ bool cThreadEvent::Create()
    pthread_mutex_init(&m_mutex, NULL);
    pthread_cond_init(&m_cond, NULL);
    m_bInitialized = true;
+   m_bSignaled = false;
    return true;
 #endif
 }
@@ -348,10 +517,15 @@ bool cThreadEvent::Wait()
    if (m_bInitialized)
    {
       pthread_mutex_lock(&m_mutex);
-      if (pthread_cond_wait(&m_cond, &m_mutex) == 0)
+      while (!m_bSignaled)
       {
-         bResult = true;
+         if (pthread_cond_wait(&m_cond, &m_mutex) != 0)
+         {
+            break;
+         }
       }
+      bResult = m_bSignaled;
+      m_bSignaled = false;
       pthread_mutex_unlock(&m_mutex);
    }
 #endif
@@ -363,24 +537,13 @@ bool cThreadEvent::Wait()
 #ifdef __GNUC__
 static struct timespec * MillisecsFromNow(uint millisecs, struct timespec * ts)
 {
-   struct timeb curTime;
-   int64 nanosecs, secs;
    const int64 kNanosecsPerMillisec = 1000000;
    const int64 kNanosecsPerSec = 1000000000;
-   ftime(&curTime);
-   nanosecs = ((int64)(millisecs + curTime.millitm)) * kNanosecsPerMillisec;
-   if (nanosecs >= kNanosecsPerSec)
-   {
-      secs = curTime.time + 1;
-      nanosecs %= kNanosecsPerSec;
-   }
-   else
-   {
-      secs = curTime.time;
-   }
-
-   ts->tv_nsec = nanosecs;
-   ts->tv_sec = secs;
+   struct timeval curTime;
+   gettimeofday(&curTime, NULL);
+   int64 nanosecs = (static_cast<int64>(curTime.tv_usec) * 1000) + (static_cast<int64>(millisecs % 1000) * kNanosecsPerMillisec);
+   ts->tv_sec = curTime.tv_sec + (millisecs / 1000) + static_cast<time_t>(nanosecs / kNanosecsPerSec);
+   ts->tv_nsec = static_cast<long>(nanosecs % kNanosecsPerSec);
    return ts;
 }
 #endif
@@ -397,14 +560,24 @@ bool cThreadEvent::Wait(uint timeout)
       }
    }
 #else
+   if (timeout == kInfiniteTimeout)
+   {
+      return Wait();
+   }
    if (m_bInitialized)
    {
       struct timespec timeoutSpec;
+      MillisecsFromNow(timeout, &timeoutSpec);
       pthread_mutex_lock(&m_mutex);
-      if (pthread_cond_timedwait(&m_cond, &m_mutex, MillisecsFromNow(timeout, &timeoutSpec)) == 0)
+      while (!m_bSignaled)
       {
-         bResult = true;
+         if (pthread_cond_timedwait(&m_cond, &m_mutex, &timeoutSpec) != 0)
+         {
+            break;
+         }
       }
+      bResult = m_bSignaled;
+      m_bSignaled = false;
       pthread_mutex_unlock(&m_mutex);
    }
 #endif
@@ -425,10 +598,13 @@ bool cThreadEvent::Signal()
 #else
    if (m_bInitialized)
    {
-      if (pthread_cond_signal(&m_cond) == 0)
-      {
-         return true;
-      }
+      // Stays signaled until a waiter consumes it, like a Windows
+      // auto-reset event, so a signal sent before the wait isn't lost
+      pthread_mutex_lock(&m_mutex);
+      m_bSignaled = true;
+      int result = pthread_cond_signal(&m_cond);
+      pthread_mutex_unlock(&m_mutex);
+      return (result == 0);
    }
 #endif
    return false;
@@ -445,6 +621,8 @@ bool cThreadEvent::Signal()
 cThreadMutex::cThreadMutex()
 #ifdef _WIN32
  : m_hMutex(NULL)
+#else
+ : m_bInitialized(false)
 #endif
 {
 }
@@ -460,7 +638,11 @@ cThreadMutex::~cThreadMutex()
       m_hMutex = NULL;
    }
 #else
-   pthread_mutex_destroy(&m_mutex);
+   if (m_bInitialized)
+   {
+      pthread_mutex_destroy(&m_mutex);
+      m_bInitialized = false;
+   }
 #endif
 }
 
@@ -479,9 +661,17 @@ bool cThreadMutex::Create()
    }
    return false;
 #else
-   pthread_mutex_init(&m_mutex, NULL);
-   // TODO: test return value
-   return true;
+   if (m_bInitialized)
+   {
+      return false;
+   }
+   // Recursive to match the Windows mutex
+   pthread_mutexattr_t attr;
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+   m_bInitialized = (pthread_mutex_init(&m_mutex, &attr) == 0);
+   pthread_mutexattr_destroy(&attr);
+   return m_bInitialized;
 #endif
 }
 
@@ -499,9 +689,23 @@ bool cThreadMutex::Acquire(uint timeout)
    }
    return false;
 #else
-   pthread_mutex_lock(&m_mutex);
-   // TODO: test return value
-   return true;
+   if (!m_bInitialized)
+   {
+      return false;
+   }
+   if (timeout == kInfiniteTimeout)
+   {
+      return (pthread_mutex_lock(&m_mutex) == 0);
+   }
+   else if (timeout == 0)
+   {
+      return (pthread_mutex_trylock(&m_mutex) == 0);
+   }
+   else
+   {
+      struct timespec timeoutSpec;
+      return (pthread_mutex_timedlock(&m_mutex, MillisecsFromNow(timeout, &timeoutSpec)) == 0);
+   }
 #endif
 }
 
@@ -519,9 +723,7 @@ bool cThreadMutex::Release()
    }
    return false;
 #else
-   pthread_mutex_unlock(&m_mutex);
-   // TODO: test return value
-   return true;
+   return m_bInitialized && (pthread_mutex_unlock(&m_mutex) == 0);
 #endif
 }
 
@@ -572,49 +774,765 @@ void cMutexLock::Release()
 
 
 ///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cThreadCondition
+//
+// Windows (before Vista) has no condition variable that works with a mutex
+// handle, so waiters count themselves under the caller's mutex and sleep on
+// a semaphore. Signal() and Broadcast() release one permit per waiter woken.
 
-#ifdef HAVE_UNITTESTPP
+////////////////////////////////////////
 
-TEST(ThreadSleep)
+cThreadCondition::cThreadCondition()
+#ifdef _WIN32
+ : m_hSemaphore(NULL)
+ , m_nWaiters(0)
+#else
+ : m_bInitialized(false)
+#endif
 {
-   cThreadEvent event;
-   CHECK(event.Create());
+}
 
-   static const double kWaitSecs = 2;
-   static const ulong kWaitMillis = (ulong)(kWaitSecs * 1000);
+////////////////////////////////////////
 
-   class cSleepThread : public cThread
+cThreadCondition::~cThreadCondition()
+{
+#ifdef _WIN32
+   if (m_hSemaphore != NULL)
    {
-   public:
-      cSleepThread(cThreadEvent * pEvent, ulong sleepMs)
-        : m_pEvent(pEvent), m_sleepMs(sleepMs)
+      CloseHandle(m_hSemaphore);
+      m_hSemaphore = NULL;
+   }
+#else
+   if (m_bInitialized)
+   {
+      pthread_cond_destroy(&m_cond);
+      m_bInitialized = false;
+   }
+#endif
+}
+
+////////////////////////////////////////
+
+bool cThreadCondition::Create()
+{
+#ifdef _WIN32
+   if (m_hSemaphore != NULL)
+   {
+      return false;
+   }
+   m_hSemaphore = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+   return (m_hSemaphore != NULL);
+#else
+   if (m_bInitialized)
+   {
+      return false;
+   }
+   m_bInitialized = (pthread_cond_init(&m_cond, NULL) == 0);
+   return m_bInitialized;
+#endif
+}
+
+////////////////////////////////////////
+
+bool cThreadCondition::Wait(cThreadMutex * pMutex, uint timeout)
+{
+   if (pMutex == NULL)
+   {
+      return false;
+   }
+#ifdef _WIN32
+   if (m_hSemaphore == NULL)
+   {
+      return false;
+   }
+   m_nWaiters++;
+   pMutex->Release();
+   bool bSignaled = (WaitForSingleObject(m_hSemaphore, timeout) == WAIT_OBJECT_0);
+   pMutex->Acquire();
+   if (!bSignaled)
+   {
+      // A signal may have counted this waiter after the wait timed out but
+      // before the mutex was re-acquired; consume its permit if so
+      if (WaitForSingleObject(m_hSemaphore, 0) == WAIT_OBJECT_0)
       {
+         bSignaled = true;
       }
-
-      virtual int Run()
+      else
       {
-         ThreadSleep(m_sleepMs);
-         m_pEvent->Signal();
-         return 0;
+         m_nWaiters--;
       }
+   }
+   return bSignaled;
+#else
+   if (!m_bInitialized)
+   {
+      return false;
+   }
+   if (timeout == kInfiniteTimeout)
+   {
+      return (pthread_cond_wait(&m_cond, &pMutex->m_mutex) == 0);
+   }
+   struct timespec timeoutSpec;
+   return (pthread_cond_timedwait(&m_cond, &pMutex->m_mutex, MillisecsFromNow(timeout, &timeoutSpec)) == 0);
+#endif
+}
 
-   private:
-      cThreadEvent * m_pEvent;
-      ulong m_sleepMs;
-   };
+////////////////////////////////////////
 
-   cSleepThread * pThread = new cSleepThread(&event, kWaitMillis);
+void cThreadCondition::Signal()
+{
+#ifdef _WIN32
+   if (m_nWaiters > 0)
+   {
+      m_nWaiters--;
+      ReleaseSemaphore(m_hSemaphore, 1, NULL);
+   }
+#else
+   if (m_bInitialized)
+   {
+      pthread_cond_signal(&m_cond);
+   }
+#endif
+}
 
-   double elapsed = -TimeGetSecs();
+////////////////////////////////////////
 
-   CHECK(pThread->Create());
-   CHECK(event.Wait());
+void cThreadCondition::Broadcast()
+{
+#ifdef _WIN32
+   if (m_nWaiters > 0)
+   {
+      long nWaiters = m_nWaiters;
+      m_nWaiters = 0;
+      ReleaseSemaphore(m_hSemaphore, nWaiters, NULL);
+   }
+#else
+   if (m_bInitialized)
+   {
+      pthread_cond_broadcast(&m_cond);
+   }
+#endif
+}
 
-   elapsed += TimeGetSecs();
 
-   delete pThread, pThread = NULL;
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cThreadSemaphore
+//
 
-   CHECK(elapsed > (kWaitSecs - 1.0e-2));
+////////////////////////////////////////
+
+cThreadSemaphore::cThreadSemaphore()
+#ifdef _WIN32
+ : m_hSemaphore(NULL)
+#else
+ : m_bInitialized(false)
+#endif
+{
+}
+
+////////////////////////////////////////
+
+cThreadSemaphore::~cThreadSemaphore()
+{
+#ifdef _WIN32
+   if (m_hSemaphore != NULL)
+   {
+      CloseHandle(m_hSemaphore);
+      m_hSemaphore = NULL;
+   }
+#else
+   if (m_bInitialized)
+   {
+      sem_destroy(&m_semaphore);
+      m_bInitialized = false;
+   }
+#endif
+}
+
+////////////////////////////////////////
+
+bool cThreadSemaphore::Create(long initialCount, long maxCount)
+{
+   if (initialCount < 0 || maxCount <= 0 || initialCount > maxCount)
+   {
+      return false;
+   }
+#ifdef _WIN32
+   if (m_hSemaphore != NULL)
+   {
+      return false;
+   }
+   m_hSemaphore = CreateSemaphore(NULL, initialCount, maxCount, NULL);
+   return (m_hSemaphore != NULL);
+#else
+   // The maximum isn't enforced with posix semaphores
+   if (m_bInitialized)
+   {
+      return false;
+   }
+   m_bInitialized = (sem_init(&m_semaphore, 0, initialCount) == 0);
+   return m_bInitialized;
+#endif
+}
+
+////////////////////////////////////////
+
+bool cThreadSemaphore::Wait(uint timeout)
+{
+#ifdef _WIN32
+   return (m_hSemaphore != NULL) && (WaitForSingleObject(m_hSemaphore, timeout) == WAIT_OBJECT_0);
+#else
+   if (!m_bInitialized)
+   {
+      return false;
+   }
+   int result;
+   if (timeout == kInfiniteTimeout)
+   {
+      while ((result = sem_wait(&m_semaphore)) != 0 && errno == EINTR)
+      {
+      }
+   }
+   else if (timeout == 0)
+   {
+      result = sem_trywait(&m_semaphore);
+   }
+   else
+   {
+      struct timespec timeoutSpec;
+      MillisecsFromNow(timeout, &timeoutSpec);
+      while ((result = sem_timedwait(&m_semaphore, &timeoutSpec)) != 0 && errno == EINTR)
+      {
+      }
+   }
+   return (result == 0);
+#endif
+}
+
+////////////////////////////////////////
+
+bool cThreadSemaphore::Post(long count)
+{
+#ifdef _WIN32
+   return (m_hSemaphore != NULL) && ReleaseSemaphore(m_hSemaphore, count, NULL);
+#else
+   if (!m_bInitialized)
+   {
+      return false;
+   }
+   for (long i = 0; i < count; i++)
+   {
+      if (sem_post(&m_semaphore) != 0)
+      {
+         return false;
+      }
+   }
+   return true;
+#endif
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Spin-waiting shared by cThreadSpinLock and cReadWriteLock
+//
+
+static const uint kMaxSpins = 1000;
+
+static inline void CpuPause()
+{
+#if defined(_WIN32) && defined(YieldProcessor)
+   YieldProcessor();
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+   __asm__ __volatile__("pause");
+#endif
+}
+
+// Called once per failed attempt to take a lock. Spinning only helps when
+// the holder can be running on another processor at the same time.
+static void SpinWait(uint * pnSpins)
+{
+   static const uint nProcessors = ThreadGetProcessorCount();
+   if (nProcessors > 1 && *pnSpins < kMaxSpins)
+   {
+      (*pnSpins)++;
+      CpuPause();
+   }
+   else
+   {
+      ThreadYield();
+   }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cThreadSpinLock
+//
+
+////////////////////////////////////////
+
+cThreadSpinLock::cThreadSpinLock()
+ : m_lock(0)
+{
+}
+
+////////////////////////////////////////
+
+void cThreadSpinLock::Acquire()
+{
+   uint nSpins = 0;
+   for (;;)
+   {
+      // Spin on a plain read so that waiters don't fight over the cache
+      // line until the lock looks free
+      if (m_lock == 0 && AtomicExchange(&m_lock, 1) == 0)
+      {
+         return;
+      }
+      SpinWait(&nSpins);
+   }
+}
+
+////////////////////////////////////////
+
+bool cThreadSpinLock::TryAcquire()
+{
+   return (m_lock == 0) && (AtomicExchange(&m_lock, 1) == 0);
+}
+
+////////////////////////////////////////
+
+void cThreadSpinLock::Release()
+{
+   Assert(m_lock != 0);
+   AtomicExchange(&m_lock, 0);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cReadWriteLock
+//
+
+static const long kWriter = -1;
+
+////////////////////////////////////////
+
+cReadWriteLock::cReadWriteLock()
+ : m_state(0)
+ , m_nWritersWaiting(0)
+{
+}
+
+////////////////////////////////////////
+
+void cReadWriteLock::AcquireRead()
+{
+   uint nSpins = 0;
+   while (!TryAcquireRead())
+   {
+      SpinWait(&nSpins);
+   }
+}
+
+////////////////////////////////////////
+
+bool cReadWriteLock::TryAcquireRead()
+{
+   long state = m_state;
+   if (state == kWriter || m_nWritersWaiting > 0)
+   {
+      return false;
+   }
+   return (AtomicCompareExchange(&m_state, state + 1, state) == state);
+}
+
+////////////////////////////////////////
+
+void cReadWriteLock::ReleaseRead()
+{
+   Assert(m_state > 0);
+   AtomicDecrement(&m_state);
+}
+
+////////////////////////////////////////
+
+void cReadWriteLock::AcquireWrite()
+{
+   if (TryAcquireWrite())
+   {
+      return;
+   }
+   AtomicIncrement(&m_nWritersWaiting);
+   uint nSpins = 0;
+   while (!TryAcquireWrite())
+   {
+      SpinWait(&nSpins);
+   }
+   AtomicDecrement(&m_nWritersWaiting);
+}
+
+////////////////////////////////////////
+
+bool cReadWriteLock::TryAcquireWrite()
+{
+   return (m_state == 0) && (AtomicCompareExchange(&m_state, kWriter, 0) == 0);
+}
+
+////////////////////////////////////////
+
+void cReadWriteLock::ReleaseWrite()
+{
+   Assert(m_state == kWriter);
+   AtomicExchange(&m_state, 0);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef HAVE_UNITTESTPP
+
+TEST(ThreadSleep)
+{
+   cThreadEvent event;
+   CHECK(event.Create());
+
+   static const double kWaitSecs = 2;
+   static const ulong kWaitMillis = (ulong)(kWaitSecs * 1000);
+
+   class cSleepThread : public cThread
+   {
+   public:
+      cSleepThread(cThreadEvent * pEvent, ulong sleepMs)
+        : m_pEvent(pEvent), m_sleepMs(sleepMs)
+      {
+      }
+
+      virtual int Run()
+      {
+         ThreadSleep(m_sleepMs);
+         m_pEvent->Signal();
+         return 0;
+      }
+
+   private:
+      cThreadEvent * m_pEvent;
+      ulong m_sleepMs;
+   };
+
+   cSleepThread * pThread = new cSleepThread(&event, kWaitMillis);
+
+   double elapsed = -TimeGetSecs();
+
+   CHECK(pThread->Create());
+   CHECK(event.Wait());
+
+   elapsed += TimeGetSecs();
+
+   delete pThread, pThread = NULL;
+
+   CHECK(elapsed > (kWaitSecs - 1.0e-2));
+}
+
+////////////////////////////////////////
+
+class cFunctionThread : public cThread
+{
+public:
+   typedef void (* tThreadFn)(void *);
+
+   cFunctionThread(tThreadFn pfn, void * pArg) : m_pfn(pfn), m_pArg(pArg) {}
+
+   virtual int Run()
+   {
+      (*m_pfn)(m_pArg);
+      return 0;
+   }
+
+private:
+   tThreadFn m_pfn;
+   void * m_pArg;
+};
+
+static void RunThreads(cFunctionThread::tThreadFn pfn, void * pArg, int nThreads)
+{
+   std::vector<cFunctionThread *> threads;
+   for (int i = 0; i < nThreads; i++)
+   {
+      threads.push_back(new cFunctionThread(pfn, pArg));
+      threads.back()->Create();
+   }
+   for (int i = 0; i < nThreads; i++)
+   {
+      threads[i]->Join();
+      delete threads[i];
+   }
+}
+
+////////////////////////////////////////
+
+TEST(ThreadEventSignalBeforeWait)
+{
+   cThreadEvent event;
+   CHECK(event.Create());
+   CHECK(event.Signal());
+   CHECK(event.Wait(1000));
+   // Auto-reset
+   CHECK(!event.Wait(10));
+}
+
+////////////////////////////////////////
+
+static void TryAcquireMutex(void * pArg)
+{
+   std::pair<cThreadMutex *, bool> * pTest = static_cast<std::pair<cThreadMutex *, bool> *>(pArg);
+   pTest->second = pTest->first->Acquire(50);
+   if (pTest->second)
+   {
+      pTest->first->Release();
+   }
+}
+
+TEST(ThreadMutexTimeout)
+{
+   cThreadMutex mutex;
+   CHECK(mutex.Create());
+   CHECK(mutex.Acquire());
+   // Recursive, as on Windows
+   CHECK(mutex.Acquire(0));
+   CHECK(mutex.Release());
+
+   std::pair<cThreadMutex *, bool> test(&mutex, true);
+   RunThreads(TryAcquireMutex, &test, 1);
+   CHECK(!test.second);
+
+   CHECK(mutex.Release());
+   RunThreads(TryAcquireMutex, &test, 1);
+   CHECK(test.second);
+}
+
+////////////////////////////////////////
+
+static const int kLockIterations = 100000;
+static const int kLockThreads = 4;
+
+struct sSpinLockTest
+{
+   cThreadSpinLock lock;
+   long count;
+};
+
+static void IncrementUnderSpinLock(void * pArg)
+{
+   sSpinLockTest * pTest = static_cast<sSpinLockTest *>(pArg);
+   for (int i = 0; i < kLockIterations; i++)
+   {
+      cScopedLock<cThreadSpinLock> lock(&pTest->lock);
+      pTest->count++;
+   }
+}
+
+TEST(ThreadSpinLock)
+{
+   sSpinLockTest test;
+   test.count = 0;
+
+   CHECK(test.lock.TryAcquire());
+   CHECK(!test.lock.TryAcquire());
+   test.lock.Release();
+
+   RunThreads(IncrementUnderSpinLock, &test, kLockThreads);
+   CHECK_EQUAL(kLockIterations * kLockThreads, test.count);
+}
+
+////////////////////////////////////////
+
+struct sReadWriteLockTest
+{
+   cReadWriteLock lock;
+   long a, b;
+   cAtomicCounter nMismatches;
+   cAtomicCounter nReads;
+};
+
+static void ReadWriteLockThread(void * pArg)
+{
+   sReadWriteLockTest * pTest = static_cast<sReadWriteLockTest *>(pArg);
+   for (int i = 0; i < kLockIterations; i++)
+   {
+      if ((i % 8) == 0)
+      {
+         cWriteLock lock(&pTest->lock);
+         pTest->a++;
+         pTest->b++;
+      }
+      else
+      {
+         cReadLock lock(&pTest->lock);
+         if (pTest->a != pTest->b)
+         {
+            ++pTest->nMismatches;
+         }
+         ++pTest->nReads;
+      }
+   }
+}
+
+TEST(ThreadReadWriteLock)
+{
+   sReadWriteLockTest test;
+   test.a = test.b = 0;
+
+   // Readers share, writers don't
+   CHECK(test.lock.TryAcquireRead());
+   CHECK(test.lock.TryAcquireRead());
+   CHECK(!test.lock.TryAcquireWrite());
+   test.lock.ReleaseRead();
+   test.lock.ReleaseRead();
+   CHECK(test.lock.TryAcquireWrite());
+   CHECK(!test.lock.TryAcquireRead());
+   test.lock.ReleaseWrite();
+
+   RunThreads(ReadWriteLockThread, &test, kLockThreads);
+
+   CHECK_EQUAL(0, test.nMismatches.Get());
+   CHECK_EQUAL((kLockIterations / 8) * kLockThreads, test.a);
+   CHECK_EQUAL(test.a, test.b);
+   CHECK_EQUAL((kLockIterations - (kLockIterations / 8)) * kLockThreads, test.nReads.Get());
+}
+
+////////////////////////////////////////
+
+TEST(AtomicCounter)
+{
+   cAtomicCounter counter(5);
+   CHECK_EQUAL(6, ++counter);
+   CHECK_EQUAL(5, --counter);
+   CHECK_EQUAL(15, counter.Add(10));
+   CHECK_EQUAL(15, counter.Exchange(1));
+   CHECK_EQUAL(1, counter.CompareExchange(7, 2));
+   CHECK_EQUAL(1, counter.CompareExchange(7, 1));
+   CHECK_EQUAL(7, static_cast<long>(counter));
+}
+
+////////////////////////////////////////
+
+static const int kNumItems = 10000;
+
+struct sSemaphoreTest
+{
+   cThreadSemaphore items;
+   cAtomicCounter nConsumed;
+};
+
+static void ConsumeItems(void * pArg)
+{
+   sSemaphoreTest * pTest = static_cast<sSemaphoreTest *>(pArg);
+   for (int i = 0; i < kNumItems; i++)
+   {
+      if (pTest->items.Wait(10000))
+      {
+         ++pTest->nConsumed;
+      }
+   }
+}
+
+TEST(ThreadSemaphore)
+{
+   sSemaphoreTest test;
+   CHECK(test.items.Create(2));
+   CHECK(test.items.Wait(0));
+   CHECK(test.items.Wait(10));
+   CHECK(!test.items.Wait(10));
+
+   cFunctionThread consumer(ConsumeItems, &test);
+   CHECK(consumer.Create());
+   for (int i = 0; i < kNumItems; i++)
+   {
+      CHECK(test.items.Post());
+   }
+   consumer.Join();
+
+   CHECK_EQUAL(kNumItems, test.nConsumed.Get());
+}
+
+////////////////////////////////////////
+
+struct sConditionTest
+{
+   cThreadMutex mutex;
+   cThreadCondition notEmpty;
+   std::vector<int> queue;
+   long sum;
+};
+
+static void ConsumeQueue(void * pArg)
+{
+   sConditionTest * pTest = static_cast<sConditionTest *>(pArg);
+   cMutexLock lock(&pTest->mutex);
+   lock.Acquire();
+   for (int n = 0; n < kNumItems; )
+   {
+      while (pTest->queue.empty())
+      {
+         pTest->notEmpty.Wait(&pTest->mutex, 1000);
+      }
+      pTest->sum += pTest->queue.back();
+      pTest->queue.pop_back();
+      n++;
+   }
+}
+
+TEST(ThreadCondition)
+{
+   sConditionTest test;
+   test.sum = 0;
+   CHECK(test.mutex.Create());
+   CHECK(test.notEmpty.Create());
+
+   {
+      // Times out with nobody to signal
+      cMutexLock lock(&test.mutex);
+      CHECK(lock.Acquire());
+      CHECK(!test.notEmpty.Wait(&test.mutex, 10));
+   }
+
+   cFunctionThread consumer(ConsumeQueue, &test);
+   CHECK(consumer.Create());
+   for (int i = 1; i <= kNumItems; i++)
+   {
+      cMutexLock lock(&test.mutex);
+      lock.Acquire();
+      test.queue.push_back(i);
+      test.notEmpty.Signal();
+   }
+   consumer.Join();
+
+   CHECK_EQUAL((kNumItems * (kNumItems + 1)) / 2, test.sum);
+}
+
+////////////////////////////////////////
+
+static void WaitForEvent(void * pArg)
+{
+   static_cast<cThreadEvent *>(pArg)->Wait(10000);
+}
+
+TEST(ThreadNameAndAffinity)
+{
+   cThreadEvent event;
+   CHECK(event.Create());
+
+   cFunctionThread thread(WaitForEvent, &event);
+   CHECK(thread.Create());
+   thread.SetName("AffinityTestThread");
+   CHECK(thread.SetAffinity(1));
+   CHECK(!thread.SetAffinity(0));
+   event.Signal();
+   thread.Join();
 }
 
 #endif // HAVE_UNITTESTPP
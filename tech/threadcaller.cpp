@@ -4,6 +4,9 @@
 #include "stdhdr.h"
 
 #include "threadcaller.h"
+#include "blockpool.h"
+
+#include "tech/techtime.h"
 
 #ifdef HAVE_UNITTESTPP
 #include "UnitTest++.h"
@@ -21,6 +24,257 @@ LOG_DEFINE_CHANNEL(ThreadCaller);
 #define LocalMsg3(msg,a,b,c)     DebugMsgEx3(ThreadCaller,msg,(a),(b),(c))
 #define LocalMsg4(msg,a,b,c,d)   DebugMsgEx4(ThreadCaller,msg,(a),(b),(c),(d))
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cFutureStateBase
+//
+
+// Marks m_pContinuation once the state has completed
+static void * const kContinuationDone = reinterpret_cast<void *>(1);
+
+// Waits are done in slices because the auto-reset event only wakes one of
+// possibly several threads waiting on the same future
+static const uint kFutureWaitSlice = 10;
+
+////////////////////////////////////////
+
+cFutureStateBase::cFutureStateBase()
+ : m_refCount(0)
+ , m_status(kFuturePending)
+ , m_pContinuation(NULL)
+ , m_pContinuationCaller(NULL)
+ , m_continuationThreadId(0)
+{
+   m_event.Create();
+}
+
+////////////////////////////////////////
+
+cFutureStateBase::~cFutureStateBase()
+{
+   void * pContinuation = m_pContinuation;
+   if (pContinuation != NULL && pContinuation != kContinuationDone)
+   {
+      delete static_cast<cFunctor *>(pContinuation);
+   }
+   SafeRelease(m_pContinuationCaller);
+}
+
+////////////////////////////////////////
+
+void cFutureStateBase::AddRef()
+{
+   AtomicIncrement(&m_refCount);
+}
+
+////////////////////////////////////////
+
+void cFutureStateBase::Release()
+{
+   if (AtomicDecrement(&m_refCount) == 0)
+   {
+      delete this;
+   }
+}
+
+////////////////////////////////////////
+
+eFutureStatus cFutureStateBase::GetStatus() const
+{
+   return static_cast<eFutureStatus>(AtomicRead(const_cast<volatile long *>(&m_status)));
+}
+
+////////////////////////////////////////
+
+tResult cFutureStateBase::Wait(uint timeout)
+{
+   double deadline = (timeout != kInfiniteTimeout) ? (TimeGetSecs() + (timeout / 1000.0)) : 0;
+
+   for (;;)
+   {
+      eFutureStatus status = GetStatus();
+      if (status != kFuturePending)
+      {
+         return (status == kFutureReady) ? S_OK : E_FAIL;
+      }
+
+      uint slice = kFutureWaitSlice;
+      if (timeout != kInfiniteTimeout)
+      {
+         double remaining = deadline - TimeGetSecs();
+         if (remaining <= 0)
+         {
+            return S_FALSE;
+         }
+         if ((remaining * 1000) < slice)
+         {
+            slice = static_cast<uint>(remaining * 1000) + 1;
+         }
+      }
+
+      m_event.Wait(slice);
+   }
+}
+
+////////////////////////////////////////
+
+tResult cFutureStateBase::SetContinuation(IThreadCaller * pThreadCaller, tThreadId threadId, cFunctor * pFunctor)
+{
+   if (pFunctor == NULL)
+   {
+      return E_POINTER;
+   }
+
+   if (pThreadCaller == NULL)
+   {
+      delete pFunctor;
+      return E_POINTER;
+   }
+
+   // Fields are written before the functor pointer is published and are
+   // only read by whoever takes the functor back out
+   if (m_pContinuationCaller == NULL)
+   {
+      m_pContinuationCaller = CTAddRef(pThreadCaller);
+      m_continuationThreadId = threadId;
+   }
+
+   void * pPrev = AtomicCompareExchangePointer(&m_pContinuation, pFunctor, NULL);
+   if (pPrev == NULL)
+   {
+      return S_OK;
+   }
+
+   if (pPrev == kContinuationDone)
+   {
+      // Already complete
+      if (GetStatus() == kFutureReady)
+      {
+         return pThreadCaller->PostCall(threadId, pFunctor);
+      }
+      delete pFunctor;
+      return S_OK;
+   }
+
+   WarnMsg("Future already has a continuation\n");
+   delete pFunctor;
+   return E_FAIL;
+}
+
+////////////////////////////////////////
+
+void cFutureStateBase::Complete(eFutureStatus status)
+{
+   if (AtomicCompareExchange(&m_status, status, kFuturePending) != kFuturePending)
+   {
+      // Already completed
+      return;
+   }
+
+   m_event.Signal();
+
+   void * pContinuation = AtomicExchangePointer(&m_pContinuation, kContinuationDone);
+   if (pContinuation != NULL)
+   {
+      Assert(pContinuation != kContinuationDone);
+      cFunctor * pFunctor = static_cast<cFunctor *>(pContinuation);
+      if (status == kFutureReady)
+      {
+         m_pContinuationCaller->PostCall(m_continuationThreadId, pFunctor);
+      }
+      else
+      {
+         // Failing the next future doesn't need to wait for the other thread
+         delete pFunctor;
+      }
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cThreadCallQueue
+//
+
+////////////////////////////////////////
+
+cThreadCallQueue::cThreadCallQueue()
+ : m_pHead(&m_stub)
+ , m_pTail(&m_stub)
+{
+   m_stub.pNext = NULL;
+   m_stub.pFunctor = NULL;
+}
+
+////////////////////////////////////////
+
+cThreadCallQueue::~cThreadCallQueue()
+{
+}
+
+////////////////////////////////////////
+
+void cThreadCallQueue::Push(sThreadCall * pCall)
+{
+   pCall->pNext = NULL;
+   sThreadCall * pPrev = static_cast<sThreadCall *>(
+      AtomicExchangePointer(reinterpret_cast<void * volatile *>(&m_pHead), pCall));
+   // Until this store the consumer can't see pCall or anything pushed after it
+   pPrev->pNext = pCall;
+}
+
+////////////////////////////////////////
+
+sThreadCall * cThreadCallQueue::Pop()
+{
+   sThreadCall * pTail = m_pTail;
+   sThreadCall * pNext = pTail->pNext;
+
+   if (pTail == &m_stub)
+   {
+      if (pNext == NULL)
+      {
+         return NULL;
+      }
+      m_pTail = pNext;
+      pTail = pNext;
+      pNext = pNext->pNext;
+   }
+
+   if (pNext != NULL)
+   {
+      m_pTail = pNext;
+      return pTail;
+   }
+
+   if (pTail != m_pHead)
+   {
+      // A producer has swapped the head but not yet linked its call
+      return NULL;
+   }
+
+   // pTail is the only call in the queue; put the stub behind it so that it
+   // can be unlinked
+   Push(&m_stub);
+
+   pNext = pTail->pNext;
+   if (pNext != NULL)
+   {
+      m_pTail = pNext;
+      return pTail;
+   }
+
+   return NULL;
+}
+
+////////////////////////////////////////
+
+sThreadCall * cThreadCallQueue::Last() const
+{
+   return (m_pHead != &m_stub) ? m_pHead : NULL;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // CLASS: cThreadCaller
@@ -30,12 +284,28 @@ LOG_DEFINE_CHANNEL(ThreadCaller);
 
 cThreadCaller::cThreadCaller()
 {
+   for (int i = 0; i < kMaxThreads; i++)
+   {
+      m_threads[i].state = kThreadSlotFree;
+      m_threads[i].nPosters = 0;
+      m_threads[i].initCount = 0;
+   }
 }
 
 ////////////////////////////////////////
 
 cThreadCaller::~cThreadCaller()
 {
+   // Nothing can be posting to or receiving from the slots once the last
+   // reference is gone, so whatever threads left registered is freed here
+   for (int i = 0; i < kMaxThreads; i++)
+   {
+      sThreadInfo * pThreadInfo = &m_threads[i];
+      if (AtomicRead(&pThreadInfo->state) == kThreadSlotActive)
+      {
+         CloseThread(pThreadInfo);
+      }
+   }
 }
 
 ////////////////////////////////////////
@@ -53,33 +323,31 @@ tResult cThreadCaller::Init()
 
 ////////////////////////////////////////
 
+// Only the calling thread's queue is closed. A queue may only be drained by
+// the thread that owns it, so other threads still registered keep theirs
+// until they call ThreadTerm.
+
 tResult cThreadCaller::Term()
 {
    cMutexLock lock(&m_mutex);
    if (lock.Acquire())
    {
+      tThreadId threadId = ThreadGetCurrentId();
+      for (int i = 0; i < kMaxThreads; i++)
       {
-         tThreadCalls::iterator iter = m_calls.begin();
-         tThreadCalls::iterator end = m_calls.end();
-         for (; iter != end; iter++)
+         sThreadInfo * pThreadInfo = &m_threads[i];
+         if (AtomicRead(&pThreadInfo->state) != kThreadSlotActive)
          {
-            delete iter->second;
+            continue;
          }
-
-         m_calls.clear();
-      }
-
-      {
-         tThreadInfoMap::iterator iter = m_threadInfoMap.begin();
-         tThreadInfoMap::iterator end = m_threadInfoMap.end();
-         for (; iter != end; ++iter)
+         if (pThreadInfo->threadId == threadId)
          {
-            sThreadInfo * pThreadInfo = iter->second;
-            pThreadInfo->callEvent.Signal();
-            delete pThreadInfo;
+            CloseThread(pThreadInfo);
+         }
+         else
+         {
+            LocalMsg1("Thread %d is still registered with the thread caller\n", pThreadInfo->threadId);
          }
-
-         m_threadInfoMap.clear();
       }
    }
 
@@ -96,32 +364,36 @@ tResult cThreadCaller::ThreadInit()
       tThreadId threadId = ThreadGetCurrentId();
 
       {
-         tThreadInfoMap::iterator f = m_threadInfoMap.find(threadId);
-         if (f != m_threadInfoMap.end())
+         sThreadInfo * pThreadInfo = FindThread(threadId);
+         if (pThreadInfo != NULL)
          {
             // Thread already initialized
-            f->second->initCount += 1;
+            pThreadInfo->initCount += 1;
             return S_FALSE;
          }
       }
 
-      sThreadInfo * pThreadInfo = new sThreadInfo;
-      if (pThreadInfo == NULL)
+      for (int i = 0; i < kMaxThreads; i++)
       {
-         return E_OUTOFMEMORY;
-      }
+         sThreadInfo * pThreadInfo = &m_threads[i];
+         if (AtomicRead(&pThreadInfo->state) == kThreadSlotFree)
+         {
+            if (!pThreadInfo->callEvent.Create())
+            {
+               return E_FAIL;
+            }
 
-      pThreadInfo->initCount = 1;
+            pThreadInfo->threadId = threadId;
+            pThreadInfo->initCount = 1;
 
-      if (!pThreadInfo->callEvent.Create())
-      {
-         delete pThreadInfo;
-         return E_FAIL;
-      }
+            // Publish the slot to posting threads last
+            AtomicExchange(&pThreadInfo->state, kThreadSlotActive);
 
-      m_threadInfoMap.insert(std::make_pair(threadId, pThreadInfo));
+            return S_OK;
+         }
+      }
 
-      return S_OK;
+      ErrorMsg1("Too many threads registered with the thread caller (max %d)\n", kMaxThreads);
    }
 
    return E_FAIL;
@@ -134,26 +406,21 @@ tResult cThreadCaller::ThreadTerm()
    cMutexLock lock(&m_mutex);
    if (lock.Acquire())
    {
-      tThreadId threadId = ThreadGetCurrentId();
-
-      tThreadCalls::size_type nCallsErased = m_calls.erase(threadId);
-
-      LocalMsg2("Cancelled %d pending calls for thread %d\n", nCallsErased, threadId);
-
+      sThreadInfo * pThreadInfo = FindThread(ThreadGetCurrentId());
+      if (pThreadInfo != NULL)
       {
-         tThreadInfoMap::iterator f = m_threadInfoMap.find(threadId);
-         if (f != m_threadInfoMap.end())
+         pThreadInfo->initCount -= 1;
+         if (pThreadInfo->initCount == 0)
+         {
+            CloseThread(pThreadInfo);
+            // Threads not started through cThread may be about to exit
+            BlockPoolThreadTerm();
+         }
+         else
          {
-            sThreadInfo * pThreadInfo = f->second;
             pThreadInfo->callEvent.Signal();
-            pThreadInfo->initCount -= 1;
-            if (pThreadInfo->initCount == 0)
-            {
-               delete pThreadInfo;
-               m_threadInfoMap.erase(f);
-            }
-            return S_OK;
          }
+         return S_OK;
       }
    }
 
@@ -164,83 +431,143 @@ tResult cThreadCaller::ThreadTerm()
 
 tResult cThreadCaller::ThreadIsInitialized(tThreadId threadId)
 {
-   cMutexLock lock(&m_mutex);
-   if (lock.Acquire())
-   {
-      tThreadInfoMap::iterator f = m_threadInfoMap.find(threadId);
-      if (f != m_threadInfoMap.end())
-      {
-         return S_OK;
-      }
-
-      return S_FALSE;
-   }
-
-   return E_FAIL;
+   return (FindThread(threadId) != NULL) ? S_OK : S_FALSE;
 }
 
 ////////////////////////////////////////
 
 tResult cThreadCaller::ReceiveCalls(uint * pnCalls)
 {
-   cMutexLock lock(&m_mutex);
-   if (lock.Acquire())
+   sThreadInfo * pThreadInfo = FindThread(ThreadGetCurrentId());
+   if (pThreadInfo == NULL)
    {
-      tThreadId threadId = ThreadGetCurrentId();
+      return E_FAIL;
+   }
 
-      sThreadInfo * pThreadInfo = NULL;
+   uint nCalls = 0;
 
+   // Stop at the last call queued on entry so that a call which posts
+   // another call to this thread can't keep the loop going forever
+   sThreadCall * pLast = pThreadInfo->calls.Last();
+   if (pLast != NULL)
+   {
+      sThreadCall * pCall = NULL;
+      while ((pCall = pThreadInfo->calls.Pop()) != NULL)
       {
-         tThreadInfoMap::iterator f = m_threadInfoMap.find(threadId);
-         if (f != m_threadInfoMap.end())
+         (*pCall->pFunctor)();
+         delete pCall->pFunctor;
+         nCalls++;
+
+         bool bLast = (pCall == pLast);
+         BlockPoolFree(pCall, sizeof(sThreadCall));
+         if (bLast)
          {
-            pThreadInfo = f->second;
+            break;
          }
       }
+   }
+
+   if (pnCalls != NULL)
+   {
+      *pnCalls = nCalls;
+   }
+
+   pThreadInfo->callEvent.Signal();
 
-      uint nCalls = 0;
+   return (nCalls > 0) ? S_OK : S_FALSE;
+}
+
+////////////////////////////////////////
+
+tResult cThreadCaller::PostCall(tThreadId threadId, cFunctor * pFunctor)
+{
+   if (pFunctor == NULL)
+   {
+      return E_POINTER;
+   }
 
-      tThreadCalls::iterator iter = m_calls.lower_bound(threadId);
-      tThreadCalls::iterator end = m_calls.upper_bound(threadId);
-      for (; iter != end; iter++)
+   for (int i = 0; i < kMaxThreads; i++)
+   {
+      sThreadInfo * pThreadInfo = &m_threads[i];
+      if (AtomicRead(&pThreadInfo->state) != kThreadSlotActive
+         || pThreadInfo->threadId != threadId)
       {
-         (*iter->second)();
-         delete iter->second;
-         nCalls++;
+         continue;
       }
 
-      if (pnCalls != NULL)
+      // Announce this poster then check again, so that either ThreadTerm
+      // sees the count and waits for the push to finish, or this sees the
+      // slot closing and backs off
+      AtomicIncrement(&pThreadInfo->nPosters);
+      if (AtomicRead(&pThreadInfo->state) == kThreadSlotActive
+         && pThreadInfo->threadId == threadId)
       {
-         *pnCalls = nCalls;
+         sThreadCall * pCall = static_cast<sThreadCall *>(BlockPoolAlloc(sizeof(sThreadCall)));
+         if (pCall == NULL)
+         {
+            AtomicDecrement(&pThreadInfo->nPosters);
+            delete pFunctor;
+            return E_OUTOFMEMORY;
+         }
+         pCall->pFunctor = pFunctor;
+         pThreadInfo->calls.Push(pCall);
+         AtomicDecrement(&pThreadInfo->nPosters);
+         return S_OK;
       }
+      AtomicDecrement(&pThreadInfo->nPosters);
+      break;
+   }
 
-      m_calls.erase(threadId);
+   LocalMsg1("Call posted to unregistered thread %d\n", threadId);
+   delete pFunctor;
+   return E_FAIL;
+}
 
-      pThreadInfo->callEvent.Signal();
+////////////////////////////////////////
 
-      return (nCalls > 0) ? S_OK : S_FALSE;
+cThreadCaller::sThreadInfo * cThreadCaller::FindThread(tThreadId threadId)
+{
+   for (int i = 0; i < kMaxThreads; i++)
+   {
+      sThreadInfo * pThreadInfo = &m_threads[i];
+      if (AtomicRead(&pThreadInfo->state) == kThreadSlotActive
+         && pThreadInfo->threadId == threadId)
+      {
+         return pThreadInfo;
+      }
    }
-
-   return E_FAIL;
+   return NULL;
 }
 
 ////////////////////////////////////////
+// Caller must hold m_mutex, unless no other thread can reach this object
 
-tResult cThreadCaller::PostCall(tThreadId threadId, cFunctor * pFunctor)
+void cThreadCaller::CloseThread(sThreadInfo * pThreadInfo)
 {
-   if (pFunctor == NULL)
+   AtomicExchange(&pThreadInfo->state, kThreadSlotClosing);
+
+   // Let any PostCall that got in ahead of the state change finish its push
+   while (AtomicRead(&pThreadInfo->nPosters) != 0)
    {
-      return E_POINTER;
+      ThreadYield();
    }
 
-   cMutexLock lock(&m_mutex);
-   if (lock.Acquire())
+   uint nCallsCancelled = 0;
+   sThreadCall * pCall = NULL;
+   while ((pCall = pThreadInfo->calls.Pop()) != NULL)
    {
-      m_calls.insert(std::make_pair(threadId, pFunctor));
-      return S_OK;
+      delete pCall->pFunctor;
+      BlockPoolFree(pCall, sizeof(sThreadCall));
+      nCallsCancelled++;
    }
 
-   return E_FAIL;
+   LocalMsg2("Cancelled %d pending calls for thread %d\n", nCallsCancelled, pThreadInfo->threadId);
+
+   pThreadInfo->callEvent.Signal();
+   pThreadInfo->callEvent.Destroy();
+   pThreadInfo->initCount = 0;
+
+   AtomicExchange(&pThreadInfo->state, kThreadSlotFree);
 }
 
 ////////////////////////////////////////
@@ -359,6 +686,257 @@ TEST_FIXTURE(cThreadFixture, ThreadCallerPostCall)
    CHECK(cFooStatic::gm_threadIdSetFooLastCalledFrom == threadId);
 }
 
+////////////////////////////////////////
+
+static int SquareOnThread(int value)
+{
+   return value * value;
+}
+
+static tThreadId GetCallingThreadId()
+{
+   return ThreadGetCurrentId();
+}
+
+static int AddOne(int value)
+{
+   return value + 1;
+}
+
+class cReceiveUntilStoppedThread : public cThread
+{
+public:
+   cReceiveUntilStoppedThread() : m_bStop(0) {}
+
+   virtual int Run()
+   {
+      UseGlobal(ThreadCaller);
+      if (FAILED(pThreadCaller->ThreadInit()))
+      {
+         return -1;
+      }
+      while (AtomicRead(&m_bStop) == 0)
+      {
+         if (pThreadCaller->ReceiveCalls(NULL) != S_OK)
+         {
+            ThreadYield();
+         }
+      }
+      pThreadCaller->ThreadTerm();
+      return 0;
+   }
+
+   void WaitUntilInitialized()
+   {
+      UseGlobal(ThreadCaller);
+      while (pThreadCaller->ThreadIsInitialized(GetThreadId()) != S_OK)
+      {
+         ThreadYield();
+      }
+   }
+
+   void Stop()
+   {
+      AtomicExchange(&m_bStop, 1);
+      Join();
+   }
+
+   volatile long m_bStop;
+};
+
+TEST_FIXTURE(cThreadFixture, ThreadCallerPostCallWithResult)
+{
+   UseGlobal(ThreadCaller);
+
+   cReceiveUntilStoppedThread thread;
+   CHECK(thread.Create());
+   thread.WaitUntilInitialized();
+
+   cFuture<int> square = pThreadCaller->PostCallWithResult(thread.GetThreadId(), &SquareOnThread, 12);
+   cFuture<tThreadId> calledOn = pThreadCaller->PostCallWithResult(thread.GetThreadId(), &GetCallingThreadId);
+
+   CHECK(square.Wait(10000) == S_OK);
+   CHECK(calledOn.Wait(10000) == S_OK);
+
+   int result = 0;
+   CHECK(square.GetResult(&result) == S_OK);
+   CHECK_EQUAL(144, result);
+
+   tThreadId threadId = 0;
+   CHECK(calledOn.GetResult(&threadId) == S_OK);
+   CHECK(threadId == thread.GetThreadId());
+
+   thread.Stop();
+
+   // The thread is gone so the call can't be posted
+   cFuture<int> failed = pThreadCaller->PostCallWithResult(thread.GetThreadId(), &SquareOnThread, 3);
+   CHECK(failed.IsDone());
+   CHECK(failed.Wait(0) == E_FAIL);
+   CHECK(failed.GetResult(&result) == E_FAIL);
+}
+
+TEST(ThreadCallerTermOnlyClosesCallingThread)
+{
+   UseGlobal(ThreadCaller);
+
+   cReceiveUntilStoppedThread thread;
+   CHECK(thread.Create());
+   thread.WaitUntilInitialized();
+
+   cAutoIPtr<IGlobalObject> pGlobalObject;
+   CHECK(pThreadCaller->QueryInterface(IID_IGlobalObject, (void**)&pGlobalObject) == S_OK);
+
+   CHECK(SUCCEEDED(pThreadCaller->ThreadInit()));
+   CHECK(pGlobalObject->Term() == S_OK);
+   CHECK(pThreadCaller->ThreadIsInitialized(ThreadGetCurrentId()) == S_FALSE);
+
+   // The other thread still owns its queue and keeps receiving calls
+   CHECK(pThreadCaller->ThreadIsInitialized(thread.GetThreadId()) == S_OK);
+   cFuture<int> square = pThreadCaller->PostCallWithResult(thread.GetThreadId(), &SquareOnThread, 7);
+   CHECK(square.Wait(10000) == S_OK);
+   int result = 0;
+   CHECK(square.GetResult(&result) == S_OK);
+   CHECK_EQUAL(49, result);
+
+   thread.Stop();
+}
+
+TEST_FIXTURE(cThreadFixture, ThreadCallerFuturePollAndTimeout)
+{
+   UseGlobal(ThreadCaller);
+
+   // Posted to this thread, so nothing happens until ReceiveCalls
+   cFuture<int> future = pThreadCaller->PostCallWithResult(ThreadGetCurrentId(), &AddOne, 1);
+   CHECK(!future.IsDone());
+   CHECK(future.Wait(20) == S_FALSE);
+
+   int result = 0;
+   CHECK(future.GetResult(&result) == S_FALSE);
+
+   CHECK(pThreadCaller->ReceiveCalls(NULL) == S_OK);
+   CHECK(future.IsDone());
+   CHECK(future.GetResult(&result) == S_OK);
+   CHECK_EQUAL(2, result);
+}
+
+TEST_FIXTURE(cThreadFixture, ThreadCallerFutureContinuation)
+{
+   UseGlobal(ThreadCaller);
+
+   cReceiveUntilStoppedThread thread;
+   CHECK(thread.Create());
+   thread.WaitUntilInitialized();
+
+   // Square on the worker thread, then add one back on this thread
+   cFuture<int> square = pThreadCaller->PostCallWithResult(thread.GetThreadId(), &SquareOnThread, 5);
+   cFuture<int> next = square.Then(pThreadCaller, &AddOne);
+
+   static const double kTimeout = 10;
+   double startTime = TimeGetSecs();
+   while (!next.IsDone() && (TimeGetSecs() - startTime) < kTimeout)
+   {
+      pThreadCaller->ReceiveCalls(NULL);
+   }
+
+   int result = 0;
+   CHECK(next.GetResult(&result) == S_OK);
+   CHECK_EQUAL(26, result);
+
+   // Chaining onto a future that is already complete still runs here
+   cFuture<int> last = next.Then(pThreadCaller, &AddOne);
+   CHECK(!last.IsDone());
+   pThreadCaller->ReceiveCalls(NULL);
+   CHECK(last.GetResult(&result) == S_OK);
+   CHECK_EQUAL(27, result);
+
+   thread.Stop();
+
+   // Failure propagates down the chain
+   cFuture<int> failed = pThreadCaller->PostCallWithResult(thread.GetThreadId(), &SquareOnThread, 5);
+   cFuture<int> failedNext = failed.Then(pThreadCaller, &AddOne);
+   CHECK(failedNext.Wait(0) == E_FAIL);
+}
+
+////////////////////////////////////////
+
+static long g_nContentionCalls = 0;
+static void ContentionTestCall(int)
+{
+   // Only ever run on the receiving thread so no need for atomics
+   g_nContentionCalls++;
+}
+
+class cPostCallsThread : public cThread
+{
+public:
+   cPostCallsThread(tThreadId targetThreadId, int nCalls)
+    : m_targetThreadId(targetThreadId), m_nCalls(nCalls), m_nFailed(0)
+   {
+   }
+
+   virtual int Run()
+   {
+      UseGlobal(ThreadCaller);
+      for (int i = 0; i < m_nCalls; i++)
+      {
+         if (pThreadCaller->PostCall(m_targetThreadId, &ContentionTestCall, i) != S_OK)
+         {
+            m_nFailed++;
+         }
+      }
+      return 0;
+   }
+
+   tThreadId m_targetThreadId;
+   int m_nCalls;
+   int m_nFailed;
+};
+
+TEST_FIXTURE(cThreadFixture, ThreadCallerContentionTimeTrial)
+{
+   static const int kNumPosters = 8;
+   static const int kCallsPerPoster = 100000;
+   static const long kTotalCalls = kNumPosters * kCallsPerPoster;
+
+   UseGlobal(ThreadCaller);
+
+   g_nContentionCalls = 0;
+
+   double time = -TimeGetSecs();
+
+   cPostCallsThread * posters[kNumPosters];
+   for (int i = 0; i < kNumPosters; i++)
+   {
+      posters[i] = new cPostCallsThread(ThreadGetCurrentId(), kCallsPerPoster);
+      CHECK(posters[i]->Create());
+   }
+
+   static const double kTimeout = 60;
+   double startTime = TimeGetSecs();
+   while (g_nContentionCalls < kTotalCalls && (TimeGetSecs() - startTime) < kTimeout)
+   {
+      if (pThreadCaller->ReceiveCalls(NULL) != S_OK)
+      {
+         ThreadYield();
+      }
+   }
+
+   time += TimeGetSecs();
+
+   int nFailed = 0;
+   for (int i = 0; i < kNumPosters; i++)
+   {
+      posters[i]->Join();
+      nFailed += posters[i]->m_nFailed;
+      delete posters[i];
+   }
+
+   CHECK_EQUAL(0, nFailed);
+   CHECK_EQUAL(kTotalCalls, g_nContentionCalls);
+
+   LocalMsg3("%d threads posted %d calls in %f seconds\n", kNumPosters, kTotalCalls, time);
+}
+
 #endif // HAVE_UNITTESTPP
 
 ////////////////////////////////////////////////////////////////////////////////
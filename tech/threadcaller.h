@@ -8,12 +8,56 @@
 #include "tech/thread.h"
 #include "tech/globalobjdef.h"
 
-#include <map>
-
 #ifdef _MSC_VER
 #pragma once
 #endif
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// STRUCT: sThreadCall
+//
+
+struct sThreadCall
+{
+   sThreadCall * volatile pNext;
+   cFunctor * pFunctor;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// CLASS: cThreadCallQueue
+//
+// Intrusive multiple-producer, single-consumer queue. Push() may be called
+// from any thread without locking; Pop() only from the thread that owns the
+// queue. Producers contend on a single atomic exchange of the head pointer.
+//
+// REFERENCES
+// Dmitry Vyukov, "Intrusive MPSC node-based queue", 1024cores.net
+
+class cThreadCallQueue
+{
+   cThreadCallQueue(const cThreadCallQueue &);
+   const cThreadCallQueue & operator =(const cThreadCallQueue &);
+
+public:
+   cThreadCallQueue();
+   ~cThreadCallQueue();
+
+   void Push(sThreadCall * pCall);
+
+   // Returns NULL when the queue is empty or when a producer is midway
+   // through a push, in which case its call is picked up next time
+   sThreadCall * Pop();
+
+   // The most recently pushed call, or NULL if the queue is known to be empty
+   sThreadCall * Last() const;
+
+private:
+   sThreadCall * volatile m_pHead; // most recently pushed
+   sThreadCall * m_pTail; // next to pop
+   sThreadCall m_stub;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // CLASS: cThreadCaller
@@ -40,18 +84,31 @@ public:
    virtual tResult PostCall(tThreadId threadId, cFunctor * pFunctor);
 
 private:
-   typedef std::multimap<tThreadId, cFunctor *> tThreadCalls;
-   tThreadCalls m_calls;
+   enum eThreadState
+   {
+      kThreadSlotFree,
+      kThreadSlotClosing,
+      kThreadSlotActive,
+   };
 
    struct sThreadInfo
    {
+      volatile long state;
+      volatile long nPosters; // threads currently inside PostCall for this slot
+      tThreadId threadId;
       long initCount;
+      cThreadCallQueue calls;
       cThreadEvent callEvent;
    };
 
-   typedef std::map<tThreadId, sThreadInfo *> tThreadInfoMap;
-   tThreadInfoMap m_threadInfoMap;
+   sThreadInfo * FindThread(tThreadId threadId);
+   void CloseThread(sThreadInfo * pThreadInfo);
+
+   // Fixed so that posting threads can scan it without a lock
+   enum { kMaxThreads = 64 };
+   sThreadInfo m_threads[kMaxThreads];
 
+   // Serializes ThreadInit/ThreadTerm only
    cThreadMutex m_mutex;
 };
 
@@ -42,6 +42,7 @@ static void RegisterGlobalObjects()
    GUIContextCreate();
    GUIFactoryCreate();
    InputCreate();
+   JobSystemCreate();
    RendererCreate();
    ResourceManagerCreate();
    SaveLoadManagerCreate();
@@ -159,6 +159,7 @@ static void RegisterGlobalObjects()
    EntityManagerCreate();
    EntityComponentRegistryCreate();
    InputCreate();
+   JobSystemCreate();
    ResourceManagerCreate();
    SaveLoadManagerCreate();
    SchedulerCreate();
@@ -552,6 +552,7 @@ static void RegisterGlobalObjects()
    EntityManagerCreate();
    EntitySelectionCreate();
    InputCreate();
+   JobSystemCreate();
    GUIContextCreate();
    GUIFactoryCreate();
    GUIEventSoundsCreate();